@@ -1,31 +1,613 @@
+#ifndef _WIN32
+#define _GNU_SOURCE
+#endif
+
+#ifdef _WIN32
 #include <windows.h>
 #include <wincrypt.h>
+#include <tchar.h>
+#define PSAPI_VERSION 2     // GetProcessMemoryInfo from kernel32, no extra library
+#include <psapi.h>
+#include <io.h>
+#else
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <strings.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#endif
+#endif
 #include <stdio.h>
 #include <stdlib.h>
-#include <tchar.h>
 #include <string.h>
 #include <ctype.h>
 
-typedef struct _FileEntry {
-    TCHAR *path;
-    LARGE_INTEGER fileSize;
-    BYTE *hash;
-    struct _FileEntry *next;
-} FileEntry;
+#ifdef _WIN32
+#define PATH_SEP _T('\\')
+#else
+// POSIX build: map the Win32/TCHAR vocabulary used below onto libc.
+typedef int BOOL;
+typedef unsigned char BYTE;
+typedef unsigned long DWORD;
+typedef unsigned long long ULONGLONG;
+typedef char TCHAR;
+typedef const char *LPCTSTR;
+#define TRUE 1
+#define FALSE 0
+#define MAX_PATH PATH_MAX
+#define PATH_SEP '/'
+#define _T(x) x
+#define _tmain main
+#define _tcscmp strcmp
+#define _tcslen strlen
+#define _tcschr strchr
+#define _tcsrchr strrchr
+#define _tcsicmp strcasecmp
+#define _tcsnicmp strncasecmp
+#define _tcstok strtok
+#define _tcstod strtod
+#define _stprintf_s snprintf
+#define _ttoi atoi
+#define _tprintf printf
+#define _tfopen fopen
+#define _fgetts fgets
+#define _totlower tolower
+#define _istdigit(c) isdigit((unsigned char)(c))
+#define GetLastError() ((unsigned long)errno)
+#define DeleteFile(path) (unlink(path) == 0)
+#define GetCurrentDirectory(size, buffer) ((void)!getcwd(buffer, size))
+
+static void _tcscpy_s(TCHAR *dest, size_t size, LPCTSTR src) {
+    snprintf(dest, size, "%s", src);
+}
+#endif
+
+// Minimal threads and locks over Win32 and pthreads.
+#ifdef _WIN32
+typedef CRITICAL_SECTION Mutex;
+typedef HANDLE Thread;
+#define MutexInit(m) InitializeCriticalSection(m)
+#define MutexDestroy(m) DeleteCriticalSection(m)
+#define MutexLock(m) EnterCriticalSection(m)
+#define MutexUnlock(m) LeaveCriticalSection(m)
+typedef CONDITION_VARIABLE CondVar;
+#define CondInit(c) InitializeConditionVariable(c)
+#define CondDestroy(c) ((void)(c))
+#define CondWait(c, m) SleepConditionVariableCS(c, m, INFINITE)
+#define CondWakeAll(c) WakeAllConditionVariable(c)
+#define THREAD_PROC(name) DWORD WINAPI name(LPVOID arg)
+#define THREAD_EXIT return 0
+#define StartThread(thread, proc, param) ((*(thread) = CreateThread(NULL, 0, proc, param, 0, NULL)) != NULL)
+#define JoinThread(thread) (WaitForSingleObject(thread, INFINITE), CloseHandle(thread))
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+#else
+typedef pthread_mutex_t Mutex;
+typedef pthread_t Thread;
+#define MutexInit(m) pthread_mutex_init(m, NULL)
+#define MutexDestroy(m) pthread_mutex_destroy(m)
+#define MutexLock(m) pthread_mutex_lock(m)
+#define MutexUnlock(m) pthread_mutex_unlock(m)
+typedef pthread_cond_t CondVar;
+#define CondInit(c) pthread_cond_init(c, NULL)
+#define CondDestroy(c) pthread_cond_destroy(c)
+#define CondWait(c, m) pthread_cond_wait(c, m)
+#define CondWakeAll(c) pthread_cond_broadcast(c)
+#define THREAD_PROC(name) void *name(void *arg)
+#define THREAD_EXIT return NULL
+#define StartThread(thread, proc, param) (pthread_create(thread, NULL, proc, param) == 0)
+#define JoinThread(thread) pthread_join(thread, NULL)
+#define THREAD_LOCAL __thread
+#endif
+
+#define HASH_SIZE 32
+
+// Per-file hash state
+#define HASH_NONE  0
+#define HASH_OK    1
+#define HASH_ERROR 2
+#define HASH_LINK  3    // hardlink to another entry, which stands for it
+
+// Contiguous file table: one slot per file id in each parallel array, paths
+// packed into a single pool and addressed by offset.
+typedef struct _FileTable {
+    int count;
+    int capacity;
+    ULONGLONG *sizes;
+    ULONGLONG *mtimes;      // FILETIME on Windows, nanoseconds on POSIX
+    BYTE (*hashes)[HASH_SIZE];
+    BYTE *hashState;
+    int *devices;           // index into deviceList
+    int *dirs;              // containing directory, -1 if it could not be recorded
+    ULONGLONG *fileIds;     // inode or file index if the file has several links, else 0
+    int *links;             // next entry naming the same file, -1 at the end
+    size_t *pathOffsets;
+    TCHAR *pathPool;
+    size_t poolUsed;
+    size_t poolCapacity;
+    ULONGLONG *deviceList;  // st_dev on POSIX, volume serial on Windows
+    int deviceCount;
+    // Scanned directories, each recorded before its subdirectories.
+    int dirCount;
+    int dirCapacity;
+    int *dirParents;        // -1 for a scanned root
+    size_t *dirPathOffsets;
+    BYTE *dirComplete;      // FALSE if some entry was skipped or unreadable
+} FileTable;
+
+// A group is the run [start, start + count) of a file id array.
+typedef struct _GroupSpan {
+    int start;
+    int count;
+} GroupSpan;
+
+// A path built in place, reallocated only when it outgrows its capacity.
+typedef struct _PathBuffer {
+    TCHAR *text;
+    size_t length;
+    size_t capacity;
+} PathBuffer;
+
+// One entry of a directory listing; its name lives in the batch's arena.
+typedef struct _ScanEntry {
+    size_t nameOffset;
+    ULONGLONG size;
+    ULONGLONG mtime;
+    ULONGLONG device;
+    ULONGLONG fileId;
+    BOOL isDir;
+} ScanEntry;
+
+// A listing gathered outside the scan lock, reused from directory to
+// directory so that steady-state listing allocates nothing.
+typedef struct _ScanBatch {
+    ScanEntry *entries;
+    int count;
+    int capacity;
+    TCHAR *names;
+    size_t namesUsed;
+    size_t namesCapacity;
+    BOOL complete;
+} ScanBatch;
+
+// Directories waiting to be listed, shared by the scan workers.
+typedef struct _DirectoryScan {
+    FileTable *table;
+    BOOL recursive;
+    int *stack;
+    int stackCount;
+    int stackCapacity;
+    int busy;               // workers listing a directory right now
+    Mutex lock;
+    CondVar ready;
+} DirectoryScan;
+
+// Pipeline instrumentation. Counters are always kept (one lock per file
+// read); --stats reports them and --trace samples what each thread does.
+#define STAGE_SCAN  0
+#define STAGE_HASH  1
+#define STAGE_CHUNK 2
+#define NUM_STAGES  3
+
+#define SIZE_CLASSES    6   // < 64 KB, < 1 MB, < 16 MB, < 256 MB, < 4 GB, larger
+#define LATENCY_BUCKETS 20  // bucket b: under 2^b ms; the last is open-ended
+#define MAX_TRACE_THREADS 256
+
+// Thread activities as they appear in the trace.
+#define ACTIVITY_WAIT     'w'   // waiting for work
+#define ACTIVITY_LIST     'L'   // listing a directory
+#define ACTIVITY_RECORD   'C'   // recording a listing in the table
+#define ACTIVITY_READ     'R'   // blocked opening or reading a file
+#define ACTIVITY_PROCESS  'H'   // hashing or chunking what was read
+#define ACTIVITY_THROTTLE 'T'   // sleeping for --max-mbps
+#define ACTIVITY_ACTION   'A'   // carrying out a batch action
+#define ACTIVITY_EXITED   '-'
+
+typedef struct _StageStats {
+    double seconds;         // wall time of the stage
+    ULONGLONG files;
+    ULONGLONG bytes;
+    ULONGLONG failures;
+    // Summed over threads. For the scan, I/O is listing and CPU is
+    // recording; for reads, I/O is open and read calls and CPU is the
+    // hashing or chunking of the data.
+    double ioSeconds;
+    double cpuSeconds;
+    double throttleSeconds;
+    ULONGLONG latency[SIZE_CLASSES][LATENCY_BUCKETS];  // per file read
+} StageStats;
+
+typedef struct _PipelineStats {
+    double started;
+    StageStats stages[NUM_STAGES];
+    int stage;              // stage that file reads are charged to
+    ULONGLONG dirs;
+    int scanThreads;
+    double groupSeconds;
+    ULONGLONG sizeGroups;
+    ULONGLONG candidates;   // files in a size group of two or more
+    ULONGLONG candidateBytes;
+    ULONGLONG singletons;   // files ruled out by a unique size
+    ULONGLONG hardlinks;    // extra names folded before hashing
+    ULONGLONG duplicateGroups;
+    ULONGLONG duplicateFiles;
+    ULONGLONG uniqueAfterHash;  // candidates whose hash matched nothing
+    ULONGLONG reclaimable;
+    Mutex lock;
+    // Sampling trace: one activity byte per registered thread.
+    FILE *trace;
+    double traceInterval;
+    volatile char activity[MAX_TRACE_THREADS];
+    int numThreads;
+    BOOL stopping;
+    Thread sampler;
+} PipelineStats;
+
+static PipelineStats pipelineStats;
+static THREAD_LOCAL int traceSlot = -1;
+
+// A synthetic corpus for --corpus-bench.
+typedef struct _CorpusSpec {
+    int files;
+    double duplicateRatio;  // files that copy an earlier file
+    double sameSizeRatio;   // files sized like an earlier one, differing in the last byte
+    double emptyRatio;
+    double hardlinkRatio;   // files that also get a second name
+    double longPathRatio;   // files placed below a path longer than PATH_MAX / MAX_PATH
+    ULONGLONG maxSize;
+    ULONGLONG seed;
+    BOOL keep;              // leave the corpus on disk
+} CorpusSpec;
+
+// Out-of-core mode (--memory-limit): what the scan keeps per file, written
+// to sorted runs on disk. The path itself goes to a separate path file.
+typedef struct _SpillRecord {
+    ULONGLONG size;
+    ULONGLONG mtime;
+    ULONGLONG device;
+    ULONGLONG fileId;
+    ULONGLONG pathOffset;   // byte offset in the path file
+    unsigned int pathLength;
+} SpillRecord;
+
+// Runs are merged MERGE_FAN_IN at a time as they accumulate, which keeps at
+// most MAX_OPEN_RUNS open and the merge buffers within the budget.
+#define MERGE_FAN_IN  16
+#define MAX_OPEN_RUNS 64
+
+typedef struct _SpillState {
+    LPCTSTR directory;
+    FILE *paths;
+    ULONGLONG pathBytes;
+    SpillRecord *records;   // the run being filled
+    int count;
+    int capacity;
+    FILE **runs;
+    int *levels;            // merge passes behind each run, non-increasing
+    int numRuns;
+    int runCapacity;
+    int runsWritten;        // names the next run file
+    size_t mergeBuffer;     // read buffer per run while merging
+    ULONGLONG files;
+    ULONGLONG bytes;
+    ULONGLONG dirs;
+} SpillState;
+
+// Directories waiting to be listed, as paths in a pool used like a stack.
+typedef struct _PathStack {
+    TCHAR *pool;
+    size_t used;
+    size_t poolCapacity;
+    size_t *offsets;
+    int count;
+    int capacity;
+} PathStack;
+
+#define HASH_BUFFER_SIZE (1024 * 1024)
+#define IO_ALIGNMENT 4096
+
+// Caps the sustained hashing read rate, allowing at most one second of burst.
+typedef struct _RateLimiter {
+    double bytesPerSecond;  // 0 = unlimited
+    double windowStart;
+    double windowBytes;
+    Mutex lock;
+} RateLimiter;
+
+// Settings for the reads done while hashing.
+typedef struct _HashOptions {
+    BOOL cachePolite;       // sequential hints, bypass or drop the page cache
+    RateLimiter limiter;
+    int hddThreads;         // concurrent reads per rotational disk
+    int ssdThreads;         // concurrent reads per non-rotational device
+    BOOL largestFirst;      // groups are queued by reclaimable bytes
+} HashOptions;
+
+typedef struct _QueueEntry {
+    int id;
+    int group;
+} QueueEntry;
+
+// One physical disk: its candidates in read order and the next to dispatch.
+typedef struct _DeviceQueue {
+    TCHAR key[MAX_PATH];
+    BOOL rotational;
+    QueueEntry *entries;
+    int count;
+    int next;
+} DeviceQueue;
+
+struct _IoScheduler;
+
+// Receives each block read from a file; returning FALSE stops the read.
+typedef BOOL (*BlockProc)(void *context, const BYTE *data, size_t len);
+
+// Reads and processes one file on a scheduler worker. `buffer` is the
+// worker's HASH_BUFFER_SIZE read buffer, or NULL if it could not be had.
+typedef void (*FileProc)(struct _IoScheduler *scheduler, int id, BYTE *buffer);
+
+typedef struct _HashWorker {
+    struct _IoScheduler *scheduler;
+    DeviceQueue *queue;
+    Thread thread;
+} HashWorker;
+
+// Hashes candidates with one queue per disk so every disk is read at once,
+// handing back each group as soon as its last member is hashed. Other
+// whole-file passes reuse it through `process`.
+typedef struct _IoScheduler {
+    FileTable *table;
+    HashOptions *options;
+    FileProc process;
+    void *context;
+    DeviceQueue *queues;
+    int numQueues;
+    HashWorker *workers;
+    int numWorkers;
+    int workersRunning;
+    int numGroups;
+    int *pending;           // members left to hash, per group
+    int *completed;         // finished groups in completion order
+    int completedHead;
+    int completedTail;
+    Mutex lock;
+    CondVar groupDone;
+} IoScheduler;
+
+// Batch mode: which member of a group to keep, and what becomes of the rest.
+#define KEEP_OLDEST   0
+#define KEEP_NEWEST   1
+#define KEEP_SHORTEST 2
+
+#define ACTION_DELETE   0
+#define ACTION_HARDLINK 1
+#define ACTION_REFLINK  2
+
+typedef struct _DedupPolicy {
+    int keep;
+    LPCTSTR *preferPrefixes;  // earlier prefixes take priority over the keep rule
+    int numPrefixes;
+    int action;
+    BOOL dryRun;              // verify and journal, change nothing
+    FILE *journal;            // NDJSON record of every action, or NULL
+    int threads;
+} DedupPolicy;
+
+typedef struct _DedupAction {
+    int keep;
+    int target;
+} DedupAction;
+
+// Outcome of one action
+#define RESULT_DONE    0
+#define RESULT_PLANNED 1
+#define RESULT_LINKED  2    // target already is the kept file
+#define RESULT_CHANGED 3    // modified since hashing, left alone
+#define RESULT_FAILED  4
+
+// Actions planned by the main thread and carried out by worker threads.
+typedef struct _ActionQueue {
+    const FileTable *table;
+    const DedupPolicy *policy;
+    DedupAction *items;
+    int count;
+    int capacity;
+    int next;
+    int busy;               // actions taken but not yet finished
+    BOOL closed;
+    Thread *threads;
+    int numThreads;
+    int results[5];
+    ULONGLONG reclaimed;
+    Mutex lock;
+    CondVar ready;
+} ActionQueue;
+
+// A group put to the user, by its size and digest.
+typedef struct _HandledGroup {
+    ULONGLONG size;
+    BYTE hash[HASH_SIZE];
+} HandledGroup;
+
+// Progress of a hashing run, kept on disk so that an interrupted run can
+// be resumed (--checkpoint).
+typedef struct _Checkpoint {
+    FILE *file;
+    LPCTSTR path;
+    double interval;        // seconds between flushes of computed digests
+    double lastFlush;
+    int resumed;            // digests taken from the previous run
+    HandledGroup *handled;  // groups answered in the previous run, sorted
+    int numHandled;
+    int handledCapacity;
+    Mutex lock;
+} Checkpoint;
+
+// Content-defined chunking (FastCDC): cut points depend only on nearby
+// bytes, so content shifted by an insertion still splits the same way.
+#define CDC_MIN_SIZE (2 * 1024)
+#define CDC_AVG_SIZE (8 * 1024)
+#define CDC_MAX_SIZE (64 * 1024)
+// Normalized chunking: a harder test before the average size and an easier
+// one after it keep most chunks near CDC_AVG_SIZE.
+#define CDC_MASK_SMALL 0xFFFE000000000000ULL  // 15 bits
+#define CDC_MASK_LARGE 0xFFE0000000000000ULL  // 11 bits
+
+typedef struct _ChunkRef {
+    ULONGLONG fingerprint;  // XXH64 of the chunk
+    unsigned int length;
+} ChunkRef;
+
+// Splits one stream into chunks, collecting a fingerprint for each.
+typedef struct _Chunker {
+    BYTE *chunk;            // bytes of the chunk in progress, CDC_MAX_SIZE
+    size_t length;
+    ULONGLONG gear;         // rolling hash over the chunk in progress
+    ChunkRef *chunks;
+    int count;
+    int capacity;
+} Chunker;
+
+typedef struct _SharedPair {
+    int file;
+    int original;           // where the shared chunks were first seen
+    ULONGLONG bytes;
+} SharedPair;
+
+// Every chunk fingerprint seen so far, with the file it was first seen in,
+// in an open-addressing table of parallel arrays (12 bytes per slot).
+typedef struct _ChunkIndex {
+    ULONGLONG *fingerprints;  // 0 marks an empty slot
+    int *owners;
+    size_t slots;
+    size_t used;
+    ULONGLONG totalBytes;
+    ULONGLONG totalChunks;
+    ULONGLONG *duplicateBytes;  // per file: bytes in chunks seen earlier
+    SharedPair *pairs;          // pairs sharing at least minShared bytes
+    int numPairs;
+    int pairCapacity;
+    ULONGLONG minShared;
+    Mutex lock;
+} ChunkIndex;
+
+// Streaming SHA-256: CryptoAPI on Windows, built in elsewhere.
+typedef struct _HashContext {
+#ifdef _WIN32
+    HCRYPTPROV hProv;
+    HCRYPTHASH hHash;
+#else
+    uint32_t state[8];
+    ULONGLONG length;
+    BYTE block[64];
+    size_t blockUsed;
+#endif
+} HashContext;
 
 // Function prototypes
-void TraverseDirectory(LPCTSTR dirPath, BOOL recursive, FileEntry **fileList);
-BOOL ComputeFileHash(LPCTSTR filePath, BYTE **hash, DWORD *hashSize);
-void ComputeHashes(FileEntry *group);
-int CompareFileSizes(const void *a, const void *b);
-int CompareHashes(const void *a, const void *b);
-void GroupBySize(FileEntry **sortedFiles, int count, FileEntry ***groups, int *numGroups);
-FileEntry **SortFilesBySize(FileEntry *list, int *count);
-FileEntry **GroupByHash(FileEntry *group, int *numGroups);
-void HandleDuplicateGroup(FileEntry *group);
-void FreeFileList(FileEntry *list);
+void InitFileTable(FileTable *table);
+BOOL AddFile(FileTable *table, LPCTSTR path, ULONGLONG size, ULONGLONG mtime, ULONGLONG device,
+             ULONGLONG fileId, int dir);
+int AddDirectory(FileTable *table, LPCTSTR path, int parent);
+LPCTSTR GetFilePath(const FileTable *table, int id);
+LPCTSTR GetDirectoryPath(const FileTable *table, int dir);
+void FreeFileTable(FileTable *table);
+BOOL ReservePath(PathBuffer *path, size_t needed);
+BOOL JoinPath(PathBuffer *path, LPCTSTR dir, LPCTSTR name);
+void ListDirectory(LPCTSTR dirPath, BOOL recursive, PathBuffer *scratch, ScanBatch *batch);
+void CommitListing(DirectoryScan *scan, int dir, LPCTSTR dirPath, PathBuffer *fullPath, const ScanBatch *batch);
+void TraverseDirectories(FileTable *table, LPCTSTR *roots, int numRoots, BOOL recursive, int threads);
+void InitHashOptions(HashOptions *options);
+void FreeHashOptions(HashOptions *options);
+BOOL HashBegin(HashContext *ctx);
+BOOL HashUpdate(HashContext *ctx, const BYTE *data, size_t len);
+BOOL HashEnd(HashContext *ctx, BYTE hash[HASH_SIZE]);
+BYTE *AllocIoBuffer(size_t size);
+void FreeIoBuffer(BYTE *buffer);
+double NowSeconds(void);
+void SleepSeconds(double seconds);
+void ThrottleIo(RateLimiter *limiter, size_t bytes);
+BOOL ReadFileBlocks(LPCTSTR filePath, HashOptions *options, BYTE *buffer, BlockProc consume, void *context);
+void InitPipelineStats(void);
+void RegisterTraceThread(const char *role, LPCTSTR detail);
+void SetActivity(char activity);
+void UnregisterTraceThread(void);
+BOOL StartTrace(LPCTSTR path, double interval);
+void RecordFileRead(ULONGLONG bytes, BOOL ok, double elapsed, double io, double cpu, double throttle);
+void RecordScanTime(double list, double record);
+void FinishPipelineStats(LPCTSTR statsPath);
+ULONGLONG PeakMemoryBytes(void);
+int RunCorpusBenchmark(LPCTSTR dir, const CorpusSpec *spec, HashOptions *options, int scanThreads);
+int FindDuplicatesOutOfCore(LPCTSTR *roots, int numRoots, BOOL recursive, ULONGLONG memoryLimit,
+                            LPCTSTR spillDir, HashOptions *options, FILE *ndjson, ActionQueue *actions);
+BOOL ComputeFileHash(LPCTSTR filePath, HashOptions *options, BYTE *buffer, BYTE hash[HASH_SIZE]);
+void DescribeDevice(ULONGLONG device, LPCTSTR samplePath, TCHAR key[MAX_PATH], BOOL *rotational);
+ULONGLONG GetPhysicalOffset(LPCTSTR path);
+BOOL StartScan(IoScheduler *scheduler, FileTable *table, const int *files, const GroupSpan *groups,
+               int numGroups, HashOptions *options, FileProc process, void *context);
+BOOL StartHashing(IoScheduler *scheduler, FileTable *table, const int *files,
+                  const GroupSpan *groups, int numGroups, HashOptions *options);
+void HashTableFile(IoScheduler *scheduler, int id, BYTE *buffer);
+int NextHashedGroup(IoScheduler *scheduler);
+void StopHashing(IoScheduler *scheduler);
+void FinishHashing(IoScheduler *scheduler);
+BOOL ComputeHashes(FileTable *table, const int *members, int count, HashOptions *options);
+int *SortFilesBySize(const FileTable *table, int *count);
+void GroupBySize(const FileTable *table, int *sortedFiles, int count, GroupSpan **groups, int *numGroups);
+ULONGLONG GetFileIdentity(LPCTSTR path);
+int CollapseHardlinks(FileTable *table, int *files, GroupSpan *groups, int numGroups);
+void ReportHardlinks(const FileTable *table, int folded, FILE *ndjson);
+GroupSpan *GroupByHash(const FileTable *table, int *members, int count, int *numGroups);
+GroupSpan *GroupByDigest(BYTE (*hashes)[HASH_SIZE], const BYTE *state, int *members, int count, int *numGroups);
+BOOL ComputeDirectoryHashes(const FileTable *table, BYTE (*hashes)[HASH_SIZE], ULONGLONG *sizes, BYTE *state);
+BYTE *ReportDuplicateDirectories(const FileTable *table, FILE *ndjson);
+void SortGroupsByReclaimable(const FileTable *table, const int *files, GroupSpan *groups, int numGroups);
+void WriteJsonString(FILE *out, LPCTSTR str);
+void WriteGroupJson(FILE *out, const FileTable *table, const int *members, int count);
+void WriteDirectoryGroupJson(FILE *out, const FileTable *table, ULONGLONG size, const BYTE hash[HASH_SIZE],
+                             const int *dirs, int count);
+BOOL HandleDuplicateGroup(const FileTable *table, const int *members, int count);
 BOOL IsSymbolicLink(LPCTSTR path);
-int CountFiles(FileEntry *list);
+BOOL GetFileStamp(LPCTSTR path, ULONGLONG *size, ULONGLONG *mtime);
+BOOL IsSameFile(LPCTSTR path1, LPCTSTR path2);
+int ChooseKeeper(const FileTable *table, const int *members, int count, const DedupPolicy *policy);
+BOOL ReplaceWithLink(LPCTSTR keep, LPCTSTR target, int action);
+int ExecuteAction(const FileTable *table, const DedupPolicy *policy, const DedupAction *item, unsigned long *error);
+void StartActions(ActionQueue *queue, const FileTable *table, const DedupPolicy *policy);
+void PlanDuplicateGroup(ActionQueue *queue, const FileTable *table, const int *members, int count);
+void RebindActions(ActionQueue *queue, const FileTable *table);
+void FinishActions(ActionQueue *queue);
+BOOL OpenCheckpoint(Checkpoint *checkpoint, LPCTSTR path, LPCTSTR *roots, int numRoots, BOOL recursive,
+                    FileTable *table, double interval);
+void CheckpointHash(Checkpoint *checkpoint, int id, const BYTE hash[HASH_SIZE]);
+void CheckpointGroup(Checkpoint *checkpoint, ULONGLONG size, const BYTE hash[HASH_SIZE]);
+BOOL IsGroupAnswered(const Checkpoint *checkpoint, ULONGLONG size, const BYTE hash[HASH_SIZE]);
+void CloseCheckpoint(Checkpoint *checkpoint, BOOL finished);
+void InitGearTable(void);
+ULONGLONG Xxh64(const BYTE *data, size_t len);
+BOOL InitChunker(Chunker *chunker);
+BOOL ChunkerUpdate(Chunker *chunker, const BYTE *data, size_t len);
+BOOL ChunkerFinish(Chunker *chunker);
+void FreeChunker(Chunker *chunker);
+BOOL InitChunkIndex(ChunkIndex *index, int numFiles, ULONGLONG minShared);
+void MergeChunks(ChunkIndex *index, int id, const ChunkRef *chunks, int count);
+void FreeChunkIndex(ChunkIndex *index);
+void AnalyzeChunks(FileTable *table, HashOptions *options, ULONGLONG minShared);
+void RunChunkBenchmark(void);
 
 // New helper prototypes
 LPCTSTR GetFileName(LPCTSTR path);
@@ -34,454 +616,4577 @@ BOOL AreFilenamesSimilar(LPCTSTR name1, LPCTSTR name2);
 
 int _tmain(int argc, TCHAR *argv[]) {
     TCHAR directory[MAX_PATH] = {0};
+    LPCTSTR *roots = (LPCTSTR *)malloc(argc * sizeof(LPCTSTR));
+    int numRoots = 0;
     BOOL recursive = FALSE;
+    LPCTSTR ndjsonPath = NULL;
+    LPCTSTR journalPath = NULL;
+    BOOL batch = FALSE;
+    BOOL findDirectories = FALSE;
+    BOOL chunkMode = FALSE;
+    int scanThreads = 1;
+    LPCTSTR statsPath = NULL;
+    LPCTSTR tracePath = NULL;
+    double traceInterval = 0.01;
+    LPCTSTR corpusDir = NULL;
+    ULONGLONG memoryLimit = 0;
+    LPCTSTR spillDir = NULL;
+    LPCTSTR checkpointPath = NULL;
+    double checkpointInterval = 30.0;
+    CorpusSpec corpus;
+    memset(&corpus, 0, sizeof(corpus));
+    corpus.files = 10000;
+    corpus.duplicateRatio = 0.3;
+    corpus.sameSizeRatio = 0.1;
+    corpus.emptyRatio = 0.01;
+    corpus.hardlinkRatio = 0.02;
+    corpus.longPathRatio = 0.02;
+    corpus.maxSize = 256 * 1024;
+    corpus.seed = 1;
+    ULONGLONG minShared = 1024 * 1024;
+    DedupPolicy policy;
+    memset(&policy, 0, sizeof(policy));
+    policy.keep = KEEP_OLDEST;
+    policy.action = ACTION_DELETE;
+    policy.threads = 4;
+    policy.preferPrefixes = (LPCTSTR *)malloc(argc * sizeof(LPCTSTR));
+    HashOptions hashOptions;
+    InitHashOptions(&hashOptions);
+    InitPipelineStats();
 
     // Parse command line arguments
     for (int i = 1; i < argc; i++) {
         if (_tcscmp(argv[i], _T("-r")) == 0) {
             recursive = TRUE;
-        } else if (directory[0] == 0) {
-            _tcscpy_s(directory, MAX_PATH, argv[i]);
+        } else if (_tcscmp(argv[i], _T("--cache-polite")) == 0) {
+            hashOptions.cachePolite = TRUE;
+        } else if (_tcscmp(argv[i], _T("--max-mbps")) == 0 && i + 1 < argc) {
+            hashOptions.limiter.bytesPerSecond = _tcstod(argv[++i], NULL) * 1024.0 * 1024.0;
+        } else if (_tcscmp(argv[i], _T("--hdd-threads")) == 0 && i + 1 < argc) {
+            hashOptions.hddThreads = _ttoi(argv[++i]);
+        } else if (_tcscmp(argv[i], _T("--ssd-threads")) == 0 && i + 1 < argc) {
+            hashOptions.ssdThreads = _ttoi(argv[++i]);
+        } else if (_tcscmp(argv[i], _T("--largest-first")) == 0) {
+            hashOptions.largestFirst = TRUE;
+        } else if (_tcscmp(argv[i], _T("--ndjson")) == 0 && i + 1 < argc) {
+            ndjsonPath = argv[++i];
+        } else if (_tcscmp(argv[i], _T("--chunks")) == 0) {
+            chunkMode = TRUE;
+        } else if (_tcscmp(argv[i], _T("--min-shared")) == 0 && i + 1 < argc) {
+            minShared = (ULONGLONG)(_tcstod(argv[++i], NULL) * 1024.0 * 1024.0);
+        } else if (_tcscmp(argv[i], _T("--chunk-bench")) == 0) {
+            RunChunkBenchmark();
+            return 0;
+        } else if (_tcscmp(argv[i], _T("--dirs")) == 0) {
+            findDirectories = TRUE;
+        } else if (_tcscmp(argv[i], _T("--batch")) == 0) {
+            batch = TRUE;
+        } else if (_tcscmp(argv[i], _T("--keep")) == 0 && i + 1 < argc) {
+            LPCTSTR rule = argv[++i];
+            if (_tcscmp(rule, _T("oldest")) == 0) policy.keep = KEEP_OLDEST;
+            else if (_tcscmp(rule, _T("newest")) == 0) policy.keep = KEEP_NEWEST;
+            else if (_tcscmp(rule, _T("shortest")) == 0) policy.keep = KEEP_SHORTEST;
+            else {
+                _tprintf(_T("Unknown keep rule: %s (use oldest, newest or shortest)\n"), rule);
+                return 1;
+            }
+        } else if (_tcscmp(argv[i], _T("--prefer")) == 0 && i + 1 < argc) {
+            policy.preferPrefixes[policy.numPrefixes++] = argv[++i];
+        } else if (_tcscmp(argv[i], _T("--action")) == 0 && i + 1 < argc) {
+            LPCTSTR action = argv[++i];
+            if (_tcscmp(action, _T("delete")) == 0) policy.action = ACTION_DELETE;
+            else if (_tcscmp(action, _T("hardlink")) == 0) policy.action = ACTION_HARDLINK;
+            else if (_tcscmp(action, _T("reflink")) == 0) policy.action = ACTION_REFLINK;
+            else {
+                _tprintf(_T("Unknown action: %s (use delete, hardlink or reflink)\n"), action);
+                return 1;
+            }
+        } else if (_tcscmp(argv[i], _T("--dry-run")) == 0) {
+            policy.dryRun = TRUE;
+        } else if (_tcscmp(argv[i], _T("--journal")) == 0 && i + 1 < argc) {
+            journalPath = argv[++i];
+        } else if (_tcscmp(argv[i], _T("--action-threads")) == 0 && i + 1 < argc) {
+            policy.threads = _ttoi(argv[++i]);
+        } else if (_tcscmp(argv[i], _T("--scan-threads")) == 0 && i + 1 < argc) {
+            scanThreads = _ttoi(argv[++i]);
+        } else if (_tcscmp(argv[i], _T("--stats")) == 0 && i + 1 < argc) {
+            statsPath = argv[++i];
+        } else if (_tcscmp(argv[i], _T("--trace")) == 0 && i + 1 < argc) {
+            tracePath = argv[++i];
+        } else if (_tcscmp(argv[i], _T("--trace-ms")) == 0 && i + 1 < argc) {
+            traceInterval = _tcstod(argv[++i], NULL) / 1000.0;
+        } else if (_tcscmp(argv[i], _T("--corpus-bench")) == 0 && i + 1 < argc) {
+            corpusDir = argv[++i];
+        } else if (_tcscmp(argv[i], _T("--corpus-files")) == 0 && i + 1 < argc) {
+            corpus.files = _ttoi(argv[++i]);
+        } else if (_tcscmp(argv[i], _T("--corpus-dups")) == 0 && i + 1 < argc) {
+            corpus.duplicateRatio = _tcstod(argv[++i], NULL);
+        } else if (_tcscmp(argv[i], _T("--corpus-max-kb")) == 0 && i + 1 < argc) {
+            corpus.maxSize = (ULONGLONG)(_tcstod(argv[++i], NULL) * 1024.0);
+        } else if (_tcscmp(argv[i], _T("--corpus-seed")) == 0 && i + 1 < argc) {
+            corpus.seed = (ULONGLONG)_ttoi(argv[++i]);
+        } else if (_tcscmp(argv[i], _T("--corpus-keep")) == 0) {
+            corpus.keep = TRUE;
+        } else if (_tcscmp(argv[i], _T("--memory-limit")) == 0 && i + 1 < argc) {
+            memoryLimit = (ULONGLONG)(_tcstod(argv[++i], NULL) * 1024.0 * 1024.0);
+        } else if (_tcscmp(argv[i], _T("--spill-dir")) == 0 && i + 1 < argc) {
+            spillDir = argv[++i];
+        } else if (_tcscmp(argv[i], _T("--checkpoint")) == 0 && i + 1 < argc) {
+            checkpointPath = argv[++i];
+        } else if (_tcscmp(argv[i], _T("--checkpoint-secs")) == 0 && i + 1 < argc) {
+            checkpointInterval = _tcstod(argv[++i], NULL);
+        } else {
+            roots[numRoots++] = argv[i];
         }
     }
 
-    if (directory[0] == 0) {
+    if (hashOptions.hddThreads < 1) hashOptions.hddThreads = 1;
+    if (hashOptions.ssdThreads < 1) hashOptions.ssdThreads = 1;
+    if (policy.threads < 1) policy.threads = 1;
+    if (scanThreads < 1) scanThreads = 1;
+
+    if (numRoots == 0) {
         GetCurrentDirectory(MAX_PATH, directory);
+        roots[numRoots++] = directory;
     }
 
-    FileEntry *fileList = NULL;
-    TraverseDirectory(directory, recursive, &fileList);
+    if (traceInterval <= 0) traceInterval = 0.01;
+    if (tracePath) StartTrace(tracePath, traceInterval);
 
-    int fileCount = 0;
-    FileEntry **sortedFiles = SortFilesBySize(fileList, &fileCount);
+    if (corpusDir) {
+        if (corpus.files < 0) corpus.files = 0;
+        if (corpus.maxSize < 8) corpus.maxSize = 8;
+        int status = RunCorpusBenchmark(corpusDir, &corpus, &hashOptions, scanThreads);
+        FinishPipelineStats(statsPath);
+        FreeHashOptions(&hashOptions);
+        free(policy.preferPrefixes);
+        free(roots);
+        return status;
+    }
 
-    FileEntry **sizeGroups = NULL;
-    int numSizeGroups = 0;
-    GroupBySize(sortedFiles, fileCount, &sizeGroups, &numSizeGroups);
-    free(sortedFiles);
+    FILE *ndjson = NULL;
+    if (ndjsonPath) {
+        ndjson = _tfopen(ndjsonPath, _T("wb"));
+        if (!ndjson) _tprintf(_T("Cannot open %s for writing.\n"), ndjsonPath);
+    }
+    if (journalPath) {
+        policy.journal = _tfopen(journalPath, _T("wb"));
+        if (!policy.journal) _tprintf(_T("Cannot open %s for writing.\n"), journalPath);
+    }
 
-    for (int i = 0; i < numSizeGroups; i++) {
-        FileEntry *group = sizeGroups[i];
-        if (CountFiles(group) > 1) {
-            ComputeHashes(group);
-            
-            int numHashGroups = 0;
-            FileEntry **hashGroups = GroupByHash(group, &numHashGroups);
-            
-            for (int j = 0; j < numHashGroups; j++) {
-                if (CountFiles(hashGroups[j]) > 1) {
-                    HandleDuplicateGroup(hashGroups[j]);
-                }
-                // Removed freeing per DeepSeek suggestion.
-            }
-            free(hashGroups);
+    // Past a few tens of millions of files the table no longer fits; bound
+    // memory instead and work through size groups a batch at a time.
+    if (memoryLimit > 0) {
+        int status = 1;
+        TCHAR tempDir[MAX_PATH];
+        if (!spillDir) {
+#ifdef _WIN32
+            GetTempPath(MAX_PATH, tempDir);
+#else
+            _tcscpy_s(tempDir, MAX_PATH, getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp");
+#endif
+            spillDir = tempDir;
+        }
+        if (checkpointPath) _tprintf(_T("--checkpoint is not supported with --memory-limit; ignoring it.\n"));
+        if (findDirectories || chunkMode) {
+            _tprintf(_T("--dirs and --chunks need the whole tree in memory and cannot be used with --memory-limit.\n"));
+        } else {
+            ActionQueue actions;
+            if (batch) StartActions(&actions, NULL, &policy);
+            status = FindDuplicatesOutOfCore(roots, numRoots, recursive, memoryLimit, spillDir, &hashOptions,
+                                             ndjson, batch ? &actions : NULL);
+            if (batch) FinishActions(&actions);
         }
-        // Removed freeing per DeepSeek suggestion.
+        FinishPipelineStats(statsPath);
+        if (ndjson) fclose(ndjson);
+        if (policy.journal) fclose(policy.journal);
+        FreeHashOptions(&hashOptions);
+        free(policy.preferPrefixes);
+        free(roots);
+        return status;
     }
-    free(sizeGroups);
 
-    FreeFileList(fileList);
-    return 0;
-}
-
-void TraverseDirectory(LPCTSTR dirPath, BOOL recursive, FileEntry **fileList) {
-    WIN32_FIND_DATA findFileData;
-    HANDLE hFind = INVALID_HANDLE_VALUE;
-    TCHAR searchPath[MAX_PATH];
+    FileTable table;
+    InitFileTable(&table);
+    double stageStarted = NowSeconds();
+    TraverseDirectories(&table, roots, numRoots, recursive, scanThreads);
+    StageStats *scanStats = &pipelineStats.stages[STAGE_SCAN];
+    scanStats->seconds = NowSeconds() - stageStarted;
+    scanStats->files = (ULONGLONG)table.count;
+    for (int id = 0; id < table.count; id++) scanStats->bytes += table.sizes[id];
+    pipelineStats.dirs = (ULONGLONG)table.dirCount;
+    pipelineStats.scanThreads = scanThreads;
 
-    _stprintf_s(searchPath, MAX_PATH, _T("%s\\*"), dirPath);
+    // Chunk analysis reports shared content instead of deduplicating.
+    if (chunkMode) {
+        AnalyzeChunks(&table, &hashOptions, minShared);
+        FinishPipelineStats(statsPath);
+        if (ndjson) fclose(ndjson);
+        if (policy.journal) fclose(policy.journal);
+        FreeFileTable(&table);
+        FreeHashOptions(&hashOptions);
+        free(policy.preferPrefixes);
+        free(roots);
+        return 0;
+    }
 
-    hFind = FindFirstFile(searchPath, &findFileData);
-    if (hFind == INVALID_HANDLE_VALUE) return;
+    stageStarted = NowSeconds();
+    int fileCount = 0;
+    int *sortedFiles = SortFilesBySize(&table, &fileCount);
 
-    do {
-        if (_tcscmp(findFileData.cFileName, _T(".")) == 0 ||
-            _tcscmp(findFileData.cFileName, _T("..")) == 0) {
-            continue;
-        }
+    GroupSpan *sizeGroups = NULL;
+    int numSizeGroups = 0;
+    GroupBySize(&table, sortedFiles, fileCount, &sizeGroups, &numSizeGroups);
 
-        TCHAR fullPath[MAX_PATH];
-        _stprintf_s(fullPath, MAX_PATH, _T("%s\\%s"), dirPath, findFileData.cFileName);
+    // Several names for one file free nothing and need reading only once;
+    // drop the groups that no longer have two distinct files.
+    int folded = CollapseHardlinks(&table, sortedFiles, sizeGroups, numSizeGroups);
+    ReportHardlinks(&table, folded, ndjson);
+    int keptGroups = 0;
+    for (int j = 0; j < numSizeGroups; j++) {
+        if (sizeGroups[j].count > 1) sizeGroups[keptGroups++] = sizeGroups[j];
+    }
+    numSizeGroups = keptGroups;
 
-        if (findFileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
-            if (recursive) {
-                TraverseDirectory(fullPath, recursive, fileList);
-            }
-        } else {
-            FileEntry *entry = (FileEntry *)malloc(sizeof(FileEntry));
-            entry->path = _tcsdup(fullPath);
-            entry->fileSize.LowPart = findFileData.nFileSizeLow;
-            entry->fileSize.HighPart = findFileData.nFileSizeHigh;
-            entry->hash = NULL;
-            entry->next = *fileList;
-            *fileList = entry;
-        }
-    } while (FindNextFile(hFind, &findFileData));
+    pipelineStats.groupSeconds = NowSeconds() - stageStarted;
+    pipelineStats.sizeGroups = (ULONGLONG)numSizeGroups;
+    pipelineStats.hardlinks = (ULONGLONG)folded;
+    for (int j = 0; j < numSizeGroups; j++) {
+        pipelineStats.candidates += (ULONGLONG)sizeGroups[j].count;
+        pipelineStats.candidateBytes += (ULONGLONG)sizeGroups[j].count * table.sizes[sortedFiles[sizeGroups[j].start]];
+    }
+    pipelineStats.singletons = (ULONGLONG)table.count - pipelineStats.candidates - pipelineStats.hardlinks;
 
-    FindClose(hFind);
-}
+    // Digests from an interrupted run over the same roots are taken as they
+    // are for files whose size and mtime have not changed.
+    Checkpoint checkpoint;
+    BOOL checkpointing = FALSE;
+    if (checkpointPath) {
+        if (checkpointInterval < 0) checkpointInterval = 0;
+        checkpointing = OpenCheckpoint(&checkpoint, checkpointPath, roots, numRoots, recursive, &table,
+                                       checkpointInterval);
+    }
+    int answered = 0;
 
-BOOL ComputeFileHash(LPCTSTR filePath, BYTE **hash, DWORD *hashSize) {
-    HANDLE hFile = CreateFile(filePath, GENERIC_READ, FILE_SHARE_READ, 
-                            NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-    if (hFile == INVALID_HANDLE_VALUE) return FALSE;
+    // Batch actions run on their own threads while hashing continues.
+    ActionQueue actions;
+    if (batch) StartActions(&actions, &table, &policy);
 
-    HCRYPTPROV hProv = 0;
-    HCRYPTHASH hHash = 0;
+    // Potential savings are known before any hashing: (count - 1) x size.
+    // Verifying the biggest first means an interrupted run has already
+    // reported the duplicates worth acting on.
+    if (hashOptions.largestFirst) {
+        SortGroupsByReclaimable(&table, sortedFiles, sizeGroups, numSizeGroups);
+    }
 
-    if (!CryptAcquireContext(&hProv, NULL, NULL, PROV_RSA_AES, CRYPT_VERIFYCONTEXT)) {
-        CloseHandle(hFile);
-        return FALSE;
+    // Hash every member of every size group in one scheduled pass so that
+    // all disks are busy at once, and report each group as soon as its last
+    // member is hashed. Directories can only be compared once every file is
+    // hashed, so with --dirs the file groups are held back until then.
+    GroupSpan *fileGroups = NULL;
+    int numFileGroups = 0;
+    int fileGroupCapacity = 0;
+    stageStarted = NowSeconds();
+    pipelineStats.stage = STAGE_HASH;
+    IoScheduler scheduler;
+    int status = 0;
+    BOOL quit = FALSE;  // 'q' at the prompt
+    if (!StartScan(&scheduler, &table, sortedFiles, sizeGroups, numSizeGroups, &hashOptions, HashTableFile,
+                   checkpointing ? &checkpoint : NULL)) {
+        _tprintf(_T("Out of memory queueing %llu files for hashing.\n"), pipelineStats.candidates);
+        status = 1;
     }
+    int g;
+    while (status == 0 && (g = NextHashedGroup(&scheduler)) >= 0) {
+        int *members = sortedFiles + sizeGroups[g].start;
+        int count = sizeGroups[g].count;
 
-    if (!CryptCreateHash(hProv, CALG_SHA_256, 0, 0, &hHash)) {
-        CryptReleaseContext(hProv, 0);
-        CloseHandle(hFile);
-        return FALSE;
+        int numHashGroups = 0;
+        GroupSpan *hashGroups = GroupByHash(&table, members, count, &numHashGroups);
+        int matched = 0;
+        for (int j = 0; j < numHashGroups; j++) {
+            matched += hashGroups[j].count;
+            pipelineStats.reclaimable += (ULONGLONG)(hashGroups[j].count - 1) * table.sizes[members[0]];
+        }
+        pipelineStats.duplicateGroups += (ULONGLONG)numHashGroups;
+        pipelineStats.duplicateFiles += (ULONGLONG)matched;
+        pipelineStats.uniqueAfterHash += (ULONGLONG)(count - matched);
+        for (int j = 0; !quit && j < numHashGroups; j++) {
+            int *group = members + hashGroups[j].start;
+            if (ndjson) WriteGroupJson(ndjson, &table, group, hashGroups[j].count);
+            if (findDirectories) {
+                if (numFileGroups == fileGroupCapacity) {
+                    int newCapacity = fileGroupCapacity ? fileGroupCapacity * 2 : 256;
+                    GroupSpan *grown = (GroupSpan *)realloc(fileGroups, newCapacity * sizeof(GroupSpan));
+                    if (!grown) {
+                        _tprintf(_T("Out of memory recording group of %s\n"), GetFilePath(&table, group[0]));
+                        continue;
+                    }
+                    fileGroups = grown;
+                    fileGroupCapacity = newCapacity;
+                }
+                fileGroups[numFileGroups].start = (int)(group - sortedFiles);
+                fileGroups[numFileGroups].count = hashGroups[j].count;
+                numFileGroups++;
+            } else if (batch) {
+                PlanDuplicateGroup(&actions, &table, group, hashGroups[j].count);
+            } else if (checkpointing && IsGroupAnswered(&checkpoint, table.sizes[group[0]], table.hashes[group[0]])) {
+                answered++;
+            } else {
+                quit = !HandleDuplicateGroup(&table, group, hashGroups[j].count);
+                // End of input is no answer.
+                if (!quit && checkpointing && !feof(stdin)) {
+                    CheckpointGroup(&checkpoint, table.sizes[group[0]], table.hashes[group[0]]);
+                }
+            }
+        }
+        free(hashGroups);
+        if (quit) {
+            StopHashing(&scheduler);
+            break;
+        }
     }
+    FinishHashing(&scheduler);
+    pipelineStats.stages[STAGE_HASH].seconds = NowSeconds() - stageStarted;
 
-    BYTE buffer[4096];
-    DWORD bytesRead;
-    while (ReadFile(hFile, buffer, sizeof(buffer), &bytesRead, NULL) && bytesRead > 0) {
-        if (!CryptHashData(hHash, buffer, bytesRead, 0)) {
-            CryptDestroyHash(hHash);
-            CryptReleaseContext(hProv, 0);
-            CloseHandle(hFile);
-            return FALSE;
+    if (findDirectories && status == 0 && !quit) {
+        // Report whole identical directories first; a file group lying
+        // entirely inside them is already accounted for and not asked about.
+        BYTE *covered = ReportDuplicateDirectories(&table, ndjson);
+        int skipped = 0;
+        for (int j = 0; !quit && j < numFileGroups; j++) {
+            int *group = sortedFiles + fileGroups[j].start;
+            int count = fileGroups[j].count;
+            BOOL inside = covered != NULL;
+            for (int k = 0; inside && k < count; k++) {
+                int dir = table.dirs[group[k]];
+                inside = dir >= 0 && covered[dir];
+            }
+            if (batch) {
+                PlanDuplicateGroup(&actions, &table, group, count);
+            } else if (inside) {
+                skipped++;
+            } else if (checkpointing && IsGroupAnswered(&checkpoint, table.sizes[group[0]], table.hashes[group[0]])) {
+                answered++;
+            } else {
+                quit = !HandleDuplicateGroup(&table, group, count);
+                if (!quit && checkpointing && !feof(stdin)) {
+                    CheckpointGroup(&checkpoint, table.sizes[group[0]], table.hashes[group[0]]);
+                }
+            }
         }
+        if (skipped > 0) {
+            _tprintf(_T("\nSkipped %d file groups lying wholly inside identical directories.\n"), skipped);
+        }
+        free(covered);
     }
+    free(fileGroups);
+    if (answered > 0) _tprintf(_T("\nSkipped %d groups already answered before the checkpoint.\n"), answered);
+    if (batch) FinishActions(&actions);
+    // A run left with 'q' keeps its checkpoint, to be resumed.
+    if (checkpointing) CloseCheckpoint(&checkpoint, status == 0 && !quit);
+    FinishPipelineStats(statsPath);
+    if (ndjson) fclose(ndjson);
+    if (policy.journal) fclose(policy.journal);
+    free(policy.preferPrefixes);
+    free(sizeGroups);
+    free(sortedFiles);
+    free(roots);
 
-    DWORD len = 0;
-    DWORD dummy = sizeof(DWORD);
-    if (!CryptGetHashParam(hHash, HP_HASHSIZE, (BYTE *)&len, &dummy, 0)) {
-        CryptDestroyHash(hHash);
-        CryptReleaseContext(hProv, 0);
-        CloseHandle(hFile);
-        return FALSE;
+    FreeFileTable(&table);
+    FreeHashOptions(&hashOptions);
+    return status;
+}
+
+void InitFileTable(FileTable *table) {
+    memset(table, 0, sizeof(*table));
+}
+
+// Copies a path into the pool and returns its offset, or (size_t)-1.
+static size_t AppendPath(FileTable *table, LPCTSTR path) {
+    size_t len = _tcslen(path) + 1;
+    if (table->poolUsed + len > table->poolCapacity) {
+        size_t newCapacity = table->poolCapacity ? table->poolCapacity * 2 : 64 * 1024;
+        while (newCapacity < table->poolUsed + len) newCapacity *= 2;
+        TCHAR *pool = (TCHAR *)realloc(table->pathPool, newCapacity * sizeof(TCHAR));
+        if (!pool) return (size_t)-1;
+        table->pathPool = pool;
+        table->poolCapacity = newCapacity;
     }
+    size_t offset = table->poolUsed;
+    memcpy(table->pathPool + offset, path, len * sizeof(TCHAR));
+    table->poolUsed += len;
+    return offset;
+}
 
-    *hash = (BYTE *)malloc(len);
-    *hashSize = len;
+// Appends a file to the table. Arrays and the path pool grow geometrically,
+// so the per-file cost is amortized constant with no per-file allocation.
+BOOL AddFile(FileTable *table, LPCTSTR path, ULONGLONG size, ULONGLONG mtime, ULONGLONG device,
+             ULONGLONG fileId, int dir) {
+    // Devices are few and files arrive grouped by directory, so the last
+    // device matches almost always.
+    int deviceIndex = table->deviceCount - 1;
+    if (deviceIndex < 0 || table->deviceList[deviceIndex] != device) {
+        for (deviceIndex = 0; deviceIndex < table->deviceCount; deviceIndex++) {
+            if (table->deviceList[deviceIndex] == device) break;
+        }
+        if (deviceIndex == table->deviceCount) {
+            ULONGLONG *list = (ULONGLONG *)realloc(table->deviceList, (table->deviceCount + 1) * sizeof(ULONGLONG));
+            if (!list) return FALSE;
+            table->deviceList = list;
+            table->deviceList[table->deviceCount++] = device;
+        }
+    }
 
-    if (!CryptGetHashParam(hHash, HP_HASHVAL, *hash, &len, 0)) {
-        free(*hash);
-        *hash = NULL;
-        CryptDestroyHash(hHash);
-        CryptReleaseContext(hProv, 0);
-        CloseHandle(hFile);
-        return FALSE;
+    if (table->count == table->capacity) {
+        int newCapacity = table->capacity ? table->capacity * 2 : 1024;
+        ULONGLONG *sizes = (ULONGLONG *)realloc(table->sizes, newCapacity * sizeof(ULONGLONG));
+        if (!sizes) return FALSE;
+        table->sizes = sizes;
+        ULONGLONG *mtimes = (ULONGLONG *)realloc(table->mtimes, newCapacity * sizeof(ULONGLONG));
+        if (!mtimes) return FALSE;
+        table->mtimes = mtimes;
+        BYTE (*hashes)[HASH_SIZE] = realloc(table->hashes, newCapacity * sizeof(*table->hashes));
+        if (!hashes) return FALSE;
+        table->hashes = hashes;
+        BYTE *hashState = (BYTE *)realloc(table->hashState, newCapacity);
+        if (!hashState) return FALSE;
+        table->hashState = hashState;
+        int *devices = (int *)realloc(table->devices, newCapacity * sizeof(int));
+        if (!devices) return FALSE;
+        table->devices = devices;
+        int *dirs = (int *)realloc(table->dirs, newCapacity * sizeof(int));
+        if (!dirs) return FALSE;
+        table->dirs = dirs;
+        ULONGLONG *fileIds = (ULONGLONG *)realloc(table->fileIds, newCapacity * sizeof(ULONGLONG));
+        if (!fileIds) return FALSE;
+        table->fileIds = fileIds;
+        int *links = (int *)realloc(table->links, newCapacity * sizeof(int));
+        if (!links) return FALSE;
+        table->links = links;
+        size_t *offsets = (size_t *)realloc(table->pathOffsets, newCapacity * sizeof(size_t));
+        if (!offsets) return FALSE;
+        table->pathOffsets = offsets;
+        table->capacity = newCapacity;
     }
 
-    CryptDestroyHash(hHash);
-    CryptReleaseContext(hProv, 0);
-    CloseHandle(hFile);
+    size_t offset = AppendPath(table, path);
+    if (offset == (size_t)-1) return FALSE;
+
+    int id = table->count++;
+    table->pathOffsets[id] = offset;
+    table->sizes[id] = size;
+    table->mtimes[id] = mtime;
+    table->hashState[id] = HASH_NONE;
+    table->devices[id] = deviceIndex;
+    table->dirs[id] = dir;
+    table->fileIds[id] = fileId;
+    table->links[id] = -1;
     return TRUE;
 }
 
-void ComputeHashes(FileEntry *group) {
-    FileEntry *current = group;
-    DWORD hashSize;
-    while (current) {
-        if (!ComputeFileHash(current->path, &current->hash, &hashSize)) {
-            _tprintf(_T("Error computing hash for file: %s\n"), current->path);
-        }
-        current = current->next;
+// Appends a directory and returns its index, or -1 when out of memory.
+int AddDirectory(FileTable *table, LPCTSTR path, int parent) {
+    if (table->dirCount == table->dirCapacity) {
+        int newCapacity = table->dirCapacity ? table->dirCapacity * 2 : 256;
+        int *parents = (int *)realloc(table->dirParents, newCapacity * sizeof(int));
+        if (!parents) return -1;
+        table->dirParents = parents;
+        size_t *offsets = (size_t *)realloc(table->dirPathOffsets, newCapacity * sizeof(size_t));
+        if (!offsets) return -1;
+        table->dirPathOffsets = offsets;
+        BYTE *complete = (BYTE *)realloc(table->dirComplete, newCapacity);
+        if (!complete) return -1;
+        table->dirComplete = complete;
+        table->dirCapacity = newCapacity;
     }
-}
 
-FileEntry **SortFilesBySize(FileEntry *list, int *count) {
-    int n = 0;
-    FileEntry *current = list;
-    while (current) { n++; current = current->next; }
+    size_t offset = AppendPath(table, path);
+    if (offset == (size_t)-1) return -1;
 
-    FileEntry **array = (FileEntry **)malloc(n * sizeof(FileEntry *));
-    current = list;
-    for (int i = 0; i < n; i++) {
-        array[i] = current;
-        current = current->next;
-    }
+    int dir = table->dirCount++;
+    table->dirParents[dir] = parent;
+    table->dirPathOffsets[dir] = offset;
+    table->dirComplete[dir] = TRUE;
+    return dir;
+}
 
-    qsort(array, n, sizeof(FileEntry *), CompareFileSizes);
-    *count = n;
-    return array;
+LPCTSTR GetFilePath(const FileTable *table, int id) {
+    return table->pathPool + table->pathOffsets[id];
 }
 
-int CompareFileSizes(const void *a, const void *b) {
-    FileEntry *ea = *(FileEntry **)a;
-    FileEntry *eb = *(FileEntry **)b;
-    return (ea->fileSize.QuadPart > eb->fileSize.QuadPart) ? 1 : 
-          ((ea->fileSize.QuadPart < eb->fileSize.QuadPart) ? -1 : 0);
+LPCTSTR GetDirectoryPath(const FileTable *table, int dir) {
+    return table->pathPool + table->dirPathOffsets[dir];
 }
 
-void GroupBySize(FileEntry **sortedFiles, int count, FileEntry ***groups, int *numGroups) {
-    if (count == 0) return;
+void FreeFileTable(FileTable *table) {
+    free(table->sizes);
+    free(table->mtimes);
+    free(table->hashes);
+    free(table->hashState);
+    free(table->devices);
+    free(table->dirs);
+    free(table->fileIds);
+    free(table->links);
+    free(table->pathOffsets);
+    free(table->pathPool);
+    free(table->deviceList);
+    free(table->dirParents);
+    free(table->dirPathOffsets);
+    free(table->dirComplete);
+    InitFileTable(table);
+}
+
+// Grows `path` to hold at least `needed` characters, doubling so that
+// repeated joins settle into one allocation.
+BOOL ReservePath(PathBuffer *path, size_t needed) {
+    if (needed <= path->capacity) return TRUE;
+    size_t newCapacity = path->capacity ? path->capacity : 512;
+    while (newCapacity < needed) newCapacity *= 2;
+    TCHAR *text = (TCHAR *)realloc(path->text, newCapacity * sizeof(TCHAR));
+    if (!text) return FALSE;
+    path->text = text;
+    path->capacity = newCapacity;
+    return TRUE;
+}
 
-    int groupCount = 1;
-    LONGLONG prevSize = sortedFiles[0]->fileSize.QuadPart;
+// Sets `path` to dir + separator + name. On Windows a result too long for
+// the classic API gets the \\?\ prefix, which lifts the limit for absolute
+// drive and UNC paths.
+BOOL JoinPath(PathBuffer *path, LPCTSTR dir, LPCTSTR name) {
+    size_t dirLen = _tcslen(dir);
+    size_t nameLen = _tcslen(name);
+    if (!ReservePath(path, dirLen + nameLen + 16)) return FALSE;
 
-    for (int i = 1; i < count; i++) {
-        if (sortedFiles[i]->fileSize.QuadPart != prevSize) {
-            groupCount++;
-            prevSize = sortedFiles[i]->fileSize.QuadPart;
+    size_t length = 0;
+#ifdef _WIN32
+    if (dirLen + 1 + nameLen >= MAX_PATH && _tcsncmp(dir, _T("\\\\?\\"), 4) != 0) {
+        if (dir[0] == _T('\\') && dir[1] == _T('\\')) {
+            memcpy(path->text, _T("\\\\?\\UNC"), 7 * sizeof(TCHAR));
+            length = 7;
+            dir++;
+            dirLen--;
+        } else if (dir[0] && dir[1] == _T(':')) {
+            memcpy(path->text, _T("\\\\?\\"), 4 * sizeof(TCHAR));
+            length = 4;
         }
     }
+#endif
+    memcpy(path->text + length, dir, dirLen * sizeof(TCHAR));
+    length += dirLen;
+    if (length > 0 && path->text[length - 1] != PATH_SEP) path->text[length++] = PATH_SEP;
+    memcpy(path->text + length, name, (nameLen + 1) * sizeof(TCHAR));
+    path->length = length + nameLen;
+    return TRUE;
+}
 
-    *groups = (FileEntry **)malloc(groupCount * sizeof(FileEntry *));
-    *numGroups = groupCount;
+static BOOL CopyPath(PathBuffer *path, LPCTSTR text) {
+    size_t len = _tcslen(text) + 1;
+    if (!ReservePath(path, len)) return FALSE;
+    memcpy(path->text, text, len * sizeof(TCHAR));
+    path->length = len - 1;
+    return TRUE;
+}
 
-    int groupIndex = 0;
-    FileEntry *currentGroup = NULL;
-    prevSize = sortedFiles[0]->fileSize.QuadPart;
+#ifndef _WIN32
+// Opens a path of any length. One beyond PATH_MAX is opened a run of
+// components at a time, each relative to the directory before it.
+int OpenPath(const char *path, int flags) {
+    int fd = open(path, flags);
+    if (fd >= 0 || errno != ENAMETOOLONG) return fd;
 
-    for (int i = 0; i < count; i++) {
-        if (sortedFiles[i]->fileSize.QuadPart != prevSize) {
-            (*groups)[groupIndex++] = currentGroup;
-            currentGroup = NULL;
-            prevSize = sortedFiles[i]->fileSize.QuadPart;
+    char piece[PATH_MAX];
+    const char *rest = path;
+    int dirFd = AT_FDCWD;
+    while (strlen(rest) >= PATH_MAX) {
+        const char *cut = rest + PATH_MAX - 1;
+        while (cut > rest && *cut != '/') cut--;
+        if (*cut != '/') {
+            if (dirFd != AT_FDCWD) close(dirFd);
+            errno = ENAMETOOLONG;
+            return -1;
         }
-        sortedFiles[i]->next = currentGroup;
-        currentGroup = sortedFiles[i];
+        size_t len = (size_t)(cut - rest);
+        memcpy(piece, rest, len);
+        piece[len] = '\0';
+        int next = openat(dirFd, len ? piece : "/", O_RDONLY | O_DIRECTORY);
+        int error = errno;
+        if (dirFd != AT_FDCWD) close(dirFd);
+        if (next < 0) {
+            errno = error;
+            return -1;
+        }
+        dirFd = next;
+        rest = cut + 1;
     }
-    (*groups)[groupIndex] = currentGroup;
+    fd = openat(dirFd, rest, flags);
+    int error = errno;
+    if (dirFd != AT_FDCWD) close(dirFd);
+    errno = error;
+    return fd;
 }
+#endif
 
-int CompareHashes(const void *a, const void *b) {
-    FileEntry *ea = *(FileEntry **)a;
-    FileEntry *eb = *(FileEntry **)b;
-    if (ea->hash == NULL && eb->hash == NULL) return 0;
-    if (ea->hash == NULL) return 1;
-    if (eb->hash == NULL) return -1;
-    return memcmp(ea->hash, eb->hash, 32);
+static BOOL AddScanEntry(ScanBatch *batch, LPCTSTR name, const ScanEntry *entry) {
+    if (batch->count == batch->capacity) {
+        int newCapacity = batch->capacity ? batch->capacity * 2 : 256;
+        ScanEntry *entries = (ScanEntry *)realloc(batch->entries, newCapacity * sizeof(ScanEntry));
+        if (!entries) return FALSE;
+        batch->entries = entries;
+        batch->capacity = newCapacity;
+    }
+    size_t len = _tcslen(name) + 1;
+    if (batch->namesUsed + len > batch->namesCapacity) {
+        size_t newCapacity = batch->namesCapacity ? batch->namesCapacity * 2 : 16 * 1024;
+        while (newCapacity < batch->namesUsed + len) newCapacity *= 2;
+        TCHAR *names = (TCHAR *)realloc(batch->names, newCapacity * sizeof(TCHAR));
+        if (!names) return FALSE;
+        batch->names = names;
+        batch->namesCapacity = newCapacity;
+    }
+    batch->entries[batch->count] = *entry;
+    batch->entries[batch->count].nameOffset = batch->namesUsed;
+    batch->count++;
+    memcpy(batch->names + batch->namesUsed, name, len * sizeof(TCHAR));
+    batch->namesUsed += len;
+    return TRUE;
 }
 
-FileEntry **GroupByHash(FileEntry *group, int *numGroups) {
-    int count = 0;
-    FileEntry *current = group;
-    while (current) { count++; current = current->next; }
+// Lists one directory into `batch` without touching the table. Symbolic
+// links are neither followed nor recorded, and anything left out marks the
+// listing incomplete.
+void ListDirectory(LPCTSTR dirPath, BOOL recursive, PathBuffer *scratch, ScanBatch *batch) {
+    batch->count = 0;
+    batch->namesUsed = 0;
+    batch->complete = TRUE;
+    ScanEntry entry;
+    memset(&entry, 0, sizeof(entry));
 
-    FileEntry **array = (FileEntry **)malloc(count * sizeof(FileEntry *));
-    current = group;
-    for (int i = 0; i < count; i++) {
-        array[i] = current;
-        current = current->next;
+#ifdef _WIN32
+    if (!JoinPath(scratch, dirPath, _T("*"))) {
+        batch->complete = FALSE;
+        return;
+    }
+    WIN32_FIND_DATA findFileData;
+    HANDLE hFind = FindFirstFile(scratch->text, &findFileData);
+    if (hFind == INVALID_HANDLE_VALUE) {
+        batch->complete = FALSE;
+        return;
     }
 
-    qsort(array, count, sizeof(FileEntry *), CompareHashes);
+    // Tag files with the volume serial of their directory, which is correct
+    // across mounted folders.
+    ULONGLONG device = 0;
+    HANDLE hDir = CreateFile(dirPath, 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                             NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+    if (hDir != INVALID_HANDLE_VALUE) {
+        BY_HANDLE_FILE_INFORMATION info;
+        if (GetFileInformationByHandle(hDir, &info)) device = info.dwVolumeSerialNumber;
+        CloseHandle(hDir);
+    }
 
-    int groupCount = 1;
-    BYTE *prevHash = array[0]->hash;
-    for (int i = 1; i < count; i++) {
-        if (memcmp(array[i]->hash, prevHash, 32) != 0) {
-            groupCount++;
-            prevHash = array[i]->hash;
+    do {
+        if (_tcscmp(findFileData.cFileName, _T(".")) == 0 ||
+            _tcscmp(findFileData.cFileName, _T("..")) == 0) {
+            continue;
+        }
+
+        if (findFileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+            if (!recursive) {
+                batch->complete = FALSE;
+                continue;
+            }
+            entry.isDir = TRUE;
+        } else {
+            ULARGE_INTEGER size, mtime;
+            size.LowPart = findFileData.nFileSizeLow;
+            size.HighPart = findFileData.nFileSizeHigh;
+            mtime.LowPart = findFileData.ftLastWriteTime.dwLowDateTime;
+            mtime.HighPart = findFileData.ftLastWriteTime.dwHighDateTime;
+            entry.isDir = FALSE;
+            entry.size = size.QuadPart;
+            entry.mtime = mtime.QuadPart;
+            entry.device = device;
+            // FindFirstFile does not give the file index; CollapseHardlinks
+            // reads it for the files that need it.
+            entry.fileId = 0;
         }
+        if (!AddScanEntry(batch, findFileData.cFileName, &entry)) batch->complete = FALSE;
+    } while (FindNextFile(hFind, &findFileData));
+
+    FindClose(hFind);
+#else
+    (void)scratch;
+    int fd = OpenPath(dirPath, O_RDONLY | O_DIRECTORY);
+    DIR *handle = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!handle) {
+        if (fd >= 0) close(fd);
+        batch->complete = FALSE;
+        return;
     }
 
-    FileEntry **groups = (FileEntry **)malloc(groupCount * sizeof(FileEntry *));
-    *numGroups = groupCount;
+    // Stat entries relative to the open directory, so the kernel does not
+    // walk the whole path again for each one.
+    struct dirent *dent;
+    while ((dent = readdir(handle)) != NULL) {
+        if (strcmp(dent->d_name, ".") == 0 || strcmp(dent->d_name, "..") == 0) {
+            continue;
+        }
 
-    int groupIndex = 0;
-    FileEntry *currentGroup = NULL;
-    prevHash = array[0]->hash;
+        struct stat st;
+        if (fstatat(fd, dent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            batch->complete = FALSE;
+            continue;
+        }
 
-    for (int i = 0; i < count; i++) {
-        if (memcmp(array[i]->hash, prevHash, 32) != 0) {
-            groups[groupIndex++] = currentGroup;
-            currentGroup = NULL;
-            prevHash = array[i]->hash;
+        if (S_ISDIR(st.st_mode)) {
+            if (!recursive) {
+                batch->complete = FALSE;
+                continue;
+            }
+            entry.isDir = TRUE;
+        } else if (S_ISREG(st.st_mode)) {
+            entry.isDir = FALSE;
+            entry.size = (ULONGLONG)st.st_size;
+            entry.mtime = (ULONGLONG)st.st_mtim.tv_sec * 1000000000ULL + (ULONGLONG)st.st_mtim.tv_nsec;
+            entry.device = (ULONGLONG)st.st_dev;
+            entry.fileId = st.st_nlink > 1 ? (ULONGLONG)st.st_ino : 0;
+        } else {
+            // Symbolic links and special files are not compared.
+            batch->complete = FALSE;
+            continue;
         }
-        array[i]->next = currentGroup;
-        currentGroup = array[i];
+        if (!AddScanEntry(batch, dent->d_name, &entry)) batch->complete = FALSE;
     }
-    groups[groupIndex] = currentGroup;
-    free(array);
-    return groups;
-}
 
-// New: Extracts file name from full path.
-LPCTSTR GetFileName(LPCTSTR path) {
-    LPCTSTR p = _tcsrchr(path, _T('\\'));
-    return p ? p + 1 : path;
+    closedir(handle);
+#endif
 }
 
-// New: Checks if string contains only digits and selected punctuation.
-BOOL IsOnlyDigitsAndPunctuation(LPCTSTR str) {
-    while (*str) {
-        if (!_istdigit(*str) && !_tcschr(_T("()[]{} "), *str))
-            return FALSE;
-        str++;
+static BOOL PushDirectory(DirectoryScan *scan, int dir) {
+    if (scan->stackCount == scan->stackCapacity) {
+        int newCapacity = scan->stackCapacity ? scan->stackCapacity * 2 : 256;
+        int *stack = (int *)realloc(scan->stack, newCapacity * sizeof(int));
+        if (!stack) return FALSE;
+        scan->stack = stack;
+        scan->stackCapacity = newCapacity;
     }
+    scan->stack[scan->stackCount++] = dir;
     return TRUE;
 }
 
-// New: Compares file names (without path and extension) for similarity.
-BOOL AreFilenamesSimilar(LPCTSTR name1, LPCTSTR name2) {
-    // Extract base names.
-    TCHAR base1[MAX_PATH], base2[MAX_PATH];
-    _tcscpy_s(base1, MAX_PATH, GetFileName(name1));
-    _tcscpy_s(base2, MAX_PATH, GetFileName(name2));
-    // Remove extension.
-    TCHAR *dot = _tcsrchr(base1, _T('.'));
-    if (dot) *dot = _T('\0');
-    dot = _tcsrchr(base2, _T('.'));
-    if (dot) *dot = _T('\0');
-    // If exactly equal (case-insensitive), they are similar.
-    if (_tcsicmp(base1, base2) == 0) return TRUE;
-    // Check if one is a prefix of the other.
-    size_t len1 = _tcslen(base1), len2 = _tcslen(base2);
-    if (len1 == 0 || len2 == 0) return FALSE;
-    if (len1 < len2) {
-        if (_tcsnicmp(base1, base2, len1) == 0)
-            return IsOnlyDigitsAndPunctuation(base2 + len1);
-    } else if (len2 < len1) {
-        if (_tcsnicmp(base2, base1, len2) == 0)
-            return IsOnlyDigitsAndPunctuation(base1 + len2);
-    }
-    return FALSE;
-}
-
-void HandleDuplicateGroup(FileEntry *group) {
-    int count = CountFiles(group);
-    if (count < 2) return;
+// Records a listing of directory `dir` in the table and queues its
+// subdirectories. Caller holds the scan lock.
+void CommitListing(DirectoryScan *scan, int dir, LPCTSTR dirPath, PathBuffer *fullPath, const ScanBatch *batch) {
+    FileTable *table = scan->table;
+    if (!batch->complete) table->dirComplete[dir] = FALSE;
 
-    // Check if file names are similar.
-    FileEntry *iter = group;
-    LPCTSTR refName = GetFileName(iter->path);
-    BOOL namesSimilar = TRUE;
-    while (iter) {
-        if (!AreFilenamesSimilar(refName, GetFileName(iter->path))) {
-            namesSimilar = FALSE;
-            break;
+    int firstChild = scan->stackCount;
+    for (int i = 0; i < batch->count; i++) {
+        const ScanEntry *entry = &batch->entries[i];
+        if (!JoinPath(fullPath, dirPath, batch->names + entry->nameOffset)) {
+            table->dirComplete[dir] = FALSE;
+            continue;
+        }
+        if (entry->isDir) {
+            int child = AddDirectory(table, fullPath->text, dir);
+            if (child < 0 || !PushDirectory(scan, child)) {
+                _tprintf(_T("Out of memory recording directory: %s\n"), fullPath->text);
+                table->dirComplete[dir] = FALSE;
+            }
+        } else if (!AddFile(table, fullPath->text, entry->size, entry->mtime, entry->device, entry->fileId, dir)) {
+            _tprintf(_T("Out of memory recording file: %s\n"), fullPath->text);
+            table->dirComplete[dir] = FALSE;
         }
-        iter = iter->next;
-    }
-    if (!namesSimilar) {
-        _tprintf(_T("Skipping group with dissimilar file names.\n"));
-        return;
     }
 
-    _tprintf(_T("\nFound %d duplicate files:\n"), count);
-    FileEntry *current = group;
-    int index = 1;
-    while (current) {
-        _tprintf(_T("%d) %s\n"), index++, current->path);
-        current = current->next;
+    // The stack pops from the end; reverse this directory's children so
+    // they are visited in listing order.
+    for (int lo = firstChild, hi = scan->stackCount - 1; lo < hi; lo++, hi--) {
+        int tmp = scan->stack[lo];
+        scan->stack[lo] = scan->stack[hi];
+        scan->stack[hi] = tmp;
     }
+}
 
-    TCHAR input[256];
-    _tprintf(_T("Enter files to keep (comma-separated), 's' to skip, 'q' to quit: "));
-    if (!_fgetts(input, 256, stdin)) return;
+THREAD_PROC(ScanWorkerProc) {
+    DirectoryScan *scan = (DirectoryScan *)arg;
+    PathBuffer dirPath = { NULL, 0, 0 };
+    PathBuffer scratch = { NULL, 0, 0 };
+    ScanBatch batch;
+    memset(&batch, 0, sizeof(batch));
+    double listSeconds = 0, recordSeconds = 0;
+    RegisterTraceThread("scan", NULL);
 
-    input[_tcslen(input) - 1] = 0; // Remove newline
+    MutexLock(&scan->lock);
+    for (;;) {
+        if (scan->stackCount == 0) {
+            if (scan->busy == 0) break;
+            CondWait(&scan->ready, &scan->lock);
+            continue;
+        }
+        int dir = scan->stack[--scan->stackCount];
+        // The path pool may move while the lock is released; work on a copy.
+        if (!CopyPath(&dirPath, GetDirectoryPath(scan->table, dir))) {
+            scan->table->dirComplete[dir] = FALSE;
+            continue;
+        }
+        scan->busy++;
+        MutexUnlock(&scan->lock);
 
-    if (_tcscmp(input, _T("s")) == 0) return;
-    if (_tcscmp(input, _T("q")) == 0) exit(0);
+        double started = NowSeconds();
+        SetActivity(ACTIVITY_LIST);
+        ListDirectory(dirPath.text, scan->recursive, &scratch, &batch);
+        double listed = NowSeconds();
+        listSeconds += listed - started;
 
-    int *keep = NULL;
-    int keepCount = 0;
-    TCHAR *token = _tcstok(input, _T(","));
-    while (token) {
-        int num = _ttoi(token);
-        if (num >= 1 && num <= count) {
-            keep = (int *)realloc(keep, (keepCount + 1) * sizeof(int));
-            keep[keepCount++] = num;
-        }
-        token = _tcstok(NULL, _T(","));
+        SetActivity(ACTIVITY_RECORD);
+        MutexLock(&scan->lock);
+        CommitListing(scan, dir, dirPath.text, &scratch, &batch);
+        scan->busy--;
+        CondWakeAll(&scan->ready);
+        recordSeconds += NowSeconds() - listed;
+        SetActivity(ACTIVITY_WAIT);
     }
+    CondWakeAll(&scan->ready);
+    MutexUnlock(&scan->lock);
+    RecordScanTime(listSeconds, recordSeconds);
+    UnregisterTraceThread();
 
-    if (keepCount == 0) {
-        _tprintf(_T("No valid files selected.\n"));
-        free(keep);
-        return;
-    }
+    free(dirPath.text);
+    free(scratch.text);
+    free(batch.entries);
+    free(batch.names);
+    THREAD_EXIT;
+}
 
-    FileEntry *toDelete = NULL;
-    current = group;
-    index = 1;
-    while (current) {
-        BOOL found = FALSE;
-        for (int i = 0; i < keepCount; i++) {
-            if (index == keep[i]) {
-                found = TRUE;
-                break;
-            }
-        }
-        if (!found) {
-            FileEntry *entry = (FileEntry *)malloc(sizeof(FileEntry));
-            entry->path = _tcsdup(current->path);
-            entry->next = toDelete;
-            toDelete = entry;
+// Records every root and, with `recursive`, everything below it. The walk
+// runs on an explicit stack of directories, so depth is unbounded, and
+// paths are built in growing buffers, so length is too. With threads > 1
+// several directories are listed at once, which helps on network shares
+// and SSDs where each listing waits on the device; the table itself is
+// only touched under a lock. Directories are always recorded before their
+// subdirectories.
+void TraverseDirectories(FileTable *table, LPCTSTR *roots, int numRoots, BOOL recursive, int threads) {
+    DirectoryScan scan;
+    memset(&scan, 0, sizeof(scan));
+    scan.table = table;
+    scan.recursive = recursive;
+    MutexInit(&scan.lock);
+    CondInit(&scan.ready);
+
+    for (int i = numRoots - 1; i >= 0; i--) {
+        int dir = AddDirectory(table, roots[i], -1);
+        if (dir < 0 || !PushDirectory(&scan, dir)) {
+            _tprintf(_T("Out of memory recording directory: %s\n"), roots[i]);
         }
-        current = current->next;
-        index++;
     }
-    free(keep);
 
-    _tprintf(_T("The following files will be deleted:\n"));
-    current = toDelete;
-    while (current) {
-        _tprintf(_T("%s\n"), current->path);
-        current = current->next;
+    Thread *workers = threads > 1 ? (Thread *)malloc(threads * sizeof(Thread)) : NULL;
+    int started = 0;
+    for (int t = 0; workers && t < threads; t++) {
+        if (StartThread(&workers[started], ScanWorkerProc, &scan)) started++;
     }
-
-    _tprintf(_T("Confirm deletion (y/n)? "));
-    if (!_fgetts(input, 256, stdin)) {
-        FreeFileList(toDelete);
-        return;
+    if (started == 0) ScanWorkerProc(&scan);
+    for (int t = 0; t < started; t++) {
+        JoinThread(workers[t]);
     }
 
-    if (_totlower(input[0]) != _T('y')) {
-        _tprintf(_T("Deletion cancelled.\n"));
-        FreeFileList(toDelete);
-        return;
-    }
+    free(workers);
+    free(scan.stack);
+    CondDestroy(&scan.ready);
+    MutexDestroy(&scan.lock);
+}
+
+#ifdef _WIN32
+BOOL HashBegin(HashContext *ctx) {
+    ctx->hProv = 0;
+    ctx->hHash = 0;
+    if (!CryptAcquireContext(&ctx->hProv, NULL, NULL, PROV_RSA_AES, CRYPT_VERIFYCONTEXT)) {
+        return FALSE;
+    }
+    if (!CryptCreateHash(ctx->hProv, CALG_SHA_256, 0, 0, &ctx->hHash)) {
+        CryptReleaseContext(ctx->hProv, 0);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+BOOL HashUpdate(HashContext *ctx, const BYTE *data, size_t len) {
+    return CryptHashData(ctx->hHash, data, (DWORD)len, 0);
+}
+
+// Finishes the digest and releases the context, even on failure.
+BOOL HashEnd(HashContext *ctx, BYTE hash[HASH_SIZE]) {
+    DWORD len = HASH_SIZE;
+    BOOL ok = CryptGetHashParam(ctx->hHash, HP_HASHVAL, hash, &len, 0) && len == HASH_SIZE;
+    CryptDestroyHash(ctx->hHash);
+    CryptReleaseContext(ctx->hProv, 0);
+    return ok;
+}
+#else
+static const uint32_t kSha256Rounds[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void Sha256Block(uint32_t state[8], const BYTE block[64]) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[i * 4 + 1] << 16) |
+               ((uint32_t)block[i * 4 + 2] << 8) | (uint32_t)block[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) +
+                      ((e & f) ^ (~e & g)) + kSha256Rounds[i] + w[i];
+        uint32_t t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) +
+                      ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+BOOL HashBegin(HashContext *ctx) {
+    static const uint32_t init[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(ctx->state, init, sizeof(init));
+    ctx->length = 0;
+    ctx->blockUsed = 0;
+    return TRUE;
+}
+
+BOOL HashUpdate(HashContext *ctx, const BYTE *data, size_t len) {
+    ctx->length += len;
+    if (ctx->blockUsed) {
+        size_t take = 64 - ctx->blockUsed;
+        if (take > len) take = len;
+        memcpy(ctx->block + ctx->blockUsed, data, take);
+        ctx->blockUsed += take;
+        data += take;
+        len -= take;
+        if (ctx->blockUsed < 64) return TRUE;
+        Sha256Block(ctx->state, ctx->block);
+        ctx->blockUsed = 0;
+    }
+    for (; len >= 64; data += 64, len -= 64) {
+        Sha256Block(ctx->state, data);
+    }
+    memcpy(ctx->block, data, len);
+    ctx->blockUsed = len;
+    return TRUE;
+}
+
+BOOL HashEnd(HashContext *ctx, BYTE hash[HASH_SIZE]) {
+    ULONGLONG bits = ctx->length * 8;
+    ctx->block[ctx->blockUsed++] = 0x80;
+    if (ctx->blockUsed > 56) {
+        memset(ctx->block + ctx->blockUsed, 0, 64 - ctx->blockUsed);
+        Sha256Block(ctx->state, ctx->block);
+        ctx->blockUsed = 0;
+    }
+    memset(ctx->block + ctx->blockUsed, 0, 56 - ctx->blockUsed);
+    for (int i = 0; i < 8; i++) {
+        ctx->block[56 + i] = (BYTE)(bits >> (56 - 8 * i));
+    }
+    Sha256Block(ctx->state, ctx->block);
+    for (int i = 0; i < 8; i++) {
+        hash[i * 4] = (BYTE)(ctx->state[i] >> 24);
+        hash[i * 4 + 1] = (BYTE)(ctx->state[i] >> 16);
+        hash[i * 4 + 2] = (BYTE)(ctx->state[i] >> 8);
+        hash[i * 4 + 3] = (BYTE)ctx->state[i];
+    }
+    return TRUE;
+}
+#endif
+
+// Hashing buffers are aligned and sized for unbuffered/direct I/O.
+BYTE *AllocIoBuffer(size_t size) {
+#ifdef _WIN32
+    return (BYTE *)VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+    void *buffer = NULL;
+    return posix_memalign(&buffer, IO_ALIGNMENT, size) == 0 ? (BYTE *)buffer : NULL;
+#endif
+}
+
+void FreeIoBuffer(BYTE *buffer) {
+#ifdef _WIN32
+    if (buffer) VirtualFree(buffer, 0, MEM_RELEASE);
+#else
+    free(buffer);
+#endif
+}
+
+double NowSeconds(void) {
+#ifdef _WIN32
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+void SleepSeconds(double seconds) {
+#ifdef _WIN32
+    Sleep((DWORD)(seconds * 1000.0));
+#else
+    struct timespec ts;
+    ts.tv_sec = (time_t)seconds;
+    ts.tv_nsec = (long)((seconds - (double)ts.tv_sec) * 1e9);
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR) {
+    }
+#endif
+}
+
+void InitHashOptions(HashOptions *options) {
+    memset(options, 0, sizeof(*options));
+    MutexInit(&options->limiter.lock);
+    options->hddThreads = 1;
+    options->ssdThreads = 4;
+}
+
+void FreeHashOptions(HashOptions *options) {
+    MutexDestroy(&options->limiter.lock);
+}
+
+// Accounts for `bytes` just read and sleeps until the average rate since the
+// window started is back under the limit. When reads fall more than a second
+// behind the limit (e.g. while waiting at a prompt) the window restarts, so
+// idle time is not banked as a burst.
+void ThrottleIo(RateLimiter *limiter, size_t bytes) {
+    if (limiter->bytesPerSecond <= 0) return;
+
+    MutexLock(&limiter->lock);
+    double now = NowSeconds();
+    if (limiter->windowBytes == 0 ||
+        now - (limiter->windowStart + limiter->windowBytes / limiter->bytesPerSecond) > 1.0) {
+        limiter->windowStart = now;
+        limiter->windowBytes = 0;
+    }
+    limiter->windowBytes += (double)bytes;
+
+    double due = limiter->windowStart + limiter->windowBytes / limiter->bytesPerSecond;
+    MutexUnlock(&limiter->lock);
+    if (due > now) SleepSeconds(due - now);
+}
+
+typedef struct _ReadTiming {
+    ULONGLONG bytes;
+    double cpuSeconds;
+    double throttleSeconds;
+} ReadTiming;
+
+// Passes one block to `consume`, then applies the rate limit, timing both.
+static BOOL ConsumeBlock(HashOptions *options, BlockProc consume, void *context, const BYTE *data, size_t len,
+                         ReadTiming *timing) {
+    double started = NowSeconds();
+    SetActivity(ACTIVITY_PROCESS);
+    BOOL ok = consume(context, data, len);
+    double consumed = NowSeconds();
+    timing->cpuSeconds += consumed - started;
+    timing->bytes += len;
+    if (ok && options->limiter.bytesPerSecond > 0) {
+        SetActivity(ACTIVITY_THROTTLE);
+        ThrottleIo(&options->limiter, len);
+        timing->throttleSeconds += NowSeconds() - consumed;
+    }
+    SetActivity(ACTIVITY_READ);
+    return ok;
+}
+
+static BOOL ReadBlocks(LPCTSTR filePath, HashOptions *options, BYTE *buffer, BlockProc consume, void *context,
+                       ReadTiming *timing) {
+    BOOL ok = TRUE;
+
+#ifdef _WIN32
+    DWORD flags = FILE_ATTRIBUTE_NORMAL;
+    if (options->cachePolite) flags |= FILE_FLAG_SEQUENTIAL_SCAN | FILE_FLAG_NO_BUFFERING;
+    HANDLE hFile = CreateFile(filePath, GENERIC_READ, FILE_SHARE_READ,
+                            NULL, OPEN_EXISTING, flags, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) return FALSE;
+
+    DWORD bytesRead;
+    for (;;) {
+        if (!ReadFile(hFile, buffer, HASH_BUFFER_SIZE, &bytesRead, NULL)) {
+            ok = FALSE;
+            break;
+        }
+        if (bytesRead == 0) break;
+        if (!ConsumeBlock(options, consume, context, buffer, bytesRead, timing)) {
+            ok = FALSE;
+            break;
+        }
+    }
+    CloseHandle(hFile);
+#else
+    int fd = -1;
+    BOOL direct = FALSE;
+#ifdef O_DIRECT
+    if (options->cachePolite) {
+        fd = OpenPath(filePath, O_RDONLY | O_DIRECT);
+        direct = fd >= 0;
+    }
+#endif
+    if (fd < 0) fd = OpenPath(filePath, O_RDONLY);
+    if (fd < 0) return FALSE;
+    if (options->cachePolite && !direct) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    off_t offset = 0;
+    for (;;) {
+        ssize_t n = read(fd, buffer, HASH_BUFFER_SIZE);
+        if (n < 0 && errno == EINTR) continue;
+        BOOL readDirect = direct;
+#ifdef O_DIRECT
+        // A short direct read leaves the offset unaligned, and some
+        // filesystems reject direct reads outright; finish buffered.
+        if (direct && (n < 0 ? errno == EINVAL : n < HASH_BUFFER_SIZE)) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+            posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+            direct = FALSE;
+            if (n < 0) continue;
+        }
+#endif
+        if (n < 0) {
+            ok = FALSE;
+            break;
+        }
+        if (n == 0) break;
+        if (!ConsumeBlock(options, consume, context, buffer, (size_t)n, timing)) {
+            ok = FALSE;
+            break;
+        }
+        if (options->cachePolite && !readDirect) {
+            posix_fadvise(fd, offset, n, POSIX_FADV_DONTNEED);
+        }
+        offset += n;
+    }
+    close(fd);
+#endif
+    return ok;
+}
+
+// Reads a file through `buffer` (HASH_BUFFER_SIZE bytes from AllocIoBuffer),
+// passing each block to `consume` until it returns FALSE or the file ends.
+// In cache-polite mode the file is read sequentially past the page cache:
+// FILE_FLAG_NO_BUFFERING on Windows, O_DIRECT on Linux. Where the filesystem
+// refuses direct I/O the read falls back to buffered with a sequential hint
+// and each consumed range is dropped with POSIX_FADV_DONTNEED. The read is
+// charged to the current pipeline stage; time not spent consuming blocks or
+// throttled counts as I/O.
+BOOL ReadFileBlocks(LPCTSTR filePath, HashOptions *options, BYTE *buffer, BlockProc consume, void *context) {
+    ReadTiming timing;
+    memset(&timing, 0, sizeof(timing));
+    double started = NowSeconds();
+    SetActivity(ACTIVITY_READ);
+    BOOL ok = ReadBlocks(filePath, options, buffer, consume, context, &timing);
+    double elapsed = NowSeconds() - started;
+    RecordFileRead(timing.bytes, ok, elapsed, elapsed - timing.cpuSeconds - timing.throttleSeconds,
+                   timing.cpuSeconds, timing.throttleSeconds);
+    return ok;
+}
+
+static BOOL HashBlock(void *context, const BYTE *data, size_t len) {
+    return HashUpdate((HashContext *)context, data, len);
+}
+
+// Computes a file's SHA-256, reading it as ReadFileBlocks does.
+BOOL ComputeFileHash(LPCTSTR filePath, HashOptions *options, BYTE *buffer, BYTE hash[HASH_SIZE]) {
+    HashContext ctx;
+    if (!HashBegin(&ctx)) return FALSE;
+    BOOL ok = ReadFileBlocks(filePath, options, buffer, HashBlock, &ctx);
+
+    BYTE digest[HASH_SIZE];
+    if (!HashEnd(&ctx, digest) || !ok) return FALSE;
+    memcpy(hash, digest, HASH_SIZE);
+    return TRUE;
+}
+
+// Resolves a device tag to a key naming the physical disk behind it, so that
+// partitions of one disk share a queue, and reports whether it seeks.
+void DescribeDevice(ULONGLONG device, LPCTSTR samplePath, TCHAR key[MAX_PATH], BOOL *rotational) {
+    *rotational = FALSE;
+#ifdef _WIN32
+    _stprintf_s(key, MAX_PATH, _T("volume-%08llx"), device);
+
+    TCHAR volumePath[MAX_PATH];
+    if (!GetVolumePathName(samplePath, volumePath, MAX_PATH)) return;
+    size_t len = _tcslen(volumePath);
+    if (len > 0 && volumePath[len - 1] == _T('\\')) volumePath[len - 1] = 0;
+
+    TCHAR devicePath[MAX_PATH];
+    _stprintf_s(devicePath, MAX_PATH, _T("\\\\.\\%s"), volumePath);
+    HANDLE hVolume = CreateFile(devicePath, 0, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                NULL, OPEN_EXISTING, 0, NULL);
+    if (hVolume == INVALID_HANDLE_VALUE) return;
+
+    DWORD bytes;
+    STORAGE_DEVICE_NUMBER number;
+    if (DeviceIoControl(hVolume, IOCTL_STORAGE_GET_DEVICE_NUMBER, NULL, 0,
+                        &number, sizeof(number), &bytes, NULL)) {
+        _stprintf_s(key, MAX_PATH, _T("disk-%lu"), number.DeviceNumber);
+    }
+
+    STORAGE_PROPERTY_QUERY query;
+    memset(&query, 0, sizeof(query));
+    query.PropertyId = StorageDeviceSeekPenaltyProperty;
+    query.QueryType = PropertyStandardQuery;
+    DEVICE_SEEK_PENALTY_DESCRIPTOR penalty;
+    if (DeviceIoControl(hVolume, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query),
+                        &penalty, sizeof(penalty), &bytes, NULL)) {
+        *rotational = penalty.IncursSeekPenalty;
+    }
+    CloseHandle(hVolume);
+#else
+    (void)samplePath;
+    snprintf(key, MAX_PATH, "dev-%llu", device);
+
+    // /sys/dev/block/MAJ:MIN links to the partition or whole disk; a
+    // partition's parent directory is its disk. Devices without one (tmpfs,
+    // NFS, ...) keep their own queue.
+    char link[64];
+    char sysPath[PATH_MAX];
+    snprintf(link, sizeof(link), "/sys/dev/block/%u:%u", major((dev_t)device), minor((dev_t)device));
+    if (!realpath(link, sysPath)) return;
+
+    char probe[PATH_MAX + 32];
+    snprintf(probe, sizeof(probe), "%s/partition", sysPath);
+    if (access(probe, F_OK) == 0) {
+        char *slash = strrchr(sysPath, '/');
+        if (slash) *slash = 0;
+    }
+    snprintf(key, MAX_PATH, "%s", sysPath);
+
+    snprintf(probe, sizeof(probe), "%s/queue/rotational", sysPath);
+    FILE *f = fopen(probe, "r");
+    if (f) {
+        *rotational = fgetc(f) == '1';
+        fclose(f);
+    }
+#endif
+}
+
+// Physical location of a file's first extent, used to read rotational disks
+// in on-disk order. Returns ~0 when the filesystem cannot say.
+ULONGLONG GetPhysicalOffset(LPCTSTR path) {
+    ULONGLONG offset = ~0ULL;
+#ifdef _WIN32
+    HANDLE hFile = CreateFile(path, FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                              NULL, OPEN_EXISTING, 0, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) return offset;
+
+    STARTING_VCN_INPUT_BUFFER start;
+    start.StartingVcn.QuadPart = 0;
+    RETRIEVAL_POINTERS_BUFFER extents;
+    DWORD bytes;
+    BOOL ok = DeviceIoControl(hFile, FSCTL_GET_RETRIEVAL_POINTERS, &start, sizeof(start),
+                              &extents, sizeof(extents), &bytes, NULL) ||
+              GetLastError() == ERROR_MORE_DATA;
+    if (ok && extents.ExtentCount > 0 && extents.Extents[0].Lcn.QuadPart >= 0) {
+        offset = (ULONGLONG)extents.Extents[0].Lcn.QuadPart;
+    }
+    CloseHandle(hFile);
+#elif defined(FS_IOC_FIEMAP)
+    int fd = OpenPath(path, O_RDONLY);
+    if (fd < 0) return offset;
+
+    struct {
+        struct fiemap map;
+        struct fiemap_extent extent;
+    } request;
+    memset(&request, 0, sizeof(request));
+    request.map.fm_length = FIEMAP_MAX_OFFSET;
+    request.map.fm_extent_count = 1;
+    if (ioctl(fd, FS_IOC_FIEMAP, &request.map) == 0 && request.map.fm_mapped_extents > 0 &&
+        !(request.extent.fe_flags & FIEMAP_EXTENT_UNKNOWN)) {
+        offset = request.extent.fe_physical;
+    }
+    close(fd);
+#else
+    (void)path;
+#endif
+    return offset;
+}
+
+typedef struct _ExtentKey {
+    ULONGLONG offset;
+    int rank;
+    int order;
+    QueueEntry entry;
+} ExtentKey;
+
+int CompareExtents(const void *a, const void *b) {
+    const ExtentKey *ea = (const ExtentKey *)a;
+    const ExtentKey *eb = (const ExtentKey *)b;
+    if (ea->rank != eb->rank) return ea->rank - eb->rank;
+    if (ea->offset != eb->offset) return ea->offset < eb->offset ? -1 : 1;
+    return ea->order - eb->order;
+}
+
+// Reorders a rotational disk's queue by physical position so the head
+// sweeps across the disk instead of seeking back and forth. In largest-first
+// mode the sweep is per group, keeping the group order.
+void SortQueueByExtent(const FileTable *table, DeviceQueue *queue, BOOL keepGroupOrder) {
+    ExtentKey *keys = (ExtentKey *)malloc(queue->count * sizeof(ExtentKey));
+    if (!keys) return;
+    for (int i = 0; i < queue->count; i++) {
+        keys[i].offset = GetPhysicalOffset(GetFilePath(table, queue->entries[i].id));
+        keys[i].rank = keepGroupOrder ? queue->entries[i].group : 0;
+        keys[i].order = i;
+        keys[i].entry = queue->entries[i];
+    }
+    qsort(keys, queue->count, sizeof(ExtentKey), CompareExtents);
+    for (int i = 0; i < queue->count; i++) {
+        queue->entries[i] = keys[i].entry;
+    }
+    free(keys);
+}
+
+// Records that one member of `group` has been hashed; the group is handed
+// to NextHashedGroup once its last member is done. Caller holds the lock.
+void CompleteMember(IoScheduler *scheduler, int group) {
+    if (--scheduler->pending[group] == 0) {
+        scheduler->completed[scheduler->completedTail++] = group;
+        CondWakeAll(&scheduler->groupDone);
+    }
+}
+
+THREAD_PROC(HashWorkerProc) {
+    HashWorker *worker = (HashWorker *)arg;
+    IoScheduler *scheduler = worker->scheduler;
+    DeviceQueue *queue = worker->queue;
+
+    RegisterTraceThread("io", queue->key);
+    BYTE *buffer = AllocIoBuffer(HASH_BUFFER_SIZE);
+    MutexLock(&scheduler->lock);
+    while (queue->next < queue->count) {
+        QueueEntry entry = queue->entries[queue->next++];
+        MutexUnlock(&scheduler->lock);
+
+        scheduler->process(scheduler, entry.id, buffer);
+
+        SetActivity(ACTIVITY_WAIT);
+        MutexLock(&scheduler->lock);
+        CompleteMember(scheduler, entry.group);
+    }
+    scheduler->workersRunning--;
+    CondWakeAll(&scheduler->groupDone);
+    MutexUnlock(&scheduler->lock);
+    FreeIoBuffer(buffer);
+    UnregisterTraceThread();
+    THREAD_EXIT;
+}
+
+void HashTableFile(IoScheduler *scheduler, int id, BYTE *buffer) {
+    FileTable *table = scheduler->table;
+    if (buffer && ComputeFileHash(GetFilePath(table, id), scheduler->options, buffer, table->hashes[id])) {
+        table->hashState[id] = HASH_OK;
+        if (scheduler->context) CheckpointHash((Checkpoint *)scheduler->context, id, table->hashes[id]);
+    } else {
+        table->hashState[id] = HASH_ERROR;
+        _tprintf(_T("Error computing hash for file: %s\n"), GetFilePath(table, id));
+    }
+}
+
+// Starts hashing every member of `groups` (spans of `files`); see StartScan.
+// Hashing through StartScan directly with a Checkpoint as the context also
+// appends each digest to it.
+BOOL StartHashing(IoScheduler *scheduler, FileTable *table, const int *files,
+                  const GroupSpan *groups, int numGroups, HashOptions *options) {
+    return StartScan(scheduler, table, files, groups, numGroups, options, HashTableFile, NULL);
+}
+
+// Starts running `process` on every member of `groups` (spans of `files`)
+// that has not been hashed yet. Candidates are split into one queue per
+// physical disk; each queue gets hddThreads workers if it seeks and
+// ssdThreads otherwise, and all queues drain concurrently. Within a queue,
+// files are read in group order, so put the groups that matter most first.
+// Collect finished groups with NextHashedGroup. Returns FALSE, with nothing
+// started, when out of memory; call FinishHashing either way.
+BOOL StartScan(IoScheduler *scheduler, FileTable *table, const int *files, const GroupSpan *groups,
+               int numGroups, HashOptions *options, FileProc process, void *context) {
+    memset(scheduler, 0, sizeof(*scheduler));
+    scheduler->table = table;
+    scheduler->options = options;
+    scheduler->process = process;
+    scheduler->context = context;
+    scheduler->numGroups = numGroups;
+    MutexInit(&scheduler->lock);
+    CondInit(&scheduler->groupDone);
+
+    int count = 0;
+    for (int g = 0; g < numGroups; g++) count += groups[g].count;
+    int *deviceQueue = (int *)malloc((table->deviceCount ? table->deviceCount : 1) * sizeof(int));
+    scheduler->queues = (DeviceQueue *)calloc(table->deviceCount ? table->deviceCount : 1, sizeof(DeviceQueue));
+    scheduler->pending = (int *)calloc(numGroups ? numGroups : 1, sizeof(int));
+    scheduler->completed = (int *)malloc((numGroups ? numGroups : 1) * sizeof(int));
+    if (!deviceQueue || !scheduler->queues || !scheduler->pending || !scheduler->completed) {
+        free(deviceQueue);
+        return FALSE;
+    }
+    for (int d = 0; d < table->deviceCount; d++) deviceQueue[d] = -1;
+
+    // Map each device tag to a queue, merging devices on the same disk.
+    for (int g = 0; g < numGroups; g++) {
+        for (int i = groups[g].start; i < groups[g].start + groups[g].count; i++) {
+            int id = files[i];
+            if (table->hashState[id] != HASH_NONE) continue;
+            int d = table->devices[id];
+            if (deviceQueue[d] < 0) {
+                TCHAR key[MAX_PATH];
+                BOOL rotational;
+                DescribeDevice(table->deviceList[d], GetFilePath(table, id), key, &rotational);
+                int q;
+                for (q = 0; q < scheduler->numQueues; q++) {
+                    if (_tcscmp(scheduler->queues[q].key, key) == 0) break;
+                }
+                if (q == scheduler->numQueues) {
+                    _tcscpy_s(scheduler->queues[q].key, MAX_PATH, key);
+                    scheduler->queues[q].rotational = rotational;
+                    scheduler->queues[q].entries = (QueueEntry *)malloc(count * sizeof(QueueEntry));
+                    if (!scheduler->queues[q].entries) {
+                        free(deviceQueue);
+                        return FALSE;
+                    }
+                    scheduler->numQueues++;
+                }
+                deviceQueue[d] = q;
+            }
+            DeviceQueue *queue = &scheduler->queues[deviceQueue[d]];
+            queue->entries[queue->count].id = id;
+            queue->entries[queue->count].group = g;
+            queue->count++;
+            scheduler->pending[g]++;
+        }
+    }
+    free(deviceQueue);
+
+    // Groups with nothing left to read are ready straight away.
+    for (int g = 0; g < numGroups; g++) {
+        if (scheduler->pending[g] == 0) scheduler->completed[scheduler->completedTail++] = g;
+    }
+
+    int numWorkers = 0;
+    for (int q = 0; q < scheduler->numQueues; q++) {
+        DeviceQueue *queue = &scheduler->queues[q];
+        if (queue->rotational && queue->count > 1) SortQueueByExtent(table, queue, options->largestFirst);
+        int threads = queue->rotational ? options->hddThreads : options->ssdThreads;
+        numWorkers += queue->count < threads ? queue->count : threads;
+    }
+
+    scheduler->workers = (HashWorker *)calloc(numWorkers ? numWorkers : 1, sizeof(HashWorker));
+    if (!scheduler->workers) return FALSE;
+    MutexLock(&scheduler->lock);
+    for (int q = 0; q < scheduler->numQueues; q++) {
+        DeviceQueue *queue = &scheduler->queues[q];
+        int threads = queue->rotational ? options->hddThreads : options->ssdThreads;
+        if (threads > queue->count) threads = queue->count;
+        for (int t = 0; t < threads; t++) {
+            HashWorker *worker = &scheduler->workers[scheduler->numWorkers];
+            worker->scheduler = scheduler;
+            worker->queue = queue;
+            if (StartThread(&worker->thread, HashWorkerProc, worker)) {
+                scheduler->numWorkers++;
+                scheduler->workersRunning++;
+            }
+        }
+    }
+    MutexUnlock(&scheduler->lock);
+    return TRUE;
+}
+
+// Blocks until another group has all of its members hashed and returns its
+// index, or -1 once every group has been returned.
+int NextHashedGroup(IoScheduler *scheduler) {
+    MutexLock(&scheduler->lock);
+    for (;;) {
+        if (scheduler->completedHead < scheduler->completedTail) {
+            int group = scheduler->completed[scheduler->completedHead++];
+            MutexUnlock(&scheduler->lock);
+            return group;
+        }
+        if (scheduler->completedHead == scheduler->numGroups) break;
+        if (scheduler->workersRunning > 0) {
+            CondWait(&scheduler->groupDone, &scheduler->lock);
+            continue;
+        }
+
+        // No worker left to serve some queue (thread creation failed):
+        // read its next file on this thread.
+        int q;
+        for (q = 0; q < scheduler->numQueues; q++) {
+            if (scheduler->queues[q].next < scheduler->queues[q].count) break;
+        }
+        if (q == scheduler->numQueues) break;
+        scheduler->workersRunning++;
+        MutexUnlock(&scheduler->lock);
+        HashWorker worker;
+        worker.scheduler = scheduler;
+        worker.queue = &scheduler->queues[q];
+        HashWorkerProc(&worker);
+        MutexLock(&scheduler->lock);
+    }
+    MutexUnlock(&scheduler->lock);
+    return -1;
+}
+
+// Drops the files not yet started, so the workers stop once the files in
+// hand are done. Groups left incomplete are never returned.
+void StopHashing(IoScheduler *scheduler) {
+    MutexLock(&scheduler->lock);
+    for (int q = 0; q < scheduler->numQueues; q++) scheduler->queues[q].next = scheduler->queues[q].count;
+    MutexUnlock(&scheduler->lock);
+}
+
+// Waits for the workers and releases the scheduler. Safe to call before
+// every group has been collected.
+void FinishHashing(IoScheduler *scheduler) {
+    for (int w = 0; w < scheduler->numWorkers; w++) {
+        JoinThread(scheduler->workers[w].thread);
+    }
+    CondDestroy(&scheduler->groupDone);
+    MutexDestroy(&scheduler->lock);
+    free(scheduler->workers);
+    for (int q = 0; q < scheduler->numQueues; q++) {
+        free(scheduler->queues[q].entries);
+    }
+    free(scheduler->queues);
+    free(scheduler->pending);
+    free(scheduler->completed);
+    memset(scheduler, 0, sizeof(*scheduler));
+}
+
+// Hashes the given files and waits for all of them; FALSE if hashing
+// could not start.
+BOOL ComputeHashes(FileTable *table, const int *members, int count, HashOptions *options) {
+    GroupSpan all;
+    all.start = 0;
+    all.count = count;
+    IoScheduler scheduler;
+    BOOL started = StartHashing(&scheduler, table, members, &all, count > 0 ? 1 : 0, options);
+    if (started) {
+        while (NextHashedGroup(&scheduler) >= 0) {
+        }
+    }
+    FinishHashing(&scheduler);
+    return started;
+}
+
+typedef struct _SizeKey {
+    ULONGLONG size;
+    int id;
+} SizeKey;
+
+// Returns all file ids ordered by ascending size. LSD radix sort over
+// (size, id) pairs, one pass per significant byte; passes in which every key
+// shares the same digit are skipped.
+int *SortFilesBySize(const FileTable *table, int *count) {
+    int n = table->count;
+    *count = n;
+    int *sorted = (int *)malloc((n ? n : 1) * sizeof(int));
+    SizeKey *keys = (SizeKey *)malloc((n ? n : 1) * sizeof(SizeKey));
+    SizeKey *scratch = (SizeKey *)malloc((n ? n : 1) * sizeof(SizeKey));
+    if (!sorted || !keys || !scratch) {
+        free(sorted);
+        free(keys);
+        free(scratch);
+        *count = 0;
+        return NULL;
+    }
+
+    ULONGLONG allBits = 0;
+    for (int i = 0; i < n; i++) {
+        keys[i].size = table->sizes[i];
+        keys[i].id = i;
+        allBits |= table->sizes[i];
+    }
+
+    for (int shift = 0; shift < 64 && (allBits >> shift) != 0; shift += 8) {
+        int histogram[256] = {0};
+        for (int i = 0; i < n; i++) {
+            histogram[(keys[i].size >> shift) & 0xFF]++;
+        }
+        if (histogram[(keys[0].size >> shift) & 0xFF] == n) continue;
+
+        int offset = 0;
+        for (int b = 0; b < 256; b++) {
+            int c = histogram[b];
+            histogram[b] = offset;
+            offset += c;
+        }
+        for (int i = 0; i < n; i++) {
+            scratch[histogram[(keys[i].size >> shift) & 0xFF]++] = keys[i];
+        }
+        SizeKey *tmp = keys;
+        keys = scratch;
+        scratch = tmp;
+    }
+
+    for (int i = 0; i < n; i++) {
+        sorted[i] = keys[i].id;
+    }
+    free(keys);
+    free(scratch);
+    return sorted;
+}
+
+// Splits size-sorted ids into spans of equal size. Singleton sizes cannot
+// contain duplicates, so only spans with two or more members are returned,
+// compacted to the front of sortedFiles in order.
+void GroupBySize(const FileTable *table, int *sortedFiles, int count, GroupSpan **groups, int *numGroups) {
+    *groups = NULL;
+    *numGroups = 0;
+    if (count == 0) return;
+
+    int groupCount = 0;
+    int start = 0;
+    for (int i = 1; i <= count; i++) {
+        if (i == count || table->sizes[sortedFiles[i]] != table->sizes[sortedFiles[start]]) {
+            if (i - start > 1) groupCount++;
+            start = i;
+        }
+    }
+    if (groupCount == 0) return;
+
+    *groups = (GroupSpan *)malloc(groupCount * sizeof(GroupSpan));
+    if (!*groups) return;
+    *numGroups = groupCount;
+
+    int groupIndex = 0;
+    int out = 0;
+    start = 0;
+    for (int i = 1; i <= count; i++) {
+        if (i == count || table->sizes[sortedFiles[i]] != table->sizes[sortedFiles[start]]) {
+            if (i - start > 1) {
+                memmove(sortedFiles + out, sortedFiles + start, (i - start) * sizeof(int));
+                (*groups)[groupIndex].start = out;
+                (*groups)[groupIndex].count = i - start;
+                groupIndex++;
+                out += i - start;
+            }
+            start = i;
+        }
+    }
+}
+
+// Groups files by content hash; see GroupByDigest.
+GroupSpan *GroupByHash(const FileTable *table, int *members, int count, int *numGroups) {
+    return GroupByDigest(table->hashes, table->hashState, members, count, numGroups);
+}
+
+// Groups members by digest with an open-addressing hash table, then
+// counting-sorts them in place so each digest occupies one contiguous run.
+// Returns the runs with two or more members; members whose state is not
+// HASH_OK are left out of every group.
+GroupSpan *GroupByDigest(BYTE (*hashes)[HASH_SIZE], const BYTE *state, int *members, int count, int *numGroups) {
+    *numGroups = 0;
+    if (count < 2) return NULL;
+
+    int slots = 4;
+    while (slots < count * 2) slots <<= 1;
+
+    int *slotGroup = (int *)malloc(slots * sizeof(int));
+    int *groupFirst = (int *)malloc(count * sizeof(int));
+    int *groupSize = (int *)calloc(count + 1, sizeof(int));
+    int *memberGroup = (int *)malloc(count * sizeof(int));
+    int *scratch = (int *)malloc(count * sizeof(int));
+    GroupSpan *spans = NULL;
+    if (!slotGroup || !groupFirst || !groupSize || !memberGroup || !scratch) goto cleanup;
+
+    for (int s = 0; s < slots; s++) slotGroup[s] = -1;
+
+    // Group id `count` collects unhashed files after every real group.
+    int groupCount = 0;
+    for (int i = 0; i < count; i++) {
+        int id = members[i];
+        if (state[id] != HASH_OK) {
+            memberGroup[i] = count;
+            continue;
+        }
+        // Digests are uniformly distributed, so their leading bytes already
+        // make a good probe key.
+        ULONGLONG key;
+        memcpy(&key, hashes[id], sizeof(key));
+        int s = (int)(key & (ULONGLONG)(slots - 1));
+        for (;;) {
+            int g = slotGroup[s];
+            if (g < 0) {
+                g = groupCount++;
+                slotGroup[s] = g;
+                groupFirst[g] = id;
+            } else if (memcmp(hashes[groupFirst[g]], hashes[id], HASH_SIZE) != 0) {
+                s = (s + 1) & (slots - 1);
+                continue;
+            }
+            memberGroup[i] = g;
+            groupSize[g]++;
+            break;
+        }
+    }
+
+    int duplicateGroups = 0;
+    for (int g = 0; g < groupCount; g++) {
+        if (groupSize[g] > 1) duplicateGroups++;
+    }
+    if (duplicateGroups == 0) goto cleanup;
+
+    spans = (GroupSpan *)malloc(duplicateGroups * sizeof(GroupSpan));
+    if (!spans) goto cleanup;
+
+    // Turn sizes into start offsets, recording the multi-member runs.
+    int offset = 0;
+    int spanIndex = 0;
+    for (int g = 0; g < groupCount; g++) {
+        int size = groupSize[g];
+        if (size > 1) {
+            spans[spanIndex].start = offset;
+            spans[spanIndex].count = size;
+            spanIndex++;
+        }
+        groupSize[g] = offset;
+        offset += size;
+    }
+    groupSize[count] = offset;
+
+    for (int i = 0; i < count; i++) {
+        scratch[groupSize[memberGroup[i]]++] = members[i];
+    }
+    memcpy(members, scratch, count * sizeof(int));
+    *numGroups = duplicateGroups;
+
+cleanup:
+    free(slotGroup);
+    free(groupFirst);
+    free(groupSize);
+    free(memberGroup);
+    free(scratch);
+    return spans;
+}
+
+// Reads the identity of a file that has more than one name: its file index
+// on Windows. Returns 0 for a file with a single link or on error.
+ULONGLONG GetFileIdentity(LPCTSTR path) {
+#ifdef _WIN32
+    HANDLE hFile = CreateFile(path, FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                              NULL, OPEN_EXISTING, 0, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) return 0;
+    BY_HANDLE_FILE_INFORMATION info;
+    ULONGLONG identity = 0;
+    if (GetFileInformationByHandle(hFile, &info) && info.nNumberOfLinks > 1) {
+        identity = ((ULONGLONG)info.nFileIndexHigh << 32) | info.nFileIndexLow;
+    }
+    CloseHandle(hFile);
+    return identity;
+#else
+    struct stat st;
+    return lstat(path, &st) == 0 && st.st_nlink > 1 ? (ULONGLONG)st.st_ino : 0;
+#endif
+}
+
+typedef struct _IdentityKey {
+    int device;
+    ULONGLONG fileId;
+    int position;
+} IdentityKey;
+
+int CompareIdentities(const void *a, const void *b) {
+    const IdentityKey *ka = (const IdentityKey *)a;
+    const IdentityKey *kb = (const IdentityKey *)b;
+    if (ka->device != kb->device) return ka->device - kb->device;
+    if (ka->fileId != kb->fileId) return ka->fileId < kb->fileId ? -1 : 1;
+    return ka->position - kb->position;
+}
+
+// Within each group (span of `files`), folds entries that are hardlinks to
+// one file onto the first of them before anything is read. The others get
+// HASH_LINK, are chained from it through table->links and are removed from
+// the group, which shrinks accordingly; spans are compacted to the front of
+// `files` in order. Identities are read during traversal on POSIX; on
+// Windows they are read here, for the group members only. Returns the
+// number of entries folded.
+int CollapseHardlinks(FileTable *table, int *files, GroupSpan *groups, int numGroups) {
+    int largest = 0;
+    for (int g = 0; g < numGroups; g++) {
+        if (groups[g].count > largest) largest = groups[g].count;
+    }
+    IdentityKey *keys = (IdentityKey *)malloc((largest ? largest : 1) * sizeof(IdentityKey));
+    if (!keys) return 0;
+
+    int folded = 0;
+    int out = 0;
+    for (int g = 0; g < numGroups; g++) {
+        int *members = files + groups[g].start;
+        int count = groups[g].count;
+        int numKeys = 0;
+        for (int i = 0; i < count; i++) {
+            int id = members[i];
+#ifdef _WIN32
+            table->fileIds[id] = GetFileIdentity(GetFilePath(table, id));
+#endif
+            if (table->fileIds[id] == 0) continue;
+            keys[numKeys].device = table->devices[id];
+            keys[numKeys].fileId = table->fileIds[id];
+            keys[numKeys].position = i;
+            numKeys++;
+        }
+
+        if (numKeys > 1) {
+            qsort(keys, numKeys, sizeof(IdentityKey), CompareIdentities);
+            int first = 0;
+            for (int k = 1; k < numKeys; k++) {
+                if (keys[k].device != keys[first].device || keys[k].fileId != keys[first].fileId) {
+                    first = k;
+                    continue;
+                }
+                // Append to the end of the first entry's chain.
+                int alias = members[keys[k].position];
+                int tail = members[keys[first].position];
+                while (table->links[tail] >= 0) tail = table->links[tail];
+                table->links[tail] = alias;
+                table->hashState[alias] = HASH_LINK;
+                folded++;
+            }
+        }
+
+        int start = out;
+        for (int i = 0; i < count; i++) {
+            if (table->hashState[members[i]] != HASH_LINK) files[out++] = members[i];
+        }
+        groups[g].start = start;
+        groups[g].count = out - start;
+    }
+    free(keys);
+    return folded;
+}
+
+// Reports the entries CollapseHardlinks folded: a summary line, and with
+// --ndjson one line per file listing all of its names.
+void ReportHardlinks(const FileTable *table, int folded, FILE *ndjson) {
+    if (folded == 0) return;
+    ULONGLONG bytes = 0;
+    for (int id = 0; id < table->count; id++) {
+        if (table->hashState[id] == HASH_LINK) bytes += table->sizes[id];
+        if (!ndjson || table->links[id] < 0 || table->hashState[id] == HASH_LINK) continue;
+
+        int names = 0;
+        for (int link = id; link >= 0; link = table->links[link]) names++;
+        fprintf(ndjson, "{\"size\":%llu,\"count\":%d,\"reclaimable\":0,\"hardlinked\":true,\"files\":[",
+                table->sizes[id], names);
+        for (int link = id; link >= 0; link = table->links[link]) {
+            if (link != id) fputc(',', ndjson);
+            WriteJsonString(ndjson, GetFilePath(table, link));
+        }
+        fputs("]}\n", ndjson);
+    }
+    if (ndjson) fflush(ndjson);
+    _tprintf(_T("%d entries are hardlinks to files already in the scan (%llu bytes already deduplicated); ")
+             _T("they were not hashed.\n"), folded, bytes);
+}
+
+typedef struct _RankedGroup {
+    ULONGLONG reclaimable;
+    GroupSpan span;
+} RankedGroup;
+
+int CompareReclaimable(const void *a, const void *b) {
+    const RankedGroup *ra = (const RankedGroup *)a;
+    const RankedGroup *rb = (const RankedGroup *)b;
+    if (ra->reclaimable != rb->reclaimable) return ra->reclaimable < rb->reclaimable ? 1 : -1;
+    return ra->span.start - rb->span.start;
+}
+
+// Orders size groups by the bytes deleting all but one member would free,
+// largest first.
+void SortGroupsByReclaimable(const FileTable *table, const int *files, GroupSpan *groups, int numGroups) {
+    RankedGroup *ranked = (RankedGroup *)malloc((numGroups > 0 ? numGroups : 1) * sizeof(RankedGroup));
+    if (!ranked) return;
+    for (int g = 0; g < numGroups; g++) {
+        ranked[g].reclaimable = (ULONGLONG)(groups[g].count - 1) * table->sizes[files[groups[g].start]];
+        ranked[g].span = groups[g];
+    }
+    qsort(ranked, numGroups, sizeof(RankedGroup), CompareReclaimable);
+    for (int g = 0; g < numGroups; g++) {
+        groups[g] = ranked[g].span;
+    }
+    free(ranked);
+}
+
+typedef struct _DirEntryRef {
+    LPCTSTR name;
+    int index;              // file id, or directory index when isDir
+    BOOL isDir;
+} DirEntryRef;
+
+int CompareEntryNames(const void *a, const void *b) {
+    return _tcscmp(((const DirEntryRef *)a)->name, ((const DirEntryRef *)b)->name);
+}
+
+// Computes a Merkle hash for every directory from its entries' names, sizes
+// and content hashes, subdirectories first, reusing the file hashes already
+// computed. A directory's own name is not part of its hash. Directories that
+// cannot equal any other get HASH_ERROR: incomplete ones, and those holding
+// a file that was never hashed, since that file's size is unique in the
+// scan, or a hardlink to a file elsewhere in the scan, which is already
+// deduplicated. Each directory's entries are sorted once, so the work is linear in
+// the number of entries apart from that sort.
+BOOL ComputeDirectoryHashes(const FileTable *table, BYTE (*hashes)[HASH_SIZE], ULONGLONG *sizes, BYTE *state) {
+    int numDirs = table->dirCount;
+    int *first = (int *)calloc(numDirs + 1, sizeof(int));
+    DirEntryRef *entries = (DirEntryRef *)malloc((table->count + numDirs + 1) * sizeof(DirEntryRef));
+    if (!first || !entries) {
+        free(first);
+        free(entries);
+        return FALSE;
+    }
+
+    // Bucket every file and subdirectory under its parent.
+    for (int id = 0; id < table->count; id++) {
+        if (table->dirs[id] >= 0) first[table->dirs[id] + 1]++;
+    }
+    for (int d = 0; d < numDirs; d++) {
+        if (table->dirParents[d] >= 0) first[table->dirParents[d] + 1]++;
+    }
+    for (int d = 0; d < numDirs; d++) {
+        first[d + 1] += first[d];
+    }
+    int *fill = (int *)malloc((numDirs ? numDirs : 1) * sizeof(int));
+    if (!fill) {
+        free(first);
+        free(entries);
+        return FALSE;
+    }
+    memcpy(fill, first, numDirs * sizeof(int));
+    for (int id = 0; id < table->count; id++) {
+        int d = table->dirs[id];
+        if (d < 0) continue;
+        entries[fill[d]].name = GetFileName(GetFilePath(table, id));
+        entries[fill[d]].index = id;
+        entries[fill[d]].isDir = FALSE;
+        fill[d]++;
+    }
+    for (int d = 0; d < numDirs; d++) {
+        int p = table->dirParents[d];
+        if (p < 0) continue;
+        entries[fill[p]].name = GetFileName(GetDirectoryPath(table, d));
+        entries[fill[p]].index = d;
+        entries[fill[p]].isDir = TRUE;
+        fill[p]++;
+    }
+    free(fill);
+
+    // Parents are recorded before their subdirectories, so walking the
+    // directories backwards finishes every child before its parent.
+    for (int d = numDirs - 1; d >= 0; d--) {
+        DirEntryRef *children = entries + first[d];
+        int numChildren = first[d + 1] - first[d];
+        sizes[d] = 0;
+        state[d] = table->dirComplete[d] ? HASH_OK : HASH_ERROR;
+        if (state[d] != HASH_OK) continue;
+
+        qsort(children, numChildren, sizeof(DirEntryRef), CompareEntryNames);
+
+        HashContext ctx;
+        if (!HashBegin(&ctx)) {
+            state[d] = HASH_ERROR;
+            continue;
+        }
+        for (int i = 0; i < numChildren && state[d] == HASH_OK; i++) {
+            int index = children[i].index;
+            const BYTE *digest;
+            ULONGLONG size;
+            if (children[i].isDir) {
+                if (state[index] != HASH_OK) state[d] = HASH_ERROR;
+                digest = hashes[index];
+                size = sizes[index];
+            } else {
+                if (table->hashState[index] != HASH_OK) state[d] = HASH_ERROR;
+                digest = table->hashes[index];
+                size = table->sizes[index];
+            }
+            BYTE kind = children[i].isDir ? 'd' : 'f';
+            HashUpdate(&ctx, &kind, 1);
+            HashUpdate(&ctx, (const BYTE *)children[i].name, (_tcslen(children[i].name) + 1) * sizeof(TCHAR));
+            HashUpdate(&ctx, (const BYTE *)&size, sizeof(size));
+            HashUpdate(&ctx, digest, HASH_SIZE);
+            sizes[d] += size;
+        }
+        if (!HashEnd(&ctx, hashes[d])) state[d] = HASH_ERROR;
+    }
+
+    free(first);
+    free(entries);
+    return TRUE;
+}
+
+// Reports groups of identical, non-empty directories, largest reclaimable
+// first. Only maximal matches are shown: a group is left out when its
+// members are exactly one per member of the group their parents form, as
+// the parents' report already covers it. Returns a flag per directory that
+// is set for every directory inside a reported group, or NULL.
+BYTE *ReportDuplicateDirectories(const FileTable *table, FILE *ndjson) {
+    int numDirs = table->dirCount;
+    BYTE (*hashes)[HASH_SIZE] = malloc((numDirs ? numDirs : 1) * sizeof(*hashes));
+    ULONGLONG *sizes = (ULONGLONG *)malloc((numDirs ? numDirs : 1) * sizeof(ULONGLONG));
+    BYTE *state = (BYTE *)malloc(numDirs ? numDirs : 1);
+    int *members = (int *)malloc((numDirs ? numDirs : 1) * sizeof(int));
+    int *dirGroup = (int *)malloc((numDirs ? numDirs : 1) * sizeof(int));
+    BYTE *covered = (BYTE *)calloc(numDirs ? numDirs : 1, 1);
+    GroupSpan *groups = NULL;
+    RankedGroup *ranked = NULL;
+    int numGroups = 0;
+    if (!hashes || !sizes || !state || !members || !dirGroup || !covered ||
+        !ComputeDirectoryHashes(table, hashes, sizes, state)) {
+        _tprintf(_T("Out of memory comparing directories.\n"));
+        free(covered);
+        covered = NULL;
+        goto cleanup;
+    }
+
+    int count = 0;
+    for (int d = 0; d < numDirs; d++) {
+        if (state[d] == HASH_OK && sizes[d] > 0) members[count++] = d;
+    }
+    groups = GroupByDigest(hashes, state, members, count, &numGroups);
+
+    for (int d = 0; d < numDirs; d++) dirGroup[d] = -1;
+    for (int g = 0; g < numGroups; g++) {
+        for (int i = 0; i < groups[g].count; i++) {
+            dirGroup[members[groups[g].start + i]] = g;
+        }
+    }
+
+    ranked = (RankedGroup *)malloc((numGroups > 0 ? numGroups : 1) * sizeof(RankedGroup));
+    if (!ranked) goto cleanup;
+    int numReported = 0;
+    for (int g = 0; g < numGroups; g++) {
+        const int *group = members + groups[g].start;
+        int parentGroup = table->dirParents[group[0]] >= 0 ? dirGroup[table->dirParents[group[0]]] : -1;
+        BOOL implied = parentGroup >= 0 && groups[parentGroup].count == groups[g].count;
+        for (int i = 1; implied && i < groups[g].count; i++) {
+            int p = table->dirParents[group[i]];
+            implied = p >= 0 && dirGroup[p] == parentGroup;
+        }
+        if (implied) continue;
+
+        ranked[numReported].reclaimable = (ULONGLONG)(groups[g].count - 1) * sizes[group[0]];
+        ranked[numReported].span = groups[g];
+        numReported++;
+    }
+    qsort(ranked, numReported, sizeof(RankedGroup), CompareReclaimable);
+
+    for (int r = 0; r < numReported; r++) {
+        const int *group = members + ranked[r].span.start;
+        int groupCount = ranked[r].span.count;
+        _tprintf(_T("\nFound %d identical directories (%llu bytes each):\n"), groupCount, sizes[group[0]]);
+        for (int i = 0; i < groupCount; i++) {
+            _tprintf(_T("%d) %s\n"), i + 1, GetDirectoryPath(table, group[i]));
+            covered[group[i]] = TRUE;
+        }
+        if (ndjson) WriteDirectoryGroupJson(ndjson, table, sizes[group[0]], hashes[group[0]], group, groupCount);
+    }
+
+    // Everything below a reported directory is covered too.
+    for (int d = 0; d < numDirs; d++) {
+        int p = table->dirParents[d];
+        if (p >= 0 && covered[p]) covered[d] = TRUE;
+    }
+
+cleanup:
+    free(hashes);
+    free(sizes);
+    free(state);
+    free(members);
+    free(dirGroup);
+    free(groups);
+    free(ranked);
+    return covered;
+}
+
+// Writes a quoted, escaped JSON string. Windows paths are converted to
+// UTF-8; POSIX paths are written as the bytes the filesystem returned.
+void WriteJsonString(FILE *out, LPCTSTR str) {
+#ifdef _WIN32
+#ifdef UNICODE
+    const wchar_t *wide = str;
+#else
+    int wideLen = MultiByteToWideChar(CP_ACP, 0, str, -1, NULL, 0);
+    wchar_t *wide = (wchar_t *)malloc((wideLen > 0 ? wideLen : 1) * sizeof(wchar_t));
+    if (!wide) return;
+    if (wideLen <= 0 || !MultiByteToWideChar(CP_ACP, 0, str, -1, wide, wideLen)) wide[0] = 0;
+#endif
+    int utf8Len = WideCharToMultiByte(CP_UTF8, 0, wide, -1, NULL, 0, NULL, NULL);
+    char *utf8 = (char *)malloc(utf8Len > 0 ? utf8Len : 1);
+    if (utf8 && (utf8Len <= 0 || !WideCharToMultiByte(CP_UTF8, 0, wide, -1, utf8, utf8Len, NULL, NULL))) utf8[0] = 0;
+#ifndef UNICODE
+    free(wide);
+#endif
+    if (!utf8) return;
+#else
+    const char *utf8 = str;
+#endif
+
+    fputc('"', out);
+    for (const unsigned char *p = (const unsigned char *)utf8; *p; p++) {
+        switch (*p) {
+        case '"': fputs("\\\"", out); break;
+        case '\\': fputs("\\\\", out); break;
+        case '\n': fputs("\\n", out); break;
+        case '\r': fputs("\\r", out); break;
+        case '\t': fputs("\\t", out); break;
+        default:
+            if (*p < 0x20) fprintf(out, "\\u%04x", *p);
+            else fputc(*p, out);
+        }
+    }
+    fputc('"', out);
+
+#ifdef _WIN32
+    free(utf8);
+#endif
+}
+
+// Appends one confirmed duplicate group as a single NDJSON line and flushes
+// it, so the file is complete up to the last proven group at any moment.
+void WriteGroupJson(FILE *out, const FileTable *table, const int *members, int count) {
+    ULONGLONG size = table->sizes[members[0]];
+    fprintf(out, "{\"size\":%llu,\"count\":%d,\"reclaimable\":%llu,\"sha256\":\"",
+            size, count, (ULONGLONG)(count - 1) * size);
+    for (int i = 0; i < HASH_SIZE; i++) {
+        fprintf(out, "%02x", table->hashes[members[0]][i]);
+    }
+    fputs("\",\"files\":[", out);
+    for (int i = 0; i < count; i++) {
+        if (i > 0) fputc(',', out);
+        WriteJsonString(out, GetFilePath(table, members[i]));
+    }
+    fputs("]}\n", out);
+    fflush(out);
+}
+
+// Appends one group of identical directories as a single NDJSON line.
+void WriteDirectoryGroupJson(FILE *out, const FileTable *table, ULONGLONG size, const BYTE hash[HASH_SIZE],
+                             const int *dirs, int count) {
+    fprintf(out, "{\"size\":%llu,\"count\":%d,\"reclaimable\":%llu,\"sha256\":\"",
+            size, count, (ULONGLONG)(count - 1) * size);
+    for (int i = 0; i < HASH_SIZE; i++) {
+        fprintf(out, "%02x", hash[i]);
+    }
+    fputs("\",\"directories\":[", out);
+    for (int i = 0; i < count; i++) {
+        if (i > 0) fputc(',', out);
+        WriteJsonString(out, GetDirectoryPath(table, dirs[i]));
+    }
+    fputs("]}\n", out);
+    fflush(out);
+}
+
+// New: Extracts file name from full path.
+LPCTSTR GetFileName(LPCTSTR path) {
+    LPCTSTR p = _tcsrchr(path, PATH_SEP);
+    return p ? p + 1 : path;
+}
+
+// New: Checks if string contains only digits and selected punctuation.
+BOOL IsOnlyDigitsAndPunctuation(LPCTSTR str) {
+    while (*str) {
+        if (!_istdigit(*str) && !_tcschr(_T("()[]{} "), *str))
+            return FALSE;
+        str++;
+    }
+    return TRUE;
+}
+
+// New: Compares file names (without path and extension) for similarity.
+BOOL AreFilenamesSimilar(LPCTSTR name1, LPCTSTR name2) {
+    // Extract base names.
+    TCHAR base1[MAX_PATH], base2[MAX_PATH];
+    _tcscpy_s(base1, MAX_PATH, GetFileName(name1));
+    _tcscpy_s(base2, MAX_PATH, GetFileName(name2));
+    // Remove extension.
+    TCHAR *dot = _tcsrchr(base1, _T('.'));
+    if (dot) *dot = _T('\0');
+    dot = _tcsrchr(base2, _T('.'));
+    if (dot) *dot = _T('\0');
+    // If exactly equal (case-insensitive), they are similar.
+    if (_tcsicmp(base1, base2) == 0) return TRUE;
+    // Check if one is a prefix of the other.
+    size_t len1 = _tcslen(base1), len2 = _tcslen(base2);
+    if (len1 == 0 || len2 == 0) return FALSE;
+    if (len1 < len2) {
+        if (_tcsnicmp(base1, base2, len1) == 0)
+            return IsOnlyDigitsAndPunctuation(base2 + len1);
+    } else if (len2 < len1) {
+        if (_tcsnicmp(base2, base1, len2) == 0)
+            return IsOnlyDigitsAndPunctuation(base1 + len2);
+    }
+    return FALSE;
+}
+
+// Asks which members of a group to keep and deletes the others. FALSE if
+// the user chose to quit.
+BOOL HandleDuplicateGroup(const FileTable *table, const int *members, int count) {
+    if (count < 2) return TRUE;
+
+    // Check if file names are similar.
+    LPCTSTR refName = GetFileName(GetFilePath(table, members[0]));
+    BOOL namesSimilar = TRUE;
+    for (int i = 1; i < count; i++) {
+        if (!AreFilenamesSimilar(refName, GetFileName(GetFilePath(table, members[i])))) {
+            namesSimilar = FALSE;
+            break;
+        }
+    }
+    if (!namesSimilar) {
+        _tprintf(_T("Skipping group with dissimilar file names.\n"));
+        return TRUE;
+    }
+
+    _tprintf(_T("\nFound %d duplicate files:\n"), count);
+    for (int i = 0; i < count; i++) {
+        _tprintf(_T("%d) %s\n"), i + 1, GetFilePath(table, members[i]));
+        for (int link = table->links[members[i]]; link >= 0; link = table->links[link]) {
+            _tprintf(_T("   = %s\n"), GetFilePath(table, link));
+        }
+    }
+
+    TCHAR input[256];
+    _tprintf(_T("Enter files to keep (comma-separated), 's' to skip, 'q' to quit: "));
+    if (!_fgetts(input, 256, stdin)) return TRUE;
+
+    input[_tcslen(input) - 1] = 0; // Remove newline
+
+    if (_tcscmp(input, _T("s")) == 0) return TRUE;
+    if (_tcscmp(input, _T("q")) == 0) return FALSE;
+
+    BOOL *keep = (BOOL *)calloc(count, sizeof(BOOL));
+    if (!keep) return TRUE;
+    int keepCount = 0;
+    TCHAR *token = _tcstok(input, _T(","));
+    while (token) {
+        int num = _ttoi(token);
+        if (num >= 1 && num <= count && !keep[num - 1]) {
+            keep[num - 1] = TRUE;
+            keepCount++;
+        }
+        token = _tcstok(NULL, _T(","));
+    }
+
+    if (keepCount == 0) {
+        _tprintf(_T("No valid files selected.\n"));
+        free(keep);
+        return TRUE;
+    }
+
+    // Deleting a file means deleting all of its names.
+    _tprintf(_T("The following files will be deleted:\n"));
+    for (int i = 0; i < count; i++) {
+        if (keep[i]) continue;
+        for (int link = members[i]; link >= 0; link = table->links[link]) {
+            _tprintf(_T("%s\n"), GetFilePath(table, link));
+        }
+    }
+
+    _tprintf(_T("Confirm deletion (y/n)? "));
+    if (!_fgetts(input, 256, stdin)) {
+        free(keep);
+        return TRUE;
+    }
+
+    if (_totlower(input[0]) != _T('y')) {
+        _tprintf(_T("Deletion cancelled.\n"));
+        free(keep);
+        return TRUE;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (keep[i]) continue;
+        for (int link = members[i]; link >= 0; link = table->links[link]) {
+            LPCTSTR path = GetFilePath(table, link);
+            if (!IsSymbolicLink(path)) {
+                if (!DeleteFile(path)) {
+                    _tprintf(_T("Error deleting %s (%lu)\n"),
+                            path, GetLastError());
+                } else {
+                    _tprintf(_T("Deleted: %s\n"), path);
+                }
+            } else {
+                _tprintf(_T("Skipped symbolic link: %s\n"), path);
+            }
+        }
+    }
+    free(keep);
+    return TRUE;
+}
+
+BOOL IsSymbolicLink(LPCTSTR path) {
+#ifndef _WIN32
+    struct stat st;
+    return lstat(path, &st) == 0 && S_ISLNK(st.st_mode);
+#else
+    DWORD attrs = GetFileAttributes(path);
+    if (attrs == INVALID_FILE_ATTRIBUTES) return FALSE;
+
+    if (attrs & FILE_ATTRIBUTE_REPARSE_POINT) {
+        WIN32_FIND_DATA data;
+        HANDLE hFind = FindFirstFile(path, &data);
+        if (hFind != INVALID_HANDLE_VALUE) {
+            FindClose(hFind);
+            return data.dwReserved0 == IO_REPARSE_TAG_SYMLINK;
+        }
+    }
+    return FALSE;
+#endif
+}
+
+// Reads a file's current size and last write time without following
+// symbolic links, in the same units AddFile recorded.
+BOOL GetFileStamp(LPCTSTR path, ULONGLONG *size, ULONGLONG *mtime) {
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!GetFileAttributesEx(path, GetFileExInfoStandard, &data)) return FALSE;
+    *size = ((ULONGLONG)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+    *mtime = ((ULONGLONG)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime;
+#else
+    struct stat st;
+    if (lstat(path, &st) != 0) {
+        if (errno != ENAMETOOLONG) return FALSE;
+        int fd = OpenPath(path, O_RDONLY | O_NOFOLLOW);
+        if (fd < 0) return FALSE;
+        BOOL ok = fstat(fd, &st) == 0;
+        close(fd);
+        if (!ok) return FALSE;
+    }
+    *size = (ULONGLONG)st.st_size;
+    *mtime = (ULONGLONG)st.st_mtim.tv_sec * 1000000000ULL + (ULONGLONG)st.st_mtim.tv_nsec;
+#endif
+    return TRUE;
+}
+
+// TRUE when both paths name the same file, e.g. two existing hardlinks.
+BOOL IsSameFile(LPCTSTR path1, LPCTSTR path2) {
+#ifdef _WIN32
+    BY_HANDLE_FILE_INFORMATION info1, info2;
+    BOOL same = FALSE;
+    HANDLE h1 = CreateFile(path1, 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                           NULL, OPEN_EXISTING, 0, NULL);
+    HANDLE h2 = CreateFile(path2, 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                           NULL, OPEN_EXISTING, 0, NULL);
+    if (h1 != INVALID_HANDLE_VALUE && h2 != INVALID_HANDLE_VALUE &&
+        GetFileInformationByHandle(h1, &info1) && GetFileInformationByHandle(h2, &info2)) {
+        same = info1.dwVolumeSerialNumber == info2.dwVolumeSerialNumber &&
+               info1.nFileIndexHigh == info2.nFileIndexHigh &&
+               info1.nFileIndexLow == info2.nFileIndexLow;
+    }
+    if (h1 != INVALID_HANDLE_VALUE) CloseHandle(h1);
+    if (h2 != INVALID_HANDLE_VALUE) CloseHandle(h2);
+    return same;
+#else
+    struct stat st1, st2;
+    return lstat(path1, &st1) == 0 && lstat(path2, &st2) == 0 &&
+           st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino;
+#endif
+}
+
+BOOL PathHasPrefix(LPCTSTR path, LPCTSTR prefix) {
+#ifdef _WIN32
+    return _tcsnicmp(path, prefix, _tcslen(prefix)) == 0;
+#else
+    return strncmp(path, prefix, strlen(prefix)) == 0;
+#endif
+}
+
+// Picks the member to keep: a path under an earlier --prefer prefix wins,
+// then the keep rule decides, then traversal order.
+int ChooseKeeper(const FileTable *table, const int *members, int count, const DedupPolicy *policy) {
+    int best = 0;
+    int bestRank = 0;
+    for (int i = 0; i < count; i++) {
+        LPCTSTR path = GetFilePath(table, members[i]);
+        int rank = policy->numPrefixes;
+        for (int p = 0; p < policy->numPrefixes; p++) {
+            if (PathHasPrefix(path, policy->preferPrefixes[p])) {
+                rank = p;
+                break;
+            }
+        }
+
+        BOOL better = FALSE;
+        if (i == 0 || rank < bestRank) {
+            better = TRUE;
+        } else if (rank == bestRank) {
+            ULONGLONG mtime = table->mtimes[members[i]];
+            ULONGLONG bestMtime = table->mtimes[members[best]];
+            switch (policy->keep) {
+            case KEEP_OLDEST: better = mtime < bestMtime; break;
+            case KEEP_NEWEST: better = mtime > bestMtime; break;
+            case KEEP_SHORTEST: better = _tcslen(path) < _tcslen(GetFilePath(table, members[best])); break;
+            }
+        }
+        if (better) {
+            best = i;
+            bestRank = rank;
+        }
+    }
+    return best;
+}
+
+static BOOL ReplaceVia(LPCTSTR keep, LPCTSTR target, LPCTSTR temp, int action) {
+#ifdef _WIN32
+    if (action == ACTION_HARDLINK) {
+        if (!CreateHardLink(temp, keep, NULL)) return FALSE;
+    } else {
+        // Block cloning (ReFS, Dev Drive): the clone must already have the
+        // source's length, and ranges are rounded up to whole clusters.
+        TCHAR volume[MAX_PATH];
+        DWORD sectorsPerCluster, bytesPerSector, freeClusters, totalClusters;
+        WIN32_FILE_ATTRIBUTE_DATA targetData;
+        if (!GetVolumePathName(target, volume, MAX_PATH) ||
+            !GetDiskFreeSpace(volume, &sectorsPerCluster, &bytesPerSector, &freeClusters, &totalClusters) ||
+            !GetFileAttributesEx(target, GetFileExInfoStandard, &targetData)) {
+            return FALSE;
+        }
+        ULONGLONG clusterSize = (ULONGLONG)sectorsPerCluster * bytesPerSector;
+
+        HANDLE hSource = CreateFile(keep, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+        if (hSource == INVALID_HANDLE_VALUE) return FALSE;
+        HANDLE hClone = CreateFile(temp, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_NEW, 0, NULL);
+        if (hClone == INVALID_HANDLE_VALUE) {
+            CloseHandle(hSource);
+            return FALSE;
+        }
+
+        DWORD bytes;
+        LARGE_INTEGER size;
+        BOOL ok = GetFileSizeEx(hSource, &size);
+        if (ok && (GetFileAttributes(keep) & FILE_ATTRIBUTE_SPARSE_FILE)) {
+            ok = DeviceIoControl(hClone, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &bytes, NULL);
+        }
+        if (ok) {
+            FILE_END_OF_FILE_INFO eof;
+            eof.EndOfFile = size;
+            ok = SetFileInformationByHandle(hClone, FileEndOfFileInfo, &eof, sizeof(eof));
+        }
+        // One request may not cover 4 GB or more.
+        const ULONGLONG chunk = 1ULL << 30;
+        for (ULONGLONG offset = 0; ok && offset < (ULONGLONG)size.QuadPart; offset += chunk) {
+            ULONGLONG length = (ULONGLONG)size.QuadPart - offset;
+            if (length > chunk) length = chunk;
+            DUPLICATE_EXTENTS_DATA extents;
+            extents.FileHandle = hSource;
+            extents.SourceFileOffset.QuadPart = (LONGLONG)offset;
+            extents.TargetFileOffset.QuadPart = (LONGLONG)offset;
+            extents.ByteCount.QuadPart = (LONGLONG)((length + clusterSize - 1) / clusterSize * clusterSize);
+            ok = DeviceIoControl(hClone, FSCTL_DUPLICATE_EXTENTS_TO_FILE, &extents, sizeof(extents),
+                                 NULL, 0, &bytes, NULL);
+        }
+        if (ok) {
+            SetFileTime(hClone, &targetData.ftCreationTime, &targetData.ftLastAccessTime,
+                        &targetData.ftLastWriteTime);
+        }
+        DWORD error = GetLastError();
+        CloseHandle(hSource);
+        CloseHandle(hClone);
+        if (!ok) {
+            DeleteFile(temp);
+            SetLastError(error);
+            return FALSE;
+        }
+    }
+
+    if (!MoveFileEx(temp, target, MOVEFILE_REPLACE_EXISTING)) {
+        DWORD error = GetLastError();
+        DeleteFile(temp);
+        SetLastError(error);
+        return FALSE;
+    }
+    return TRUE;
+#else
+    if (action == ACTION_HARDLINK) {
+        if (link(keep, temp) != 0) return FALSE;
+    } else {
+#ifdef FICLONE
+        struct stat st;
+        if (lstat(target, &st) != 0) return FALSE;
+        int src = open(keep, O_RDONLY);
+        if (src < 0) return FALSE;
+        int dst = open(temp, O_WRONLY | O_CREAT | O_EXCL, st.st_mode & 07777);
+        if (dst < 0) {
+            int error = errno;
+            close(src);
+            errno = error;
+            return FALSE;
+        }
+        BOOL ok = ioctl(dst, FICLONE, src) == 0;
+        int error = errno;
+        if (ok) {
+            struct timespec times[2] = { st.st_atim, st.st_mtim };
+            // Only root may give a file away; otherwise the clone stays ours.
+            if (fchown(dst, st.st_uid, st.st_gid) == 0) fchmod(dst, st.st_mode & 07777);
+            futimens(dst, times);
+        }
+        close(src);
+        close(dst);
+        if (!ok) {
+            unlink(temp);
+            errno = error;
+            return FALSE;
+        }
+#else
+        errno = EOPNOTSUPP;
+        return FALSE;
+#endif
+    }
+
+    if (rename(temp, target) != 0) {
+        int error = errno;
+        unlink(temp);
+        errno = error;
+        return FALSE;
+    }
+    return TRUE;
+#endif
+}
+
+// Replaces `target` with a hardlink to, or a block clone of, `keep`. The
+// link is made beside the target and renamed over it, so the target path
+// never goes missing. A clone keeps the target's timestamps and, on POSIX,
+// its mode and (when permitted) owner.
+BOOL ReplaceWithLink(LPCTSTR keep, LPCTSTR target, int action) {
+    // Sized from the target, which may be longer than MAX_PATH.
+    static const TCHAR suffix[] = _T(".dupfinder-tmp");
+    size_t len = _tcslen(target);
+    PathBuffer temp = { NULL, 0, 0 };
+    if (!ReservePath(&temp, len + sizeof(suffix) / sizeof(TCHAR))) return FALSE;
+    memcpy(temp.text, target, len * sizeof(TCHAR));
+    memcpy(temp.text + len, suffix, sizeof(suffix));
+    BOOL ok = ReplaceVia(keep, target, temp.text, action);
+    free(temp.text);
+    return ok;
+}
+
+static const char *ActionName(int action) {
+    switch (action) {
+    case ACTION_HARDLINK: return "hardlink";
+    case ACTION_REFLINK: return "reflink";
+    default: return "delete";
+    }
+}
+
+// Re-checks that neither file changed since it was hashed, then carries out
+// the policy's action on the target.
+int ExecuteAction(const FileTable *table, const DedupPolicy *policy, const DedupAction *item, unsigned long *error) {
+    LPCTSTR keep = GetFilePath(table, item->keep);
+    LPCTSTR target = GetFilePath(table, item->target);
+    *error = 0;
+
+    ULONGLONG size, mtime;
+    if (!GetFileStamp(keep, &size, &mtime) || size != table->sizes[item->keep] ||
+        mtime != table->mtimes[item->keep] ||
+        !GetFileStamp(target, &size, &mtime) || size != table->sizes[item->target] ||
+        mtime != table->mtimes[item->target] || IsSymbolicLink(target)) {
+        return RESULT_CHANGED;
+    }
+    if (IsSameFile(keep, target)) return RESULT_LINKED;
+    if (policy->dryRun) return RESULT_PLANNED;
+
+    BOOL ok = policy->action == ACTION_DELETE ? DeleteFile(target)
+                                              : ReplaceWithLink(keep, target, policy->action);
+    if (!ok) {
+        *error = GetLastError();
+        return RESULT_FAILED;
+    }
+    return RESULT_DONE;
+}
+
+// Appends one action to the journal as an NDJSON line. Caller holds the
+// queue lock.
+void WriteJournalEntry(ActionQueue *queue, const DedupAction *item, int result, unsigned long error) {
+    static const char *resultNames[] = { "done", "planned", "linked", "changed", "failed" };
+    FILE *out = queue->policy->journal;
+    if (!out) return;
+    fprintf(out, "{\"action\":\"%s\",\"result\":\"%s\",\"bytes\":%llu,\"keep\":",
+            ActionName(queue->policy->action), resultNames[result], queue->table->sizes[item->target]);
+    WriteJsonString(out, GetFilePath(queue->table, item->keep));
+    fputs(",\"target\":", out);
+    WriteJsonString(out, GetFilePath(queue->table, item->target));
+    if (result == RESULT_FAILED) fprintf(out, ",\"error\":%lu", error);
+    fputs("}\n", out);
+    fflush(out);
+}
+
+THREAD_PROC(ActionWorkerProc) {
+    ActionQueue *queue = (ActionQueue *)arg;
+    RegisterTraceThread("action", NULL);
+    MutexLock(&queue->lock);
+    for (;;) {
+        if (queue->next == queue->count) {
+            if (queue->closed) break;
+            CondWait(&queue->ready, &queue->lock);
+            continue;
+        }
+        DedupAction item = queue->items[queue->next++];
+        queue->busy++;
+        MutexUnlock(&queue->lock);
+
+        unsigned long error;
+        SetActivity(ACTIVITY_ACTION);
+        int result = ExecuteAction(queue->table, queue->policy, &item, &error);
+        SetActivity(ACTIVITY_WAIT);
+
+        MutexLock(&queue->lock);
+        queue->results[result]++;
+        // Extra names of one file free no more space.
+        if ((result == RESULT_DONE || result == RESULT_PLANNED) &&
+            queue->table->hashState[item.target] != HASH_LINK) {
+            queue->reclaimed += queue->table->sizes[item.target];
+        }
+        if (result == RESULT_FAILED) {
+            _tprintf(_T("Error processing %s (%lu)\n"), GetFilePath(queue->table, item.target), error);
+        }
+        WriteJournalEntry(queue, &item, result, error);
+        // RebindActions waits for the queue to drain.
+        if (--queue->busy == 0 && queue->next == queue->count) CondWakeAll(&queue->ready);
+    }
+    MutexUnlock(&queue->lock);
+    UnregisterTraceThread();
+    THREAD_EXIT;
+}
+
+// Starts the workers that carry out batch actions as groups are planned.
+void StartActions(ActionQueue *queue, const FileTable *table, const DedupPolicy *policy) {
+    memset(queue, 0, sizeof(*queue));
+    queue->table = table;
+    queue->policy = policy;
+    MutexInit(&queue->lock);
+    CondInit(&queue->ready);
+    queue->threads = (Thread *)malloc(policy->threads * sizeof(Thread));
+    for (int t = 0; queue->threads && t < policy->threads; t++) {
+        if (StartThread(&queue->threads[queue->numThreads], ActionWorkerProc, queue)) queue->numThreads++;
+    }
+}
+
+// Queues an action on every member of a confirmed group but the one the
+// policy keeps. No questions are asked and file names are not compared.
+void PlanDuplicateGroup(ActionQueue *queue, const FileTable *table, const int *members, int count) {
+    if (count < 2) return;
+    int keep = members[ChooseKeeper(table, members, count, queue->policy)];
+
+    // Every name of a target file must go for its space to be freed.
+    int needed = 0;
+    for (int i = 0; i < count; i++) {
+        for (int link = members[i]; link >= 0; link = table->links[link]) needed++;
+    }
+
+    MutexLock(&queue->lock);
+    if (queue->count + needed > queue->capacity) {
+        int newCapacity = queue->capacity ? queue->capacity * 2 : 1024;
+        while (newCapacity < queue->count + needed) newCapacity *= 2;
+        DedupAction *items = (DedupAction *)realloc(queue->items, newCapacity * sizeof(DedupAction));
+        if (!items) {
+            MutexUnlock(&queue->lock);
+            _tprintf(_T("Out of memory queueing group of %s\n"), GetFilePath(table, keep));
+            return;
+        }
+        queue->items = items;
+        queue->capacity = newCapacity;
+    }
+    for (int i = 0; i < count; i++) {
+        if (members[i] == keep) continue;
+        for (int link = members[i]; link >= 0; link = table->links[link]) {
+            queue->items[queue->count].keep = keep;
+            queue->items[queue->count].target = link;
+            queue->count++;
+        }
+    }
+    CondWakeAll(&queue->ready);
+    MutexUnlock(&queue->lock);
+}
+
+// Waits until every queued action is done, then points the queue at
+// `table` for the actions planned next. Out-of-core mode frees each batch's
+// table once its actions are through.
+void RebindActions(ActionQueue *queue, const FileTable *table) {
+    MutexLock(&queue->lock);
+    if (queue->numThreads == 0) {
+        // No workers: carry out the backlog here.
+        queue->closed = TRUE;
+        MutexUnlock(&queue->lock);
+        ActionWorkerProc(queue);
+        MutexLock(&queue->lock);
+        queue->closed = FALSE;
+    }
+    while (queue->next < queue->count || queue->busy > 0) {
+        CondWait(&queue->ready, &queue->lock);
+    }
+    queue->table = table;
+    queue->count = 0;
+    queue->next = 0;
+    MutexUnlock(&queue->lock);
+}
+
+// Lets the workers drain the queue, waits for them and prints a summary.
+void FinishActions(ActionQueue *queue) {
+    MutexLock(&queue->lock);
+    queue->closed = TRUE;
+    CondWakeAll(&queue->ready);
+    MutexUnlock(&queue->lock);
+    for (int t = 0; t < queue->numThreads; t++) {
+        JoinThread(queue->threads[t]);
+    }
+    // If no worker could be started, do the work on this thread.
+    if (queue->numThreads == 0) ActionWorkerProc(queue);
+
+    _tprintf(_T("\n%s: %d files %s, %llu bytes %s.\n"),
+             queue->policy->dryRun ? _T("Dry run") : _T("Batch"),
+             queue->results[queue->policy->dryRun ? RESULT_PLANNED : RESULT_DONE],
+             queue->policy->dryRun ? _T("planned") : _T("processed"),
+             queue->reclaimed, queue->policy->dryRun ? _T("reclaimable") : _T("reclaimed"));
+    if (queue->results[RESULT_LINKED] || queue->results[RESULT_CHANGED] || queue->results[RESULT_FAILED]) {
+        _tprintf(_T("Skipped %d already linked, %d changed since hashing; %d failed.\n"),
+                 queue->results[RESULT_LINKED], queue->results[RESULT_CHANGED], queue->results[RESULT_FAILED]);
+    }
+
+    CondDestroy(&queue->ready);
+    MutexDestroy(&queue->lock);
+    free(queue->threads);
+    free(queue->items);
+}
+
+// Checkpoint file: a header naming the scan, then tagged records appended
+// as the run goes. A record cut short by a crash ends the file.
+#define CHECKPOINT_MAGIC "DFCKPT1\n"
+#define RECORD_FILE  'F'    // size, mtime, path length, path; numbered in order
+#define RECORD_HASH  'H'    // file number, digest
+#define RECORD_GROUP 'G'    // size, digest of a group the user has answered
+
+static BOOL WriteCheckpointHeader(FILE *out, LPCTSTR *roots, int numRoots, BOOL recursive) {
+    unsigned int header[3] = { (unsigned int)sizeof(TCHAR), (unsigned int)recursive, (unsigned int)numRoots };
+    if (fwrite(CHECKPOINT_MAGIC, 1, 8, out) != 8 || fwrite(header, sizeof(header), 1, out) != 1) return FALSE;
+    for (int r = 0; r < numRoots; r++) {
+        unsigned int len = (unsigned int)_tcslen(roots[r]);
+        if (fwrite(&len, sizeof(len), 1, out) != 1 || fwrite(roots[r], sizeof(TCHAR), len, out) != len) return FALSE;
+    }
+    return TRUE;
+}
+
+// TRUE if `in` starts with the header WriteCheckpointHeader would write.
+static BOOL MatchCheckpointHeader(FILE *in, LPCTSTR *roots, int numRoots, BOOL recursive) {
+    char magic[8];
+    unsigned int header[3];
+    if (fread(magic, 1, 8, in) != 8 || memcmp(magic, CHECKPOINT_MAGIC, 8) != 0) return FALSE;
+    if (fread(header, sizeof(header), 1, in) != 1) return FALSE;
+    if (header[0] != sizeof(TCHAR) || header[1] != (unsigned int)recursive || header[2] != (unsigned int)numRoots) {
+        return FALSE;
+    }
+    PathBuffer root = { NULL, 0, 0 };
+    BOOL match = TRUE;
+    for (int r = 0; match && r < numRoots; r++) {
+        unsigned int len;
+        match = fread(&len, sizeof(len), 1, in) == 1 && len == _tcslen(roots[r]) && ReservePath(&root, len + 1) &&
+                fread(root.text, sizeof(TCHAR), len, in) == len && memcmp(root.text, roots[r], len * sizeof(TCHAR)) == 0;
+    }
+    free(root.text);
+    return match;
+}
+
+// Reads what an earlier run recorded into `old`, a table of its files
+// whose hash states say which digests are known, and its answered groups.
+static void LoadCheckpoint(Checkpoint *checkpoint, FILE *in, FileTable *old) {
+    PathBuffer path = { NULL, 0, 0 };
+    int tag;
+    while ((tag = fgetc(in)) != EOF) {
+        if (tag == RECORD_FILE) {
+            ULONGLONG stamp[2];
+            unsigned int len;
+            if (fread(stamp, sizeof(stamp), 1, in) != 1 || fread(&len, sizeof(len), 1, in) != 1 ||
+                !ReservePath(&path, len + 1) || fread(path.text, sizeof(TCHAR), len, in) != len) {
+                break;
+            }
+            path.text[len] = 0;
+            if (!AddFile(old, path.text, stamp[0], stamp[1], 0, 0, -1)) break;
+        } else if (tag == RECORD_HASH) {
+            unsigned int id;
+            BYTE hash[HASH_SIZE];
+            if (fread(&id, sizeof(id), 1, in) != 1 || fread(hash, 1, HASH_SIZE, in) != HASH_SIZE) break;
+            if (id < (unsigned int)old->count) {
+                memcpy(old->hashes[id], hash, HASH_SIZE);
+                old->hashState[id] = HASH_OK;
+            }
+        } else if (tag == RECORD_GROUP) {
+            HandledGroup group;
+            if (fread(&group.size, sizeof(group.size), 1, in) != 1 ||
+                fread(group.hash, 1, HASH_SIZE, in) != HASH_SIZE) {
+                break;
+            }
+            if (checkpoint->numHandled == checkpoint->handledCapacity) {
+                int newCapacity = checkpoint->handledCapacity ? checkpoint->handledCapacity * 2 : 64;
+                HandledGroup *grown = (HandledGroup *)realloc(checkpoint->handled, newCapacity * sizeof(HandledGroup));
+                if (!grown) break;
+                checkpoint->handled = grown;
+                checkpoint->handledCapacity = newCapacity;
+            }
+            checkpoint->handled[checkpoint->numHandled++] = group;
+        } else {
+            break;
+        }
+    }
+    free(path.text);
+}
+
+static const FileTable *pathOrderTable;
+
+static int ComparePathOrder(const void *a, const void *b) {
+    return _tcscmp(GetFilePath(pathOrderTable, *(const int *)a), GetFilePath(pathOrderTable, *(const int *)b));
+}
+
+// Ids of `table` sorted by path. Not reentrant.
+static int *SortByPath(const FileTable *table) {
+    int *ids = (int *)malloc((table->count ? table->count : 1) * sizeof(int));
+    if (!ids) return NULL;
+    for (int id = 0; id < table->count; id++) ids[id] = id;
+    pathOrderTable = table;
+    qsort(ids, table->count, sizeof(int), ComparePathOrder);
+    return ids;
+}
+
+static int CompareHandledGroups(const void *a, const void *b) {
+    const HandledGroup *ga = (const HandledGroup *)a;
+    const HandledGroup *gb = (const HandledGroup *)b;
+    if (ga->size != gb->size) return ga->size < gb->size ? -1 : 1;
+    return memcmp(ga->hash, gb->hash, HASH_SIZE);
+}
+
+static void FlushCheckpoint(Checkpoint *checkpoint) {
+    fflush(checkpoint->file);
+#ifdef _WIN32
+    _commit(_fileno(checkpoint->file));
+#else
+    fsync(fileno(checkpoint->file));
+#endif
+    checkpoint->lastFlush = NowSeconds();
+}
+
+// Opens the checkpoint at `path` for this run. A checkpoint left by an
+// interrupted run over the same roots lends its digests to every file
+// whose path, size and mtime are unchanged, and its answered groups are
+// not asked about again. The file is then rewritten compactly, listing
+// this run's table, and records are appended from there on. Call after
+// hardlinks are folded; only files still to be hashed take old digests.
+BOOL OpenCheckpoint(Checkpoint *checkpoint, LPCTSTR path, LPCTSTR *roots, int numRoots, BOOL recursive,
+                    FileTable *table, double interval) {
+    memset(checkpoint, 0, sizeof(*checkpoint));
+    checkpoint->path = path;
+    checkpoint->interval = interval;
+    MutexInit(&checkpoint->lock);
+
+    FILE *in = _tfopen(path, _T("rb"));
+    if (in) {
+        FileTable old;
+        InitFileTable(&old);
+        if (MatchCheckpointHeader(in, roots, numRoots, recursive)) {
+            LoadCheckpoint(checkpoint, in, &old);
+        } else {
+            _tprintf(_T("Checkpoint %s is from a different scan; starting over.\n"), path);
+        }
+        fclose(in);
+
+        // Walk both tables in path order.
+        int *oldIds = SortByPath(&old);
+        int *newIds = SortByPath(table);
+        int changed = 0;
+        for (int i = 0, j = 0; oldIds && newIds && i < old.count && j < table->count;) {
+            int o = oldIds[i];
+            int n = newIds[j];
+            int order = _tcscmp(GetFilePath(&old, o), GetFilePath(table, n));
+            if (order < 0) {
+                i++;
+                continue;
+            }
+            if (order > 0) {
+                j++;
+                continue;
+            }
+            if (old.hashState[o] == HASH_OK && table->hashState[n] == HASH_NONE) {
+                if (old.sizes[o] == table->sizes[n] && old.mtimes[o] == table->mtimes[n]) {
+                    memcpy(table->hashes[n], old.hashes[o], HASH_SIZE);
+                    table->hashState[n] = HASH_OK;
+                    checkpoint->resumed++;
+                } else {
+                    changed++;
+                }
+            }
+            i++;
+            j++;
+        }
+        free(oldIds);
+        free(newIds);
+        FreeFileTable(&old);
+        if (checkpoint->numHandled > 1) {
+            qsort(checkpoint->handled, checkpoint->numHandled, sizeof(HandledGroup), CompareHandledGroups);
+        }
+        if (checkpoint->resumed || checkpoint->numHandled) {
+            _tprintf(_T("Resuming from %s: %d digests reused, %d files changed since, %d groups already answered.\n"),
+                     path, checkpoint->resumed, changed, checkpoint->numHandled);
+        }
+    }
+
+    // Write the new checkpoint beside the old one and swap it in whole, so
+    // an interruption here leaves one or the other.
+    PathBuffer temp = { NULL, 0, 0 };
+    size_t len = _tcslen(path);
+    BOOL ok = ReservePath(&temp, len + 5);
+    FILE *out = NULL;
+    if (ok) {
+        memcpy(temp.text, path, len * sizeof(TCHAR));
+        memcpy(temp.text + len, _T(".tmp"), 5 * sizeof(TCHAR));
+        out = _tfopen(temp.text, _T("wb"));
+    }
+    ok = out && WriteCheckpointHeader(out, roots, numRoots, recursive);
+    for (int id = 0; ok && id < table->count; id++) {
+        LPCTSTR name = GetFilePath(table, id);
+        unsigned int nameLen = (unsigned int)_tcslen(name);
+        ULONGLONG stamp[2] = { table->sizes[id], table->mtimes[id] };
+        ok = fputc(RECORD_FILE, out) != EOF && fwrite(stamp, sizeof(stamp), 1, out) == 1 &&
+             fwrite(&nameLen, sizeof(nameLen), 1, out) == 1 && fwrite(name, sizeof(TCHAR), nameLen, out) == nameLen;
+    }
+    for (int id = 0; ok && id < table->count; id++) {
+        if (table->hashState[id] != HASH_OK) continue;
+        unsigned int number = (unsigned int)id;
+        ok = fputc(RECORD_HASH, out) != EOF && fwrite(&number, sizeof(number), 1, out) == 1 &&
+             fwrite(table->hashes[id], 1, HASH_SIZE, out) == HASH_SIZE;
+    }
+    for (int g = 0; ok && g < checkpoint->numHandled; g++) {
+        ok = fputc(RECORD_GROUP, out) != EOF && fwrite(&checkpoint->handled[g].size, sizeof(ULONGLONG), 1, out) == 1 &&
+             fwrite(checkpoint->handled[g].hash, 1, HASH_SIZE, out) == HASH_SIZE;
+    }
+    if (out && fclose(out) != 0) ok = FALSE;
+#ifdef _WIN32
+    ok = ok && MoveFileEx(temp.text, path, MOVEFILE_REPLACE_EXISTING);
+#else
+    ok = ok && rename(temp.text, path) == 0;
+#endif
+    if (ok) checkpoint->file = _tfopen(path, _T("ab"));
+    if (!checkpoint->file) {
+        _tprintf(_T("Cannot write checkpoint %s; continuing without one.\n"), path);
+        if (out) (void)DeleteFile(temp.text);
+        free(temp.text);
+        free(checkpoint->handled);
+        MutexDestroy(&checkpoint->lock);
+        memset(checkpoint, 0, sizeof(*checkpoint));
+        return FALSE;
+    }
+    free(temp.text);
+    checkpoint->lastFlush = NowSeconds();
+    return TRUE;
+}
+
+// Appends a computed digest, flushing it to disk once the interval has
+// passed since the last flush. Called from the hashing workers.
+void CheckpointHash(Checkpoint *checkpoint, int id, const BYTE hash[HASH_SIZE]) {
+    unsigned int number = (unsigned int)id;
+    MutexLock(&checkpoint->lock);
+    fputc(RECORD_HASH, checkpoint->file);
+    fwrite(&number, sizeof(number), 1, checkpoint->file);
+    fwrite(hash, 1, HASH_SIZE, checkpoint->file);
+    if (NowSeconds() - checkpoint->lastFlush >= checkpoint->interval) FlushCheckpoint(checkpoint);
+    MutexUnlock(&checkpoint->lock);
+}
+
+// Records that the user answered a group and flushes at once: the answer
+// may already have deleted files.
+void CheckpointGroup(Checkpoint *checkpoint, ULONGLONG size, const BYTE hash[HASH_SIZE]) {
+    MutexLock(&checkpoint->lock);
+    fputc(RECORD_GROUP, checkpoint->file);
+    fwrite(&size, sizeof(size), 1, checkpoint->file);
+    fwrite(hash, 1, HASH_SIZE, checkpoint->file);
+    FlushCheckpoint(checkpoint);
+    MutexUnlock(&checkpoint->lock);
+}
+
+// TRUE if an earlier run already put this group to the user.
+BOOL IsGroupAnswered(const Checkpoint *checkpoint, ULONGLONG size, const BYTE hash[HASH_SIZE]) {
+    if (checkpoint->numHandled == 0) return FALSE;
+    HandledGroup key;
+    key.size = size;
+    memcpy(key.hash, hash, HASH_SIZE);
+    return bsearch(&key, checkpoint->handled, checkpoint->numHandled, sizeof(HandledGroup),
+                   CompareHandledGroups) != NULL;
+}
+
+// Closes the checkpoint. A run that got to the end has nothing to resume,
+// so its checkpoint is removed.
+void CloseCheckpoint(Checkpoint *checkpoint, BOOL finished) {
+    if (!checkpoint->file) return;
+    fclose(checkpoint->file);
+    if (finished) (void)DeleteFile(checkpoint->path);
+    free(checkpoint->handled);
+    MutexDestroy(&checkpoint->lock);
+    memset(checkpoint, 0, sizeof(*checkpoint));
+}
+
+static ULONGLONG gearTable[256];
+
+// Fills the gear table with fixed pseudo-random values (splitmix64), so
+// cut points are the same from run to run.
+void InitGearTable(void) {
+    ULONGLONG state = 0x6A09E667F3BCC909ULL;
+    for (int i = 0; i < 256; i++) {
+        ULONGLONG z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        gearTable[i] = z ^ (z >> 31);
+    }
+}
+
+#define XXH_PRIME1 11400714785074694791ULL
+#define XXH_PRIME2 14029467366897019727ULL
+#define XXH_PRIME3 1609587929392839161ULL
+#define XXH_PRIME4 9650029242287828579ULL
+#define XXH_PRIME5 2870177450012600261ULL
+#define ROTL64(x, n) (((x) << (n)) | ((x) >> (64 - (n))))
+
+static ULONGLONG XxhRound(ULONGLONG acc, ULONGLONG input) {
+    acc += input * XXH_PRIME2;
+    acc = ROTL64(acc, 31);
+    return acc * XXH_PRIME1;
+}
+
+static ULONGLONG XxhMerge(ULONGLONG acc, ULONGLONG value) {
+    acc ^= XxhRound(0, value);
+    return acc * XXH_PRIME1 + XXH_PRIME4;
+}
+
+// XXH64 with seed 0. Chunk fingerprints only need to be well spread and
+// fast; a collision merely overstates the estimated savings.
+ULONGLONG Xxh64(const BYTE *data, size_t len) {
+    const BYTE *p = data;
+    const BYTE *end = data + len;
+    ULONGLONG h, word;
+    unsigned int half;  // 32 bits on every supported compiler
+
+    if (len >= 32) {
+        ULONGLONG v1 = XXH_PRIME1 + XXH_PRIME2;
+        ULONGLONG v2 = XXH_PRIME2;
+        ULONGLONG v3 = 0;
+        ULONGLONG v4 = 0 - XXH_PRIME1;
+        do {
+            memcpy(&word, p, 8); v1 = XxhRound(v1, word);
+            memcpy(&word, p + 8, 8); v2 = XxhRound(v2, word);
+            memcpy(&word, p + 16, 8); v3 = XxhRound(v3, word);
+            memcpy(&word, p + 24, 8); v4 = XxhRound(v4, word);
+            p += 32;
+        } while (p + 32 <= end);
+        h = ROTL64(v1, 1) + ROTL64(v2, 7) + ROTL64(v3, 12) + ROTL64(v4, 18);
+        h = XxhMerge(h, v1);
+        h = XxhMerge(h, v2);
+        h = XxhMerge(h, v3);
+        h = XxhMerge(h, v4);
+    } else {
+        h = XXH_PRIME5;
+    }
+    h += (ULONGLONG)len;
+
+    for (; p + 8 <= end; p += 8) {
+        memcpy(&word, p, 8);
+        h ^= XxhRound(0, word);
+        h = ROTL64(h, 27) * XXH_PRIME1 + XXH_PRIME4;
+    }
+    if (p + 4 <= end) {
+        memcpy(&half, p, 4);
+        h ^= (ULONGLONG)half * XXH_PRIME1;
+        h = ROTL64(h, 23) * XXH_PRIME2 + XXH_PRIME3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * XXH_PRIME5;
+        h = ROTL64(h, 11) * XXH_PRIME1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME2;
+    h ^= h >> 29;
+    h *= XXH_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+BOOL InitChunker(Chunker *chunker) {
+    memset(chunker, 0, sizeof(*chunker));
+    chunker->chunk = (BYTE *)malloc(CDC_MAX_SIZE);
+    return chunker->chunk != NULL;
+}
+
+static BOOL EmitChunk(Chunker *chunker) {
+    if (chunker->count == chunker->capacity) {
+        int newCapacity = chunker->capacity ? chunker->capacity * 2 : 256;
+        ChunkRef *chunks = (ChunkRef *)realloc(chunker->chunks, newCapacity * sizeof(ChunkRef));
+        if (!chunks) return FALSE;
+        chunker->chunks = chunks;
+        chunker->capacity = newCapacity;
+    }
+    chunker->chunks[chunker->count].fingerprint = Xxh64(chunker->chunk, chunker->length);
+    chunker->chunks[chunker->count].length = (unsigned int)chunker->length;
+    chunker->count++;
+    chunker->length = 0;
+    chunker->gear = 0;
+    return TRUE;
+}
+
+// Feeds the next bytes of the stream. The first CDC_MIN_SIZE bytes of each
+// chunk are never cut, so they are copied without being hashed.
+BOOL ChunkerUpdate(Chunker *chunker, const BYTE *data, size_t len) {
+    while (len > 0) {
+        size_t n;
+        BOOL cut = FALSE;
+        if (chunker->length < CDC_MIN_SIZE) {
+            n = CDC_MIN_SIZE - chunker->length;
+            if (n > len) n = len;
+        } else {
+            size_t limit = CDC_MAX_SIZE - chunker->length;
+            if (limit > len) limit = len;
+            size_t position = chunker->length;
+            ULONGLONG gear = chunker->gear;
+            for (n = 0; n < limit;) {
+                gear = (gear << 1) + gearTable[data[n]];
+                n++;
+                ULONGLONG mask = position + n <= CDC_AVG_SIZE ? CDC_MASK_SMALL : CDC_MASK_LARGE;
+                if ((gear & mask) == 0) {
+                    cut = TRUE;
+                    break;
+                }
+            }
+            chunker->gear = gear;
+            if (position + n == CDC_MAX_SIZE) cut = TRUE;
+        }
+
+        memcpy(chunker->chunk + chunker->length, data, n);
+        chunker->length += n;
+        data += n;
+        len -= n;
+        if (cut && !EmitChunk(chunker)) return FALSE;
+    }
+    return TRUE;
+}
+
+// Ends the stream, emitting the last partial chunk.
+BOOL ChunkerFinish(Chunker *chunker) {
+    return chunker->length == 0 || EmitChunk(chunker);
+}
+
+void FreeChunker(Chunker *chunker) {
+    free(chunker->chunk);
+    free(chunker->chunks);
+}
+
+static BOOL ChunkBlock(void *context, const BYTE *data, size_t len) {
+    return ChunkerUpdate((Chunker *)context, data, len);
+}
+
+BOOL InitChunkIndex(ChunkIndex *index, int numFiles, ULONGLONG minShared) {
+    memset(index, 0, sizeof(*index));
+    index->slots = 1 << 16;
+    index->fingerprints = (ULONGLONG *)calloc(index->slots, sizeof(ULONGLONG));
+    index->owners = (int *)malloc(index->slots * sizeof(int));
+    index->duplicateBytes = (ULONGLONG *)calloc(numFiles ? numFiles : 1, sizeof(ULONGLONG));
+    index->minShared = minShared;
+    MutexInit(&index->lock);
+    return index->fingerprints && index->owners && index->duplicateBytes;
+}
+
+static BOOL GrowChunkIndex(ChunkIndex *index) {
+    size_t slots = index->slots * 2;
+    ULONGLONG *fingerprints = (ULONGLONG *)calloc(slots, sizeof(ULONGLONG));
+    int *owners = (int *)malloc(slots * sizeof(int));
+    if (!fingerprints || !owners) {
+        free(fingerprints);
+        free(owners);
+        return FALSE;
+    }
+    for (size_t i = 0; i < index->slots; i++) {
+        if (!index->fingerprints[i]) continue;
+        size_t s = (size_t)index->fingerprints[i] & (slots - 1);
+        while (fingerprints[s]) s = (s + 1) & (slots - 1);
+        fingerprints[s] = index->fingerprints[i];
+        owners[s] = index->owners[i];
+    }
+    free(index->fingerprints);
+    free(index->owners);
+    index->fingerprints = fingerprints;
+    index->owners = owners;
+    index->slots = slots;
+    return TRUE;
+}
+
+// Adds one file's chunks to the index. A chunk already present counts
+// toward the file's duplicate bytes and toward the pair it forms with the
+// file the chunk was first seen in.
+void MergeChunks(ChunkIndex *index, int id, const ChunkRef *chunks, int count) {
+    // Bytes shared with each earlier file, tallied in a small table.
+    size_t tallySlots = 16;
+    while (tallySlots < (size_t)count * 2) tallySlots <<= 1;
+    int *tallyOwners = (int *)malloc(tallySlots * sizeof(int));
+    ULONGLONG *tallyBytes = (ULONGLONG *)calloc(tallySlots, sizeof(ULONGLONG));
+    if (tallyOwners) {
+        for (size_t t = 0; t < tallySlots; t++) tallyOwners[t] = -1;
+    }
+
+    MutexLock(&index->lock);
+    for (int i = 0; i < count; i++) {
+        index->totalBytes += chunks[i].length;
+        index->totalChunks++;
+        if ((index->used + 1) * 4 > index->slots * 3 && !GrowChunkIndex(index)) continue;
 
-    current = toDelete;
-    while (current) {
-        if (!IsSymbolicLink(current->path)) {
-            if (!DeleteFile(current->path)) {
-                _tprintf(_T("Error deleting %s (%lu)\n"), 
-                        current->path, GetLastError());
-            } else {
-                _tprintf(_T("Deleted: %s\n"), current->path);
+        ULONGLONG fingerprint = chunks[i].fingerprint ? chunks[i].fingerprint : 1;
+        size_t s = (size_t)fingerprint & (index->slots - 1);
+        while (index->fingerprints[s] && index->fingerprints[s] != fingerprint) {
+            s = (s + 1) & (index->slots - 1);
+        }
+        if (!index->fingerprints[s]) {
+            index->fingerprints[s] = fingerprint;
+            index->owners[s] = id;
+            index->used++;
+            continue;
+        }
+
+        index->duplicateBytes[id] += chunks[i].length;
+        int owner = index->owners[s];
+        if (owner == id || !tallyOwners || !tallyBytes) continue;
+        size_t t = ((size_t)owner * 2654435761u) & (tallySlots - 1);
+        while (tallyOwners[t] >= 0 && tallyOwners[t] != owner) t = (t + 1) & (tallySlots - 1);
+        tallyOwners[t] = owner;
+        tallyBytes[t] += chunks[i].length;
+    }
+
+    for (size_t t = 0; tallyOwners && tallyBytes && t < tallySlots; t++) {
+        if (tallyOwners[t] < 0 || tallyBytes[t] < index->minShared || tallyBytes[t] == 0) continue;
+        if (index->numPairs == index->pairCapacity) {
+            int newCapacity = index->pairCapacity ? index->pairCapacity * 2 : 256;
+            SharedPair *pairs = (SharedPair *)realloc(index->pairs, newCapacity * sizeof(SharedPair));
+            if (!pairs) break;
+            index->pairs = pairs;
+            index->pairCapacity = newCapacity;
+        }
+        index->pairs[index->numPairs].file = id;
+        index->pairs[index->numPairs].original = tallyOwners[t];
+        index->pairs[index->numPairs].bytes = tallyBytes[t];
+        index->numPairs++;
+    }
+    MutexUnlock(&index->lock);
+
+    free(tallyOwners);
+    free(tallyBytes);
+}
+
+void FreeChunkIndex(ChunkIndex *index) {
+    MutexDestroy(&index->lock);
+    free(index->fingerprints);
+    free(index->owners);
+    free(index->duplicateBytes);
+    free(index->pairs);
+}
+
+void ChunkTableFile(IoScheduler *scheduler, int id, BYTE *buffer) {
+    LPCTSTR path = GetFilePath(scheduler->table, id);
+    Chunker chunker;
+    if (!buffer || !InitChunker(&chunker)) {
+        _tprintf(_T("Out of memory chunking file: %s\n"), path);
+        return;
+    }
+    if (ReadFileBlocks(path, scheduler->options, buffer, ChunkBlock, &chunker) && ChunkerFinish(&chunker)) {
+        MergeChunks((ChunkIndex *)scheduler->context, id, chunker.chunks, chunker.count);
+    } else {
+        _tprintf(_T("Error chunking file: %s\n"), path);
+    }
+    FreeChunker(&chunker);
+}
+
+int CompareSharedBytes(const void *a, const void *b) {
+    const SharedPair *pa = (const SharedPair *)a;
+    const SharedPair *pb = (const SharedPair *)b;
+    if (pa->bytes != pb->bytes) return pa->bytes < pb->bytes ? 1 : -1;
+    return pa->file - pb->file;
+}
+
+#define MB(bytes) ((double)(bytes) / (1024.0 * 1024.0))
+
+// Chunks every file through the I/O scheduler and reports how much of the
+// data is stored more than once: in total, for each pair of files sharing
+// at least minShared bytes, and for each directory tree holding at least
+// that many repeated bytes. The first file a chunk is seen in counts as its
+// original, so each repeated byte is counted once.
+void AnalyzeChunks(FileTable *table, HashOptions *options, ULONGLONG minShared) {
+    InitGearTable();
+    ChunkIndex index;
+    int *files = (int *)malloc((table->count ? table->count : 1) * sizeof(int));
+    if (!files || !InitChunkIndex(&index, table->count, minShared)) {
+        _tprintf(_T("Out of memory starting chunk analysis.\n"));
+        free(files);
+        return;
+    }
+
+    GroupSpan all;
+    all.start = 0;
+    all.count = 0;
+    for (int id = 0; id < table->count; id++) {
+        if (table->sizes[id] > 0) files[all.count++] = id;
+    }
+    ReportHardlinks(table, CollapseHardlinks(table, files, &all, 1), NULL);
+
+    double started = NowSeconds();
+    pipelineStats.stage = STAGE_CHUNK;
+    IoScheduler scheduler;
+    if (StartScan(&scheduler, table, files, &all, all.count > 0 ? 1 : 0, options, ChunkTableFile, &index)) {
+        while (NextHashedGroup(&scheduler) >= 0) {
+        }
+    }
+    FinishHashing(&scheduler);
+    double elapsed = NowSeconds() - started;
+    pipelineStats.stages[STAGE_CHUNK].seconds = elapsed;
+    free(files);
+
+    ULONGLONG duplicate = 0;
+    for (int id = 0; id < table->count; id++) {
+        duplicate += index.duplicateBytes[id];
+    }
+    _tprintf(_T("Chunked %d files: %.1f MB in %llu chunks, %.1f MB/s.\n"), all.count,
+             MB(index.totalBytes), index.totalChunks, elapsed > 0 ? MB(index.totalBytes) / elapsed : 0.0);
+    _tprintf(_T("Estimated savings: %.1f MB (%.1f%%) in chunks stored more than once.\n"), MB(duplicate),
+             index.totalBytes ? 100.0 * (double)duplicate / (double)index.totalBytes : 0.0);
+
+    if (index.numPairs > 0) {
+        qsort(index.pairs, index.numPairs, sizeof(SharedPair), CompareSharedBytes);
+        _tprintf(_T("\nFiles sharing at least %.1f MB with an earlier file:\n"), MB(minShared));
+        for (int i = 0; i < index.numPairs; i++) {
+            SharedPair *pair = &index.pairs[i];
+            _tprintf(_T("%s\n  shares %.1f MB (%.0f%% of it) with %s\n"), GetFilePath(table, pair->file),
+                     MB(pair->bytes), 100.0 * (double)pair->bytes / (double)table->sizes[pair->file],
+                     GetFilePath(table, pair->original));
+        }
+    }
+
+    // Sum each directory's files, then fold subdirectories into their
+    // parents; subdirectories come after their parents.
+    ULONGLONG *dirDuplicate = (ULONGLONG *)calloc(table->dirCount ? table->dirCount : 1, sizeof(ULONGLONG));
+    ULONGLONG *dirTotal = (ULONGLONG *)calloc(table->dirCount ? table->dirCount : 1, sizeof(ULONGLONG));
+    if (dirDuplicate && dirTotal) {
+        for (int id = 0; id < table->count; id++) {
+            int d = table->dirs[id];
+            if (d < 0) continue;
+            dirDuplicate[d] += index.duplicateBytes[id];
+            dirTotal[d] += table->sizes[id];
+        }
+        for (int d = table->dirCount - 1; d >= 0; d--) {
+            int p = table->dirParents[d];
+            if (p < 0) continue;
+            dirDuplicate[p] += dirDuplicate[d];
+            dirTotal[p] += dirTotal[d];
+        }
+
+        BOOL header = FALSE;
+        for (int d = 0; d < table->dirCount; d++) {
+            if (dirDuplicate[d] == 0 || dirDuplicate[d] < minShared) continue;
+            if (!header) {
+                _tprintf(_T("\nDirectories holding at least %.1f MB of repeated chunks:\n"), MB(minShared));
+                header = TRUE;
             }
+            _tprintf(_T("%10.1f MB (%5.1f%%)  %s\n"), MB(dirDuplicate[d]),
+                     100.0 * (double)dirDuplicate[d] / (double)dirTotal[d], GetDirectoryPath(table, d));
+        }
+    }
+    free(dirDuplicate);
+    free(dirTotal);
+    FreeChunkIndex(&index);
+}
+
+static void FillRandom(BYTE *data, size_t len, ULONGLONG *state) {
+    for (size_t i = 0; i < len; i++) {
+        *state ^= *state << 13;
+        *state ^= *state >> 7;
+        *state ^= *state << 17;
+        data[i] = (BYTE)(*state >> 32);
+    }
+}
+
+// Chunks in-memory data with a known overlap and reports throughput and how
+// much of the overlap was found. The copy has every fourth 1 MB block
+// replaced and a few bytes inserted before every other block, so 75% of it
+// is shared but almost none of it at the original offsets.
+void RunChunkBenchmark(void) {
+    const size_t blockSize = 1024 * 1024;
+    const int numBlocks = 128;
+    const size_t insertSize = 7;
+    BYTE *original = (BYTE *)malloc(numBlocks * blockSize);
+    BYTE *copy = (BYTE *)malloc(numBlocks * (blockSize + insertSize));
+    ChunkIndex index;
+    if (!original || !copy || !InitChunkIndex(&index, 2, 0)) {
+        _tprintf(_T("Out of memory for the benchmark.\n"));
+        free(original);
+        free(copy);
+        return;
+    }
+
+    ULONGLONG state = 0x2545F4914F6CDD1DULL;
+    FillRandom(original, numBlocks * blockSize, &state);
+    size_t copyLen = 0;
+    ULONGLONG known = 0;
+    for (int b = 0; b < numBlocks; b++) {
+        if (b % 4 == 3) {
+            FillRandom(copy + copyLen, blockSize, &state);
         } else {
-            _tprintf(_T("Skipped symbolic link: %s\n"), current->path);
+            FillRandom(copy + copyLen, insertSize, &state);
+            copyLen += insertSize;
+            memcpy(copy + copyLen, original + b * blockSize, blockSize);
+            known += blockSize;
         }
-        FileEntry *next = current->next;
-        free(current->path);
-        free(current);
-        current = next;
+        copyLen += blockSize;
     }
+
+    InitGearTable();
+    const BYTE *inputs[2] = { original, copy };
+    size_t lengths[2] = { numBlocks * blockSize, copyLen };
+    double started = NowSeconds();
+    for (int f = 0; f < 2; f++) {
+        Chunker chunker;
+        if (!InitChunker(&chunker)) break;
+        // Feed it in read-sized blocks, as a file would be.
+        for (size_t offset = 0; offset < lengths[f]; offset += HASH_BUFFER_SIZE) {
+            size_t len = lengths[f] - offset < HASH_BUFFER_SIZE ? lengths[f] - offset : HASH_BUFFER_SIZE;
+            ChunkerUpdate(&chunker, inputs[f] + offset, len);
+        }
+        ChunkerFinish(&chunker);
+        MergeChunks(&index, f, chunker.chunks, chunker.count);
+        FreeChunker(&chunker);
+    }
+    double elapsed = NowSeconds() - started;
+
+    _tprintf(_T("Chunked %.0f MB in %.2f s: %.0f MB/s, average chunk %llu bytes.\n"), MB(index.totalBytes),
+             elapsed, elapsed > 0 ? MB(index.totalBytes) / elapsed : 0.0,
+             index.totalChunks ? index.totalBytes / index.totalChunks : 0);
+    _tprintf(_T("Known overlap %.1f MB, found %.1f MB (%.1f%%).\n"), MB(known), MB(index.duplicateBytes[1]),
+             known ? 100.0 * (double)index.duplicateBytes[1] / (double)known : 0.0);
+
+    FreeChunkIndex(&index);
+    free(original);
+    free(copy);
 }
 
-BOOL IsSymbolicLink(LPCTSTR path) {
-    DWORD attrs = GetFileAttributes(path);
-    if (attrs == INVALID_FILE_ATTRIBUTES) return FALSE;
-    
-    if (attrs & FILE_ATTRIBUTE_REPARSE_POINT) {
-        WIN32_FIND_DATA data;
-        HANDLE hFind = FindFirstFile(path, &data);
-        if (hFind != INVALID_HANDLE_VALUE) {
-            FindClose(hFind);
-            return data.dwReserved0 == IO_REPARSE_TAG_SYMLINK;
+static ULONGLONG NextRandom(ULONGLONG *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static double RandomUnit(ULONGLONG *state) {
+    return (double)(NextRandom(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+#ifndef _WIN32
+// Opens the directory holding `path` for the *at calls and points `name` at
+// the last component, so that paths of any length can be created.
+static int OpenParent(PathBuffer *scratch, const char *path, const char **name) {
+    const char *slash = strrchr(path, '/');
+    if (!slash) {
+        *name = path;
+        return OpenPath(".", O_RDONLY | O_DIRECTORY);
+    }
+    size_t len = slash > path ? (size_t)(slash - path) : 1;
+    if (!ReservePath(scratch, len + 1)) return -1;
+    memcpy(scratch->text, path, len);
+    scratch->text[len] = '\0';
+    *name = slash + 1;
+    return OpenPath(scratch->text, O_RDONLY | O_DIRECTORY);
+}
+#endif
+
+static BOOL CorpusMakeDirectory(PathBuffer *scratch, LPCTSTR path) {
+#ifdef _WIN32
+    (void)scratch;
+    return CreateDirectory(path, NULL);
+#else
+    const char *name;
+    int dirFd = OpenParent(scratch, path, &name);
+    if (dirFd < 0) return FALSE;
+    BOOL ok = mkdirat(dirFd, name, 0755) == 0;
+    close(dirFd);
+    return ok;
+#endif
+}
+
+static BOOL CorpusWriteFile(PathBuffer *scratch, LPCTSTR path, const BYTE *data, size_t len) {
+#ifdef _WIN32
+    (void)scratch;
+    HANDLE hFile = CreateFile(path, GENERIC_WRITE, 0, NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) return FALSE;
+    DWORD written;
+    BOOL ok = len == 0 || (WriteFile(hFile, data, (DWORD)len, &written, NULL) && written == len);
+    CloseHandle(hFile);
+    return ok;
+#else
+    const char *name;
+    int dirFd = OpenParent(scratch, path, &name);
+    if (dirFd < 0) return FALSE;
+    int fd = openat(dirFd, name, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    close(dirFd);
+    if (fd < 0) return FALSE;
+    BOOL ok = TRUE;
+    while (ok && len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR) continue;
+        ok = n > 0;
+        if (ok) {
+            data += n;
+            len -= (size_t)n;
         }
     }
-    return FALSE;
+    close(fd);
+    return ok;
+#endif
+}
+
+static BOOL CorpusLink(PathBuffer *scratch, LPCTSTR existing, LPCTSTR path) {
+#ifdef _WIN32
+    (void)scratch;
+    return CreateHardLink(path, existing, NULL);
+#else
+    PathBuffer other = { NULL, 0, 0 };
+    const char *existingName, *name;
+    int fromFd = OpenParent(&other, existing, &existingName);
+    int toFd = OpenParent(scratch, path, &name);
+    BOOL ok = fromFd >= 0 && toFd >= 0 && linkat(fromFd, existingName, toFd, name, 0) == 0;
+    if (fromFd >= 0) close(fromFd);
+    if (toFd >= 0) close(toFd);
+    free(other.text);
+    return ok;
+#endif
+}
+
+static BOOL CorpusRemove(PathBuffer *scratch, LPCTSTR path, BOOL directory) {
+#ifdef _WIN32
+    (void)scratch;
+    return directory ? RemoveDirectory(path) : DeleteFile(path);
+#else
+    const char *name;
+    int dirFd = OpenParent(scratch, path, &name);
+    if (dirFd < 0) return FALSE;
+    BOOL ok = unlinkat(dirFd, name, directory ? AT_REMOVEDIR : 0) == 0;
+    close(dirFd);
+    return ok;
+#endif
+}
+
+// Peak memory of the process so far: working set on Windows, resident set
+// on Linux.
+ULONGLONG PeakMemoryBytes(void) {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0;
+    return (ULONGLONG)counters.PeakWorkingSetSize;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+    return (ULONGLONG)usage.ru_maxrss * 1024;  // kilobytes on Linux
+#endif
+}
+
+// Content classes: files of one class have identical bytes. A class is
+// random data from its own seed, or a variant of another class's data with
+// the last byte changed, which has the same size and differs only at the
+// very end. Class 0 is the empty file.
+typedef struct _CorpusClass {
+    ULONGLONG size;
+    int source;             // class whose seed generates the data
+    int variant;            // XORed into the last byte, 0 for the original
+    int variants;           // variants made from this class so far
+    int files;              // distinct files (hardlinks excluded)
+} CorpusClass;
+
+#define CORPUS_DIRS 32
+#define CORPUS_DEEP_LEVELS 24
+#define CORPUS_DEEP_NAME 200
+
+static void FillClass(const CorpusSpec *spec, const CorpusClass *classes, int c, BYTE *data) {
+    const CorpusClass *cls = &classes[c];
+    ULONGLONG state = (spec->seed ^ ((ULONGLONG)(cls->source + 1) * 0x9E3779B97F4A7C15ULL)) | 1;
+    FillRandom(data, (size_t)cls->size, &state);
+    if (cls->variant && cls->size > 0) data[cls->size - 1] ^= (BYTE)cls->variant;
+}
+
+// Writes a synthetic corpus under `dir`, runs the grouping pipeline on it
+// without prompting (SortFilesBySize, GroupBySize, CollapseHardlinks,
+// ComputeHashes, GroupByHash) and checks that exactly the generated
+// duplicate sets come out. Reports files per second, bytes hashed and peak
+// memory, then removes the corpus unless spec->keep. Returns 0 when the
+// result is correct.
+int RunCorpusBenchmark(LPCTSTR dir, const CorpusSpec *spec, HashOptions *options, int scanThreads) {
+    PathBuffer root = { NULL, 0, 0 };
+    PathBuffer path = { NULL, 0, 0 };
+    PathBuffer scratch = { NULL, 0, 0 };
+    TCHAR name[64];
+#ifdef _WIN32
+    // Long paths need an absolute root for the \\?\ prefix.
+    TCHAR absolute[MAX_PATH];
+    if (GetFullPathName(dir, MAX_PATH, absolute, NULL)) dir = absolute;
+#endif
+    _stprintf_s(name, 64, _T("dupfinder-corpus-%llu"), spec->seed);
+    if (!JoinPath(&root, dir, name) || !CorpusMakeDirectory(&scratch, root.text)) {
+        _tprintf(_T("Cannot create %s (it must not exist yet).\n"), root.text ? root.text : dir);
+        free(root.text);
+        free(scratch.text);
+        return 1;
+    }
+
+    // Directories: CORPUS_DIRS flat ones and one deep chain whose paths
+    // exceed PATH_MAX on Linux and MAX_PATH on Windows.
+    PathBuffer *dirs = (PathBuffer *)calloc(CORPUS_DIRS + 1, sizeof(PathBuffer));
+    int *fileClass = (int *)malloc((spec->files ? spec->files : 1) * sizeof(int));
+    CorpusClass *classes = (CorpusClass *)calloc(spec->files + 1, sizeof(CorpusClass));
+    BYTE *data = (BYTE *)malloc((size_t)spec->maxSize);
+    if (!dirs || !fileClass || !classes || !data) {
+        _tprintf(_T("Out of memory generating the corpus.\n"));
+        free(dirs);
+        free(fileClass);
+        free(classes);
+        free(data);
+        free(root.text);
+        free(scratch.text);
+        return 1;
+    }
+    BOOL ready = TRUE;
+    for (int d = 0; ready && d < CORPUS_DIRS; d++) {
+        _stprintf_s(name, 64, _T("d%02d"), d);
+        ready = JoinPath(&dirs[d], root.text, name) && CorpusMakeDirectory(&scratch, dirs[d].text);
+    }
+    if (!ready) _tprintf(_T("Cannot create the corpus directories.\n"));
+    int numFiles = ready ? spec->files : 0;
+    TCHAR deepName[CORPUS_DEEP_NAME + 1];
+    for (int i = 0; i < CORPUS_DEEP_NAME; i++) deepName[i] = _T('x');
+    deepName[CORPUS_DEEP_NAME] = 0;
+    BOOL deepOk = ready && JoinPath(&dirs[CORPUS_DIRS], root.text, _T("deep")) &&
+                  CorpusMakeDirectory(&scratch, dirs[CORPUS_DIRS].text);
+    for (int level = 0; deepOk && level < CORPUS_DEEP_LEVELS; level++) {
+        deepOk = JoinPath(&path, dirs[CORPUS_DIRS].text, deepName) && CorpusMakeDirectory(&scratch, path.text) &&
+                 CopyPath(&dirs[CORPUS_DIRS], path.text);
+    }
+    if (!deepOk) _tprintf(_T("Could not create the long-path directories; no files will have long paths.\n"));
+
+    int sizeBits = 0;
+    while ((8ULL << (sizeBits + 1)) <= spec->maxSize) sizeBits++;
+    double started = NowSeconds();
+    ULONGLONG state = spec->seed | 1;
+    int numClasses = 1;         // class 0: empty
+    int hardlinks = 0;
+    int impostors = 0;
+    int deepFiles = 0;
+    int failed = 0;
+    size_t longestPath = 0;
+    ULONGLONG totalBytes = 0;
+    for (int i = 0; i < numFiles; i++) {
+        double u = RandomUnit(&state);
+        int c;
+        int earlier = i > 0 ? fileClass[NextRandom(&state) % (ULONGLONG)i] : -1;
+        if (u < spec->emptyRatio) {
+            c = 0;
+        } else if (earlier >= 0 && u < spec->emptyRatio + spec->duplicateRatio) {
+            c = earlier;
+        } else if (earlier > 0 && u < spec->emptyRatio + spec->duplicateRatio + spec->sameSizeRatio &&
+                   classes[classes[earlier].source].variants < 255) {
+            // Same size as an earlier file, different only in the last byte.
+            c = numClasses++;
+            classes[c].size = classes[earlier].size;
+            classes[c].source = classes[earlier].source;
+            classes[c].variant = ++classes[classes[earlier].source].variants;
+            impostors++;
+        } else {
+            // Roughly log-uniform sizes from 8 bytes: many small files, a
+            // few large ones.
+            c = numClasses++;
+            double x = RandomUnit(&state) * (sizeBits + 1);
+            int whole = (int)x;
+            classes[c].size = (ULONGLONG)((double)(8ULL << whole) * (1.0 + (x - whole)));
+            if (classes[c].size > spec->maxSize) classes[c].size = spec->maxSize;
+            classes[c].source = c;
+        }
+        fileClass[i] = c;
+
+        BOOL deep = deepOk && RandomUnit(&state) < spec->longPathRatio;
+        int d = deep ? CORPUS_DIRS : (int)(NextRandom(&state) % CORPUS_DIRS);
+        _stprintf_s(name, 64, _T("f%d"), i);
+        FillClass(spec, classes, c, data);
+        if (!JoinPath(&path, dirs[d].text, name) ||
+            !CorpusWriteFile(&scratch, path.text, data, (size_t)classes[c].size)) {
+            failed++;
+            continue;
+        }
+        classes[c].files++;
+        totalBytes += classes[c].size;
+        if (deep) deepFiles++;
+        if (path.length > longestPath) longestPath = path.length;
+
+        if (RandomUnit(&state) < spec->hardlinkRatio) {
+            PathBuffer alias = { NULL, 0, 0 };
+            _stprintf_s(name, 64, _T("f%d.link"), i);
+            if (JoinPath(&alias, dirs[NextRandom(&state) % CORPUS_DIRS].text, name) &&
+                CorpusLink(&scratch, path.text, alias.text)) {
+                hardlinks++;
+            }
+            free(alias.text);
+        }
+    }
+    double generated = NowSeconds() - started;
+
+    int expectedSets = 0;
+    int expectedFiles = 0;
+    for (int c = 0; c < numClasses; c++) {
+        if (classes[c].files < 2) continue;
+        expectedSets++;
+        expectedFiles += classes[c].files;
+    }
+    _tprintf(_T("Corpus %s: %d files (%.1f MB) and %d hardlinks in %.2f s.\n"), root.text, numFiles - failed,
+             MB(totalBytes), hardlinks, generated);
+    _tprintf(_T("  %d duplicate sets holding %d files, %d same-size impostors, %d files on long paths ")
+             _T("(longest %llu characters).\n"), expectedSets, expectedFiles, impostors, deepFiles,
+             (ULONGLONG)longestPath);
+    if (failed > 0) _tprintf(_T("  %d files could not be written and are left out.\n"), failed);
+
+    // The pipeline, as main runs it, minus the prompts.
+    FileTable table;
+    InitFileTable(&table);
+    LPCTSTR roots[1] = { root.text };
+    double t0 = NowSeconds();
+    TraverseDirectories(&table, roots, 1, TRUE, scanThreads);
+    double t1 = NowSeconds();
+    int fileCount = 0;
+    int *sortedFiles = SortFilesBySize(&table, &fileCount);
+    GroupSpan *sizeGroups = NULL;
+    int numSizeGroups = 0;
+    GroupBySize(&table, sortedFiles, fileCount, &sizeGroups, &numSizeGroups);
+    int folded = CollapseHardlinks(&table, sortedFiles, sizeGroups, numSizeGroups);
+    int candidates = 0;
+    int keptGroups = 0;
+    for (int j = 0; j < numSizeGroups; j++) {
+        if (sizeGroups[j].count < 2) continue;
+        memmove(sortedFiles + candidates, sortedFiles + sizeGroups[j].start, sizeGroups[j].count * sizeof(int));
+        sizeGroups[j].start = candidates;
+        candidates += sizeGroups[j].count;
+        sizeGroups[keptGroups++] = sizeGroups[j];
+    }
+    numSizeGroups = keptGroups;
+    double t2 = NowSeconds();
+    pipelineStats.stage = STAGE_HASH;
+    ULONGLONG hashedBefore = pipelineStats.stages[STAGE_HASH].bytes;
+    BOOL hashed = ComputeHashes(&table, sortedFiles, candidates, options);
+    if (!hashed) _tprintf(_T("Out of memory queueing %d files for hashing.\n"), candidates);
+    double t3 = NowSeconds();
+    ULONGLONG hashedBytes = pipelineStats.stages[STAGE_HASH].bytes - hashedBefore;
+
+    // Every reported group must be exactly one class's files.
+    int *reportedGroups = (int *)calloc(numClasses, sizeof(int));
+    int *reportedFiles = (int *)calloc(numClasses, sizeof(int));
+    int mixed = 0;
+    int unreadable = 0;
+    int foreign = 0;
+    int numHashGroupsTotal = 0;
+    for (int j = 0; j < numSizeGroups && reportedGroups && reportedFiles; j++) {
+        int *members = sortedFiles + sizeGroups[j].start;
+        for (int k = 0; k < sizeGroups[j].count; k++) {
+            if (table.hashState[members[k]] != HASH_OK) unreadable++;
+        }
+        int numHashGroups = 0;
+        GroupSpan *hashGroups = GroupByHash(&table, members, sizeGroups[j].count, &numHashGroups);
+        numHashGroupsTotal += numHashGroups;
+        int matched = 0;
+        for (int h = 0; h < numHashGroups; h++) {
+            matched += hashGroups[h].count;
+            pipelineStats.reclaimable += (ULONGLONG)(hashGroups[h].count - 1) * table.sizes[members[0]];
+        }
+        pipelineStats.candidateBytes += (ULONGLONG)sizeGroups[j].count * table.sizes[members[0]];
+        pipelineStats.duplicateFiles += (ULONGLONG)matched;
+        pipelineStats.uniqueAfterHash += (ULONGLONG)(sizeGroups[j].count - matched);
+        for (int h = 0; h < numHashGroups; h++) {
+            int *group = members + hashGroups[h].start;
+            int cls = -1;
+            for (int k = 0; k < hashGroups[h].count; k++) {
+                LPCTSTR file = GetFileName(GetFilePath(&table, group[k]));
+                int number = file[0] == _T('f') ? _ttoi(file + 1) : -1;
+                if (number < 0 || number >= numFiles) {
+                    foreign++;
+                    continue;
+                }
+                if (cls < 0) cls = fileClass[number];
+                else if (fileClass[number] != cls) mixed++;
+            }
+            if (cls >= 0) {
+                reportedGroups[cls]++;
+                reportedFiles[cls] += hashGroups[h].count;
+            }
+        }
+        free(hashGroups);
+    }
+    double t4 = NowSeconds();
+
+    int missed = 0;
+    int split = 0;
+    for (int c = 0; reportedGroups && reportedFiles && c < numClasses; c++) {
+        if (classes[c].files < 2) {
+            if (reportedGroups[c] > 0) split++;
+        } else if (reportedGroups[c] == 0) {
+            missed++;
+        } else if (reportedGroups[c] > 1 || reportedFiles[c] != classes[c].files) {
+            split++;
+        }
+    }
+    BOOL correct = ready && hashed && reportedGroups && reportedFiles && mixed == 0 && missed == 0 && split == 0 &&
+                   unreadable == 0 && foreign == 0 && folded == hardlinks && numHashGroupsTotal == expectedSets;
+
+    pipelineStats.stages[STAGE_SCAN].seconds = t1 - t0;
+    pipelineStats.stages[STAGE_SCAN].files = (ULONGLONG)table.count;
+    pipelineStats.stages[STAGE_SCAN].bytes = totalBytes;
+    pipelineStats.dirs = (ULONGLONG)table.dirCount;
+    pipelineStats.scanThreads = scanThreads;
+    pipelineStats.groupSeconds = t2 - t1;
+    pipelineStats.sizeGroups = (ULONGLONG)numSizeGroups;
+    pipelineStats.candidates = (ULONGLONG)candidates;
+    pipelineStats.singletons = (ULONGLONG)(table.count - candidates - folded);
+    pipelineStats.hardlinks = (ULONGLONG)folded;
+    pipelineStats.stages[STAGE_HASH].seconds = t3 - t2;
+    pipelineStats.duplicateGroups = (ULONGLONG)numHashGroupsTotal;
+
+    double pipeline = t4 - t0;
+    _tprintf(_T("Scan   %8.3f s  %d entries, %.0f files/s\n"), t1 - t0, table.count,
+             t1 > t0 ? table.count / (t1 - t0) : 0.0);
+    _tprintf(_T("Group  %8.3f s  %d size groups, %d candidates, %d hardlinks folded\n"), t2 - t1, numSizeGroups,
+             candidates, folded);
+    _tprintf(_T("Hash   %8.3f s  %.1f MB hashed, %.1f MB/s\n"), t3 - t2, MB(hashedBytes),
+             t3 > t2 ? MB(hashedBytes) / (t3 - t2) : 0.0);
+    _tprintf(_T("Total  %8.3f s  %.0f files/s, peak memory %.1f MB\n"), pipeline,
+             pipeline > 0 ? table.count / pipeline : 0.0, MB(PeakMemoryBytes()));
+    if (correct) {
+        _tprintf(_T("Result correct: %d duplicate sets found exactly.\n"), expectedSets);
+    } else {
+        _tprintf(_T("Result WRONG: %d groups reported for %d expected sets; %d missed, %d split or extra, ")
+                 _T("%d mixed members, %d unreadable, %d unexpected files, %d of %d hardlinks folded.\n"),
+                 numHashGroupsTotal, expectedSets, missed, split, mixed, unreadable, foreign, folded, hardlinks);
+    }
+
+    if (!spec->keep) {
+        // Every name is in the table; directories come after their parents.
+        for (int id = 0; id < table.count; id++) {
+            CorpusRemove(&scratch, GetFilePath(&table, id), FALSE);
+        }
+        for (int d = table.dirCount - 1; d >= 0; d--) {
+            CorpusRemove(&scratch, GetDirectoryPath(&table, d), TRUE);
+        }
+    }
+
+    free(reportedGroups);
+    free(reportedFiles);
+    free(sizeGroups);
+    free(sortedFiles);
+    FreeFileTable(&table);
+    for (int d = 0; d <= CORPUS_DIRS; d++) free(dirs[d].text);
+    free(dirs);
+    free(fileClass);
+    free(classes);
+    free(data);
+    free(root.text);
+    free(path.text);
+    free(scratch.text);
+    return correct ? 0 : 1;
 }
 
-int CountFiles(FileEntry *list) {
+// Creates a scratch file in `dir` for reading and writing that goes away
+// when it is closed, or when the process ends without closing it.
+static FILE *OpenSpillFile(LPCTSTR dir, LPCTSTR name) {
+    TCHAR unique[64];
+    PathBuffer path = { NULL, 0, 0 };
+    FILE *file = NULL;
+#ifdef _WIN32
+    _stprintf_s(unique, 64, _T("dupfinder-%lu-%s"), GetCurrentProcessId(), name);
+    if (JoinPath(&path, dir, unique)) file = _tfopen(path.text, _T("w+bD"));
+#else
+    _stprintf_s(unique, 64, _T("dupfinder-%ld-%s"), (long)getpid(), name);
+    if (JoinPath(&path, dir, unique)) file = _tfopen(path.text, _T("w+b"));
+    if (file) unlink(path.text);
+#endif
+    free(path.text);
+    return file;
+}
+
+static int SeekSpillFile(FILE *file, ULONGLONG offset) {
+#ifdef _WIN32
+    return _fseeki64(file, (__int64)offset, SEEK_SET);
+#else
+    return fseeko(file, (off_t)offset, SEEK_SET);
+#endif
+}
+
+static int CompareSpillRecords(const void *a, const void *b) {
+    const SpillRecord *ra = (const SpillRecord *)a;
+    const SpillRecord *rb = (const SpillRecord *)b;
+    if (ra->size != rb->size) return ra->size < rb->size ? -1 : 1;
+    if (ra->pathOffset != rb->pathOffset) return ra->pathOffset < rb->pathOffset ? -1 : 1;
+    return 0;
+}
+
+static int CompareRecordPaths(const void *a, const void *b) {
+    const SpillRecord *ra = *(const SpillRecord *const *)a;
+    const SpillRecord *rb = *(const SpillRecord *const *)b;
+    if (ra->pathOffset != rb->pathOffset) return ra->pathOffset < rb->pathOffset ? -1 : 1;
+    return 0;
+}
+
+// Next record of a run, or FALSE at its end.
+static BOOL ReadSpillRecord(FILE *run, SpillRecord *record) {
+    return fread(record, sizeof(SpillRecord), 1, run) == 1;
+}
+
+// Restores heap order below slot `i` of a min-heap of run indices keyed on
+// each run's current record.
+static void SiftDown(int *heap, int count, const SpillRecord *heads, int i) {
+    for (;;) {
+        int smallest = i;
+        int left = 2 * i + 1;
+        int right = left + 1;
+        if (left < count && CompareSpillRecords(&heads[heap[left]], &heads[heap[smallest]]) < 0) smallest = left;
+        if (right < count && CompareSpillRecords(&heads[heap[right]], &heads[heap[smallest]]) < 0) smallest = right;
+        if (smallest == i) return;
+        int tmp = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+// Opens a new, empty run file. NULL if it cannot be created.
+static FILE *OpenSpillRun(SpillState *spill) {
+    TCHAR name[32];
+    _stprintf_s(name, 32, _T("run%d.tmp"), spill->runsWritten++);
+    return OpenSpillFile(spill->directory, name);
+}
+
+// Merges runs `first` and up into one run, which takes the place of the
+// first with `level` merge passes behind it.
+static BOOL MergeSpillRuns(SpillState *spill, int first, int level) {
+    SpillRecord heads[MAX_OPEN_RUNS];
+    int heap[MAX_OPEN_RUNS];
+    int heapCount = 0;
+    FILE *merged = OpenSpillRun(spill);
+    if (!merged) return FALSE;
+    BOOL ok = TRUE;
+    for (int r = first; r < spill->numRuns; r++) {
+        setvbuf(spill->runs[r], NULL, _IOFBF, spill->mergeBuffer);
+        rewind(spill->runs[r]);
+        if (ReadSpillRecord(spill->runs[r], &heads[r - first])) heap[heapCount++] = r - first;
+    }
+    for (int i = heapCount / 2 - 1; i >= 0; i--) SiftDown(heap, heapCount, heads, i);
+    while (ok && heapCount > 0) {
+        int r = heap[0];
+        ok = fwrite(&heads[r], sizeof(SpillRecord), 1, merged) == 1;
+        if (!ReadSpillRecord(spill->runs[first + r], &heads[r])) heap[0] = heap[--heapCount];
+        SiftDown(heap, heapCount, heads, 0);
+    }
+    for (int r = first; r < spill->numRuns; r++) fclose(spill->runs[r]);
+    spill->runs[first] = merged;
+    spill->levels[first] = level;
+    spill->numRuns = first + 1;
+    return ok;
+}
+
+// Sorts the buffered records by size and writes them out as one run, then
+// merges runs so that no more than MAX_OPEN_RUNS stay open: each time the
+// last MERGE_FAN_IN runs have been through equally many merges they become
+// one, and a full set of open runs merges its tail regardless.
+static BOOL FlushSpillRun(SpillState *spill) {
+    if (spill->count == 0) return TRUE;
+    qsort(spill->records, spill->count, sizeof(SpillRecord), CompareSpillRecords);
+    if (spill->numRuns == spill->runCapacity) {
+        int newCapacity = spill->runCapacity ? spill->runCapacity * 2 : 16;
+        FILE **runs = (FILE **)realloc(spill->runs, newCapacity * sizeof(FILE *));
+        if (runs) spill->runs = runs;
+        int *levels = (int *)realloc(spill->levels, newCapacity * sizeof(int));
+        if (levels) spill->levels = levels;
+        if (!runs || !levels) return FALSE;
+        spill->runCapacity = newCapacity;
+    }
+    FILE *run = OpenSpillRun(spill);
+    if (!run) return FALSE;
+    spill->levels[spill->numRuns] = 0;
+    spill->runs[spill->numRuns++] = run;
+    BOOL ok = fwrite(spill->records, sizeof(SpillRecord), spill->count, run) == (size_t)spill->count;
+    spill->count = 0;
+    while (ok && spill->numRuns >= MERGE_FAN_IN) {
+        int first = spill->numRuns - MERGE_FAN_IN;
+        int level = spill->levels[first];
+        if (spill->levels[spill->numRuns - 1] == level) {
+            ok = MergeSpillRuns(spill, first, level + 1);
+        } else if (spill->numRuns == MAX_OPEN_RUNS) {
+            ok = MergeSpillRuns(spill, first, level);
+        } else {
+            break;
+        }
+    }
+    return ok;
+}
+
+// Appends one file's path to the path file and its record to the run
+// buffer, spilling the buffer when it is full.
+static BOOL SpillFile(SpillState *spill, LPCTSTR path, size_t length, const ScanEntry *entry) {
+    if (spill->count == spill->capacity && !FlushSpillRun(spill)) return FALSE;
+    SpillRecord *record = &spill->records[spill->count++];
+    record->size = entry->size;
+    record->mtime = entry->mtime;
+    record->device = entry->device;
+    record->fileId = entry->fileId;
+    record->pathOffset = spill->pathBytes;
+    record->pathLength = (unsigned int)length;
+    if (fwrite(path, sizeof(TCHAR), length + 1, spill->paths) != length + 1) return FALSE;
+    spill->pathBytes += (length + 1) * sizeof(TCHAR);
+    spill->files++;
+    spill->bytes += entry->size;
+    return TRUE;
+}
+
+static BOOL PushPath(PathStack *stack, LPCTSTR path, size_t length) {
+    if (stack->count == stack->capacity) {
+        int newCapacity = stack->capacity ? stack->capacity * 2 : 256;
+        size_t *offsets = (size_t *)realloc(stack->offsets, newCapacity * sizeof(size_t));
+        if (!offsets) return FALSE;
+        stack->offsets = offsets;
+        stack->capacity = newCapacity;
+    }
+    if (stack->used + length + 1 > stack->poolCapacity) {
+        size_t newCapacity = stack->poolCapacity ? stack->poolCapacity * 2 : 64 * 1024;
+        while (newCapacity < stack->used + length + 1) newCapacity *= 2;
+        TCHAR *pool = (TCHAR *)realloc(stack->pool, newCapacity * sizeof(TCHAR));
+        if (!pool) return FALSE;
+        stack->pool = pool;
+        stack->poolCapacity = newCapacity;
+    }
+    stack->offsets[stack->count++] = stack->used;
+    memcpy(stack->pool + stack->used, path, (length + 1) * sizeof(TCHAR));
+    stack->used += length + 1;
+    return TRUE;
+}
+
+// Walks the roots like TraverseDirectories, but streams every file to the
+// spill files instead of the table. Only directories still waiting to be
+// listed are held, in a stack whose pool shrinks as they are popped.
+static BOOL SpillTree(SpillState *spill, LPCTSTR *roots, int numRoots, BOOL recursive) {
+    PathStack stack;
+    memset(&stack, 0, sizeof(stack));
+    PathBuffer dirPath = { NULL, 0, 0 };
+    PathBuffer fullPath = { NULL, 0, 0 };
+    ScanBatch batch;
+    memset(&batch, 0, sizeof(batch));
+    BOOL ok = TRUE;
+
+    for (int i = numRoots - 1; ok && i >= 0; i--) {
+        ok = PushPath(&stack, roots[i], _tcslen(roots[i]));
+    }
+    while (ok && stack.count > 0) {
+        size_t top = stack.offsets[--stack.count];
+        ok = CopyPath(&dirPath, stack.pool + top);
+        stack.used = top;
+        if (!ok) break;
+        spill->dirs++;
+
+        ListDirectory(dirPath.text, recursive, &fullPath, &batch);
+        for (int e = 0; ok && e < batch.count; e++) {
+            const ScanEntry *entry = &batch.entries[e];
+            ok = JoinPath(&fullPath, dirPath.text, batch.names + entry->nameOffset);
+            if (!ok) break;
+            ok = entry->isDir ? PushPath(&stack, fullPath.text, fullPath.length)
+                              : SpillFile(spill, fullPath.text, fullPath.length, entry);
+        }
+    }
+    if (!ok) _tprintf(_T("Cannot spill the file list (out of memory or disk space).\n"));
+
+    free(stack.pool);
+    free(stack.offsets);
+    free(dirPath.text);
+    free(fullPath.text);
+    free(batch.entries);
+    free(batch.names);
+    return ok && FlushSpillRun(spill);
+}
+
+// Hashes one batch of complete size groups held in `table` (spans of
+// `files`) and reports its duplicates as the in-memory run does. FALSE if
+// hashing could not start; sets `quit` if the user quit at the prompt.
+static BOOL VerifyBatch(FileTable *table, int *files, GroupSpan *groups, int numGroups, HashOptions *options,
+                        FILE *ndjson, ActionQueue *actions, BOOL *quit) {
+    int folded = CollapseHardlinks(table, files, groups, numGroups);
+    ReportHardlinks(table, folded, ndjson);
+    pipelineStats.hardlinks += (ULONGLONG)folded;
+    int kept = 0;
+    for (int g = 0; g < numGroups; g++) {
+        if (groups[g].count > 1) groups[kept++] = groups[g];
+    }
+    pipelineStats.singletons += (ULONGLONG)(numGroups - kept);
+    numGroups = kept;
+    for (int g = 0; g < numGroups; g++) {
+        pipelineStats.sizeGroups++;
+        pipelineStats.candidates += (ULONGLONG)groups[g].count;
+        pipelineStats.candidateBytes += (ULONGLONG)groups[g].count * table->sizes[files[groups[g].start]];
+    }
+    if (options->largestFirst) SortGroupsByReclaimable(table, files, groups, numGroups);
+    if (actions) RebindActions(actions, table);
+
+    double started = NowSeconds();
+    IoScheduler scheduler;
+    BOOL hashing = StartHashing(&scheduler, table, files, groups, numGroups, options);
+    if (!hashing) _tprintf(_T("Out of memory queueing a batch of %d size groups for hashing.\n"), numGroups);
+    int g;
+    while (hashing && (g = NextHashedGroup(&scheduler)) >= 0) {
+        int *members = files + groups[g].start;
+        int count = groups[g].count;
+        int numHashGroups = 0;
+        GroupSpan *hashGroups = GroupByHash(table, members, count, &numHashGroups);
+        int matched = 0;
+        for (int j = 0; j < numHashGroups; j++) {
+            int *group = members + hashGroups[j].start;
+            matched += hashGroups[j].count;
+            pipelineStats.reclaimable += (ULONGLONG)(hashGroups[j].count - 1) * table->sizes[members[0]];
+            if (ndjson) WriteGroupJson(ndjson, table, group, hashGroups[j].count);
+            if (actions) {
+                PlanDuplicateGroup(actions, table, group, hashGroups[j].count);
+            } else if (!*quit) {
+                *quit = !HandleDuplicateGroup(table, group, hashGroups[j].count);
+            }
+        }
+        pipelineStats.duplicateGroups += (ULONGLONG)numHashGroups;
+        pipelineStats.duplicateFiles += (ULONGLONG)matched;
+        pipelineStats.uniqueAfterHash += (ULONGLONG)(count - matched);
+        free(hashGroups);
+        if (*quit) {
+            StopHashing(&scheduler);
+            break;
+        }
+    }
+    FinishHashing(&scheduler);
+    pipelineStats.stages[STAGE_HASH].seconds += NowSeconds() - started;
+    // The queued actions refer to this table; let them finish before it goes.
+    if (actions) RebindActions(actions, NULL);
+    return hashing;
+}
+
+// Loads the batched records' paths, reading the path file in order, and
+// verifies the batch. FALSE if it runs out of memory.
+static BOOL ProcessSpillBatch(SpillState *spill, SpillRecord *records, int count, GroupSpan *groups, int numGroups,
+                              HashOptions *options, FILE *ndjson, ActionQueue *actions, BOOL *quit) {
+    if (numGroups == 0) return TRUE;
+    SpillRecord **byPath = (SpillRecord **)malloc(count * sizeof(SpillRecord *));
+    int *files = (int *)malloc(count * sizeof(int));
+    PathBuffer path = { NULL, 0, 0 };
+    FileTable table;
+    InitFileTable(&table);
+    if (!byPath || !files) {
+        _tprintf(_T("Out of memory loading a batch of %d files.\n"), count);
+        free(byPath);
+        free(files);
+        return FALSE;
+    }
+    for (int i = 0; i < count; i++) byPath[i] = &records[i];
+    qsort(byPath, count, sizeof(SpillRecord *), CompareRecordPaths);
+
+    // Record i of the batch becomes table id files[i].
+    for (int i = 0; i < count; i++) {
+        SpillRecord *record = byPath[i];
+        int slot = (int)(record - records);
+        files[slot] = -1;
+        if (!ReservePath(&path, record->pathLength + 1) ||
+            SeekSpillFile(spill->paths, record->pathOffset) != 0 ||
+            fread(path.text, sizeof(TCHAR), record->pathLength + 1, spill->paths) != record->pathLength + 1) {
+            continue;
+        }
+        path.text[record->pathLength] = 0;
+        if (AddFile(&table, path.text, record->size, record->mtime, record->device, record->fileId, -1)) {
+            files[slot] = table.count - 1;
+        }
+    }
+    free(path.text);
+    free(byPath);
+
+    // Drop members whose path could not be loaded, keeping spans in order.
+    int out = 0;
+    for (int g = 0; g < numGroups; g++) {
+        int start = out;
+        for (int i = groups[g].start; i < groups[g].start + groups[g].count; i++) {
+            if (files[i] >= 0) files[out++] = files[i];
+        }
+        groups[g].start = start;
+        groups[g].count = out - start;
+    }
+    BOOL verified = VerifyBatch(&table, files, groups, numGroups, options, ndjson, actions, quit);
+    free(files);
+    FreeFileTable(&table);
+    return verified;
+}
+
+// Finds duplicates with memory bounded by `memoryLimit` bytes instead of
+// by file count. The scan streams (size, path offset) records to sorted
+// runs on disk and paths to a path file; a k-way merge of the runs yields
+// size groups in ascending size, and groups of two or more are loaded into
+// a file table a batch at a time, hashed and reported. A single size group
+// larger than the budget is still loaded whole. Whole-tree features
+// (--dirs, --chunks) need every file at once and are not available.
+int FindDuplicatesOutOfCore(LPCTSTR *roots, int numRoots, BOOL recursive, ULONGLONG memoryLimit,
+                            LPCTSTR spillDir, HashOptions *options, FILE *ndjson, ActionQueue *actions) {
+    SpillState spill;
+    memset(&spill, 0, sizeof(spill));
+    spill.directory = spillDir;
+    // Half the budget buffers records during the scan; during the merge a
+    // quarter goes to run read buffers and half to the batch being loaded.
+    spill.capacity = (int)(memoryLimit / 2 / sizeof(SpillRecord));
+    if (spill.capacity < 1024) spill.capacity = 1024;
+    spill.mergeBuffer = (size_t)(memoryLimit / 4 / MERGE_FAN_IN);
+    if (spill.mergeBuffer < 4096) spill.mergeBuffer = 4096;
+    spill.records = (SpillRecord *)malloc(spill.capacity * sizeof(SpillRecord));
+    spill.paths = OpenSpillFile(spillDir, _T("paths.tmp"));
+    if (!spill.records || !spill.paths) {
+        _tprintf(_T("Cannot set up spill files in %s.\n"), spillDir);
+        free(spill.records);
+        if (spill.paths) fclose(spill.paths);
+        return 1;
+    }
+
+    double started = NowSeconds();
+    BOOL ok = SpillTree(&spill, roots, numRoots, recursive);
+    free(spill.records);
+    spill.records = NULL;
+    pipelineStats.stages[STAGE_SCAN].seconds = NowSeconds() - started;
+    pipelineStats.stages[STAGE_SCAN].files = spill.files;
+    pipelineStats.stages[STAGE_SCAN].bytes = spill.bytes;
+    pipelineStats.dirs = spill.dirs;
+    pipelineStats.scanThreads = 1;
+    _tprintf(_T("Spilled %llu files in %d sorted runs (%.1f MB of paths).\n"), spill.files, spill.numRuns,
+             MB(spill.pathBytes));
+
+    // Merge: one buffered reader per run, at most MAX_OPEN_RUNS of them, and
+    // a heap of runs by current record.
+    size_t runBuffer = spill.numRuns ? (size_t)(memoryLimit / 4 / spill.numRuns) : 0;
+    if (runBuffer < 4096) runBuffer = 4096;
+    SpillRecord heads[MAX_OPEN_RUNS];
+    int heap[MAX_OPEN_RUNS];
+    int heapCount = 0;
+    for (int r = 0; ok && r < spill.numRuns; r++) {
+        setvbuf(spill.runs[r], NULL, _IOFBF, runBuffer);
+        rewind(spill.runs[r]);
+        if (ReadSpillRecord(spill.runs[r], &heads[r])) heap[heapCount++] = r;
+    }
+    for (int i = heapCount / 2 - 1; i >= 0; i--) SiftDown(heap, heapCount, heads, i);
+    fflush(spill.paths);
+
+    // Batch: records of complete size groups, up to half the budget with
+    // their estimated table cost (columns, path, pool slack).
+    ULONGLONG batchBudget = memoryLimit / 2;
+    ULONGLONG batchCost = 0;
+    ULONGLONG groupCost = 0;
+    SpillRecord *records = NULL;
     int count = 0;
-    while (list) { count++; list = list->next; }
-    return count;
+    int capacity = 0;
+    GroupSpan *groups = NULL;
+    int numGroups = 0;
+    int groupCapacity = 0;
+    int groupStart = 0;
+    ULONGLONG batches = 0;
+    BOOL quit = FALSE;
+    started = NowSeconds();
+    pipelineStats.stage = STAGE_HASH;
+    while (ok) {
+        BOOL done = heapCount == 0;
+        SpillRecord next;
+        if (done) memset(&next, 0, sizeof(next));
+        else next = heads[heap[0]];
+
+        // A size group ends when the size changes; a batch holds whole
+        // groups, so it is only cut between them.
+        if (count > groupStart && (done || next.size != records[groupStart].size)) {
+            if (count - groupStart < 2) {
+                pipelineStats.singletons++;
+                count = groupStart;
+            } else {
+                if (numGroups == groupCapacity) {
+                    int newCapacity = groupCapacity ? groupCapacity * 2 : 256;
+                    GroupSpan *grown = (GroupSpan *)realloc(groups, newCapacity * sizeof(GroupSpan));
+                    if (!grown) {
+                        ok = FALSE;
+                        break;
+                    }
+                    groups = grown;
+                    groupCapacity = newCapacity;
+                }
+                groups[numGroups].start = groupStart;
+                groups[numGroups].count = count - groupStart;
+                numGroups++;
+                groupStart = count;
+                batchCost += groupCost;
+            }
+            groupCost = 0;
+            if (numGroups > 0 && (done || batchCost >= batchBudget)) {
+                if (!ProcessSpillBatch(&spill, records, count, groups, numGroups, options, ndjson, actions, &quit)) {
+                    ok = FALSE;
+                    break;
+                }
+                batches++;
+                if (quit) break;
+                count = 0;
+                groupStart = 0;
+                numGroups = 0;
+                batchCost = 0;
+            }
+        }
+        if (done) break;
+
+        if (count == capacity) {
+            int newCapacity = capacity ? capacity * 2 : 4096;
+            SpillRecord *grown = (SpillRecord *)realloc(records, newCapacity * sizeof(SpillRecord));
+            if (!grown) {
+                ok = FALSE;
+                break;
+            }
+            records = grown;
+            capacity = newCapacity;
+        }
+        records[count++] = next;
+        groupCost += sizeof(SpillRecord) + 128 + 2 * ((ULONGLONG)next.pathLength + 1) * sizeof(TCHAR);
+
+        int r = heap[0];
+        if (!ReadSpillRecord(spill.runs[r], &heads[r])) heap[0] = heap[--heapCount];
+        SiftDown(heap, heapCount, heads, 0);
+    }
+    if (!ok) _tprintf(_T("Out of memory merging the spilled file list.\n"));
+    pipelineStats.groupSeconds = NowSeconds() - started - pipelineStats.stages[STAGE_HASH].seconds;
+    _tprintf(_T("Verified %llu size groups in %llu batches.\n"), pipelineStats.sizeGroups, batches);
+
+    free(records);
+    free(groups);
+    for (int r = 0; r < spill.numRuns; r++) fclose(spill.runs[r]);
+    fclose(spill.paths);
+    free(spill.runs);
+    free(spill.levels);
+    return ok ? 0 : 1;
+}
+
+void InitPipelineStats(void) {
+    memset(&pipelineStats, 0, sizeof(pipelineStats));
+    MutexInit(&pipelineStats.lock);
+    pipelineStats.started = NowSeconds();
+}
+
+// Gives the calling thread a column in the trace. Threads past
+// MAX_TRACE_THREADS, and all threads when tracing is off, go untraced.
+void RegisterTraceThread(const char *role, LPCTSTR detail) {
+    PipelineStats *stats = &pipelineStats;
+    if (!stats->trace || traceSlot >= 0) return;
+    MutexLock(&stats->lock);
+    if (stats->numThreads < MAX_TRACE_THREADS) {
+        traceSlot = stats->numThreads;
+        stats->activity[traceSlot] = ACTIVITY_WAIT;
+        fprintf(stats->trace, "{\"t\":%.4f,\"thread\":%d,\"role\":\"%s\",\"detail\":", NowSeconds() - stats->started,
+                traceSlot, role);
+        WriteJsonString(stats->trace, detail ? detail : _T(""));
+        fputs("}\n", stats->trace);
+        stats->numThreads++;
+    }
+    MutexUnlock(&stats->lock);
+}
+
+void SetActivity(char activity) {
+    if (traceSlot >= 0) pipelineStats.activity[traceSlot] = activity;
+}
+
+// Ends the calling thread's column; its slot is not reused.
+void UnregisterTraceThread(void) {
+    SetActivity(ACTIVITY_EXITED);
+    traceSlot = -1;
+}
+
+// Samples every thread's activity each interval and writes a line when
+// any of them changed since the last sample.
+THREAD_PROC(TraceSamplerProc) {
+    PipelineStats *stats = (PipelineStats *)arg;
+    char last[MAX_TRACE_THREADS + 1] = "";
+    char now[MAX_TRACE_THREADS + 1];
+    for (;;) {
+        MutexLock(&stats->lock);
+        BOOL stopping = stats->stopping;
+        int n = stats->numThreads;
+        for (int i = 0; i < n; i++) now[i] = stats->activity[i];
+        now[n] = '\0';
+        if (strcmp(now, last) != 0) {
+            fprintf(stats->trace, "{\"t\":%.4f,\"threads\":\"%s\"}\n", NowSeconds() - stats->started, now);
+            memcpy(last, now, n + 1);
+        }
+        MutexUnlock(&stats->lock);
+        if (stopping) break;
+        SleepSeconds(stats->traceInterval);
+    }
+    THREAD_EXIT;
+}
+
+BOOL StartTrace(LPCTSTR path, double interval) {
+    PipelineStats *stats = &pipelineStats;
+    stats->trace = _tfopen(path, _T("wb"));
+    if (!stats->trace) {
+        _tprintf(_T("Cannot open %s for writing.\n"), path);
+        return FALSE;
+    }
+    stats->traceInterval = interval;
+    if (!StartThread(&stats->sampler, TraceSamplerProc, stats)) {
+        fclose(stats->trace);
+        stats->trace = NULL;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static int SizeClass(ULONGLONG bytes) {
+    static const ULONGLONG limits[SIZE_CLASSES - 1] = {
+        64ULL << 10, 1ULL << 20, 16ULL << 20, 256ULL << 20, 4ULL << 30
+    };
+    int c = 0;
+    while (c < SIZE_CLASSES - 1 && bytes >= limits[c]) c++;
+    return c;
+}
+
+// Charges one file read to the current stage.
+void RecordFileRead(ULONGLONG bytes, BOOL ok, double elapsed, double io, double cpu, double throttle) {
+    PipelineStats *stats = &pipelineStats;
+    int bucket = 0;
+    for (double ms = elapsed * 1000.0; ms >= 1.0 && bucket < LATENCY_BUCKETS - 1; ms /= 2.0) bucket++;
+
+    MutexLock(&stats->lock);
+    StageStats *stage = &stats->stages[stats->stage];
+    stage->files++;
+    stage->bytes += bytes;
+    stage->ioSeconds += io;
+    stage->cpuSeconds += cpu;
+    stage->throttleSeconds += throttle;
+    if (ok) {
+        stage->latency[SizeClass(bytes)][bucket]++;
+    } else {
+        stage->failures++;
+    }
+    MutexUnlock(&stats->lock);
 }
 
-void FreeFileList(FileEntry *list) {
-    while (list) {
-        FileEntry *next = list->next;
-        free(list->path);
-        free(list->hash);
-        free(list);
-        list = next;
+// Adds one scan worker's listing and recording time.
+void RecordScanTime(double list, double record) {
+    MutexLock(&pipelineStats.lock);
+    pipelineStats.stages[STAGE_SCAN].ioSeconds += list;
+    pipelineStats.stages[STAGE_SCAN].cpuSeconds += record;
+    MutexUnlock(&pipelineStats.lock);
+}
+
+static void WriteStageJson(FILE *out, const char *name, const StageStats *stage, BOOL reads) {
+    fprintf(out, "\"%s\":{\"seconds\":%.3f,\"files\":%llu,\"bytes\":%llu", name, stage->seconds,
+            stage->files, stage->bytes);
+    if (!reads) {
+        fprintf(out, ",\"listSeconds\":%.3f,\"recordSeconds\":%.3f", stage->ioSeconds, stage->cpuSeconds);
+        return;
+    }
+    fprintf(out, ",\"failures\":%llu,\"mbps\":%.1f,\"ioSeconds\":%.3f,\"cpuSeconds\":%.3f,\"throttleSeconds\":%.3f",
+            stage->failures, stage->seconds > 0 ? MB(stage->bytes) / stage->seconds : 0.0, stage->ioSeconds,
+            stage->cpuSeconds, stage->throttleSeconds);
+    static const char *classNames[SIZE_CLASSES] = { "<64KB", "<1MB", "<16MB", "<256MB", "<4GB", ">=4GB" };
+    fputs(",\"latencyMs\":{\"buckets\":[", out);
+    for (int b = 0; b < LATENCY_BUCKETS - 1; b++) {
+        fprintf(out, "%s%d", b ? "," : "", 1 << b);
+    }
+    fputs("]", out);
+    for (int c = 0; c < SIZE_CLASSES; c++) {
+        fprintf(out, ",\"%s\":[", classNames[c]);
+        for (int b = 0; b < LATENCY_BUCKETS; b++) {
+            fprintf(out, "%s%llu", b ? "," : "", stage->latency[c][b]);
+        }
+        fputs("]", out);
+    }
+    fputs("}", out);
+}
+
+// Stops the trace and, given a path, prints a per-stage summary and writes
+// it to the path as one JSON object.
+void FinishPipelineStats(LPCTSTR statsPath) {
+    PipelineStats *stats = &pipelineStats;
+    if (stats->trace) {
+        MutexLock(&stats->lock);
+        stats->stopping = TRUE;
+        MutexUnlock(&stats->lock);
+        JoinThread(stats->sampler);
+        fclose(stats->trace);
+        stats->trace = NULL;
+    }
+
+    if (statsPath) {
+        double elapsed = NowSeconds() - stats->started;
+        const StageStats *scan = &stats->stages[STAGE_SCAN];
+        const StageStats *hash = &stats->stages[STAGE_HASH];
+        const StageStats *chunk = &stats->stages[STAGE_CHUNK];
+        _tprintf(_T("\nPipeline statistics (%.2f s):\n"), elapsed);
+        _tprintf(_T("  scan   %8.2f s  %llu files, %llu directories, %.1f MB; listed for %.2f s and recorded ")
+                 _T("for %.2f s on %d threads\n"), scan->seconds, scan->files, stats->dirs, MB(scan->bytes),
+                 scan->ioSeconds, scan->cpuSeconds, stats->scanThreads);
+        if (chunk->files == 0) {
+            _tprintf(_T("  group  %8.2f s  %llu size groups, %llu candidates (%.1f MB); %llu ruled out by size, ")
+                     _T("%llu hardlinks folded\n"), stats->groupSeconds, stats->sizeGroups, stats->candidates,
+                     MB(stats->candidateBytes), stats->singletons, stats->hardlinks);
+        }
+        const StageStats *read = chunk->files ? chunk : hash;
+        _tprintf(_T("  %-6s %8.2f s  %llu files, %.1f MB at %.1f MB/s, %llu failed; threads read for %.2f s, ")
+                 _T("%s for %.2f s, throttled for %.2f s\n"), chunk->files ? _T("chunk") : _T("hash"),
+                 read->seconds, read->files, MB(read->bytes), read->seconds > 0 ? MB(read->bytes) / read->seconds : 0.0,
+                 read->failures, read->ioSeconds, chunk->files ? _T("chunked") : _T("hashed"), read->cpuSeconds,
+                 read->throttleSeconds);
+        if (chunk->files == 0) {
+            _tprintf(_T("                   %llu duplicate groups, %llu files, %.1f MB reclaimable; ")
+                     _T("%llu candidates unique after hashing\n"), stats->duplicateGroups, stats->duplicateFiles,
+                     MB(stats->reclaimable), stats->uniqueAfterHash);
+        }
+
+        FILE *out = _tfopen(statsPath, _T("wb"));
+        if (!out) {
+            _tprintf(_T("Cannot open %s for writing.\n"), statsPath);
+        } else {
+            fprintf(out, "{\"seconds\":%.3f,", elapsed);
+            WriteStageJson(out, "scan", scan, FALSE);
+            fprintf(out, ",\"dirs\":%llu,\"threads\":%d},", stats->dirs, stats->scanThreads);
+            fprintf(out, "\"group\":{\"seconds\":%.3f,\"sizeGroups\":%llu,\"candidates\":%llu,"
+                    "\"candidateBytes\":%llu,\"singletons\":%llu,\"hardlinks\":%llu},", stats->groupSeconds,
+                    stats->sizeGroups, stats->candidates, stats->candidateBytes, stats->singletons,
+                    stats->hardlinks);
+            WriteStageJson(out, "hash", hash, TRUE);
+            fprintf(out, ",\"duplicateGroups\":%llu,\"duplicateFiles\":%llu,\"reclaimable\":%llu,"
+                    "\"uniqueAfterHash\":%llu},", stats->duplicateGroups, stats->duplicateFiles,
+                    stats->reclaimable, stats->uniqueAfterHash);
+            WriteStageJson(out, "chunk", chunk, TRUE);
+            fputs("}}\n", out);
+            fclose(out);
+        }
     }
+    MutexDestroy(&stats->lock);
 }
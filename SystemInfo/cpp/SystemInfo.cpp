@@ -1,6 +1,9 @@
+#ifdef _WIN32
 #include <Windows.h>
 #include <comdef.h>
 #include <Wbemidl.h>
+#include <Pdh.h>
+#endif
 #include <sstream>
 #include <iomanip>
 #include <vector>
@@ -10,14 +13,93 @@
 #include <cstdio>
 #include <string>
 #include <iostream>
+#include <unordered_map>
+#include <cwctype>
+#include <cstring>
+#include <climits>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <cerrno>
+#include <cstdint>
+#include <charconv>
+#include <string_view>
+#include <ctime>
+#include <random>
+#include <new>
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#include <emmintrin.h>
+#endif
+#ifndef _WIN32
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdlib>
+#include <clocale>
+#include <langinfo.h>
+#include <csignal>
+#include <ctime>
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/utsname.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+#endif
 
+#ifdef _WIN32
 // Note: MinGW ignores #pragma comment(lib, ...) so link with:
-// -loleaut32 -lole32 -lwbemuuid -lshlwapi
+// -loleaut32 -lole32 -lwbemuuid -lshlwapi -lpdh
 
 #pragma comment(lib, "wbemuuid.lib")
 #pragma comment(lib, "Ole32.lib")
 #pragma comment(lib, "OleAut32.lib")
+#pragma comment(lib, "pdh.lib")
+#else
+// POSIX build: the Win32 vocabulary used below, mapped onto libc.
+typedef long HRESULT;
+typedef unsigned long DWORD;
+typedef unsigned long ULONG;
+typedef long LONG;
+typedef unsigned long long ULONGLONG;
+typedef long long LONGLONG;
+typedef unsigned int UINT;
+typedef unsigned short USHORT;
+#define S_OK ((HRESULT)0)
+#define E_FAIL ((HRESULT)0x80004005L)
+#define SUCCEEDED(hr) ((HRESULT)(hr) >= 0)
+#define FAILED(hr) ((HRESULT)(hr) < 0)
 
+std::string Narrow(const std::wstring& text) {
+    std::string out(text.size() * MB_LEN_MAX + 1, '\0');
+    size_t len = wcstombs(&out[0], text.c_str(), out.size());
+    out.resize(len == (size_t)-1 ? 0 : len);
+    return out;
+}
+
+std::wstring Widen(const std::string& text) {
+    std::wstring out(text.size() + 1, L'\0');
+    size_t len = mbstowcs(&out[0], text.c_str(), out.size());
+    out.resize(len == (size_t)-1 ? 0 : len);
+    return out;
+}
+#endif
+
+#ifdef _WIN32
 // RAII for COM initialization
 class ComInitializer {
     HRESULT hr;
@@ -95,316 +177,4342 @@ public:
     bool IsConnected() const { return pSvc != nullptr; }
 };
 
-// Structure for WMI properties
-struct WmiProperty {
-    const wchar_t* name;
-    const wchar_t* displayName;
-    std::function<std::wstring(VARIANT&)> formatter;
-};
-
-// Formatter for memory in GB
-std::wstring FormatMemoryGB(VARIANT& v) {
-    ULONGLONG val = v.ullVal;
-    double gb = val / (1024.0 * 1024.0 * 1024.0);
-    std::wstringstream ss;
-    ss << std::fixed << std::setprecision(1) << gb;
-    return ss.str();
-}
-
-// Formatter for cache sizes in MB
-std::wstring FormatCacheMB(VARIANT& v) {
-    ULONG val = v.ulVal;
-    double mb = val / 1024.0;
-    std::wstringstream ss;
-    ss << std::fixed << std::setprecision(1) << mb;
-    return ss.str();
-}
-
-// Generic WMI query function with safe VARIANT-to-string conversion
-void QueryWMI(
-    IWbemServices* pSvc,
-    const std::wstring& className,
-    const std::vector<WmiProperty>& properties,
-    std::wstringstream& output,
-    const std::wstring& section = L"",
-    const std::wstring& condition = L""
-) {
-    if (!section.empty())
-        output << L"\n[" << section << L"]\n";
-
-    std::wstring query = L"SELECT * FROM " + className;
-    if (!condition.empty())
-        query += L" WHERE " + condition;
-
-    IEnumWbemClassObject* pEnumerator = nullptr;
-    HRESULT hres = pSvc->ExecQuery(
-        bstr_t(L"WQL"),
-        bstr_t(query.c_str()),
-        WBEM_FLAG_FORWARD_ONLY | WBEM_FLAG_RETURN_IMMEDIATELY,
-        NULL,
-        &pEnumerator
-    );
-
-    if (FAILED(hres)) {
-        output << L"Error querying " << className << L": " << hres << L"\n";
-        return;
+// Joins the calling worker thread to the process's multithreaded apartment,
+// where the WMI proxy may be used from any thread.
+class ComApartment {
+    HRESULT hr;
+public:
+    ComApartment() { hr = CoInitializeEx(0, COINIT_MULTITHREADED); }
+    ~ComApartment() {
+        if (SUCCEEDED(hr))
+            CoUninitialize();
+    }
+};
+#endif
+
+// REPORT VALUES AND SINKS
+
+// Appends UTF-16 (Windows) or UTF-32 (Linux) text to `out` as UTF-8.
+void AppendUtf8(std::string& out, const wchar_t* text, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        unsigned long c = (unsigned long)text[i];
+        if (c >= 0xD800 && c < 0xDC00 && i + 1 < len) {
+            unsigned long low = (unsigned long)text[i + 1];
+            if (low >= 0xDC00 && low < 0xE000) {
+                c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+                i++;
+            }
+        }
+        if (c < 0x80) {
+            out += (char)c;
+        } else if (c < 0x800) {
+            out += (char)(0xC0 | (c >> 6));
+            out += (char)(0x80 | (c & 0x3F));
+        } else if (c < 0x10000) {
+            out += (char)(0xE0 | (c >> 12));
+            out += (char)(0x80 | ((c >> 6) & 0x3F));
+            out += (char)(0x80 | (c & 0x3F));
+        } else {
+            out += (char)(0xF0 | (c >> 18));
+            out += (char)(0x80 | ((c >> 12) & 0x3F));
+            out += (char)(0x80 | ((c >> 6) & 0x3F));
+            out += (char)(0x80 | (c & 0x3F));
+        }
+    }
+}
+
+std::string ToUtf8(const std::wstring& text) {
+    std::string out;
+    out.reserve(text.size());
+    AppendUtf8(out, text.data(), text.size());
+    return out;
+}
+
+// A property value as it travels from a provider to a sink. Strings are
+// UTF-8. Providers reuse one Value per column, so clearing keeps the
+// string capacity for the next row.
+struct Value {
+    enum Kind : unsigned char { Empty, Integer, Real, String, List };
+    Kind kind = Empty;
+    int decimals = 0;  // digits after the point, for Real
+    long long integer = 0;
+    double real = 0;
+    std::string text;
+    std::vector<std::string> items;
+
+    static Value FromInt(long long number) {
+        Value v;
+        v.kind = Integer;
+        v.integer = number;
+        return v;
+    }
+    static Value FromReal(double number, int digits) {
+        Value v;
+        v.kind = Real;
+        v.real = number;
+        v.decimals = digits;
+        return v;
+    }
+    static Value FromString(std::string s) {
+        Value v;
+        v.kind = String;
+        v.text = std::move(s);
+        return v;
+    }
+    static Value FromList(std::vector<std::string> list) {
+        Value v;
+        v.kind = List;
+        v.items = std::move(list);
+        return v;
+    }
+
+    void Clear() {
+        kind = Empty;
+        text.clear();
+        items.clear();
+    }
+
+    // Numeric reading; WMI gives 64-bit integers as decimal strings.
+    double AsDouble() const {
+        switch (kind) {
+        case Integer: return (double)integer;
+        case Real: return real;
+        case String: return strtod(text.c_str(), nullptr);
+        default: return 0;
+        }
+    }
+};
+
+// Buffered output to a file. Numbers are formatted with to_chars straight
+// into the buffer, so nothing is allocated per value.
+class Utf8Writer {
+    FILE* file = nullptr;
+    std::string* memory = nullptr;
+    std::vector<char> buffer;
+    size_t used = 0;
+    bool failed = false;
+
+    bool Emit(const char* data, size_t size) {
+        if (memory) {
+            memory->append(data, size);
+            return true;
+        }
+        return fwrite(data, 1, size, file) == size;
+    }
+
+    char* Reserve(size_t size) {
+        if (used + size > buffer.size()) Flush();
+        return buffer.data() + used;
+    }
+
+public:
+    explicit Utf8Writer(FILE* target, size_t capacity = 64 * 1024) : file(target), buffer(capacity) {}
+    // Appends to `target` instead of writing to a file.
+    explicit Utf8Writer(std::string& target, size_t capacity = 16 * 1024) : memory(&target), buffer(capacity) {}
+    ~Utf8Writer() { Flush(); }
+
+    void Write(std::string_view text) {
+        if (text.size() > buffer.size()) {
+            Flush();
+            if (!Emit(text.data(), text.size())) failed = true;
+            return;
+        }
+        memcpy(Reserve(text.size()), text.data(), text.size());
+        used += text.size();
+    }
+
+    void Put(char c) {
+        *Reserve(1) = c;
+        used++;
+    }
+
+    void Int(long long number) {
+        char* start = Reserve(24);
+        used = (size_t)(std::to_chars(start, start + 24, number).ptr - buffer.data());
+    }
+
+    void Real(double number, int decimals) {
+        char* start = Reserve(64);
+        auto result = std::to_chars(start, start + 64, number, std::chars_format::fixed, decimals);
+        if (result.ec != std::errc())
+            result = std::to_chars(start, start + 64, number);
+        used = (size_t)(result.ptr - buffer.data());
+    }
+
+    // Returns false if anything written so far failed to reach the file.
+    bool Flush() {
+        if (used && !Emit(buffer.data(), used)) failed = true;
+        used = 0;
+        return !failed && (!file || fflush(file) == 0);
+    }
+};
+
+// Receives the report as it is produced. A section holds groups, objects
+// (one per WMI instance) and fields; fields may also stand alone.
+class Sink {
+public:
+    virtual ~Sink() {}
+    virtual void BeginReport() {}
+    virtual void EndReport() {}
+    virtual void BeginSection(std::string_view title) = 0;
+    virtual void EndSection() = 0;
+    virtual void Group(std::string_view name) = 0;
+    virtual void BeginObject() = 0;
+    virtual void EndObject() = 0;
+    virtual void Field(std::string_view label, const Value& value) = 0;
+    // Where `name` is installed, as a list of paths; a field by default.
+    virtual void Installed(std::string_view name, const Value& paths) { Field(name, paths); }
+    virtual void Note(std::string_view text) = 0;
+    virtual void Error(std::string_view text) = 0;
+};
+
+// The report as plain text, laid out as it always has been.
+class TextSink : public Sink {
+    Utf8Writer& out;
+
+public:
+    explicit TextSink(Utf8Writer& writer) : out(writer) {}
+
+    void BeginSection(std::string_view title) override {
+        out.Write("\n===== ");
+        out.Write(title);
+        out.Write(" =====\n\n");
+    }
+    void EndSection() override {}
+    void Group(std::string_view name) override {
+        out.Write("\n[");
+        out.Write(name);
+        out.Write("]\n");
+    }
+    void BeginObject() override {}
+    void EndObject() override { out.Put('\n'); }
+
+    void Field(std::string_view label, const Value& value) override {
+        out.Write(label);
+        out.Put(':');
+        switch (value.kind) {
+        case Value::Integer: out.Put(' '); out.Int(value.integer); break;
+        case Value::Real: out.Put(' '); out.Real(value.real, value.decimals); break;
+        case Value::String: out.Put(' '); out.Write(value.text); break;
+        case Value::List:
+            out.Put('\n');
+            for (const auto& item : value.items) {
+                out.Write("   ");
+                out.Write(item);
+                out.Put('\n');
+            }
+            return;
+        default: break;
+        }
+        out.Put('\n');
+    }
+    void Installed(std::string_view name, const Value& paths) override {
+        out.Write(name);
+        out.Write(" is installed at:\n");
+        for (const auto& path : paths.items) {
+            out.Write("   ");
+            out.Write(path);
+            out.Put('\n');
+        }
+    }
+
+    void Note(std::string_view text) override {
+        out.Write("Note: ");
+        out.Write(text);
+        out.Write("\n\n");
     }
+    void Error(std::string_view text) override {
+        out.Write(text);
+        out.Put('\n');
+    }
+};
 
-    IWbemClassObject* pclsObj = nullptr;
-    ULONG uReturn = 0;
-    while (pEnumerator->Next(WBEM_INFINITE, 1, &pclsObj, &uReturn) == S_OK) {
-        for (const auto& prop : properties) {
-            VARIANT vtProp;
-            VariantInit(&vtProp);
-            HRESULT hr = pclsObj->Get(prop.name, 0, &vtProp, 0, 0);
-            if (SUCCEEDED(hr)) {
-                std::wstring value;
-                if (prop.formatter) {
-                    value = prop.formatter(vtProp);
+// The report as one JSON document: {"report":[section...]}, a section being
+// {"section":title,"content":[...]} and content holding objects, groups
+// ({"group":name,"objects":[...]}), {"note":...} and {"error":...}.
+class JsonSink : public Sink {
+    Utf8Writer& out;
+    bool firstSection = true;
+    bool firstItem = true;    // in the current content or group
+    bool firstField = true;   // in the current object
+    bool inGroup = false;
+    bool inObject = false;
+
+    void String(std::string_view text) {
+        out.Put('"');
+        for (char c : text) {
+            switch (c) {
+            case '"': out.Write("\\\""); break;
+            case '\\': out.Write("\\\\"); break;
+            case '\n': out.Write("\\n"); break;
+            case '\r': out.Write("\\r"); break;
+            case '\t': out.Write("\\t"); break;
+            default:
+                if ((unsigned char)c < 0x20) {
+                    char escape[8];
+                    snprintf(escape, sizeof(escape), "\\u%04x", (unsigned)c);
+                    out.Write(escape);
                 } else {
-                    VARIANT vtCopy;
-                    VariantInit(&vtCopy);
-                    HRESULT hrConv = VariantChangeType(&vtCopy, &vtProp, 0, VT_BSTR);
-                    if (SUCCEEDED(hrConv)) {
-                        _bstr_t bstrVal(vtCopy.bstrVal, false);
-                        value = static_cast<const wchar_t*>(bstrVal);
-                    } else {
-                        value = L"[Conversion Error]";
-                    }
-                    VariantClear(&vtCopy);
+                    out.Put(c);
                 }
-                output << prop.displayName << L": " << value << L"\n";
             }
-            VariantClear(&vtProp);
         }
-        output << L"\n";
-        pclsObj->Release();
+        out.Put('"');
     }
-    pEnumerator->Release();
-}
 
-// SYSTEM SUMMARY
-void PrintSystemSummary(IWbemServices* pSvc, std::wstringstream& output) {
-    output << L"\n===== SYSTEM SUMMARY =====\n\n";
-
-    QueryWMI(pSvc, L"Win32_OperatingSystem", {
-        {L"Caption", L"OS Name", nullptr},
-        {L"Version", L"Version", nullptr},
-        {L"BuildNumber", L"Build", nullptr},
-        {L"OSArchitecture", L"Architecture", nullptr},
-        {L"SerialNumber", L"Serial", nullptr},
-        {L"InstallDate", L"Install Date", nullptr}
-    }, output);
-
-    QueryWMI(pSvc, L"Win32_BIOS", {
-        {L"Manufacturer", L"BIOS Vendor", nullptr},
-        {L"Name", L"BIOS Version", nullptr},
-        {L"ReleaseDate", L"Release Date", nullptr},
-        {L"SMBIOSBIOSVersion", L"SMBIOS Version", nullptr}
-    }, output);
-
-    QueryWMI(pSvc, L"Win32_ComputerSystem", {
-        {L"Manufacturer", L"System Manufacturer", nullptr},
-        {L"Model", L"System Model", nullptr},
-        {L"SystemType", L"System Type", nullptr},
-        {L"TotalPhysicalMemory", L"Total Physical Memory (GB)", FormatMemoryGB}
-    }, output);
+    void Item() {
+        if (!firstItem) out.Put(',');
+        firstItem = false;
+    }
+
+    // Back at section level, where the group was an item.
+    void CloseGroup() {
+        if (!inGroup) return;
+        out.Write("]}");
+        inGroup = false;
+        firstItem = false;
+    }
+
+public:
+    explicit JsonSink(Utf8Writer& writer) : out(writer) {}
+
+    void BeginReport() override { out.Write("{\"report\":["); }
+    void EndReport() override { out.Write("]}\n"); }
+
+    void BeginSection(std::string_view title) override {
+        if (!firstSection) out.Put(',');
+        firstSection = false;
+        out.Write("\n{\"section\":");
+        String(title);
+        out.Write(",\"content\":[");
+        firstItem = true;
+    }
+    void EndSection() override {
+        CloseGroup();
+        out.Write("]}");
+    }
+
+    void Group(std::string_view name) override {
+        CloseGroup();
+        Item();
+        out.Write("{\"group\":");
+        String(name);
+        out.Write(",\"objects\":[");
+        inGroup = true;
+        firstItem = true;
+    }
+
+    void BeginObject() override {
+        Item();
+        out.Put('{');
+        inObject = true;
+        firstField = true;
+    }
+    void EndObject() override {
+        out.Put('}');
+        inObject = false;
+    }
+
+    void Field(std::string_view label, const Value& value) override {
+        if (!inObject) {
+            Item();
+            out.Put('{');
+        } else if (!firstField) {
+            out.Put(',');
+        }
+        firstField = false;
+        String(label);
+        out.Put(':');
+        switch (value.kind) {
+        case Value::Integer: out.Int(value.integer); break;
+        case Value::Real: out.Real(value.real, value.decimals); break;
+        case Value::String: String(value.text); break;
+        case Value::List:
+            out.Put('[');
+            for (size_t i = 0; i < value.items.size(); i++) {
+                if (i) out.Put(',');
+                String(value.items[i]);
+            }
+            out.Put(']');
+            break;
+        default: out.Write("null"); break;
+        }
+        if (!inObject) out.Put('}');
+    }
+
+    void Note(std::string_view text) override {
+        Item();
+        out.Write("{\"note\":");
+        String(text);
+        out.Put('}');
+    }
+    void Error(std::string_view text) override {
+        Item();
+        out.Write("{\"error\":");
+        String(text);
+        out.Put('}');
+    }
+};
+
+// The compact binary form, appended to a string: one tag byte per event,
+// lengths and integers as LEB128 varints (integers zigzagged), reals as
+// 8 raw bytes and a digit count. Sections are collected into this form
+// concurrently, kept in the snapshot cache in it, and replayed into the
+// chosen sink in report order; a binary report is these bytes behind
+// REPORT_MAGIC.
+const char REPORT_MAGIC[8] = {'S', 'I', 'R', 'E', 'P', 'R', 'T', '1'};
+
+class BinarySink : public Sink {
+    std::string& out;
+
+    void Varint(unsigned long long number) {
+        while (number >= 0x80) {
+            out += (char)(number | 0x80);
+            number >>= 7;
+        }
+        out += (char)number;
+    }
+    void Bytes(std::string_view text) {
+        Varint(text.size());
+        out.append(text.data(), text.size());
+    }
+
+public:
+    explicit BinarySink(std::string& buffer) : out(buffer) {}
+
+    void BeginSection(std::string_view title) override {
+        out += 'S';
+        Bytes(title);
+    }
+    void EndSection() override { out += 's'; }
+    void Group(std::string_view name) override {
+        out += 'G';
+        Bytes(name);
+    }
+    void BeginObject() override { out += 'O'; }
+    void EndObject() override { out += 'o'; }
+
+    void Field(std::string_view label, const Value& value) override {
+        out += 'F';
+        Bytes(label);
+        out += (char)value.kind;
+        switch (value.kind) {
+        case Value::Integer:
+            Varint(((unsigned long long)value.integer << 1) ^ (unsigned long long)(value.integer >> 63));
+            break;
+        case Value::Real:
+            out.append((const char*)&value.real, sizeof(value.real));
+            out += (char)value.decimals;
+            break;
+        case Value::String: Bytes(value.text); break;
+        case Value::List:
+            Varint(value.items.size());
+            for (const auto& item : value.items) Bytes(item);
+            break;
+        default: break;
+        }
+    }
+    void Installed(std::string_view name, const Value& paths) override {
+        out += 'I';
+        Bytes(name);
+        Varint(paths.items.size());
+        for (const auto& path : paths.items) Bytes(path);
+    }
+
+    void Note(std::string_view text) override {
+        out += 'N';
+        Bytes(text);
+    }
+    void Error(std::string_view text) override {
+        out += 'E';
+        Bytes(text);
+    }
+};
+
+// Plays events recorded by BinarySink into `sink`. Returns false, having
+// stopped, at anything malformed.
+bool Replay(const std::string& data, Sink& sink) {
+    size_t pos = 0;
+    auto varint = [&](unsigned long long& number) {
+        number = 0;
+        for (int shift = 0; pos < data.size() && shift < 64; shift += 7) {
+            unsigned char byte = (unsigned char)data[pos++];
+            number |= (unsigned long long)(byte & 0x7F) << shift;
+            if (!(byte & 0x80)) return true;
+        }
+        return false;
+    };
+    auto bytes = [&](std::string_view& text) {
+        unsigned long long len;
+        if (!varint(len) || len > data.size() - pos) return false;
+        text = std::string_view(data.data() + pos, (size_t)len);
+        pos += (size_t)len;
+        return true;
+    };
+
+    Value value;
+    std::string_view text, label;
+    while (pos < data.size()) {
+        char tag = data[pos++];
+        switch (tag) {
+        case 'S': if (!bytes(text)) return false; sink.BeginSection(text); break;
+        case 's': sink.EndSection(); break;
+        case 'G': if (!bytes(text)) return false; sink.Group(text); break;
+        case 'O': sink.BeginObject(); break;
+        case 'o': sink.EndObject(); break;
+        case 'N': if (!bytes(text)) return false; sink.Note(text); break;
+        case 'E': if (!bytes(text)) return false; sink.Error(text); break;
+        case 'F': {
+            if (!bytes(label) || pos >= data.size()) return false;
+            value.Clear();
+            value.kind = (Value::Kind)data[pos++];
+            unsigned long long number;
+            switch (value.kind) {
+            case Value::Empty: break;
+            case Value::Integer:
+                if (!varint(number)) return false;
+                value.integer = (long long)(number >> 1) ^ -(long long)(number & 1);
+                break;
+            case Value::Real:
+                if (data.size() - pos < sizeof(double) + 1) return false;
+                memcpy(&value.real, data.data() + pos, sizeof(double));
+                value.decimals = data[pos + sizeof(double)];
+                pos += sizeof(double) + 1;
+                break;
+            case Value::String:
+                if (!bytes(text)) return false;
+                value.text.assign(text.data(), text.size());
+                break;
+            case Value::List:
+                if (!varint(number)) return false;
+                for (unsigned long long i = 0; i < number; i++) {
+                    if (!bytes(text)) return false;
+                    value.items.emplace_back(text);
+                }
+                break;
+            default: return false;
+            }
+            sink.Field(label, value);
+            break;
+        }
+        case 'I': {
+            unsigned long long count;
+            if (!bytes(label) || !varint(count)) return false;
+            value.Clear();
+            value.kind = Value::List;
+            for (unsigned long long i = 0; i < count; i++) {
+                if (!bytes(text)) return false;
+                value.items.emplace_back(text);
+            }
+            sink.Installed(label, value);
+            break;
+        }
+        default: return false;
+        }
+    }
+    return true;
 }
 
-// HARDWARE RESOURCES
-void PrintHardwareResources(IWbemServices* pSvc, std::wstringstream& output) {
-    output << L"\n===== HARDWARE RESOURCES =====\n\n";
+// REPORT SCHEMA
+// Every query the report makes is a constant table, checked at compile
+// time against the properties of its WMI class. Formatters are chosen by
+// an enum and dispatched with a switch, and rows live in fixed arrays, so
+// extracting a row allocates nothing before its values are formatted.
+
+enum class Format : unsigned char {
+    Plain,
+    MemoryGB,  // bytes shown as GB
+    CacheMB,   // KB shown as MB
+};
+
+struct WmiProperty {
+    const wchar_t* name;
+    const char* displayName;
+    Format format;
+};
+
+// Most properties one query may list; rows are arrays of this size.
+constexpr size_t MAX_PROPERTIES = 8;
+
+// A property table seen as a range.
+class PropertyList {
+    const WmiProperty* items;
+    size_t count;
+
+public:
+    template <size_t N>
+    constexpr PropertyList(const WmiProperty (&table)[N]) : items(table), count(N) {
+        static_assert(N <= MAX_PROPERTIES, "too many properties for one query");
+    }
+    constexpr size_t size() const { return count; }
+    constexpr const WmiProperty& operator[](size_t i) const { return items[i]; }
+    constexpr const WmiProperty* begin() const { return items; }
+    constexpr const WmiProperty* end() const { return items + count; }
+};
 
-    QueryWMI(pSvc, L"Win32_PhysicalMemory", {
-        {L"Capacity", L"Memory Capacity (GB)", FormatMemoryGB},
-        {L"Speed", L"Speed (MHz)", nullptr},
-        {L"Manufacturer", L"Manufacturer", nullptr}
-    }, output, L"Memory Devices");
+// A WMI class and the properties of it that a query may ask for.
+struct WmiClass {
+    const wchar_t* name;
+    const wchar_t* const* properties;
+    size_t count;
+};
 
-    QueryWMI(pSvc, L"Win32_Processor", {
-        {L"Name", L"Processor", nullptr},
-        {L"NumberOfCores", L"Cores", nullptr},
-        {L"NumberOfLogicalProcessors", L"Logical Processors", nullptr},
-        {L"MaxClockSpeed", L"Max Speed (MHz)", nullptr},
-        {L"L2CacheSize", L"L2 Cache (MB)", FormatCacheMB},
-        {L"L3CacheSize", L"L3 Cache (MB)", FormatCacheMB}
-    }, output, L"Processor Details");
+template <size_t N>
+constexpr WmiClass DeclareClass(const wchar_t* name, const wchar_t* const (&properties)[N]) {
+    return WmiClass{name, properties, N};
 }
 
-// COMPONENTS
-void PrintComponents(IWbemServices* pSvc, std::wstringstream& output) {
-    output << L"\n===== COMPONENTS =====\n\n";
+// From the CIMV2 schema; only the properties of interest are listed.
+constexpr const wchar_t* OPERATING_SYSTEM_PROPERTIES[] = {
+    L"BuildNumber", L"Caption", L"InstallDate", L"LastBootUpTime", L"OSArchitecture", L"SerialNumber",
+    L"Version"};
+constexpr const wchar_t* BIOS_PROPERTIES[] = {
+    L"Manufacturer", L"Name", L"ReleaseDate", L"SerialNumber", L"SMBIOSBIOSVersion", L"Version"};
+constexpr const wchar_t* COMPUTER_SYSTEM_PROPERTIES[] = {
+    L"Manufacturer", L"Model", L"Name", L"SystemType", L"TotalPhysicalMemory"};
+constexpr const wchar_t* PHYSICAL_MEMORY_PROPERTIES[] = {
+    L"BankLabel", L"Capacity", L"ConfiguredClockSpeed", L"DeviceLocator", L"Manufacturer", L"PartNumber",
+    L"Speed"};
+constexpr const wchar_t* PROCESSOR_PROPERTIES[] = {
+    L"L2CacheSize", L"L3CacheSize", L"MaxClockSpeed", L"Name", L"NumberOfCores", L"NumberOfLogicalProcessors"};
+constexpr const wchar_t* VIDEO_CONTROLLER_PROPERTIES[] = {
+    L"AdapterRAM", L"DriverVersion", L"Name", L"VideoModeDescription", L"VideoProcessor"};
+constexpr const wchar_t* DISK_DRIVE_PROPERTIES[] = {
+    L"InterfaceType", L"MediaType", L"Model", L"SerialNumber", L"Size"};
+constexpr const wchar_t* QUICK_FIX_PROPERTIES[] = {
+    L"Description", L"HotFixID", L"InstalledBy", L"InstalledOn"};
+constexpr const wchar_t* NETWORK_ADAPTER_CONFIGURATION_PROPERTIES[] = {
+    L"DefaultIPGateway", L"Description", L"DHCPEnabled", L"IPAddress", L"IPEnabled", L"MACAddress"};
 
-    QueryWMI(pSvc, L"Win32_VideoController", {
-        {L"Name", L"Adapter", nullptr},
-        {L"AdapterRAM", L"VRAM (GB)", FormatMemoryGB},
-        {L"DriverVersion", L"Driver Version", nullptr},
-        {L"VideoProcessor", L"GPU Chip", nullptr}
-    }, output, L"Display");
+constexpr WmiClass WIN32_OPERATING_SYSTEM = DeclareClass(L"Win32_OperatingSystem", OPERATING_SYSTEM_PROPERTIES);
+constexpr WmiClass WIN32_BIOS = DeclareClass(L"Win32_BIOS", BIOS_PROPERTIES);
+constexpr WmiClass WIN32_COMPUTER_SYSTEM = DeclareClass(L"Win32_ComputerSystem", COMPUTER_SYSTEM_PROPERTIES);
+constexpr WmiClass WIN32_PHYSICAL_MEMORY = DeclareClass(L"Win32_PhysicalMemory", PHYSICAL_MEMORY_PROPERTIES);
+constexpr WmiClass WIN32_PROCESSOR = DeclareClass(L"Win32_Processor", PROCESSOR_PROPERTIES);
+constexpr WmiClass WIN32_VIDEO_CONTROLLER = DeclareClass(L"Win32_VideoController", VIDEO_CONTROLLER_PROPERTIES);
+constexpr WmiClass WIN32_DISK_DRIVE = DeclareClass(L"Win32_DiskDrive", DISK_DRIVE_PROPERTIES);
+constexpr WmiClass WIN32_QUICK_FIX_ENGINEERING = DeclareClass(L"Win32_QuickFixEngineering", QUICK_FIX_PROPERTIES);
+constexpr WmiClass WIN32_NETWORK_ADAPTER_CONFIGURATION =
+    DeclareClass(L"Win32_NetworkAdapterConfiguration", NETWORK_ADAPTER_CONFIGURATION_PROPERTIES);
 
-    QueryWMI(pSvc, L"Win32_DiskDrive", {
-        {L"Model", L"Disk Model", nullptr},
-        {L"Size", L"Capacity (GB)", FormatMemoryGB},
-        {L"InterfaceType", L"Interface", nullptr}
-    }, output, L"Storage");
+// One query of a section: which class, which properties, under which
+// heading and filter.
+struct WmiQuery {
+    const WmiClass* cls;
+    PropertyList properties;
+    const char* group;          // or null
+    const wchar_t* condition;   // WQL WHERE clause, or null
+};
+
+constexpr bool SameName(const wchar_t* a, const wchar_t* b) {
+    while (*a && *a == *b) {
+        a++;
+        b++;
+    }
+    return *a == *b;
 }
 
-// SOFTWARE ENVIRONMENT
-void PrintSoftwareEnvironment(IWbemServices* pSvc, std::wstringstream& output) {
-    output << L"\n===== SOFTWARE ENVIRONMENT =====\n\n";
+constexpr bool Declares(const WmiClass& cls, const wchar_t* name) {
+    for (size_t i = 0; i < cls.count; i++) {
+        if (SameName(cls.properties[i], name)) return true;
+    }
+    return false;
+}
 
-    QueryWMI(pSvc, L"Win32_QuickFixEngineering", {
-        {L"HotFixID", L"Update", nullptr},
-        {L"InstalledOn", L"Install Date", nullptr},
-        {L"Description", L"Description", nullptr}
-    }, output, L"Windows Updates");
+// True when every property asked for exists in its class.
+template <size_t N>
+constexpr bool Valid(const WmiQuery (&queries)[N]) {
+    for (const auto& query : queries) {
+        for (const auto& property : query.properties) {
+            if (!Declares(*query.cls, property.name)) return false;
+        }
+    }
+    return true;
+}
 
-    QueryWMI(pSvc, L"Win32_NetworkAdapterConfiguration", {
-        {L"Description", L"Adapter", nullptr},
-        {L"IPAddress", L"IP Address", nullptr},
-        {L"MACAddress", L"MAC", nullptr}
-    }, output, L"Network", L"IPEnabled = TRUE");
+// Applies the property's formatter; Plain values pass through uncopied.
+inline void EmitField(Sink& out, const WmiProperty& property, const Value& value) {
+    switch (property.format) {
+    case Format::MemoryGB:
+        out.Field(property.displayName, Value::FromReal(value.AsDouble() / (1024.0 * 1024.0 * 1024.0), 1));
+        break;
+    case Format::CacheMB:
+        out.Field(property.displayName, Value::FromReal(value.AsDouble() / 1024.0, 1));
+        break;
+    case Format::Plain:
+        out.Field(property.displayName, value);
+        break;
+    }
 }
 
-// LOCALE AND ENCODING
-void PrintLocaleAndEncoding(std::wstringstream& output) {
-    output << L"\n===== LOCALE AND ENCODING =====\n\n";
-    wchar_t localeName[85];
-    if (GetUserDefaultLocaleName(localeName, 85))
-        output << L"System Locale: " << localeName << L"\n";
-    else
-        output << L"System Locale: unknown\n";
+// A row handler passed down to a provider. Refers to the caller's lambda
+// instead of copying it, so unlike std::function it never allocates.
+class RowFunction {
+    const void* target;
+    void (*invoke)(const void*, const Value*);
 
-    UINT cp = GetACP();
-    output << L"Default Encoding: Code Page " << cp << L"\n";
+public:
+    template <typename F>
+    RowFunction(const F& f)
+        : target(&f), invoke([](const void* t, const Value* values) { (*(const F*)t)(values); }) {}
+    void operator()(const Value* values) const { invoke(target, values); }
+};
+
+// When collection has to give up: a point in time (the end of the
+// report's budget, or never) and how long any one query or blocking call
+// may take before it. Whatever is cut short calls Miss, so the section is
+// known to be partial.
+class Deadline {
+    std::chrono::steady_clock::time_point at;
+    std::chrono::milliseconds step;  // 0: no limit per step
+    bool missed = false;
+
+public:
+    explicit Deadline(std::chrono::steady_clock::time_point end = std::chrono::steady_clock::time_point::max(),
+                      std::chrono::milliseconds stepLimit = std::chrono::milliseconds(0))
+        : at(end), step(stepLimit) {}
+
+    // The deadline for one step: the step limit from now, if that comes
+    // first.
+    Deadline Step() const {
+        auto now = std::chrono::steady_clock::now();
+        if (step.count() > 0 && at - now > step) return Deadline(now + step, step);
+        return Deadline(at, step);
+    }
+
+    bool Expired() const { return std::chrono::steady_clock::now() >= at; }
+
+    // Milliseconds left, rounded up, and at most `cap`.
+    long long Remaining(long long cap) const {
+        auto now = std::chrono::steady_clock::now();
+        if (now >= at) return 0;
+        if (at - now > std::chrono::milliseconds(cap)) return cap;
+        return std::chrono::duration_cast<std::chrono::milliseconds>(at - now).count() + 1;
+    }
+
+    void Miss() { missed = true; }
+    bool Missed() const { return missed; }
+};
+
+// HRESULT_FROM_WIN32(ERROR_TIMEOUT): a query ran out of time.
+const HRESULT TIMED_OUT = (HRESULT)(int32_t)0x800705B4u;
+
+// Work abandoned by RunWithin and still running somewhere. While there is
+// any, main ends the process without running destructors.
+std::atomic<int> abandonedWork{0};
+
+// Runs `work` on a thread of its own and waits for it until `deadline`,
+// for blocking calls nothing can interrupt, such as listing a network
+// share that went away. Work that overruns is left to finish in the
+// background, so it must own what it touches (capture by value); false
+// then, with `result` untouched.
+template <typename T, typename F>
+bool RunWithin(const Deadline& deadline, F work, T& result) {
+    struct State {
+        std::mutex lock;
+        std::condition_variable done;
+        bool finished = false;
+        T result;
+    };
+    auto state = std::make_shared<State>();
+    std::thread([state, work]() mutable {
+        T value = work();
+        std::lock_guard<std::mutex> guard(state->lock);
+        state->result = std::move(value);
+        state->finished = true;
+        state->done.notify_all();
+    }).detach();
+    std::unique_lock<std::mutex> guard(state->lock);
+    while (!state->finished) {
+        long long left = deadline.Remaining(1000);
+        if (left == 0) {
+            abandonedWork++;
+            return false;
+        }
+        state->done.wait_for(guard, std::chrono::milliseconds(left));
+    }
+    result = std::move(state->result);
+    return true;
 }
 
-// Execute where.exe to locate executables, redirecting error output to nul
-std::vector<std::wstring> ExecuteWhere(const std::wstring& exe) {
-    std::vector<std::wstring> paths;
-    std::wstring cmd = L"where.exe " + exe + L" 2>nul";
-    FILE* pipe = _wpopen(cmd.c_str(), L"rt");
-    if (pipe) {
-        wchar_t buffer[512];
-        while (fgetws(buffer, 512, pipe)) {
-            std::wstring line(buffer);
-            line.erase(std::remove(line.begin(), line.end(), L'\n'), line.end());
-            line.erase(std::remove(line.begin(), line.end(), L'\r'), line.end());
-            if (!line.empty())
-                paths.push_back(line);
+// Where section data comes from. Query calls `row` once per object with
+// the requested properties in order; a property the object does not have
+// is Empty. A query still running at `deadline` stops and returns
+// TIMED_OUT, possibly after some rows.
+class Provider {
+public:
+    virtual ~Provider() {}
+    virtual HRESULT Query(std::wstring_view className, PropertyList properties, std::wstring_view condition,
+                          RowFunction row, const Deadline& deadline) = 0;
+};
+
+// How queries are issued. The defaults are what the report uses;
+// --bench-queries compares them with SELECT * fetched one object at a time.
+struct QueryPlan {
+    bool project = true;  // SELECT only the listed properties
+    ULONG batch = 64;     // objects per Next call, at most MAX_BATCH
+    bool handles = true;  // resolve properties once per class, not per row
+};
+
+constexpr ULONG MAX_BATCH = 64;
+
+std::wstring BuildQuery(std::wstring_view className, PropertyList properties, std::wstring_view condition,
+                        bool project) {
+    std::wstring query = L"SELECT ";
+    if (project && properties.size() > 0) {
+        for (size_t i = 0; i < properties.size(); i++) {
+            if (i) query += L", ";
+            query += properties[i].name;
         }
-        _pclose(pipe);
+    } else {
+        query += L"*";
     }
-    return paths;
+    query += L" FROM ";
+    query += className;
+    if (!condition.empty()) {
+        query += L" WHERE ";
+        query += condition;
+    }
+    return query;
 }
 
-// INSTALLED PROGRAMMING LANGUAGES (Enhanced list)
-void PrintInstalledLanguages(std::wstringstream& output) {
-    output << L"\n===== INSTALLED PROGRAMMING LANGUAGES =====\n\n";
-    output << L"Note: Detection requires language executables to be in the system's PATH.\n\n";
-
-    const std::vector<std::pair<std::wstring, std::vector<std::wstring>>> languages = {
-        {L"C", {L"cl.exe", L"gcc.exe", L"clang.exe"}},
-        {L"C++", {L"cl.exe", L"g++.exe", L"clang++.exe"}},
-        {L"C#", {L"csc.exe", L"dotnet.exe"}},
-        {L"D", {L"dmd.exe", L"ldc2.exe", L"gdc.exe"}},
-        {L"Java", {L"java.exe", L"javac.exe"}},
-        {L"Kotlin", {L"kotlinc.exe", L"kotlinc-jvm.exe", L"kotlin.bat"}},
-        {L"Scala", {L"scala.exe", L"scalac.exe"}},
-        {L"Go", {L"go.exe"}},
-        {L"Rust", {L"rustc.exe", L"cargo.exe"}},
-        {L"Swift", {L"swift.exe", L"swiftc.exe"}},
-        {L"F#", {L"fsc.exe", L"fsi.exe", L"dotnet.exe"}},
-        {L"Fortran", {L"gfortran.exe", L"ifort.exe"}},
-        {L"Pascal", {L"fpc.exe", L"ppc386.exe", L"ppcx64.exe"}},
-        {L"Delphi", {L"dcc32.exe", L"dcc64.exe", L"bds.exe"}},
-        {L"Ada", {L"gnat.exe", L"gcc.exe"}},
-        {L"Objective-C", {L"gcc.exe", L"clang.exe"}},
-        {L"Zig", {L"zig.exe"}},
-        {L"Nim", {L"nim.exe", L"nimble.exe"}},
-        {L"Python", {L"python.exe", L"python3.exe", L"pypy.exe", L"pypy3.exe", L"py.exe"}},
-        {L"Perl", {L"perl.exe"}},
-        {L"PHP", {L"php.exe", L"php-cgi.exe"}},
-        {L"Ruby", {L"ruby.exe", L"irb.exe"}},
-        {L"Node.js", {L"node.exe"}},
-        {L"TypeScript", {L"tsc.exe", L"ts-node.exe"}},
-        {L"R", {L"R.exe", L"Rscript.exe"}},
-        {L"Lua", {L"lua.exe", L"luajit.exe"}},
-        {L"Tcl", {L"tclsh.exe", L"tclsh86.exe", L"tclsh8.6.exe"}},
-        {L"Julia", {L"julia.exe"}},
-        {L"Raku", {L"raku.exe", L"perl6.exe"}},
-        {L"Groovy", {L"groovy.exe", L"groovyc.exe", L"grape.exe"}},
-        {L"Haskell (GHC)", {L"ghc.exe", L"ghci.exe", L"runghc.exe"}},
-        {L"OCaml", {L"ocaml.exe", L"ocamlc.exe", L"ocamlopt.exe", L"ocamldebug.exe"}},
-        {L"Erlang", {L"erl.exe", L"erlc.exe"}},
-        {L"Elixir", {L"elixir.exe", L"iex.exe", L"mix.exe"}},
-        {L"Lisp (SBCL)", {L"sbcl.exe"}},
-        {L"Lisp (CLISP)", {L"clisp.exe"}},
-        {L"Clojure", {L"clojure.exe", L"clj.exe"}},
-        {L"Scheme", {L"guile.exe", L"mit-scheme.exe", L"racket.exe", L"chicken.exe"}},
-        {L"JRuby", {L"jruby.exe"}},
-        {L"Jython", {L"jython.exe"}},
-        {L"Emscripten (C/C++)", {L"emcc.bat", L"em++.bat", L"emcc", L"em++"}},
-        {L"AssemblyScript", {L"asc.cmd", L"asc"}},
-        {L"MATLAB", {L"matlab.exe"}},
-        {L"Octave", {L"octave-cli.exe", L"octave.exe"}},
-        {L"Prolog (SWI-Prolog)", {L"swipl.exe", L"swipl-win.exe"}},
-        {L"Visual Basic .NET", {L"vbc.exe"}},
-        {L"PowerShell", {L"powershell.exe", L"pwsh.exe"}}
+#ifdef _WIN32
+class WmiProvider : public Provider {
+    IWbemServices* pSvc;
+    QueryPlan plan;
+
+    // A property resolved through IWbemObjectAccess. Integers and strings
+    // are read by handle; anything else (arrays, booleans) by name.
+    struct Column {
+        long handle = -1;
+        CIMTYPE type = 0;
     };
 
-    for (const auto& lang : languages) {
-        std::vector<std::wstring> found;
-        for (const auto& exe : lang.second) {
-            auto paths = ExecuteWhere(exe);
-            found.insert(found.end(), paths.begin(), paths.end());
+    static void Resolve(IWbemObjectAccess* access, PropertyList properties, Column* columns) {
+        for (size_t i = 0; i < properties.size(); i++) {
+            if (FAILED(access->GetPropertyHandle(properties[i].name, &columns[i].type, &columns[i].handle)))
+                columns[i].handle = -1;
+        }
+    }
+
+    // Converts what Get returns; arrays of strings (IPAddress) become lists.
+    static void FromVariant(const VARIANT& v, Value& value) {
+        switch (v.vt) {
+        case VT_I1: value = Value::FromInt(v.cVal); break;
+        case VT_I2: value = Value::FromInt(v.iVal); break;
+        case VT_I4: value = Value::FromInt(v.lVal); break;
+        case VT_I8: value = Value::FromInt(v.llVal); break;
+        case VT_UI1: value = Value::FromInt(v.bVal); break;
+        case VT_UI2: value = Value::FromInt(v.uiVal); break;
+        case VT_UI4: value = Value::FromInt(v.ulVal); break;
+        case VT_UI8: value = Value::FromInt((long long)v.ullVal); break;
+        case VT_R4: value = Value::FromReal(v.fltVal, 2); break;
+        case VT_R8: value = Value::FromReal(v.dblVal, 2); break;
+        case VT_BOOL: value = Value::FromString(v.boolVal ? "True" : "False"); break;
+        case VT_BSTR:
+            value.kind = Value::String;
+            AppendUtf8(value.text, v.bstrVal, SysStringLen(v.bstrVal));
+            break;
+        case VT_ARRAY | VT_BSTR: {
+            LONG lower, upper;
+            BSTR* items;
+            if (FAILED(SafeArrayGetLBound(v.parray, 1, &lower)) || FAILED(SafeArrayGetUBound(v.parray, 1, &upper)) ||
+                FAILED(SafeArrayAccessData(v.parray, (void**)&items)))
+                break;
+            value.kind = Value::List;
+            for (LONG i = 0; i <= upper - lower; i++) {
+                value.items.emplace_back();
+                AppendUtf8(value.items.back(), items[i], SysStringLen(items[i]));
+            }
+            SafeArrayUnaccessData(v.parray);
+            break;
         }
-        if (!found.empty()) {
-            output << lang.first << L" is installed at:\n";
-            for (const auto& path : found)
-                output << L"   " << path << L"\n";
-            output << L"\n";
+        default: break;
         }
     }
-}
 
-int main() {
-    ComInitializer comInit;
-    if (!comInit.IsOK()) {
-        std::wcerr << L"COM initialization failed!\n";
-        return 1;
+    static void Read(IWbemClassObject* object, IWbemObjectAccess* access, const WmiProperty& property,
+                     const Column& column, std::vector<BYTE>& buffer, Value& value) {
+        value.Clear();
+        if (access && column.handle != -1) {
+            switch (column.type) {
+            case CIM_SINT8: case CIM_UINT8: case CIM_SINT16: case CIM_UINT16: case CIM_SINT32: case CIM_UINT32: {
+                DWORD number;
+                if (access->ReadDWORD(column.handle, &number) == WBEM_S_NO_ERROR) {
+                    value.kind = Value::Integer;
+                    value.integer = column.type == CIM_UINT32 || column.type == CIM_UINT16 ||
+                                            column.type == CIM_UINT8
+                                        ? (long long)number : (long long)(LONG)number;
+                }
+                return;
+            }
+            case CIM_SINT64: case CIM_UINT64: {
+                ULONGLONG number;
+                if (access->ReadQWORD(column.handle, &number) == WBEM_S_NO_ERROR) {
+                    value.kind = Value::Integer;
+                    value.integer = (long long)number;
+                }
+                return;
+            }
+            case CIM_STRING: case CIM_DATETIME: {
+                long size = 0;
+                HRESULT hr = access->ReadPropertyValue(column.handle, (long)buffer.size(), &size, buffer.data());
+                if (hr == WBEM_E_BUFFER_TOO_SMALL) {
+                    buffer.resize((size_t)size);
+                    hr = access->ReadPropertyValue(column.handle, (long)buffer.size(), &size, buffer.data());
+                }
+                if (hr == WBEM_S_NO_ERROR && size >= (long)sizeof(wchar_t)) {
+                    value.kind = Value::String;
+                    const wchar_t* text = (const wchar_t*)buffer.data();
+                    AppendUtf8(value.text, text, wcsnlen(text, (size_t)size / sizeof(wchar_t)));
+                }
+                return;
+            }
+            }
+        }
+        VARIANT v;
+        VariantInit(&v);
+        if (SUCCEEDED(object->Get(property.name, 0, &v, 0, 0)))
+            FromVariant(v, value);
+        VariantClear(&v);
     }
 
-    WmiConnection wmi;
-    if (!wmi.IsConnected()) {
-        std::wcerr << L"WMI connection failed!\n";
-        return 1;
+public:
+    explicit WmiProvider(IWbemServices* services, QueryPlan queryPlan = QueryPlan())
+        : pSvc(services), plan(queryPlan) {}
+
+    HRESULT Query(std::wstring_view className, PropertyList properties, std::wstring_view condition,
+                  RowFunction row, const Deadline& deadline) override {
+        std::wstring query = BuildQuery(className, properties, condition, plan.project);
+
+        IEnumWbemClassObject* pEnumerator = nullptr;
+        HRESULT hres = pSvc->ExecQuery(
+            bstr_t(L"WQL"),
+            bstr_t(query.c_str()),
+            WBEM_FLAG_FORWARD_ONLY | WBEM_FLAG_RETURN_IMMEDIATELY,
+            NULL,
+            &pEnumerator
+        );
+        if (FAILED(hres))
+            return hres;
+
+        // Every object of one query has the same layout, so the handles
+        // taken from the first object serve for the rest.
+        std::array<Value, MAX_PROPERTIES> values;
+        std::array<IWbemClassObject*, MAX_BATCH> objects;
+        std::array<Column, MAX_PROPERTIES> columns;
+        thread_local std::vector<BYTE> buffer(256);
+        bool resolved = false;
+        ULONG batch = std::min<ULONG>(std::max<ULONG>(plan.batch, 1), MAX_BATCH);
+        ULONG uReturn = 0;
+        // Semisynchronous: Next waits a bounded time and says WBEM_S_TIMEDOUT
+        // when the batch is not complete yet. Releasing the enumerator
+        // cancels the call on the provider's side.
+        for (;;) {
+            long wait = (long)deadline.Remaining(LONG_MAX);
+            if (wait == 0) {
+                hres = TIMED_OUT;
+                break;
+            }
+            HRESULT next = pEnumerator->Next(wait, batch, objects.data(), &uReturn);
+            if (FAILED(next)) {
+                // The rows already passed on stay, followed by the error.
+                hres = next;
+                break;
+            }
+            for (ULONG n = 0; n < uReturn; n++) {
+                IWbemObjectAccess* access = nullptr;
+                if (plan.handles &&
+                    FAILED(objects[n]->QueryInterface(IID_IWbemObjectAccess, (void**)&access)))
+                    access = nullptr;
+                if (access && !resolved) {
+                    Resolve(access, properties, columns.data());
+                    resolved = true;
+                }
+                for (size_t i = 0; i < properties.size(); i++)
+                    Read(objects[n], access, properties[i], columns[i], buffer, values[i]);
+                row(values.data());
+                if (access) access->Release();
+                objects[n]->Release();
+            }
+            if (next == WBEM_S_FALSE || (next == WBEM_S_NO_ERROR && uReturn == 0)) break;
+        }
+        pEnumerator->Release();
+        return hres;
+    }
+};
+#endif
+
+// Stand-in for a real provider: every query waits `latency` and returns one
+// object whose properties are all the same number. Lets the collection
+// pipeline be timed anywhere, without WMI.
+class SimulatedProvider : public Provider {
+    std::chrono::milliseconds latency;
+public:
+    explicit SimulatedProvider(int latencyMs) : latency(latencyMs) {}
+
+    HRESULT Query(std::wstring_view, PropertyList properties, std::wstring_view, RowFunction row,
+                  const Deadline& deadline) override {
+        if (deadline.Remaining(latency.count() + 1) <= latency.count()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(deadline.Remaining(latency.count())));
+            return TIMED_OUT;
+        }
+        std::this_thread::sleep_for(latency);
+        std::array<Value, MAX_PROPERTIES> values;
+        for (size_t i = 0; i < properties.size(); i++) values[i] = Value::FromInt(8LL << 30);
+        row(values.data());
+        return S_OK;
     }
+};
 
-    std::wstringstream output;
-
-    PrintSystemSummary(wmi.operator->(), output);
-    PrintHardwareResources(wmi.operator->(), output);
-    PrintComponents(wmi.operator->(), output);
-    PrintSoftwareEnvironment(wmi.operator->(), output);
-    PrintLocaleAndEncoding(output);
-    PrintInstalledLanguages(output);
-
-    HANDLE hFile = CreateFileW(L"system_info.txt", GENERIC_WRITE, 0, NULL,
-                               CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
-    if (hFile != INVALID_HANDLE_VALUE) {
-        std::wstring data = output.str();
-        DWORD written;
-        // Write UTF-16 LE BOM (optional)
-        const wchar_t BOM = 0xFEFF;
-        WriteFile(hFile, &BOM, sizeof(BOM), &written, NULL);
-        // Write content
-        WriteFile(hFile, data.c_str(), (DWORD)(data.size() * sizeof(wchar_t)), &written, NULL);
-        CloseHandle(hFile);
-        std::wcout << L"File written to system_info.txt\n";
-    } else {
-        std::wcout << L"Error creating file: " << GetLastError() << L"\n";
+// In-memory model of a WMI class for --bench-queries. Every Next call
+// costs one simulated round trip; every object carries a copy of each
+// selected property, as WMI marshals them, out of a class `width`
+// properties wide; reading a property by name scans the object's list,
+// by handle indexes it.
+class FakeWmiProvider : public Provider {
+    QueryPlan plan;
+    int rows;
+    int width;
+    std::chrono::microseconds roundTrip;
+
+public:
+    ULONGLONG roundTrips = 0;
+    ULONGLONG rowsReturned = 0;
+    ULONGLONG propertiesCopied = 0;
+
+    FakeWmiProvider(QueryPlan queryPlan, int rowCount, int classWidth, int roundTripUs)
+        : plan(queryPlan), rows(rowCount), width(classWidth), roundTrip(roundTripUs) {}
+
+    HRESULT Query(std::wstring_view, PropertyList properties, std::wstring_view, RowFunction row,
+                  const Deadline& deadline) override {
+        // Columns the server sends: the projection, or the whole class with
+        // the wanted properties spread through it.
+        std::vector<std::wstring> names;
+        if (plan.project) {
+            for (const auto& prop : properties) names.push_back(prop.name);
+        } else {
+            for (int c = 0; c < width; c++) names.push_back(L"Property" + std::to_wstring(c));
+            for (size_t i = 0; i < properties.size(); i++)
+                names[(i * 7 + 3) % names.size()] = properties[i].name;
+        }
+
+        typedef std::vector<std::pair<std::wstring, std::wstring>> Object;
+        std::vector<Object> batch;
+        std::vector<size_t> handles;
+        std::array<Value, MAX_PROPERTIES> values;
+        ULONG batchSize = plan.batch ? plan.batch : 1;
+        for (int done = 0; done < rows;) {
+            if (deadline.Expired()) return TIMED_OUT;
+            auto until = std::chrono::steady_clock::now() + roundTrip;
+            while (std::chrono::steady_clock::now() < until) {}
+            roundTrips++;
+
+            int count = std::min<int>((int)batchSize, rows - done);
+            batch.assign(count, Object());
+            for (auto& object : batch) {
+                for (const auto& name : names) object.emplace_back(name, L"Value of " + name);
+                propertiesCopied += names.size();
+            }
+            for (const auto& object : batch) {
+                if (!plan.handles || handles.empty()) {
+                    handles.clear();
+                    for (const auto& prop : properties) {
+                        size_t c = 0;
+                        while (c < object.size() && object[c].first != prop.name) c++;
+                        handles.push_back(c);
+                    }
+                }
+                for (size_t i = 0; i < properties.size(); i++) {
+                    values[i].Clear();
+                    if (handles[i] < object.size()) {
+                        const std::wstring& text = object[handles[i]].second;
+                        values[i].kind = Value::String;
+                        AppendUtf8(values[i].text, text.data(), text.size());
+                    }
+                }
+                row(values.data());
+            }
+            done += count;
+            rowsReturned += count;
+        }
+        return S_OK;
     }
+};
 
-    return 0;
-}
\ No newline at end of file
+#ifndef _WIN32
+// Reads a /proc, /sys or /etc file whole, with one pread for anything up to
+// 64 KB. Empty if the file is missing or unreadable.
+std::string ReadSysFile(const std::string& path) {
+    std::string data;
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return data;
+    size_t size = 0;
+    data.resize(65536);
+    for (;;) {
+        ssize_t got = pread(fd, &data[size], data.size() - size, (off_t)size);
+        if (got <= 0) break;
+        size += (size_t)got;
+        if (size < data.size()) break;
+        data.resize(data.size() * 2);
+    }
+    close(fd);
+    data.resize(size);
+    return data;
+}
+
+// First line of a sysfs attribute, without the newline.
+std::string ReadSysValue(const std::string& path) {
+    std::string data = ReadSysFile(path);
+    return data.substr(0, data.find('\n'));
+}
+
+// Value of `key` in text made of "key<separator>value" lines.
+std::string FindKey(const std::string& text, const std::string& key, char separator) {
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t end = text.find('\n', pos);
+        if (end == std::string::npos) end = text.size();
+        size_t sep = text.find(separator, pos);
+        if (sep < end) {
+            size_t nameEnd = sep;
+            while (nameEnd > pos && (text[nameEnd - 1] == ' ' || text[nameEnd - 1] == '\t')) nameEnd--;
+            if (text.compare(pos, nameEnd - pos, key) == 0) {
+                size_t value = text.find_first_not_of(" \t", sep + 1);
+                if (value == std::string::npos || value > end) return "";
+                std::string result = text.substr(value, end - value);
+                if (result.size() >= 2 && result.front() == '"' && result.back() == '"')
+                    result = result.substr(1, result.size() - 2);
+                return result;
+            }
+        }
+        pos = end + 1;
+    }
+    return "";
+}
+
+std::vector<std::string> ListDirectory(const std::string& path) {
+    std::vector<std::string> names;
+    DIR* dir = opendir(path.c_str());
+    if (!dir) return names;
+    while (struct dirent* entry = readdir(dir)) {
+        if (entry->d_name[0] != '.') names.push_back(entry->d_name);
+    }
+    closedir(dir);
+    std::sort(names.begin(), names.end());
+    return names;
+}
+
+// Answers the WMI classes the report asks for from procfs, sysfs, SMBIOS
+// and cpuid, so the tool runs natively on Linux without starting any
+// process. Values keep WMI's units (bytes, KB for caches, MHz).
+class LinuxProvider : public Provider {
+    typedef std::unordered_map<std::wstring, Value> Record;
+
+    static void Set(Record& record, const wchar_t* name, const std::string& text) {
+        if (!text.empty()) record[name] = Value::FromString(text);
+    }
+    static void Set(Record& record, const wchar_t* name, ULONGLONG number) {
+        if (number) record[name] = Value::FromInt((long long)number);
+    }
+
+    static std::string Machine() {
+        struct utsname names;
+        return uname(&names) == 0 ? names.machine : "";
+    }
+
+    std::vector<Record> OperatingSystem() {
+        Record os;
+        std::string release = ReadSysFile("/etc/os-release");
+        if (release.empty()) release = ReadSysFile("/usr/lib/os-release");
+        std::string name = FindKey(release, "PRETTY_NAME", '=');
+        Set(os, L"Caption", name.empty() ? std::string("Linux") : name);
+        Set(os, L"Version", ReadSysValue("/proc/sys/kernel/osrelease"));
+        Set(os, L"BuildNumber", ReadSysValue("/proc/sys/kernel/version"));
+        std::string machine = Machine();
+        Set(os, L"OSArchitecture", machine == "x86_64" || machine == "aarch64" ? "64-bit" : machine);
+        Set(os, L"SerialNumber", ReadSysValue("/etc/machine-id"));
+        return {os};
+    }
+
+    std::vector<Record> Bios() {
+        Record bios;
+        Set(bios, L"Manufacturer", ReadSysValue("/sys/class/dmi/id/bios_vendor"));
+        Set(bios, L"Name", ReadSysValue("/sys/class/dmi/id/bios_version"));
+        Set(bios, L"ReleaseDate", ReadSysValue("/sys/class/dmi/id/bios_date"));
+        Set(bios, L"SMBIOSBIOSVersion", ReadSysValue("/sys/class/dmi/id/bios_version"));
+        if (bios.empty()) return {};
+        return {bios};
+    }
+
+    static ULONGLONG TotalMemory() {
+        std::string kb = FindKey(ReadSysFile("/proc/meminfo"), "MemTotal", ':');
+        return strtoull(kb.c_str(), nullptr, 10) * 1024;
+    }
+
+    std::vector<Record> ComputerSystem() {
+        Record system;
+        Set(system, L"Manufacturer", ReadSysValue("/sys/class/dmi/id/sys_vendor"));
+        Set(system, L"Model", ReadSysValue("/sys/class/dmi/id/product_name"));
+        Set(system, L"SystemType", Machine() + "-based PC");
+        Set(system, L"TotalPhysicalMemory", TotalMemory());
+        return {system};
+    }
+
+    // Memory devices are SMBIOS type 17 structures. The raw table is
+    // readable by root only; otherwise the section is left empty.
+    std::vector<Record> PhysicalMemory() {
+        std::vector<Record> modules;
+        std::string table = ReadSysFile("/sys/firmware/dmi/tables/DMI");
+        size_t pos = 0;
+        while (pos + 4 <= table.size()) {
+            unsigned char type = (unsigned char)table[pos];
+            unsigned char length = (unsigned char)table[pos + 1];
+            if (length < 4 || pos + length > table.size()) break;
+            const unsigned char* data = (const unsigned char*)&table[pos];
+
+            // Strings follow the formatted area, ending with an empty one.
+            std::vector<std::string> strings;
+            size_t end = pos + length;
+            while (end < table.size() && table[end] != '\0') {
+                size_t stop = table.find('\0', end);
+                if (stop == std::string::npos) stop = table.size();
+                strings.push_back(table.substr(end, stop - end));
+                end = stop + 1;
+            }
+            end = strings.empty() ? end + 2 : end + 1;
+
+            if (type == 127) break;
+            if (type == 17 && length >= 0x18) {
+                unsigned size = data[0x0C] | (data[0x0D] << 8);
+                ULONGLONG bytes = 0;
+                if (size == 0x7FFF && length >= 0x20)
+                    bytes = (ULONGLONG)(data[0x1C] | (data[0x1D] << 8) | (data[0x1E] << 16) |
+                                        ((unsigned)data[0x1F] << 24)) << 20;
+                else if (size != 0 && size != 0xFFFF)
+                    bytes = size & 0x8000 ? (ULONGLONG)(size & 0x7FFF) << 10 : (ULONGLONG)size << 20;
+                if (bytes) {
+                    Record module;
+                    Set(module, L"Capacity", bytes);
+                    Set(module, L"Speed", (ULONGLONG)(data[0x15] | (data[0x16] << 8)));
+                    unsigned vendor = data[0x17];
+                    if (vendor && vendor <= strings.size()) Set(module, L"Manufacturer", strings[vendor - 1]);
+                    modules.push_back(module);
+                }
+            }
+            pos = end;
+        }
+        return modules;
+    }
+
+    // KB of the unified cache at `level` for CPU 0, from sysfs or cpuid.
+    static ULONGLONG CacheKB(int level) {
+        std::string base = "/sys/devices/system/cpu/cpu0/cache/";
+        for (const auto& index : ListDirectory(base)) {
+            if (index.compare(0, 5, "index") != 0) continue;
+            if (atoi(ReadSysValue(base + index + "/level").c_str()) != level) continue;
+            if (ReadSysValue(base + index + "/type") == "Instruction") continue;
+            std::string size = ReadSysValue(base + index + "/size");
+            ULONGLONG kb = strtoull(size.c_str(), nullptr, 10);
+            if (!size.empty() && size.back() == 'M') kb *= 1024;
+            return kb;
+        }
+#if defined(__x86_64__) || defined(__i386__)
+        unsigned a, b, c, d;
+        if (__get_cpuid(0x80000006, &a, &b, &c, &d)) {
+            if (level == 2) return c >> 16;
+            if (level == 3) return (ULONGLONG)(d >> 18) * 512;
+        }
+#endif
+        return 0;
+    }
+
+    static std::string BrandString() {
+#if defined(__x86_64__) || defined(__i386__)
+        unsigned regs[12];
+        if (__get_cpuid_max(0x80000000, nullptr) >= 0x80000004) {
+            for (unsigned leaf = 0; leaf < 3; leaf++)
+                __get_cpuid(0x80000002 + leaf, &regs[leaf * 4], &regs[leaf * 4 + 1], &regs[leaf * 4 + 2],
+                            &regs[leaf * 4 + 3]);
+            std::string brand((const char*)regs, sizeof(regs));
+            brand = brand.substr(0, brand.find('\0'));
+            size_t first = brand.find_first_not_of(' ');
+            return first == std::string::npos ? "" : brand.substr(first);
+        }
+#endif
+        return "";
+    }
+
+    // One record per physical package, as WMI gives one per socket.
+    std::vector<Record> Processor() {
+        std::string cpuinfo = ReadSysFile("/proc/cpuinfo");
+        struct Package {
+            std::string name;
+            std::vector<std::string> cores;
+            ULONGLONG logical = 0;
+            double mhz = 0;
+        };
+        std::vector<std::pair<std::string, Package>> packages;
+
+        // Entries are blank-line separated, one per logical processor.
+        size_t pos = 0;
+        while (pos < cpuinfo.size()) {
+            size_t end = cpuinfo.find("\n\n", pos);
+            if (end == std::string::npos) end = cpuinfo.size();
+            std::string entry = cpuinfo.substr(pos, end - pos) + "\n";
+            pos = end + 2;
+            if (FindKey(entry, "processor", ':').empty()) continue;
+
+            std::string id = FindKey(entry, "physical id", ':');
+            auto it = std::find_if(packages.begin(), packages.end(),
+                                   [&](const std::pair<std::string, Package>& p) { return p.first == id; });
+            if (it == packages.end()) {
+                packages.push_back({id, Package()});
+                it = packages.end() - 1;
+            }
+            Package& package = it->second;
+            if (package.name.empty()) {
+                package.name = FindKey(entry, "model name", ':');
+                if (package.name.empty()) package.name = FindKey(entry, "Model", ':');
+            }
+            std::string core = FindKey(entry, "core id", ':');
+            if (std::find(package.cores.begin(), package.cores.end(), core) == package.cores.end())
+                package.cores.push_back(core);
+            package.logical++;
+            package.mhz = std::max(package.mhz, atof(FindKey(entry, "cpu MHz", ':').c_str()));
+        }
+
+        std::string brand = BrandString();
+        ULONGLONG maxKHz = strtoull(ReadSysValue("/sys/devices/system/cpu/cpu0/cpufreq/cpuinfo_max_freq").c_str(),
+                                    nullptr, 10);
+        ULONGLONG l2 = CacheKB(2), l3 = CacheKB(3);
+        std::vector<Record> records;
+        for (const auto& entry : packages) {
+            const Package& package = entry.second;
+            Record cpu;
+            Set(cpu, L"Name", brand.empty() ? package.name : brand);
+            // Without "core id" (some ARM kernels), each logical CPU is a core.
+            Set(cpu, L"NumberOfCores",
+                (ULONGLONG)(package.cores.size() == 1 && package.cores[0].empty() ? package.logical
+                                                                                  : package.cores.size()));
+            Set(cpu, L"NumberOfLogicalProcessors", package.logical);
+            Set(cpu, L"MaxClockSpeed", maxKHz ? maxKHz / 1000 : (ULONGLONG)package.mhz);
+            Set(cpu, L"L2CacheSize", l2);
+            Set(cpu, L"L3CacheSize", l3);
+            records.push_back(cpu);
+        }
+        return records;
+    }
+
+    // Where a block or DRM device hangs off the bus, e.g. ".../usb2/...".
+    static std::string DevicePath(const std::string& path) {
+        char resolved[PATH_MAX];
+        return realpath(path.c_str(), resolved) ? resolved : "";
+    }
+
+    std::vector<Record> VideoControllers() {
+        std::vector<Record> records;
+        for (const auto& card : ListDirectory("/sys/class/drm")) {
+            if (card.compare(0, 4, "card") != 0 || card.find('-') != std::string::npos) continue;
+            std::string device = "/sys/class/drm/" + card + "/device";
+            Record adapter;
+            std::string driver = DevicePath(device + "/driver");
+            driver = driver.substr(driver.rfind('/') + 1);
+            std::string vendor = ReadSysValue(device + "/vendor"), id = ReadSysValue(device + "/device");
+            std::string name = driver;
+            if (!vendor.empty()) name += " (PCI " + vendor.substr(2) + ":" + id.substr(id.size() > 2 ? 2 : 0) + ")";
+            Set(adapter, L"Name", name);
+            Set(adapter, L"AdapterRAM", strtoull(ReadSysValue(device + "/mem_info_vram_total").c_str(), nullptr, 10));
+            if (!driver.empty()) Set(adapter, L"DriverVersion", ReadSysValue("/sys/module/" + driver + "/version"));
+            if (!adapter.empty()) records.push_back(adapter);
+        }
+        return records;
+    }
+
+    std::vector<Record> DiskDrives() {
+        std::vector<Record> records;
+        for (const auto& block : ListDirectory("/sys/block")) {
+            std::string base = "/sys/block/" + block;
+            // Physical disks have a backing device; loop, ram and dm do not.
+            std::string device = DevicePath(base + "/device");
+            if (device.empty()) continue;
+            Record disk;
+            std::string model = ReadSysValue(base + "/device/model");
+            std::string vendor = ReadSysValue(base + "/device/vendor");
+            while (!model.empty() && model.back() == ' ') model.pop_back();
+            while (!vendor.empty() && vendor.back() == ' ') vendor.pop_back();
+            // Virtio and NVMe give a PCI vendor id here, not a name.
+            if (!vendor.empty() && vendor != "ATA" && vendor.compare(0, 2, "0x") != 0)
+                model = vendor + " " + model;
+            while (!model.empty() && model.back() == ' ') model.pop_back();
+            Set(disk, L"Model", model.empty() ? block : model);
+            Set(disk, L"Size", strtoull(ReadSysValue(base + "/size").c_str(), nullptr, 10) * 512);
+            std::string bus = device.find("/usb") != std::string::npos    ? "USB"
+                              : block.compare(0, 4, "nvme") == 0           ? "NVMe"
+                              : device.find("/virtio") != std::string::npos ? "Virtio"
+                              : device.find("/ata") != std::string::npos    ? "IDE"
+                                                                            : "SCSI";
+            Set(disk, L"InterfaceType", bus);
+            records.push_back(disk);
+        }
+        return records;
+    }
+
+    // Interfaces with at least one address, loopback excepted, matching the
+    // report's "IPEnabled = TRUE".
+    std::vector<Record> NetworkAdapters() {
+        std::vector<Record> records;
+        std::vector<std::string> names;
+        std::unordered_map<std::string, std::vector<std::string>> addresses;
+        struct ifaddrs* list = nullptr;
+        if (getifaddrs(&list) != 0) return records;
+        for (struct ifaddrs* entry = list; entry; entry = entry->ifa_next) {
+            if (!entry->ifa_addr || (entry->ifa_flags & IFF_LOOPBACK)) continue;
+            char text[INET6_ADDRSTRLEN] = "";
+            int family = entry->ifa_addr->sa_family;
+            if (family == AF_INET)
+                inet_ntop(family, &((struct sockaddr_in*)entry->ifa_addr)->sin_addr, text, sizeof(text));
+            else if (family == AF_INET6)
+                inet_ntop(family, &((struct sockaddr_in6*)entry->ifa_addr)->sin6_addr, text, sizeof(text));
+            else
+                continue;
+            std::vector<std::string>& list = addresses[entry->ifa_name];
+            if (list.empty()) names.push_back(entry->ifa_name);
+            list.push_back(text);
+        }
+        freeifaddrs(list);
+
+        for (const auto& name : names) {
+            Record adapter;
+            Set(adapter, L"Description", name);
+            adapter[L"IPAddress"] = Value::FromList(addresses[name]);
+            std::string mac = ReadSysValue("/sys/class/net/" + name + "/address");
+            std::transform(mac.begin(), mac.end(), mac.begin(), ::toupper);
+            Set(adapter, L"MACAddress", mac);
+            records.push_back(adapter);
+        }
+        return records;
+    }
+
+    std::vector<Record> Collect(std::wstring_view className) {
+        if (className == L"Win32_OperatingSystem") return OperatingSystem();
+        if (className == L"Win32_BIOS") return Bios();
+        if (className == L"Win32_ComputerSystem") return ComputerSystem();
+        if (className == L"Win32_PhysicalMemory") return PhysicalMemory();
+        if (className == L"Win32_Processor") return Processor();
+        if (className == L"Win32_VideoController") return VideoControllers();
+        if (className == L"Win32_DiskDrive") return DiskDrives();
+        if (className == L"Win32_NetworkAdapterConfiguration") return NetworkAdapters();
+        // Anything else (Win32_QuickFixEngineering) has no Linux counterpart.
+        return {};
+    }
+
+public:
+    HRESULT Query(std::wstring_view className, PropertyList properties, std::wstring_view,
+                  RowFunction row, const Deadline& deadline) override {
+        // Reads of /proc and /sys cannot be made non-blocking, and a driver
+        // can stall one, so a class is read on a thread of its own (the
+        // provider lives as long as the process).
+        std::vector<Record> records;
+        std::wstring name(className);
+        if (!RunWithin(deadline, [this, name] { return Collect(name); }, records)) return TIMED_OUT;
+
+        std::array<Value, MAX_PROPERTIES> values;
+        for (auto& record : records) {
+            for (size_t i = 0; i < properties.size(); i++) {
+                auto it = record.find(properties[i].name);
+                if (it == record.end()) values[i].Clear();
+                else values[i] = std::move(it->second);
+            }
+            row(values.data());
+        }
+        return S_OK;
+    }
+};
+#endif
+
+// Generic query function: one object per row, formatted values passed on
+// typed, absent properties left out. A query that runs out of time keeps
+// the rows it returned and marks the section partial.
+void QueryWMI(Provider* provider, const WmiQuery& query, Sink& out, Deadline& deadline) {
+    if (query.group)
+        out.Group(query.group);
+
+    PropertyList properties = query.properties;
+    HRESULT hres = provider->Query(query.cls->name, properties, query.condition ? query.condition : L"",
+                                   [&](const Value* values) {
+        out.BeginObject();
+        for (size_t i = 0; i < properties.size(); i++) {
+            if (values[i].kind != Value::Empty)
+                EmitField(out, properties[i], values[i]);
+        }
+        out.EndObject();
+    }, deadline.Step());
+
+    if (hres == TIMED_OUT) {
+        deadline.Miss();
+        out.Error("Partial: " + ToUtf8(query.cls->name) + " did not answer in time");
+    } else if (FAILED(hres)) {
+        char message[160];
+        snprintf(message, sizeof(message), "Error querying %s: 0x%08lX", ToUtf8(query.cls->name).c_str(),
+                 (unsigned long)hres);
+        out.Error(message);
+    }
+}
+
+template <size_t N>
+void RunQueries(Provider* provider, const WmiQuery (&queries)[N], Sink& out, Deadline& deadline) {
+    for (const auto& query : queries) QueryWMI(provider, query, out, deadline);
+}
+
+// SYSTEM SUMMARY
+constexpr WmiProperty OS_FIELDS[] = {
+    {L"Caption", "OS Name", Format::Plain},
+    {L"Version", "Version", Format::Plain},
+    {L"BuildNumber", "Build", Format::Plain},
+    {L"OSArchitecture", "Architecture", Format::Plain},
+    {L"SerialNumber", "Serial", Format::Plain},
+    {L"InstallDate", "Install Date", Format::Plain},
+};
+constexpr WmiProperty BIOS_FIELDS[] = {
+    {L"Manufacturer", "BIOS Vendor", Format::Plain},
+    {L"Name", "BIOS Version", Format::Plain},
+    {L"ReleaseDate", "Release Date", Format::Plain},
+    {L"SMBIOSBIOSVersion", "SMBIOS Version", Format::Plain},
+};
+constexpr WmiProperty SYSTEM_FIELDS[] = {
+    {L"Manufacturer", "System Manufacturer", Format::Plain},
+    {L"Model", "System Model", Format::Plain},
+    {L"SystemType", "System Type", Format::Plain},
+    {L"TotalPhysicalMemory", "Total Physical Memory (GB)", Format::MemoryGB},
+};
+constexpr WmiQuery SYSTEM_SUMMARY[] = {
+    {&WIN32_OPERATING_SYSTEM, OS_FIELDS, nullptr, nullptr},
+    {&WIN32_BIOS, BIOS_FIELDS, nullptr, nullptr},
+    {&WIN32_COMPUTER_SYSTEM, SYSTEM_FIELDS, nullptr, nullptr},
+};
+static_assert(Valid(SYSTEM_SUMMARY), "SYSTEM SUMMARY asks for a property its class lacks");
+
+void PrintSystemSummary(Provider* pSvc, Sink& out, Deadline& deadline) {
+    out.BeginSection("SYSTEM SUMMARY");
+    RunQueries(pSvc, SYSTEM_SUMMARY, out, deadline);
+    out.EndSection();
+}
+
+// HARDWARE RESOURCES
+constexpr WmiProperty MEMORY_FIELDS[] = {
+    {L"Capacity", "Memory Capacity (GB)", Format::MemoryGB},
+    {L"Speed", "Speed (MHz)", Format::Plain},
+    {L"Manufacturer", "Manufacturer", Format::Plain},
+};
+constexpr WmiProperty PROCESSOR_FIELDS[] = {
+    {L"Name", "Processor", Format::Plain},
+    {L"NumberOfCores", "Cores", Format::Plain},
+    {L"NumberOfLogicalProcessors", "Logical Processors", Format::Plain},
+    {L"MaxClockSpeed", "Max Speed (MHz)", Format::Plain},
+    {L"L2CacheSize", "L2 Cache (MB)", Format::CacheMB},
+    {L"L3CacheSize", "L3 Cache (MB)", Format::CacheMB},
+};
+constexpr WmiQuery HARDWARE_RESOURCES[] = {
+    {&WIN32_PHYSICAL_MEMORY, MEMORY_FIELDS, "Memory Devices", nullptr},
+    {&WIN32_PROCESSOR, PROCESSOR_FIELDS, "Processor Details", nullptr},
+};
+static_assert(Valid(HARDWARE_RESOURCES), "HARDWARE RESOURCES asks for a property its class lacks");
+
+void PrintHardwareResources(Provider* pSvc, Sink& out, Deadline& deadline) {
+    out.BeginSection("HARDWARE RESOURCES");
+    RunQueries(pSvc, HARDWARE_RESOURCES, out, deadline);
+    out.EndSection();
+}
+
+// COMPONENTS
+constexpr WmiProperty DISPLAY_FIELDS[] = {
+    {L"Name", "Adapter", Format::Plain},
+    {L"AdapterRAM", "VRAM (GB)", Format::MemoryGB},
+    {L"DriverVersion", "Driver Version", Format::Plain},
+    {L"VideoProcessor", "GPU Chip", Format::Plain},
+};
+constexpr WmiProperty STORAGE_FIELDS[] = {
+    {L"Model", "Disk Model", Format::Plain},
+    {L"Size", "Capacity (GB)", Format::MemoryGB},
+    {L"InterfaceType", "Interface", Format::Plain},
+};
+constexpr WmiQuery COMPONENTS[] = {
+    {&WIN32_VIDEO_CONTROLLER, DISPLAY_FIELDS, "Display", nullptr},
+    {&WIN32_DISK_DRIVE, STORAGE_FIELDS, "Storage", nullptr},
+};
+static_assert(Valid(COMPONENTS), "COMPONENTS asks for a property its class lacks");
+
+void PrintComponents(Provider* pSvc, Sink& out, Deadline& deadline) {
+    out.BeginSection("COMPONENTS");
+    RunQueries(pSvc, COMPONENTS, out, deadline);
+    out.EndSection();
+}
+
+// SOFTWARE ENVIRONMENT
+constexpr WmiProperty UPDATE_FIELDS[] = {
+    {L"HotFixID", "Update", Format::Plain},
+    {L"InstalledOn", "Install Date", Format::Plain},
+    {L"Description", "Description", Format::Plain},
+};
+constexpr WmiProperty NETWORK_FIELDS[] = {
+    {L"Description", "Adapter", Format::Plain},
+    {L"IPAddress", "IP Address", Format::Plain},
+    {L"MACAddress", "MAC", Format::Plain},
+};
+constexpr WmiQuery SOFTWARE_ENVIRONMENT[] = {
+    {&WIN32_QUICK_FIX_ENGINEERING, UPDATE_FIELDS, "Windows Updates", nullptr},
+    {&WIN32_NETWORK_ADAPTER_CONFIGURATION, NETWORK_FIELDS, "Network", L"IPEnabled = TRUE"},
+};
+static_assert(Valid(SOFTWARE_ENVIRONMENT), "SOFTWARE ENVIRONMENT asks for a property its class lacks");
+
+void PrintSoftwareEnvironment(Provider* pSvc, Sink& out, Deadline& deadline) {
+    out.BeginSection("SOFTWARE ENVIRONMENT");
+    RunQueries(pSvc, SOFTWARE_ENVIRONMENT, out, deadline);
+    out.EndSection();
+}
+
+// LOCALE AND ENCODING
+void PrintLocaleAndEncoding(Sink& out, Deadline&) {
+    out.BeginSection("LOCALE AND ENCODING");
+#ifdef _WIN32
+    wchar_t localeName[85];
+    if (GetUserDefaultLocaleName(localeName, 85))
+        out.Field("System Locale", Value::FromString(ToUtf8(localeName)));
+    else
+        out.Field("System Locale", Value::FromString("unknown"));
+
+    UINT cp = GetACP();
+    out.Field("Default Encoding", Value::FromString("Code Page " + std::to_string(cp)));
+#else
+    // main() has adopted the environment's locale; report it as a BCP 47
+    // name like Windows does (en_US.UTF-8 becomes en-US).
+    const char* name = setlocale(LC_CTYPE, NULL);
+    std::string locale = name ? name : "";
+    locale = locale.substr(0, locale.find_first_of(".@"));
+    std::replace(locale.begin(), locale.end(), '_', '-');
+    if (locale.empty() || locale == "C" || locale == "POSIX")
+        locale = "unknown";
+    out.Field("System Locale", Value::FromString(locale));
+
+    out.Field("Default Encoding", Value::FromString(nl_langinfo(CODESET)));
+#endif
+    out.EndSection();
+}
+
+std::wstring Lowercase(std::wstring text) {
+    for (auto& c : text) c = (wchar_t)std::towlower(c);
+    return text;
+}
+
+// Executables reachable through PATH, indexed by listing each directory
+// once, so that any number of lookups costs no process launches. Lookups
+// follow where.exe: the current directory first, then PATH in order, and
+// within a directory the name as given before the name with each PATHEXT
+// extension appended. On Linux, names are matched exactly without a
+// Windows extension and must carry an execute bit. A directory that does
+// not list within a step of the deadline (an offline share) is skipped.
+class PathIndex {
+    struct Entry {
+        size_t dir;
+        std::wstring path;
+    };
+    std::vector<std::wstring> dirs;
+    std::vector<std::wstring> extensions;   // lowercase, with the dot
+    std::unordered_map<std::wstring, std::vector<Entry>> files;  // by name (lowercase on Windows)
+
+    // Names of the files in `dir`.
+    static std::vector<std::wstring> List(const std::wstring& dir) {
+        std::vector<std::wstring> names;
+#ifdef _WIN32
+        WIN32_FIND_DATAW fd;
+        HANDLE hFind = FindFirstFileExW((dir + L"\\*").c_str(), FindExInfoBasic, &fd, FindExSearchNameMatch,
+                                        NULL, FIND_FIRST_EX_LARGE_FETCH);
+        if (hFind == INVALID_HANDLE_VALUE) return names;
+        do {
+            if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) continue;
+            names.push_back(fd.cFileName);
+        } while (FindNextFileW(hFind, &fd));
+        FindClose(hFind);
+#else
+        DIR* handle = opendir(Narrow(dir).c_str());
+        if (!handle) return names;
+        // Execute bits are checked at lookup, for the few names asked for.
+        while (struct dirent* entry = readdir(handle)) {
+            if (entry->d_type == DT_DIR) continue;
+            names.push_back(Widen(entry->d_name));
+        }
+        closedir(handle);
+#endif
+        return names;
+    }
+
+    void AddDirectory(std::wstring dir, const Deadline& deadline) {
+        if (!dir.empty() && dir.front() == L'"') dir.erase(0, 1);
+        if (!dir.empty() && dir.back() == L'"') dir.pop_back();
+        while (dir.size() > 1 && (dir.back() == L'\\' || dir.back() == L'/')) dir.pop_back();
+        if (dir.empty()) return;
+#ifdef _WIN32
+        std::wstring key = Lowercase(dir);
+        for (const auto& seen : dirs) {
+            if (Lowercase(seen) == key) return;
+        }
+#else
+        for (const auto& seen : dirs) {
+            if (seen == dir) return;
+        }
+#endif
+        size_t index = dirs.size();
+        dirs.push_back(dir);
+        std::vector<std::wstring> names;
+        if (!RunWithin(deadline.Step(), [dir] { return List(dir); }, names)) {
+            skipped.push_back(dir);
+            return;
+        }
+#ifdef _WIN32
+        std::wstring prefix = dir.back() == L'\\' || dir.back() == L'/' ? dir : dir + L"\\";
+        for (const auto& name : names) files[Lowercase(name)].push_back({index, prefix + name});
+#else
+        std::wstring prefix = dir.back() == L'/' ? dir : dir + L"/";
+        for (const auto& name : names) files[name].push_back({index, prefix + name});
+#endif
+    }
+
+public:
+    std::vector<std::wstring> skipped;  // directories that did not answer
+
+    explicit PathIndex(const Deadline& deadline = Deadline()) {
+#ifdef _WIN32
+        wchar_t cwd[MAX_PATH];
+        if (GetCurrentDirectoryW(MAX_PATH, cwd)) AddDirectory(cwd, deadline);
+
+        std::wstring pathExt = L".COM;.EXE;.BAT;.CMD;.VBS;.VBE;.JS;.JSE;.WSF;.WSH;.MSC";
+        DWORD len = GetEnvironmentVariableW(L"PATHEXT", NULL, 0);
+        if (len > 0) {
+            std::vector<wchar_t> buffer(len);
+            if (GetEnvironmentVariableW(L"PATHEXT", buffer.data(), len)) pathExt = buffer.data();
+        }
+        std::wstringstream exts(pathExt);
+        std::wstring ext;
+        while (std::getline(exts, ext, L';')) {
+            if (!ext.empty()) extensions.push_back(Lowercase(ext));
+        }
+
+        std::wstring path;
+        len = GetEnvironmentVariableW(L"PATH", NULL, 0);
+        if (len > 0) {
+            std::vector<wchar_t> buffer(len);
+            if (GetEnvironmentVariableW(L"PATH", buffer.data(), len)) path = buffer.data();
+        }
+        const wchar_t separator = L';';
+#else
+        const char* env = getenv("PATH");
+        std::wstring path = Widen(env ? env : "/usr/local/bin:/usr/bin:/bin");
+        const wchar_t separator = L':';
+#endif
+        std::wstringstream entries(path);
+        std::wstring dir;
+        while (std::getline(entries, dir, separator)) AddDirectory(dir, deadline);
+    }
+
+    // Every match for `exe`, in the order where.exe would print them.
+    std::vector<std::wstring> Find(const std::wstring& exe) const {
+        std::vector<const Entry*> matches;
+#ifdef _WIN32
+        std::vector<std::wstring> names = {Lowercase(exe)};
+        for (const auto& ext : extensions) names.push_back(names[0] + ext);
+#else
+        // The table names Windows binaries; their Linux counterparts have no
+        // extension.
+        std::wstring name = exe;
+        for (const wchar_t* ext : {L".exe", L".bat", L".cmd"}) {
+            size_t n = wcslen(ext);
+            if (name.size() > n && Lowercase(name.substr(name.size() - n)) == ext) {
+                name.erase(name.size() - n);
+                break;
+            }
+        }
+        std::vector<std::wstring> names = {name};
+#endif
+        for (const auto& name : names) {
+            auto it = files.find(name);
+            if (it == files.end()) continue;
+            for (const auto& entry : it->second) {
+#ifndef _WIN32
+                struct stat st;
+                if (stat(Narrow(entry.path).c_str(), &st) != 0 || !S_ISREG(st.st_mode) ||
+                    !(st.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH))) {
+                    continue;
+                }
+#endif
+                matches.push_back(&entry);
+            }
+        }
+        // By directory; within one, in the order the names were tried.
+        std::stable_sort(matches.begin(), matches.end(),
+                         [](const Entry* a, const Entry* b) { return a->dir < b->dir; });
+        std::vector<std::wstring> paths;
+        for (const Entry* entry : matches) paths.push_back(entry->path);
+        return paths;
+    }
+};
+
+// Runs queued tasks on a few worker threads.
+class TaskPool {
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex lock;
+    std::condition_variable ready;
+    std::condition_variable finished;
+    size_t running = 0;
+    bool closed = false;
+
+    void Work() {
+#ifdef _WIN32
+        ComApartment apartment;
+#endif
+        std::unique_lock<std::mutex> guard(lock);
+        for (;;) {
+            if (tasks.empty()) {
+                if (closed) break;
+                ready.wait(guard);
+                continue;
+            }
+            std::function<void()> task = std::move(tasks.front());
+            tasks.pop_front();
+            guard.unlock();
+            task();
+            guard.lock();
+        }
+        running--;
+        finished.notify_all();
+    }
+
+public:
+    explicit TaskPool(unsigned threads) : running(threads) {
+        for (unsigned t = 0; t < threads; t++) workers.emplace_back(&TaskPool::Work, this);
+    }
+
+    void Submit(std::function<void()> task) {
+        std::lock_guard<std::mutex> guard(lock);
+        tasks.push_back(std::move(task));
+        ready.notify_one();
+    }
+
+    // Runs whatever is still queued and waits for the workers.
+    void Wait() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            closed = true;
+            ready.notify_all();
+        }
+        for (auto& worker : workers) worker.join();
+        workers.clear();
+    }
+
+    // Like Wait, but only until `deadline`. If tasks are still running
+    // then, those not started are dropped, the workers detached and false
+    // returned; the pool must outlive them, so the caller leaks it.
+    bool WaitUntil(const Deadline& deadline) {
+        std::unique_lock<std::mutex> guard(lock);
+        closed = true;
+        ready.notify_all();
+        while (running > 0) {
+            long long left = deadline.Remaining(1000);
+            if (left == 0) {
+                tasks.clear();
+                for (auto& worker : workers) worker.detach();
+                workers.clear();
+                return false;
+            }
+            finished.wait_for(guard, std::chrono::milliseconds(left));
+        }
+        guard.unlock();
+        for (auto& worker : workers) worker.join();
+        workers.clear();
+        return true;
+    }
+
+    ~TaskPool() {
+        if (!workers.empty()) Wait();
+    }
+};
+
+// One section of the report, collected into its own buffer in the binary
+// form (see BinarySink). Sections with a TTL are kept in the snapshot
+// cache and reused while younger than it and while `key` still gives the
+// value stored with them. A partial section (something timed out) is
+// reported but never cached; one still running when the report's budget
+// ends is abandoned and reported as its title and an error.
+struct Section {
+    const char* name;
+    const char* title;
+    long long ttl;  // seconds; 0 collects every run
+    std::function<std::wstring(const Deadline&)> key;  // bounded by the caller's deadline
+    std::function<void(Sink&, Deadline&)> collect;
+    std::string encoded;
+    std::wstring validation;
+    long long collectedAt = 0;
+    bool cached = false;
+    double seconds = 0;
+    bool alone = false;  // collected after the others, with nothing running beside it
+    bool done = false;
+    bool partial = false;
+    bool abandoned = false;
+    Section(const char* sectionName, const char* sectionTitle, long long sectionTtl,
+            std::function<std::wstring(const Deadline&)> validationKey, std::function<void(Sink&, Deadline&)> collector)
+        : name(sectionName), title(sectionTitle), ttl(sectionTtl), key(validationKey), collect(collector) {}
+};
+
+std::wstring EnvironmentVariable(const wchar_t* name) {
+#ifdef _WIN32
+    DWORD len = GetEnvironmentVariableW(name, NULL, 0);
+    if (len == 0) return L"";
+    std::vector<wchar_t> buffer(len);
+    return GetEnvironmentVariableW(name, buffer.data(), len) ? buffer.data() : L"";
+#else
+    const char* value = getenv(Narrow(name).c_str());
+    return value ? Widen(value) : L"";
+#endif
+}
+
+// Changes whenever the machine restarts: hardware, drivers and OS updates
+// only change across a reboot.
+std::wstring BootKey() {
+#ifdef _WIN32
+    // Boot time to the minute, from the clock minus the uptime.
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+    ULONGLONG ticks = ((ULONGLONG)now.dwHighDateTime << 32 | now.dwLowDateTime) / 10000 - GetTickCount64();
+    return L"boot " + std::to_wstring(ticks / 60000);
+#else
+    std::string id = ReadSysValue("/proc/sys/kernel/random/boot_id");
+    return L"boot " + Widen(id);
+#endif
+}
+
+// FNV-1a of PATH and the modification time of every directory on it, so
+// installing or removing an executable anywhere on PATH invalidates the
+// language section. Should a directory not answer within a step of the
+// deadline, the key matches nothing, so the section is collected again.
+std::wstring PathKey(const Deadline& deadline) {
+#ifdef _WIN32
+    std::wstring path = EnvironmentVariable(L"PATH") + L"|" + EnvironmentVariable(L"PATHEXT");
+    const wchar_t separator = L';';
+#else
+    std::wstring path = EnvironmentVariable(L"PATH");
+    const wchar_t separator = L':';
+#endif
+    std::wstring state;
+    bool answered = RunWithin(deadline.Step(), [path, separator] {
+        std::wstring state = path;
+        std::wstringstream entries(path);
+        std::wstring dir;
+        while (std::getline(entries, dir, separator)) {
+            if (!dir.empty() && dir.front() == L'"') dir.erase(0, 1);
+            if (!dir.empty() && dir.back() == L'"') dir.pop_back();
+            if (dir.empty()) continue;
+#ifdef _WIN32
+            WIN32_FILE_ATTRIBUTE_DATA info;
+            if (GetFileAttributesExW(dir.c_str(), GetFileExInfoStandard, &info))
+                state += L"|" + std::to_wstring(((ULONGLONG)info.ftLastWriteTime.dwHighDateTime << 32) |
+                                                info.ftLastWriteTime.dwLowDateTime);
+#else
+            struct stat info;
+            if (stat(Narrow(dir).c_str(), &info) == 0)
+                state += L"|" + std::to_wstring((long long)info.st_mtime) + L"." +
+                         std::to_wstring((long long)info.st_mtim.tv_nsec);
+#endif
+            else
+                state += L"|-";
+        }
+        return state;
+    }, state);
+    if (!answered) return L"path unanswered " + std::to_wstring((long long)time(nullptr));
+    ULONGLONG hash = 1469598103934665603ULL;
+    for (wchar_t c : state) {
+        hash ^= (ULONGLONG)c;
+        hash *= 1099511628211ULL;
+    }
+    std::wstringstream key;
+    key << L"path " << std::hex << hash;
+    return key.str();
+}
+
+// The snapshot cache: "SICACHE2", the size of wchar_t, then per section its
+// name, collection time (Unix seconds), validation key and encoded events.
+// Strings are a 32-bit length followed by the characters.
+struct CachedSection {
+    long long collectedAt;
+    std::wstring key;
+    std::string data;
+};
+
+const char CACHE_MAGIC[8] = {'S', 'I', 'C', 'A', 'C', 'H', 'E', '3'};
+
+template <typename Char>
+bool ReadCacheString(FILE* file, std::basic_string<Char>& text) {
+    uint32_t len;
+    if (fread(&len, sizeof(len), 1, file) != 1 || len > (1u << 26)) return false;
+    text.resize(len);
+    return len == 0 || fread(&text[0], sizeof(Char), len, file) == len;
+}
+
+template <typename Char>
+void WriteCacheString(FILE* file, const std::basic_string<Char>& text) {
+    uint32_t len = (uint32_t)text.size();
+    fwrite(&len, sizeof(len), 1, file);
+    fwrite(text.data(), sizeof(Char), len, file);
+}
+
+// Missing, foreign or truncated files give an empty cache.
+std::unordered_map<std::string, CachedSection> LoadCache(const std::string& path) {
+    std::unordered_map<std::string, CachedSection> cache;
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file) return cache;
+    char magic[8];
+    uint32_t charSize;
+    if (fread(magic, 1, 8, file) == 8 && memcmp(magic, CACHE_MAGIC, 8) == 0 &&
+        fread(&charSize, sizeof(charSize), 1, file) == 1 && charSize == sizeof(wchar_t)) {
+        std::string name;
+        CachedSection section;
+        while (ReadCacheString(file, name) &&
+               fread(&section.collectedAt, sizeof(section.collectedAt), 1, file) == 1 &&
+               ReadCacheString(file, section.key) && ReadCacheString(file, section.data))
+            cache[name] = section;
+    }
+    fclose(file);
+    return cache;
+}
+
+// Written to a temporary file and renamed over the old one, so a run that
+// dies halfway leaves the previous cache intact.
+void SaveCache(const std::string& path, Section* sections, size_t count) {
+    std::string temp = path + ".tmp";
+    FILE* file = fopen(temp.c_str(), "wb");
+    if (!file) return;
+    uint32_t charSize = sizeof(wchar_t);
+    fwrite(CACHE_MAGIC, 1, 8, file);
+    fwrite(&charSize, sizeof(charSize), 1, file);
+    for (size_t i = 0; i < count; i++) {
+        const Section& section = sections[i];
+        if (section.ttl <= 0 || section.partial) continue;
+        WriteCacheString(file, std::string(section.name));
+        fwrite(&section.collectedAt, sizeof(section.collectedAt), 1, file);
+        WriteCacheString(file, section.validation);
+        WriteCacheString(file, section.encoded);
+    }
+    bool ok = fflush(file) == 0 && !ferror(file);
+    ok = fclose(file) == 0 && ok;
+#ifdef _WIN32
+    if (ok && MoveFileExA(temp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING)) return;
+#else
+    if (ok && rename(temp.c_str(), path.c_str()) == 0) return;
+#endif
+    remove(temp.c_str());
+}
+
+double SecondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// TOOLCHAIN VERSIONS
+// Each executable found for a language is asked for its version directly,
+// without a shell: stdin reads nothing, stdout and stderr go to one pipe,
+// and the probe is killed with everything it started once its deadline
+// passes. Probes run side by side on a TaskPool, so probing takes about as
+// long as the slowest one.
+struct ProbeResult {
+    std::string output;  // at most PROBE_OUTPUT_LIMIT bytes
+    bool started = false;
+    bool timedOut = false;
+    long long exitCode = -1;
+    double seconds = 0;
+};
+
+const size_t PROBE_OUTPUT_LIMIT = 4096;
+
+#ifdef _WIN32
+ProbeResult RunProbe(const std::wstring& path, const std::vector<std::wstring>& args, int timeoutMs) {
+    ProbeResult result;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    // The child inherits the pipe's write end and NUL. Probes starting at
+    // the same time may inherit each other's handles as well, so the end of
+    // a probe is taken from its process, never from the pipe closing.
+    SECURITY_ATTRIBUTES inherit = {sizeof(inherit), NULL, TRUE};
+    HANDLE readEnd, writeEnd;
+    if (!CreatePipe(&readEnd, &writeEnd, &inherit, 1 << 16)) return result;
+    SetHandleInformation(readEnd, HANDLE_FLAG_INHERIT, 0);
+    HANDLE nul = CreateFileW(L"NUL", GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, &inherit, OPEN_EXISTING,
+                             0, NULL);
+    std::wstring commandLine = L"\"" + path + L"\"";
+    for (const auto& arg : args) commandLine += L" " + arg;
+
+    STARTUPINFOW startup = {};
+    startup.cb = sizeof(startup);
+    startup.dwFlags = STARTF_USESTDHANDLES | STARTF_USESHOWWINDOW;
+    startup.wShowWindow = SW_HIDE;
+    startup.hStdInput = nul;
+    startup.hStdOutput = writeEnd;
+    startup.hStdError = writeEnd;
+    PROCESS_INFORMATION process = {};
+    // A job takes the probe's own children down with it.
+    HANDLE job = CreateJobObjectW(NULL, NULL);
+    JOBOBJECT_EXTENDED_LIMIT_INFORMATION limits = {};
+    limits.BasicLimitInformation.LimitFlags = JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE;
+    if (job) SetInformationJobObject(job, JobObjectExtendedLimitInformation, &limits, sizeof(limits));
+    result.started = CreateProcessW(path.c_str(), &commandLine[0], NULL, NULL, TRUE,
+                                    CREATE_SUSPENDED | CREATE_NO_WINDOW, NULL, NULL, &startup, &process) != 0;
+    CloseHandle(writeEnd);
+    if (nul != INVALID_HANDLE_VALUE) CloseHandle(nul);
+    if (result.started) {
+        if (job) AssignProcessToJobObject(job, process.hProcess);
+        ResumeThread(process.hThread);
+        char buffer[4096];
+        for (bool exited = false;;) {
+            DWORD available = 0, got = 0;
+            while (PeekNamedPipe(readEnd, NULL, 0, NULL, &available, NULL) && available > 0 &&
+                   ReadFile(readEnd, buffer, std::min<DWORD>(available, sizeof(buffer)), &got, NULL) && got > 0) {
+                size_t room = PROBE_OUTPUT_LIMIT - result.output.size();
+                result.output.append(buffer, std::min<size_t>(got, room));
+            }
+            if (exited) break;
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+            if (left.count() <= 0) {
+                result.timedOut = true;
+                break;
+            }
+            exited = WaitForSingleObject(process.hProcess, (DWORD)std::min<long long>(left.count(), 10)) == WAIT_OBJECT_0;
+        }
+        if (result.timedOut) {
+            if (job)
+                TerminateJobObject(job, 1);
+            else
+                TerminateProcess(process.hProcess, 1);
+        } else {
+            DWORD code;
+            if (GetExitCodeProcess(process.hProcess, &code)) result.exitCode = code;
+        }
+        CloseHandle(process.hThread);
+        CloseHandle(process.hProcess);
+    }
+    if (job) CloseHandle(job);
+    CloseHandle(readEnd);
+    return result;
+}
+#else
+ProbeResult RunProbe(const std::wstring& path, const std::vector<std::wstring>& args, int timeoutMs) {
+    ProbeResult result;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) return result;
+    std::string file = Narrow(path);
+    std::vector<std::string> words = {file};
+    for (const auto& arg : args) words.push_back(Narrow(arg));
+    std::vector<char*> argv;
+    for (auto& word : words) argv.push_back(&word[0]);
+    argv.push_back(nullptr);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], 1);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], 2);
+    // Its own process group, so the deadline also stops whatever it starts.
+    posix_spawnattr_t attributes;
+    posix_spawnattr_init(&attributes);
+    sigset_t signals;
+    sigemptyset(&signals);
+    posix_spawnattr_setsigmask(&attributes, &signals);
+    posix_spawnattr_setpgroup(&attributes, 0);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK);
+    pid_t pid;
+    result.started = posix_spawn(&pid, file.c_str(), &actions, &attributes, argv.data(), environ) == 0;
+    posix_spawnattr_destroy(&attributes);
+    posix_spawn_file_actions_destroy(&actions);
+    close(fds[1]);
+    if (result.started) {
+        // Until the output ends and the probe has exited; a process it left
+        // behind holding the pipe is stopped at the deadline without
+        // counting against the probe.
+        bool open = true, exited = false;
+        int status = 0;
+        char buffer[4096];
+        for (;;) {
+            if (!exited) exited = waitpid(pid, &status, WNOHANG) == pid;
+            if (exited && !open) break;
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+            if (left.count() <= 0) {
+                kill(-pid, SIGKILL);
+                result.timedOut = !exited;
+                break;
+            }
+            if (!open) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                continue;
+            }
+            struct pollfd readable = {fds[0], POLLIN, 0};
+            int wait = exited ? (int)left.count() : (int)std::min<long long>(left.count(), 50);
+            if (poll(&readable, 1, wait) <= 0) continue;
+            ssize_t got = read(fds[0], buffer, sizeof(buffer));
+            if (got > 0) {
+                size_t room = PROBE_OUTPUT_LIMIT - result.output.size();
+                result.output.append(buffer, std::min<size_t>((size_t)got, room));
+            } else if (got == 0 || errno != EINTR) {
+                open = false;
+            }
+        }
+        if (!exited) waitpid(pid, &status, 0);
+        if (!result.timedOut && WIFEXITED(status)) result.exitCode = WEXITSTATUS(status);
+    }
+    close(fds[0]);
+    return result;
+}
+#endif
+
+// Arguments that make each tool print its version, by executable name
+// without extension; the rest take --version. Tools without such a switch,
+// and IDEs or GUI front ends, are not started at all.
+const std::pair<const wchar_t*, const wchar_t*> VERSION_ARGUMENTS[] = {
+    {L"cl", L""}, {L"csc", L"-version"}, {L"vbc", L"-version"}, {L"java", L"-version"},
+    {L"javac", L"-version"}, {L"kotlinc", L"-version"}, {L"kotlinc-jvm", L"-version"},
+    {L"scala", L"-version"}, {L"scalac", L"-version"}, {L"go", L"version"}, {L"zig", L"version"},
+    {L"fpc", L"-iV"}, {L"ppc386", L"-iV"}, {L"ppcx64", L"-iV"}, {L"dcc32", L""}, {L"dcc64", L""},
+    {L"lua", L"-v"}, {L"luajit", L"-v"}, {L"erl", L"-version"}, {L"erlc", nullptr},
+    {L"ocaml", L"-version"}, {L"ocamlc", L"-version"}, {L"ocamlopt", L"-version"},
+    {L"ocamldebug", L"-version"}, {L"chicken", L"-version"}, {L"matlab", L"-batch disp(version)"},
+    {L"powershell", L"-NoProfile -Command $PSVersionTable.PSVersion.ToString()"},
+    {L"bds", nullptr}, {L"swipl-win", nullptr}, {L"tclsh", nullptr}, {L"tclsh86", nullptr},
+    {L"tclsh8.6", nullptr}, {L"grape", nullptr},
+};
+
+const char VERSION_CACHE_MAGIC[8] = {'S', 'I', 'V', 'E', 'R', 'S', '0', '1'};
+
+// Versions by executable, from a cache kept next to the snapshot cache and
+// keyed by path, modification time and size, so only new or replaced
+// binaries are started again. Probes that time out are not remembered.
+class VersionProber {
+    struct Entry {
+        long long modified;
+        long long size;
+        std::string version;
+    };
+    unsigned jobs;
+    int timeoutMs;
+    std::string cachePath;
+    std::mutex lock;
+    std::unordered_map<std::wstring, Entry> cache;
+    bool dirty = false;
+
+    static bool Stamp(const std::wstring& path, long long& modified, long long& size) {
+#ifdef _WIN32
+        WIN32_FILE_ATTRIBUTE_DATA info;
+        if (!GetFileAttributesExW(path.c_str(), GetFileExInfoStandard, &info)) return false;
+        modified = (long long)(((ULONGLONG)info.ftLastWriteTime.dwHighDateTime << 32) | info.ftLastWriteTime.dwLowDateTime);
+        size = (long long)(((ULONGLONG)info.nFileSizeHigh << 32) | info.nFileSizeLow);
+#else
+        struct stat info;
+        if (stat(Narrow(path).c_str(), &info) != 0) return false;
+        modified = (long long)info.st_mtim.tv_sec * 1000000000LL + info.st_mtim.tv_nsec;
+        size = (long long)info.st_size;
+#endif
+        return true;
+    }
+
+    // The arguments for `path`, or false when it should not be started.
+    static bool Arguments(const std::wstring& path, std::vector<std::wstring>& args) {
+        std::wstring name = path.substr(path.find_last_of(L"\\/") + 1);
+#ifdef _WIN32
+        name = Lowercase(name);
+        size_t dot = name.rfind(L'.');
+        std::wstring ext = dot == std::wstring::npos ? L"" : name.substr(dot);
+        // Batch files only run under cmd.exe.
+        if (ext == L".bat" || ext == L".cmd") return false;
+        if (ext == L".exe" || ext == L".com") name.erase(dot);
+#endif
+        const wchar_t* spec = L"--version";
+        for (const auto& entry : VERSION_ARGUMENTS) {
+            if (name == entry.first) spec = entry.second;
+        }
+        if (!spec) return false;
+        std::wstringstream words(spec);
+        std::wstring word;
+        while (words >> word) args.push_back(word);
+        return true;
+    }
+
+    // The first line of output that says something, in printable ASCII.
+    static std::string FirstLine(const std::string& output) {
+        std::string line;
+        for (char c : output) {
+            if (c == '\n' || c == '\r') {
+                if (!line.empty()) break;
+                continue;
+            }
+            line += (c >= 0x20 && c < 0x7f) ? c : c == '\t' ? ' ' : '?';
+        }
+        while (!line.empty() && line.back() == ' ') line.pop_back();
+        if (line.size() > 120) line = line.substr(0, 117) + "...";
+        return line;
+    }
+
+public:
+    // Totals for --timing.
+    size_t probed = 0, reused = 0, timedOut = 0;
+    double seconds = 0, probeSeconds = 0, slowest = 0;
+
+    VersionProber(unsigned probeJobs, int probeTimeoutMs, std::string path, bool load)
+        : jobs(std::max(probeJobs, 1u)), timeoutMs(probeTimeoutMs), cachePath(std::move(path)) {
+        if (cachePath.empty() || !load) return;
+        FILE* file = fopen(cachePath.c_str(), "rb");
+        if (!file) return;
+        char magic[8];
+        uint32_t charSize;
+        if (fread(magic, 1, 8, file) == 8 && memcmp(magic, VERSION_CACHE_MAGIC, 8) == 0 &&
+            fread(&charSize, sizeof(charSize), 1, file) == 1 && charSize == sizeof(wchar_t)) {
+            std::wstring exe;
+            Entry entry;
+            while (ReadCacheString(file, exe) && fread(&entry.modified, sizeof(entry.modified), 1, file) == 1 &&
+                   fread(&entry.size, sizeof(entry.size), 1, file) == 1 && ReadCacheString(file, entry.version))
+                cache[exe] = entry;
+        }
+        fclose(file);
+    }
+
+    // Version lines for `paths`; empty where a tool gave none. Paths that
+    // resolve to the same file under the same name are started once (the
+    // name matters to multi-call binaries such as the rustup proxies).
+    // Probes get no more time than is left before `deadline`.
+    std::unordered_map<std::wstring, std::string> Probe(const std::vector<std::wstring>& paths,
+                                                        const Deadline& deadline) {
+        auto started = std::chrono::steady_clock::now();
+        struct Job {
+            std::wstring path;
+            std::vector<std::wstring> args;
+            std::vector<std::pair<std::wstring, Entry>> targets;
+            ProbeResult result;
+        };
+        std::unordered_map<std::wstring, std::string> versions;
+        std::vector<Job> probes;
+        std::unordered_map<std::wstring, size_t> byFile;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            for (const auto& path : paths) {
+                Entry entry = {};
+                std::vector<std::wstring> args;
+                if (!Stamp(path, entry.modified, entry.size) || !Arguments(path, args)) continue;
+                auto known = cache.find(path);
+                if (known != cache.end() && known->second.modified == entry.modified && known->second.size == entry.size) {
+                    versions[path] = known->second.version;
+                    reused++;
+                    continue;
+                }
+#ifdef _WIN32
+                std::wstring file = Lowercase(path);
+#else
+                char* real = realpath(Narrow(path).c_str(), nullptr);
+                std::wstring file = real ? Widen(real) : path;
+                free(real);
+#endif
+                file += L"\n" + path.substr(path.find_last_of(L"\\/") + 1);
+                auto slot = byFile.emplace(file, probes.size());
+                if (slot.second) probes.push_back({path, args, {}, {}});
+                probes[slot.first->second].targets.push_back({path, entry});
+            }
+        }
+
+        int timeout = (int)deadline.Remaining(timeoutMs);
+        if (timeout == 0) probes.clear();
+        {
+            TaskPool pool(std::min<unsigned>(jobs, (unsigned)probes.size()));
+            for (auto& job : probes) {
+                Job* target = &job;
+                pool.Submit([target, timeout] {
+                    auto probeStarted = std::chrono::steady_clock::now();
+                    target->result = RunProbe(target->path, target->args, timeout);
+                    target->result.seconds = SecondsSince(probeStarted);
+                });
+            }
+            pool.Wait();
+        }
+
+        std::lock_guard<std::mutex> guard(lock);
+        for (const auto& job : probes) {
+            probed++;
+            probeSeconds += job.result.seconds;
+            slowest = std::max(slowest, job.result.seconds);
+            if (job.result.timedOut) {
+                timedOut++;
+                std::string note = "no answer within " + std::to_string(timeout) + " ms";
+                for (const auto& target : job.targets) versions[target.first] = note;
+                continue;
+            }
+            std::string version = job.result.exitCode == 0 ? FirstLine(job.result.output) : "";
+            for (auto target : job.targets) {
+                versions[target.first] = version;
+                target.second.version = version;
+                cache[target.first] = target.second;
+                dirty = true;
+            }
+        }
+        seconds += SecondsSince(started);
+        return versions;
+    }
+
+    // Like SaveCache, through a temporary file.
+    void Save() {
+        std::lock_guard<std::mutex> guard(lock);
+        if (cachePath.empty() || !dirty) return;
+        std::string temp = cachePath + ".tmp";
+        FILE* file = fopen(temp.c_str(), "wb");
+        if (!file) return;
+        uint32_t charSize = sizeof(wchar_t);
+        fwrite(VERSION_CACHE_MAGIC, 1, 8, file);
+        fwrite(&charSize, sizeof(charSize), 1, file);
+        for (const auto& entry : cache) {
+            WriteCacheString(file, entry.first);
+            fwrite(&entry.second.modified, sizeof(entry.second.modified), 1, file);
+            fwrite(&entry.second.size, sizeof(entry.second.size), 1, file);
+            WriteCacheString(file, entry.second.version);
+        }
+        bool ok = fflush(file) == 0 && !ferror(file);
+        ok = fclose(file) == 0 && ok;
+#ifdef _WIN32
+        if (ok && MoveFileExA(temp.c_str(), cachePath.c_str(), MOVEFILE_REPLACE_EXISTING)) return;
+#else
+        if (ok && rename(temp.c_str(), cachePath.c_str()) == 0) return;
+#endif
+        remove(temp.c_str());
+    }
+};
+
+// INSTALLED PROGRAMMING LANGUAGES (Enhanced list)
+// With `versions`, each executable is followed by the first line of what it
+// says about its version.
+void PrintInstalledLanguages(Sink& out, VersionProber* versions, Deadline& deadline) {
+    out.BeginSection("INSTALLED PROGRAMMING LANGUAGES");
+    out.Note("Detection requires language executables to be in the system's PATH.");
+
+    const std::vector<std::pair<const char*, std::vector<std::wstring>>> languages = {
+        {"C", {L"cl.exe", L"gcc.exe", L"clang.exe"}},
+        {"C++", {L"cl.exe", L"g++.exe", L"clang++.exe"}},
+        {"C#", {L"csc.exe", L"dotnet.exe"}},
+        {"D", {L"dmd.exe", L"ldc2.exe", L"gdc.exe"}},
+        {"Java", {L"java.exe", L"javac.exe"}},
+        {"Kotlin", {L"kotlinc.exe", L"kotlinc-jvm.exe", L"kotlin.bat"}},
+        {"Scala", {L"scala.exe", L"scalac.exe"}},
+        {"Go", {L"go.exe"}},
+        {"Rust", {L"rustc.exe", L"cargo.exe"}},
+        {"Swift", {L"swift.exe", L"swiftc.exe"}},
+        {"F#", {L"fsc.exe", L"fsi.exe", L"dotnet.exe"}},
+        {"Fortran", {L"gfortran.exe", L"ifort.exe"}},
+        {"Pascal", {L"fpc.exe", L"ppc386.exe", L"ppcx64.exe"}},
+        {"Delphi", {L"dcc32.exe", L"dcc64.exe", L"bds.exe"}},
+        {"Ada", {L"gnat.exe", L"gcc.exe"}},
+        {"Objective-C", {L"gcc.exe", L"clang.exe"}},
+        {"Zig", {L"zig.exe"}},
+        {"Nim", {L"nim.exe", L"nimble.exe"}},
+        {"Python", {L"python.exe", L"python3.exe", L"pypy.exe", L"pypy3.exe", L"py.exe"}},
+        {"Perl", {L"perl.exe"}},
+        {"PHP", {L"php.exe", L"php-cgi.exe"}},
+        {"Ruby", {L"ruby.exe", L"irb.exe"}},
+        {"Node.js", {L"node.exe"}},
+        {"TypeScript", {L"tsc.exe", L"ts-node.exe"}},
+        {"R", {L"R.exe", L"Rscript.exe"}},
+        {"Lua", {L"lua.exe", L"luajit.exe"}},
+        {"Tcl", {L"tclsh.exe", L"tclsh86.exe", L"tclsh8.6.exe"}},
+        {"Julia", {L"julia.exe"}},
+        {"Raku", {L"raku.exe", L"perl6.exe"}},
+        {"Groovy", {L"groovy.exe", L"groovyc.exe", L"grape.exe"}},
+        {"Haskell (GHC)", {L"ghc.exe", L"ghci.exe", L"runghc.exe"}},
+        {"OCaml", {L"ocaml.exe", L"ocamlc.exe", L"ocamlopt.exe", L"ocamldebug.exe"}},
+        {"Erlang", {L"erl.exe", L"erlc.exe"}},
+        {"Elixir", {L"elixir.exe", L"iex.exe", L"mix.exe"}},
+        {"Lisp (SBCL)", {L"sbcl.exe"}},
+        {"Lisp (CLISP)", {L"clisp.exe"}},
+        {"Clojure", {L"clojure.exe", L"clj.exe"}},
+        {"Scheme", {L"guile.exe", L"mit-scheme.exe", L"racket.exe", L"chicken.exe"}},
+        {"JRuby", {L"jruby.exe"}},
+        {"Jython", {L"jython.exe"}},
+        {"Emscripten (C/C++)", {L"emcc.bat", L"em++.bat", L"emcc", L"em++"}},
+        {"AssemblyScript", {L"asc.cmd", L"asc"}},
+        {"MATLAB", {L"matlab.exe"}},
+        {"Octave", {L"octave-cli.exe", L"octave.exe"}},
+        {"Prolog (SWI-Prolog)", {L"swipl.exe", L"swipl-win.exe"}},
+        {"Visual Basic .NET", {L"vbc.exe"}},
+        {"PowerShell", {L"powershell.exe", L"pwsh.exe"}}
+    };
+
+    PathIndex index(deadline);
+    for (const auto& dir : index.skipped) {
+        deadline.Miss();
+        out.Error("Partial: " + ToUtf8(dir) + " did not answer in time and was skipped");
+    }
+    std::vector<std::vector<std::wstring>> found(languages.size());
+    std::vector<std::wstring> executables;
+    for (size_t i = 0; i < languages.size(); i++) {
+        for (const auto& exe : languages[i].second) {
+            auto paths = index.Find(exe);
+            for (const auto& path : paths) {
+                // emcc and emcc.bat name the same file on Linux.
+                if (std::find(found[i].begin(), found[i].end(), path) == found[i].end()) found[i].push_back(path);
+                if (std::find(executables.begin(), executables.end(), path) == executables.end())
+                    executables.push_back(path);
+            }
+        }
+    }
+    // All at once, before anything is written.
+    std::unordered_map<std::wstring, std::string> known;
+    if (versions) known = versions->Probe(executables, deadline);
+
+    for (size_t i = 0; i < languages.size(); i++) {
+        if (found[i].empty()) continue;
+        std::vector<std::string> paths;
+        for (const auto& path : found[i]) {
+            std::string item = ToUtf8(path);
+            auto version = known.find(path);
+            if (version != known.end() && !version->second.empty()) item += " (" + version->second + ")";
+            paths.push_back(std::move(item));
+        }
+        out.BeginObject();
+        out.Installed(languages[i].first, Value::FromList(std::move(paths)));
+        out.EndObject();
+    }
+    out.EndSection();
+}
+
+// PERFORMANCE PROFILE
+// Short calibrated measurements of what the nominal figures elsewhere in
+// the report only imply: memory bandwidth and latency, compute throughput
+// and disk reads. Working sets are sized from the caches and memory the
+// provider reports. The section is collected alone, after the others, so
+// nothing else competes with it.
+constexpr WmiProperty PROFILE_CPU_FIELDS[] = {
+    {L"L2CacheSize", "L2", Format::Plain},
+    {L"L3CacheSize", "L3", Format::Plain},
+};
+constexpr WmiProperty PROFILE_MEMORY_FIELDS[] = {
+    {L"TotalPhysicalMemory", "Memory", Format::Plain},
+};
+constexpr WmiQuery PROFILE_SIZES[] = {
+    {&WIN32_PROCESSOR, PROFILE_CPU_FIELDS, nullptr, nullptr},
+    {&WIN32_COMPUTER_SYSTEM, PROFILE_MEMORY_FIELDS, nullptr, nullptr},
+};
+static_assert(Valid(PROFILE_SIZES), "PERFORMANCE PROFILE asks for a property its class lacks");
+
+const size_t KB = 1024, MB = 1024 * KB;
+
+// Runs body(t) for t in [0, threads) on as many threads and waits for them.
+template <typename F>
+void OnThreads(unsigned threads, const F& body) {
+    std::vector<std::thread> workers;
+    for (unsigned t = 1; t < threads; t++) workers.emplace_back([&body, t] { body(t); });
+    body(0);
+    for (auto& worker : workers) worker.join();
+}
+
+// Doubles `iterations` until one call of run(iterations) takes at least
+// 20 ms, then scales it to about `seconds`.
+template <typename F>
+long long Calibrate(const F& run, double seconds) {
+    long long iterations = 1 << 10;
+    for (;;) {
+        auto started = std::chrono::steady_clock::now();
+        run(iterations);
+        double took = SecondsSince(started);
+        if (took >= 0.02 || iterations >= (1LL << 40)) return std::max(iterations, (long long)(iterations * seconds / took));
+        iterations *= 2;
+    }
+}
+
+// STREAM's four kernels over three arrays each four times the last-level
+// cache (64-256 MB), split across all threads; the best of five passes.
+void ProfileBandwidth(Sink& out, size_t l3Bytes, size_t memoryBytes, unsigned threads) {
+    size_t arrayBytes = std::min(std::max(4 * l3Bytes, 64 * MB), 256 * MB);
+    arrayBytes = std::min(arrayBytes, std::max(memoryBytes / 16, 16 * MB));
+    size_t n = arrayBytes / sizeof(double);
+    std::unique_ptr<double[]> a(new double[n]), b(new double[n]), c(new double[n]);
+    double* pa = a.get();
+    double* pb = b.get();
+    double* pc = c.get();
+    auto part = [n, threads](unsigned t, size_t& begin, size_t& end) {
+        begin = n * t / threads;
+        end = n * (t + 1) / threads;
+    };
+    // Touched first by the thread that will use each part.
+    OnThreads(threads, [&](unsigned t) {
+        size_t begin, end;
+        part(t, begin, end);
+        for (size_t i = begin; i < end; i++) {
+            pa[i] = 1.0;
+            pb[i] = 2.0;
+            pc[i] = 0.0;
+        }
+    });
+    const double scalar = 3.0;
+    struct Kernel {
+        const char* label;
+        int arrays;  // read and written per element
+    } kernels[] = {{"Copy (GB/s)", 2}, {"Scale (GB/s)", 2}, {"Add (GB/s)", 3}, {"Triad (GB/s)", 3}};
+    double best[4] = {};
+    for (int pass = 0; pass < 5; pass++) {
+        for (int k = 0; k < 4; k++) {
+            auto started = std::chrono::steady_clock::now();
+            OnThreads(threads, [&](unsigned t) {
+                size_t begin, end;
+                part(t, begin, end);
+                switch (k) {
+                case 0: for (size_t i = begin; i < end; i++) pc[i] = pa[i]; break;
+                case 1: for (size_t i = begin; i < end; i++) pb[i] = scalar * pc[i]; break;
+                case 2: for (size_t i = begin; i < end; i++) pc[i] = pa[i] + pb[i]; break;
+                default: for (size_t i = begin; i < end; i++) pa[i] = pb[i] + scalar * pc[i]; break;
+                }
+            });
+            double rate = kernels[k].arrays * arrayBytes / SecondsSince(started) / 1e9;
+            best[k] = std::max(best[k], rate);
+        }
+    }
+    out.Group("Memory Bandwidth");
+    out.BeginObject();
+    out.Field("Threads", Value::FromInt(threads));
+    out.Field("Array Size (MB)", Value::FromInt((long long)(arrayBytes / MB)));
+    for (int k = 0; k < 4; k++) out.Field(kernels[k].label, Value::FromReal(best[k], 1));
+    out.EndObject();
+}
+
+// Dependent loads through a random cycle of cache lines, one working set
+// inside each cache level and one well beyond the last.
+void ProfileLatency(Sink& out, size_t l2Bytes, size_t l3Bytes, size_t memoryBytes) {
+    const size_t LINE = 64;
+    struct Level {
+        const char* name;
+        size_t bytes;
+    };
+    std::vector<Level> levels = {{"L1", 16 * KB}};
+    if (l2Bytes > 64 * KB) levels.push_back({"L2", l2Bytes / 2});
+    if (l3Bytes > l2Bytes) levels.push_back({"L3", l3Bytes / 2});
+    size_t dram = std::min(std::max(4 * l3Bytes, 256 * MB), 512 * MB);
+    levels.push_back({"DRAM", std::min(dram, std::max(memoryBytes / 16, 64 * MB))});
+
+    out.Group("Memory Latency");
+    std::mt19937_64 rng(42);
+    for (const auto& level : levels) {
+        size_t lines = level.bytes / LINE;
+        std::unique_ptr<char[]> buffer(new char[lines * LINE + LINE]);
+        char* base = (char*)(((uintptr_t)buffer.get() + LINE - 1) & ~(uintptr_t)(LINE - 1));
+        // Sattolo's shuffle gives a single cycle through every line.
+        std::vector<uint32_t> order(lines);
+        for (size_t i = 0; i < lines; i++) order[i] = (uint32_t)i;
+        for (size_t i = lines - 1; i > 0; i--) std::swap(order[i], order[rng() % i]);
+        for (size_t i = 0; i < lines; i++) *(char**)(base + (size_t)order[i] * LINE) = base + (size_t)order[(i + 1) % lines] * LINE;
+
+        char* p = base;
+        auto chase = [&p](long long loads) {
+            for (long long i = 0; i < loads; i += 8) {
+                p = *(char**)p; p = *(char**)p; p = *(char**)p; p = *(char**)p;
+                p = *(char**)p; p = *(char**)p; p = *(char**)p; p = *(char**)p;
+            }
+        };
+        long long loads = Calibrate(chase, 0.1);
+        auto started = std::chrono::steady_clock::now();
+        chase(loads);
+        double ns = SecondsSince(started) * 1e9 / loads;
+        char* volatile end = p;  // keeps the loads
+        (void)end;
+
+        out.BeginObject();
+        out.Field("Level", Value::FromString(level.name));
+        out.Field("Working Set (KB)", Value::FromInt((long long)(level.bytes / KB)));
+        out.Field("Latency (ns)", Value::FromReal(ns, 1));
+        out.EndObject();
+    }
+}
+
+// Integer: eight independent 64-bit multiply-add chains. SIMD: twelve
+// independent 4-wide single-precision multiply-add chains (SSE2 where
+// available). Each on one thread, then on every thread at once.
+long long IntegerKernel(long long iterations) {
+    uint64_t x[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+    for (long long i = 0; i < iterations; i++) {
+        for (auto& v : x) v = v * 6364136223846793005ULL + 1442695040888963407ULL;
+    }
+    uint64_t sum = 0;
+    for (auto v : x) sum ^= v;
+    return (long long)sum;
+}
+const double INTEGER_OPS = 8 * 2;
+
+float SimdKernel(long long iterations) {
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+    __m128 acc[12];
+    for (int k = 0; k < 12; k++) acc[k] = _mm_set1_ps(0.5f + k);
+    const __m128 m = _mm_set1_ps(0.9999f), a = _mm_set1_ps(0.0001f);
+    for (long long i = 0; i < iterations; i++) {
+        for (auto& v : acc) v = _mm_add_ps(_mm_mul_ps(v, m), a);
+    }
+    __m128 sum = acc[0];
+    for (int k = 1; k < 12; k++) sum = _mm_add_ps(sum, acc[k]);
+    return _mm_cvtss_f32(sum);
+#else
+    float acc[12][4];
+    for (int k = 0; k < 12; k++)
+        for (auto& v : acc[k]) v = 0.5f + k;
+    for (long long i = 0; i < iterations; i++) {
+        for (auto& lanes : acc)
+            for (auto& v : lanes) v = v * 0.9999f + 0.0001f;
+    }
+    float sum = 0;
+    for (auto& lanes : acc) sum += lanes[0];
+    return sum;
+#endif
+}
+const double SIMD_FLOPS = 12 * 4 * 2;
+
+void ProfileCompute(Sink& out, unsigned threads) {
+    volatile double keep = 0;
+    auto rate = [&](auto kernel, double opsPerIteration, unsigned count) {
+        long long iterations = Calibrate([&](long long n) { keep = keep + (double)kernel(n); }, 0.2);
+        auto started = std::chrono::steady_clock::now();
+        OnThreads(count, [&](unsigned) { keep = keep + (double)kernel(iterations); });
+        return opsPerIteration * iterations * count / SecondsSince(started) / 1e9;
+    };
+    out.Group("Compute");
+    out.BeginObject();
+    out.Field("Integer, One Core (Gops/s)", Value::FromReal(rate(IntegerKernel, INTEGER_OPS, 1), 1));
+    out.Field("Integer, All Cores (Gops/s)", Value::FromReal(rate(IntegerKernel, INTEGER_OPS, threads), 1));
+    out.Field("SIMD, One Core (GFLOP/s)", Value::FromReal(rate(SimdKernel, SIMD_FLOPS, 1), 1));
+    out.Field("SIMD, All Cores (GFLOP/s)", Value::FromReal(rate(SimdKernel, SIMD_FLOPS, threads), 1));
+    out.EndObject();
+}
+
+// Sequential 1 MB reads through a 256 MB temporary file, then random 4 KB
+// reads one at a time for about a second. Reads bypass the page cache
+// (O_DIRECT, FILE_FLAG_NO_BUFFERING) where the file system allows it.
+void ProfileDisk(Sink& out, const std::string& dir) {
+    const size_t FILE_BYTES = 256 * MB, BLOCK = 1 * MB, PAGE = 4 * KB;
+    std::string path = dir + (dir.empty() || dir.back() == '/' || dir.back() == '\\' ? "" : "/") +
+                       "SystemInfo-profile-" + std::to_string((long long)time(nullptr)) + ".tmp";
+    struct AlignedFree {
+        void operator()(char* p) const { ::operator delete[](p, std::align_val_t(4096)); }
+    };
+    std::unique_ptr<char[], AlignedFree> buffer((char*)::operator new[](BLOCK, std::align_val_t(4096)));
+    std::mt19937_64 rng(7);
+    for (size_t i = 0; i < BLOCK; i += 8) {
+        uint64_t word = rng();
+        memcpy(buffer.get() + i, &word, 8);
+    }
+    out.Group("Disk");
+    bool direct = true;
+    double sequential = 0, iops = 0, latency = 0;
+#ifdef _WIN32
+    // Paths from the command line are in the ANSI code page.
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    bool ok = file != INVALID_HANDLE_VALUE;
+    for (size_t done = 0; ok && done < FILE_BYTES; done += BLOCK) {
+        DWORD wrote;
+        ok = WriteFile(file, buffer.get(), (DWORD)BLOCK, &wrote, NULL) && wrote == BLOCK;
+    }
+    if (file != INVALID_HANDLE_VALUE) {
+        ok = FlushFileBuffers(file) && ok;
+        CloseHandle(file);
+    }
+    auto open = [&](DWORD hint) {
+        HANDLE h = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                               FILE_FLAG_NO_BUFFERING | hint, NULL);
+        if (h == INVALID_HANDLE_VALUE) {
+            direct = false;
+            h = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, hint, NULL);
+        }
+        return h;
+    };
+    auto readAt = [&](HANDLE h, size_t offset, size_t bytes) {
+        OVERLAPPED at = {};
+        at.Offset = (DWORD)offset;
+        at.OffsetHigh = (DWORD)((ULONGLONG)offset >> 32);
+        DWORD got;
+        return ReadFile(h, buffer.get(), (DWORD)bytes, &got, &at) && got == bytes;
+    };
+    if (ok && (file = open(FILE_FLAG_SEQUENTIAL_SCAN)) != INVALID_HANDLE_VALUE) {
+        auto started = std::chrono::steady_clock::now();
+        for (size_t offset = 0; ok && offset < FILE_BYTES; offset += BLOCK) ok = readAt(file, offset, BLOCK);
+        sequential = FILE_BYTES / SecondsSince(started) / MB;
+        CloseHandle(file);
+    }
+    if (ok && (file = open(FILE_FLAG_RANDOM_ACCESS)) != INVALID_HANDLE_VALUE) {
+        long long reads = 0;
+        auto started = std::chrono::steady_clock::now();
+        while (ok && reads < 100000 && SecondsSince(started) < 1.0) {
+            ok = readAt(file, (size_t)(rng() % (FILE_BYTES / PAGE)) * PAGE, PAGE);
+            reads++;
+        }
+        double took = SecondsSince(started);
+        iops = reads / took;
+        latency = took * 1e6 / reads;
+        CloseHandle(file);
+    }
+    DeleteFileA(path.c_str());
+#else
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    bool ok = fd >= 0;
+    for (size_t done = 0; ok && done < FILE_BYTES; done += BLOCK) ok = write(fd, buffer.get(), BLOCK) == (ssize_t)BLOCK;
+    if (fd >= 0) {
+        ok = fsync(fd) == 0 && ok;
+        close(fd);
+    }
+    // Without O_DIRECT (tmpfs, some network file systems), the written
+    // pages are at least dropped from the cache before each pass.
+    auto open = [&]() {
+        int h = ::open(path.c_str(), O_RDONLY | O_DIRECT | O_CLOEXEC);
+        if (h < 0) {
+            direct = false;
+            h = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (h >= 0) posix_fadvise(h, 0, 0, POSIX_FADV_DONTNEED);
+        }
+        return h;
+    };
+    if (ok && (fd = open()) >= 0) {
+        auto started = std::chrono::steady_clock::now();
+        for (size_t offset = 0; ok && offset < FILE_BYTES; offset += BLOCK)
+            ok = pread(fd, buffer.get(), BLOCK, (off_t)offset) == (ssize_t)BLOCK;
+        sequential = FILE_BYTES / SecondsSince(started) / MB;
+        close(fd);
+    }
+    if (ok && (fd = open()) >= 0) {
+        long long reads = 0;
+        auto started = std::chrono::steady_clock::now();
+        while (ok && reads < 100000 && SecondsSince(started) < 1.0) {
+            off_t offset = (off_t)(rng() % (FILE_BYTES / PAGE)) * PAGE;
+            ok = pread(fd, buffer.get(), PAGE, offset) == (ssize_t)PAGE;
+            reads++;
+        }
+        double took = SecondsSince(started);
+        iops = reads / took;
+        latency = took * 1e6 / reads;
+        close(fd);
+    }
+    unlink(path.c_str());
+#endif
+    if (!ok) {
+        out.Error("Disk profile failed in " + dir + ": " + strerror(errno));
+        return;
+    }
+    out.BeginObject();
+    out.Field("Directory", Value::FromString(dir));
+    out.Field("File Size (MB)", Value::FromInt((long long)(FILE_BYTES / MB)));
+    out.Field("Direct I/O", Value::FromString(direct ? "yes" : "no (page cache dropped)"));
+    out.Field("Sequential Read (MB/s)", Value::FromReal(sequential, 0));
+    out.Field("Random 4K Read (IOPS)", Value::FromReal(iops, 0));
+    out.Field("Random 4K Latency (us)", Value::FromReal(latency, 1));
+    out.EndObject();
+}
+
+std::string TempDirectory() {
+#ifdef _WIN32
+    char path[MAX_PATH + 1];
+    DWORD len = GetTempPathA(MAX_PATH + 1, path);
+    return len ? std::string(path, len) : ".";
+#else
+    const char* dir = getenv("TMPDIR");
+    return dir && *dir ? dir : "/tmp";
+#endif
+}
+
+void PrintPerformanceProfile(Provider* pSvc, Sink& out, const std::string& diskDir, Deadline& deadline) {
+    out.BeginSection("PERFORMANCE PROFILE");
+    // Cache sizes in KB for the first processor; placeholders and missing
+    // values fall back to common sizes.
+    size_t l2 = 0, l3 = 0, memory = 0;
+    PropertyList cpu = PROFILE_SIZES[0].properties, system = PROFILE_SIZES[1].properties;
+    pSvc->Query(PROFILE_SIZES[0].cls->name, cpu, L"", [&](const Value* values) {
+        if (!l2) l2 = (size_t)values[0].AsDouble() * KB;
+        if (!l3) l3 = (size_t)values[1].AsDouble() * KB;
+    }, deadline.Step());
+    pSvc->Query(PROFILE_SIZES[1].cls->name, system, L"", [&](const Value* values) {
+        if (!memory) memory = (size_t)values[0].AsDouble();
+    }, deadline.Step());
+    if (l2 < 64 * KB || l2 > 64 * MB) l2 = 1 * MB;
+    if (l3 < l2 || l3 > 1024 * MB) l3 = std::max(l2, 8 * MB);
+    if (memory < 256 * MB) memory = 4096 * MB;
+    unsigned threads = std::max(std::thread::hardware_concurrency(), 1u);
+
+    // Each stage takes a few seconds; none starts once the budget is gone.
+    std::function<void()> stages[] = {
+        [&] { ProfileBandwidth(out, l3, memory, threads); },
+        [&] { ProfileLatency(out, l2, l3, memory); },
+        [&] { ProfileCompute(out, threads); },
+        [&] { ProfileDisk(out, diskDir.empty() ? TempDirectory() : diskDir); },
+    };
+    for (const auto& stage : stages) {
+        if (deadline.Expired()) {
+            deadline.Miss();
+            out.Error("Partial: the time budget ran out before every measurement was taken");
+            break;
+        }
+        stage();
+    }
+    out.EndSection();
+}
+
+// SAMPLING MODE
+// Volatile metrics at a fixed interval, for watching a machine over time
+// rather than describing it once.
+
+// One sample. Rates are per second over the preceding interval; per-core
+// loads (percent busy) are stored beside it in the ring.
+struct Sample {
+    long long time;  // Unix milliseconds
+    ULONGLONG memAvailable;
+    double diskRead, diskWrite;  // bytes/s
+    double netRx, netTx;         // bytes/s
+};
+
+// Single-producer, single-consumer queue of samples in storage allocated
+// once. The sampler never blocks on the writer: a sample that finds the
+// ring full is counted and dropped.
+class SampleRing {
+    std::vector<Sample> slots;
+    std::vector<float> loads;
+    size_t cores;
+    alignas(64) std::atomic<size_t> head{0};  // next slot to fill
+    alignas(64) std::atomic<size_t> tail{0};  // next slot to drain
+
+public:
+    std::atomic<ULONGLONG> dropped{0};
+
+    SampleRing(size_t capacity, size_t coreCount)
+        : slots(capacity), loads(capacity * coreCount), cores(coreCount) {}
+
+    // Producer: a free slot to fill, or null if the ring is full.
+    Sample* Reserve(float*& coreLoads) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) == slots.size()) return nullptr;
+        coreLoads = &loads[(h % slots.size()) * cores];
+        return &slots[h % slots.size()];
+    }
+    void Publish() { head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+    // Consumer: the oldest filled slot, or null if the ring is empty.
+    const Sample* Peek(const float*& coreLoads) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t == head.load(std::memory_order_acquire)) return nullptr;
+        coreLoads = &loads[(t % slots.size()) * cores];
+        return &slots[t % slots.size()];
+    }
+    void Release() { tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+};
+
+// CPU time of the calling thread, in seconds.
+double ThreadCpuSeconds() {
+#ifdef _WIN32
+    FILETIME created, exited, kernel, user;
+    if (!GetThreadTimes(GetCurrentThread(), &created, &exited, &kernel, &user)) return 0;
+    return ((((ULONGLONG)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime) +
+            (((ULONGLONG)user.dwHighDateTime << 32) | user.dwLowDateTime)) / 1e7;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+double ProcessCpuSeconds() {
+#ifdef _WIN32
+    FILETIME created, exited, kernel, user;
+    if (!GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user)) return 0;
+    return ((((ULONGLONG)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime) +
+            (((ULONGLONG)user.dwHighDateTime << 32) | user.dwLowDateTime)) / 1e7;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+#ifdef _WIN32
+// Performance counters through PDH, which gives rates and loads directly.
+class MetricSource {
+    PDH_HQUERY query = NULL;
+    PDH_HCOUNTER cpu = NULL, memory = NULL, diskRead = NULL, diskWrite = NULL, netRx = NULL, netTx = NULL;
+    std::vector<BYTE> items;  // reused by every wildcard read
+    size_t cores;
+    ULONGLONG memTotal = 0;
+
+    double Value(PDH_HCOUNTER counter) {
+        PDH_FMT_COUNTERVALUE value;
+        if (!counter || PdhGetFormattedCounterValue(counter, PDH_FMT_DOUBLE, NULL, &value) != ERROR_SUCCESS)
+            return 0;
+        return value.doubleValue;
+    }
+
+    // Calls `each` with every instance of a wildcard counter.
+    template <typename Each>
+    void Instances(PDH_HCOUNTER counter, Each each) {
+        if (!counter) return;
+        DWORD size = (DWORD)items.size(), count = 0;
+        PDH_STATUS status = PdhGetFormattedCounterArrayW(counter, PDH_FMT_DOUBLE, &size, &count,
+                                                         (PDH_FMT_COUNTERVALUE_ITEM_W*)items.data());
+        if (status == PDH_MORE_DATA) {
+            items.resize(size);
+            status = PdhGetFormattedCounterArrayW(counter, PDH_FMT_DOUBLE, &size, &count,
+                                                  (PDH_FMT_COUNTERVALUE_ITEM_W*)items.data());
+        }
+        if (status != ERROR_SUCCESS) return;
+        const PDH_FMT_COUNTERVALUE_ITEM_W* item = (const PDH_FMT_COUNTERVALUE_ITEM_W*)items.data();
+        for (DWORD i = 0; i < count; i++) each(item[i].szName, item[i].FmtValue.doubleValue);
+    }
+
+public:
+    MetricSource() : items(64 * 1024) {
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        cores = info.dwNumberOfProcessors;
+        MEMORYSTATUSEX status;
+        status.dwLength = sizeof(status);
+        if (GlobalMemoryStatusEx(&status)) memTotal = status.ullTotalPhys;
+
+        if (PdhOpenQueryW(NULL, 0, &query) != ERROR_SUCCESS) {
+            query = NULL;
+            return;
+        }
+        const struct {
+            const wchar_t* path;
+            PDH_HCOUNTER* counter;
+        } counters[] = {
+            {L"\\Processor(*)\\% Processor Time", &cpu},
+            {L"\\Memory\\Available Bytes", &memory},
+            {L"\\PhysicalDisk(_Total)\\Disk Read Bytes/sec", &diskRead},
+            {L"\\PhysicalDisk(_Total)\\Disk Write Bytes/sec", &diskWrite},
+            {L"\\Network Interface(*)\\Bytes Received/sec", &netRx},
+            {L"\\Network Interface(*)\\Bytes Sent/sec", &netTx},
+        };
+        for (const auto& counter : counters) {
+            if (PdhAddEnglishCounterW(query, counter.path, 0, counter.counter) != ERROR_SUCCESS)
+                *counter.counter = NULL;
+        }
+        // Rates need two collections; this is the first.
+        PdhCollectQueryData(query);
+    }
+
+    ~MetricSource() {
+        if (query) PdhCloseQuery(query);
+    }
+
+    bool IsOK() const { return query != NULL; }
+    size_t Cores() const { return cores; }
+    ULONGLONG MemTotal() const { return memTotal; }
+
+    void Read(Sample& sample, float* loads) {
+        PdhCollectQueryData(query);
+        sample.memAvailable = (ULONGLONG)Value(memory);
+        sample.diskRead = Value(diskRead);
+        sample.diskWrite = Value(diskWrite);
+        sample.netRx = sample.netTx = 0;
+        Instances(netRx, [&](const wchar_t*, double value) { sample.netRx += value; });
+        Instances(netTx, [&](const wchar_t*, double value) { sample.netTx += value; });
+        // Instances are named "0", "1", ... plus "_Total".
+        std::fill(loads, loads + cores, 0.0f);
+        Instances(cpu, [&](const wchar_t* name, double value) {
+            if (name[0] < L'0' || name[0] > L'9') return;
+            size_t index = wcstoul(name, nullptr, 10);
+            if (index < cores) loads[index] = (float)value;
+        });
+    }
+};
+#else
+// Cumulative counters from /proc, differenced between samples. Each file
+// stays open and is re-read with a single pread into a buffer allocated
+// once, so a sample costs four system calls and no allocation.
+class MetricSource {
+    int statFd, memFd, diskFd, netFd;
+    std::vector<char> buffer;
+    std::vector<std::string> disks;  // whole disks, so partitions are not counted twice
+    size_t cores = 0;
+    ULONGLONG memTotal = 0;
+    std::vector<ULONGLONG> lastBusy, lastTotal, busy, total;
+    ULONGLONG lastRead = 0, lastWrite = 0, lastRx = 0, lastTx = 0;
+    std::chrono::steady_clock::time_point lastTime;
+
+    const char* Load(int fd) {
+        ssize_t got = fd < 0 ? -1 : pread(fd, buffer.data(), buffer.size() - 1, 0);
+        buffer[got > 0 ? got : 0] = '\0';
+        return buffer.data();
+    }
+
+    static ULONGLONG Number(const char*& p) {
+        while (*p == ' ' || *p == '\t') p++;
+        ULONGLONG value = 0;
+        while (*p >= '0' && *p <= '9') value = value * 10 + (ULONGLONG)(*p++ - '0');
+        return value;
+    }
+
+    static const char* NextLine(const char* p) {
+        const char* end = strchr(p, '\n');
+        return end ? end + 1 : p + strlen(p);
+    }
+
+    // Fills busy and total jiffies per core; returns the cores seen.
+    size_t ReadCpu(std::vector<ULONGLONG>& busy, std::vector<ULONGLONG>& total) {
+        size_t seen = 0;
+        for (const char* line = Load(statFd); *line; line = NextLine(line)) {
+            if (strncmp(line, "cpu", 3) != 0 || line[3] < '0' || line[3] > '9') continue;
+            const char* p = line + 3;
+            size_t index = (size_t)Number(p);
+            ULONGLONG fields[8] = {0};
+            for (auto& field : fields) field = Number(p);
+            ULONGLONG sum = 0;
+            for (auto field : fields) sum += field;
+            if (index < busy.size()) {
+                total[index] = sum;
+                busy[index] = sum - fields[3] - fields[4];  // minus idle and iowait
+            }
+            seen++;
+        }
+        return seen;
+    }
+
+    void ReadDisks(ULONGLONG& read, ULONGLONG& written) {
+        read = written = 0;
+        for (const char* line = Load(diskFd); *line; line = NextLine(line)) {
+            const char* p = line;
+            Number(p);
+            Number(p);
+            while (*p == ' ') p++;
+            const char* name = p;
+            while (*p && *p != ' ') p++;
+            size_t len = (size_t)(p - name);
+            bool whole = false;
+            for (const auto& disk : disks) {
+                if (disk.size() == len && strncmp(disk.c_str(), name, len) == 0) whole = true;
+            }
+            if (!whole) continue;
+            Number(p);                // reads completed
+            Number(p);                // reads merged
+            read += Number(p) * 512;  // sectors read
+            Number(p);                // ms reading
+            Number(p);                // writes completed
+            Number(p);                // writes merged
+            written += Number(p) * 512;
+        }
+    }
+
+    void ReadNetwork(ULONGLONG& rx, ULONGLONG& tx) {
+        rx = tx = 0;
+        for (const char* line = Load(netFd); *line; line = NextLine(line)) {
+            const char* colon = strchr(line, ':');
+            const char* end = strchr(line, '\n');
+            if (!colon || (end && colon > end)) continue;
+            const char* name = line;
+            while (*name == ' ') name++;
+            if (colon - name == 2 && strncmp(name, "lo", 2) == 0) continue;
+            const char* p = colon + 1;
+            rx += Number(p);
+            for (int field = 0; field < 7; field++) Number(p);
+            tx += Number(p);
+        }
+    }
+
+public:
+    MetricSource() : buffer(256 * 1024) {
+        statFd = open("/proc/stat", O_RDONLY | O_CLOEXEC);
+        memFd = open("/proc/meminfo", O_RDONLY | O_CLOEXEC);
+        diskFd = open("/proc/diskstats", O_RDONLY | O_CLOEXEC);
+        netFd = open("/proc/net/dev", O_RDONLY | O_CLOEXEC);
+        for (const auto& block : ListDirectory("/sys/block")) {
+            struct stat info;
+            if (stat(("/sys/block/" + block + "/device").c_str(), &info) == 0) disks.push_back(block);
+        }
+        std::vector<ULONGLONG> none;
+        cores = ReadCpu(none, none);
+        lastBusy.assign(cores, 0);
+        lastTotal.assign(cores, 0);
+        busy.assign(cores, 0);
+        total.assign(cores, 0);
+        std::string kb = FindKey(Load(memFd), "MemTotal", ':');
+        memTotal = strtoull(kb.c_str(), nullptr, 10) * 1024;
+
+        // The first sample's rates are measured from here.
+        ReadCpu(lastBusy, lastTotal);
+        ReadDisks(lastRead, lastWrite);
+        ReadNetwork(lastRx, lastTx);
+        lastTime = std::chrono::steady_clock::now();
+    }
+
+    ~MetricSource() {
+        for (int fd : {statFd, memFd, diskFd, netFd}) {
+            if (fd >= 0) close(fd);
+        }
+    }
+
+    bool IsOK() const { return statFd >= 0 && memFd >= 0 && cores > 0; }
+    size_t Cores() const { return cores; }
+    ULONGLONG MemTotal() const { return memTotal; }
+
+    void Read(Sample& sample, float* loads) {
+        auto now = std::chrono::steady_clock::now();
+        double seconds = std::chrono::duration<double>(now - lastTime).count();
+        if (seconds <= 0) seconds = 1e-9;
+        lastTime = now;
+
+        // Swap the previous totals out, read the new ones in place.
+        lastBusy.swap(busy);
+        lastTotal.swap(total);
+        ReadCpu(lastBusy, lastTotal);
+        for (size_t c = 0; c < cores; c++) {
+            ULONGLONG elapsed = lastTotal[c] - total[c];
+            loads[c] = elapsed ? (float)(100.0 * (lastBusy[c] - busy[c]) / elapsed) : 0.0f;
+        }
+
+        const char* meminfo = Load(memFd);
+        const char* available = strstr(meminfo, "MemAvailable:");
+        if (available) {
+            const char* p = available + 13;
+            sample.memAvailable = Number(p) * 1024;
+        } else {
+            sample.memAvailable = 0;
+        }
+
+        ULONGLONG read, written, rx, tx;
+        ReadDisks(read, written);
+        ReadNetwork(rx, tx);
+        sample.diskRead = (read - lastRead) / seconds;
+        sample.diskWrite = (written - lastWrite) / seconds;
+        sample.netRx = (rx - lastRx) / seconds;
+        sample.netTx = (tx - lastTx) / seconds;
+        lastRead = read;
+        lastWrite = written;
+        lastRx = rx;
+        lastTx = tx;
+    }
+};
+#endif
+
+// Set by Ctrl+C (SIGINT, SIGTERM on Linux) in the modes that run until
+// interrupted: sampling and the query service.
+std::atomic<bool> stopRequested{false};
+
+#ifdef _WIN32
+BOOL WINAPI StopOnCtrlC(DWORD) {
+    stopRequested = true;
+    return TRUE;
+}
+#else
+void StopOnSignal(int) { stopRequested = true; }
+#endif
+
+// Writes one sample as a JSON line.
+void WriteSample(Utf8Writer& out, const Sample& sample, const float* loads, size_t cores) {
+    out.Write("{\"t\":");
+    out.Int(sample.time);
+    out.Write(",\"mem_avail\":");
+    out.Int((long long)sample.memAvailable);
+    out.Write(",\"cpu\":[");
+    for (size_t c = 0; c < cores; c++) {
+        if (c) out.Put(',');
+        out.Real(loads[c], 1);
+    }
+    out.Write("],\"disk_read\":");
+    out.Real(sample.diskRead, 0);
+    out.Write(",\"disk_write\":");
+    out.Real(sample.diskWrite, 0);
+    out.Write(",\"net_rx\":");
+    out.Real(sample.netRx, 0);
+    out.Write(",\"net_tx\":");
+    out.Real(sample.netTx, 0);
+    out.Write("}\n");
+}
+
+// Samples every `intervalMs` into the ring on a thread of its own while
+// this thread drains the ring to `path` every `flushMs`. Stops after
+// `durationS` seconds, or on Ctrl+C when that is 0. Reports the sampler's
+// own CPU use at the end.
+int RunSampler(const std::string& path, int intervalMs, int flushMs, int durationS) {
+    MetricSource source;
+    if (!source.IsOK()) {
+        std::wcerr << L"Cannot open the performance counters.\n";
+        return 1;
+    }
+    FILE* file = path == "-" ? stdout : fopen(path.c_str(), "w");
+    if (!file) {
+        std::wcerr << L"Cannot create " << path.c_str() << L"\n";
+        return 1;
+    }
+#ifdef _WIN32
+    SetConsoleCtrlHandler(StopOnCtrlC, TRUE);
+#else
+    signal(SIGINT, StopOnSignal);
+    signal(SIGTERM, StopOnSignal);
+#endif
+
+    size_t cores = source.Cores();
+    // Room for a minute of samples or ten flushes, whichever is more.
+    size_t capacity = std::max<size_t>(60000 / intervalMs, 10 * (size_t)flushMs / intervalMs + 1);
+    SampleRing ring(capacity, cores);
+    Utf8Writer writer(file);
+    writer.Write("{\"start\":");
+    writer.Int((long long)time(nullptr) * 1000);
+    writer.Write(",\"interval_ms\":");
+    writer.Int(intervalMs);
+    writer.Write(",\"cores\":");
+    writer.Int((long long)cores);
+    writer.Write(",\"mem_total\":");
+    writer.Int((long long)source.MemTotal());
+    writer.Write("}\n");
+
+    ULONGLONG samples = 0;
+    double samplerCpu = 0;
+    std::atomic<bool> samplerDone{false};
+    auto started = std::chrono::steady_clock::now();
+    auto deadline = started + std::chrono::seconds(durationS);
+    double processCpuStart = ProcessCpuSeconds();
+
+    std::thread sampler([&] {
+        double cpuStart = ThreadCpuSeconds();
+        auto next = started + std::chrono::milliseconds(intervalMs);
+        while (!stopRequested && (durationS <= 0 || next <= deadline)) {
+            std::this_thread::sleep_until(next);
+            next += std::chrono::milliseconds(intervalMs);
+            float* loads;
+            Sample* sample = ring.Reserve(loads);
+            if (!sample) {
+                ring.dropped++;
+                continue;
+            }
+            sample->time = std::chrono::duration_cast<std::chrono::milliseconds>(
+                               std::chrono::system_clock::now().time_since_epoch()).count();
+            source.Read(*sample, loads);
+            ring.Publish();
+            samples++;
+        }
+        samplerCpu = ThreadCpuSeconds() - cpuStart;
+        samplerDone = true;
+    });
+
+    // Drain until the sampler has finished and the ring is empty.
+    for (;;) {
+        bool finished = samplerDone;
+        const float* loads;
+        while (const Sample* sample = ring.Peek(loads)) {
+            WriteSample(writer, *sample, loads, cores);
+            ring.Release();
+        }
+        writer.Flush();
+        if (finished) break;
+        auto wake = std::chrono::steady_clock::now() + std::chrono::milliseconds(flushMs);
+        while (!samplerDone && std::chrono::steady_clock::now() < wake)
+            std::this_thread::sleep_for(std::chrono::milliseconds(std::min(flushMs, 50)));
+    }
+    sampler.join();
+    if (file != stdout) fclose(file);
+
+    double wall = SecondsSince(started);
+    double processCpu = ProcessCpuSeconds() - processCpuStart;
+    std::wcerr << std::fixed << std::setprecision(3) << samples << L" samples in " << wall << L" s, "
+               << ring.dropped.load() << L" dropped. Sampler thread: " << samplerCpu * 1000 << L" ms CPU ("
+               << (samples ? samplerCpu * 1e6 / samples : 0.0) << L" us per sample, "
+               << (wall > 0 ? samplerCpu * 100 / wall : 0.0) << L"% of one core); whole process "
+               << processCpu * 1000 << L" ms (" << (wall > 0 ? processCpu * 100 / wall : 0.0) << L"%)\n";
+    return 0;
+}
+
+// QUERY SERVICE
+// With --serve, SystemInfo stays resident: the provider connection and
+// the collected sections are kept, sections are collected again in the
+// background as they fall due, and the report, or some of its sections,
+// is handed out on request over a Unix domain socket (Linux) or a named
+// pipe (Windows). A caller then pays for a round trip instead of COM, WMI
+// and a collection.
+//
+// Every message is a frame: its length as 4 bytes, little endian, then
+// that many bytes. A request is the format ('t' text, 'j' JSON, 'b'
+// binary) followed by the names of the sections wanted, separated by
+// commas (none for the whole report). The answer is a status byte, then
+// the report for 0 or an error message for 1. A connection may carry any
+// number of requests, one at a time.
+
+const uint32_t MAX_REQUEST = 4096;
+const uint32_t MAX_ANSWER = 1u << 28;
+
+#ifdef _WIN32
+typedef HANDLE Channel;
+const Channel NO_CHANNEL = INVALID_HANDLE_VALUE;
+
+// NAME or \\.\pipe\NAME.
+std::wstring PipeName(const std::string& endpoint) {
+    std::wstring name(endpoint.size(), L'\0');
+    name.resize((size_t)MultiByteToWideChar(CP_ACP, 0, endpoint.c_str(), (int)endpoint.size(), &name[0],
+                                            (int)name.size()));
+    const std::wstring prefix = L"\\\\.\\pipe\\";
+    return name.compare(0, prefix.size(), prefix) == 0 ? name : prefix + name;
+}
+#else
+typedef int Channel;
+const Channel NO_CHANNEL = -1;
+
+bool SocketAddress(const std::string& path, sockaddr_un& address) {
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+#endif
+
+// Both return false at the end of the stream or on an error.
+bool ReadExactly(Channel channel, char* data, size_t size) {
+    while (size > 0) {
+#ifdef _WIN32
+        DWORD got = 0;
+        if (!ReadFile(channel, data, (DWORD)std::min<size_t>(size, 1u << 20), &got, nullptr) || got == 0)
+            return false;
+#else
+        ssize_t got = recv(channel, data, size, 0);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return false;
+#endif
+        data += got;
+        size -= (size_t)got;
+    }
+    return true;
+}
+
+bool WriteExactly(Channel channel, const char* data, size_t size) {
+    while (size > 0) {
+#ifdef _WIN32
+        DWORD put = 0;
+        if (!WriteFile(channel, data, (DWORD)std::min<size_t>(size, 1u << 20), &put, nullptr) || put == 0)
+            return false;
+#else
+        ssize_t put = send(channel, data, size, MSG_NOSIGNAL);
+        if (put < 0 && errno == EINTR) continue;
+        if (put <= 0) return false;
+#endif
+        data += put;
+        size -= (size_t)put;
+    }
+    return true;
+}
+
+bool ReadFrame(Channel channel, std::string& payload, uint32_t limit) {
+    unsigned char header[4];
+    if (!ReadExactly(channel, (char*)header, 4)) return false;
+    uint32_t size = header[0] | header[1] << 8 | header[2] << 16 | (uint32_t)header[3] << 24;
+    if (size > limit) return false;
+    payload.resize(size);
+    return ReadExactly(channel, &payload[0], size);
+}
+
+bool WriteFrame(Channel channel, std::string_view payload) {
+    uint32_t size = (uint32_t)payload.size();
+    char header[4] = {(char)size, (char)(size >> 8), (char)(size >> 16), (char)(size >> 24)};
+    return WriteExactly(channel, header, 4) && WriteExactly(channel, payload.data(), payload.size());
+}
+
+void CloseChannel(Channel channel) {
+#ifdef _WIN32
+    CloseHandle(channel);
+#else
+    close(channel);
+#endif
+}
+
+Channel ConnectTo(const std::string& endpoint) {
+#ifdef _WIN32
+    std::wstring name = PipeName(endpoint);
+    for (;;) {
+        HANDLE pipe = CreateFileW(name.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, 0, nullptr);
+        if (pipe != INVALID_HANDLE_VALUE) return pipe;
+        // Every instance busy: wait for the server to create the next one.
+        if (GetLastError() != ERROR_PIPE_BUSY || !WaitNamedPipeW(name.c_str(), 5000)) return NO_CHANNEL;
+    }
+#else
+    sockaddr_un address;
+    if (!SocketAddress(endpoint, address)) return NO_CHANNEL;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return NO_CHANNEL;
+    if (connect(fd, (sockaddr*)&address, sizeof(address)) != 0) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return NO_CHANNEL;
+    }
+    return fd;
+#endif
+}
+
+// Sends one request and receives its answer.
+bool Ask(Channel channel, std::string_view request, std::string& answer) {
+    return WriteFrame(channel, request) && ReadFrame(channel, answer, MAX_ANSWER) && !answer.empty();
+}
+
+// Holds the sections collected by main and serves them. The sections are
+// only touched by the refresher thread; what it collects is published as
+// immutable buffers, and answers rendered from them are kept until a
+// section they include changes.
+class ReportService {
+    std::vector<Section>& sections;
+    std::string cachePath;
+    int queryTimeout, budget;
+    std::chrono::milliseconds interval;
+
+    std::mutex lock;  // guards everything below it up to the counters
+    std::vector<std::shared_ptr<const std::string>> published;
+    std::vector<uint64_t> changedAt;  // generation each section last changed in
+    uint64_t generation = 0;
+    struct Rendered {
+        uint64_t generation;
+        std::shared_ptr<const std::string> answer;
+    };
+    std::unordered_map<std::string, Rendered> rendered;
+
+    struct Connection {
+        Channel channel;
+        std::thread thread;
+        std::atomic<bool> done{false};
+    };
+    std::mutex connectionsLock;
+    std::list<Connection> connections;
+
+public:
+    std::atomic<long long> answered{0}, reused{0}, accepted{0};
+    long long passes = 0, recollected = 0, changed = 0;
+
+private:
+    static std::shared_ptr<const std::string> Failure(const std::string& message) {
+        return std::make_shared<const std::string>(std::string(1, '\1') + message);
+    }
+
+    // Collects again what is due: sections collected every run at each
+    // interval, cached ones when their TTL is up or their key no longer
+    // matches, partial ones until they are complete. A refresh that comes
+    // back partial does not replace a complete answer. The performance
+    // profile is measured once, and a partial one stays partial.
+    void Refresh() {
+        long long now = (long long)time(nullptr);
+        Deadline pass(budget > 0 ? std::chrono::steady_clock::now() + std::chrono::milliseconds(budget)
+                                 : std::chrono::steady_clock::time_point::max(),
+                      std::chrono::milliseconds(std::max(queryTimeout, 0)));
+        bool save = false;
+        for (size_t i = 0; i < sections.size(); i++) {
+            Section& section = sections[i];
+            if (section.alone) continue;
+            std::wstring key;
+            if (section.ttl > 0) {
+                key = section.key ? section.key(pass) : std::wstring();
+                if (!section.partial && key == section.validation && now - section.collectedAt < section.ttl &&
+                    section.collectedAt <= now)
+                    continue;
+            }
+            std::string encoded;
+            BinarySink recorder(encoded);
+            Deadline deadline = pass;
+            section.collect(recorder, deadline);
+            recollected++;
+            if (deadline.Missed() && !section.partial) continue;
+            section.partial = deadline.Missed();
+            section.validation = key;
+            section.collectedAt = now;
+            save = save || (section.ttl > 0 && !section.partial);
+            if (encoded == section.encoded) continue;
+            section.encoded = encoded;
+            changed++;
+            std::lock_guard<std::mutex> guard(lock);
+            published[i] = std::make_shared<const std::string>(std::move(encoded));
+            changedAt[i] = ++generation;
+        }
+        passes++;
+        if (save && !cachePath.empty()) SaveCache(cachePath, sections.data(), sections.size());
+    }
+
+    // The answer to one request, with its status byte.
+    std::shared_ptr<const std::string> Answer(const std::string& request) {
+        if (request.empty() || (request[0] != 't' && request[0] != 'j' && request[0] != 'b'))
+            return Failure("Unknown format; expected t, j or b");
+        std::vector<size_t> wanted;
+        for (size_t start = 1; start < request.size();) {
+            size_t end = std::min(request.find(',', start), request.size());
+            std::string name = request.substr(start, end - start);
+            auto match = std::find_if(sections.begin(), sections.end(),
+                                      [&](const Section& section) { return name == section.name; });
+            if (match == sections.end()) return Failure("Unknown section: " + name);
+            wanted.push_back((size_t)(match - sections.begin()));
+            start = end + 1;
+        }
+        if (wanted.empty()) {
+            for (size_t i = 0; i < sections.size(); i++) wanted.push_back(i);
+        }
+
+        std::vector<std::shared_ptr<const std::string>> parts;
+        uint64_t asOf;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            asOf = generation;
+            auto hit = rendered.find(request);
+            if (hit != rendered.end() &&
+                std::all_of(wanted.begin(), wanted.end(),
+                            [&](size_t i) { return changedAt[i] <= hit->second.generation; })) {
+                reused++;
+                return hit->second.answer;
+            }
+            for (size_t i : wanted) parts.push_back(published[i]);
+        }
+
+        std::string answer(1, '\0');
+        if (request[0] == 'b') {
+            answer.append(REPORT_MAGIC, sizeof(REPORT_MAGIC));
+            for (const auto& part : parts) answer += *part;
+        } else {
+            Utf8Writer writer(answer);
+            TextSink text(writer);
+            JsonSink json(writer);
+            Sink& sink = request[0] == 'j' ? (Sink&)json : (Sink&)text;
+            sink.BeginReport();
+            for (const auto& part : parts) Replay(*part, sink);
+            sink.EndReport();
+            writer.Flush();
+        }
+        auto shared = std::make_shared<const std::string>(std::move(answer));
+        std::lock_guard<std::mutex> guard(lock);
+        if (rendered.size() >= 256) rendered.clear();
+        rendered[request] = {asOf, shared};
+        return shared;
+    }
+
+    void Converse(Channel channel) {
+        std::string request;
+        while (ReadFrame(channel, request, MAX_REQUEST)) {
+            auto answer = Answer(request);
+            answered++;
+            if (!WriteFrame(channel, *answer)) break;
+        }
+    }
+
+    // Reaps finished connections and starts a thread for the new one.
+    void Accepted(Channel channel) {
+        accepted++;
+        std::lock_guard<std::mutex> guard(connectionsLock);
+        for (auto it = connections.begin(); it != connections.end();) {
+            if (!it->done) {
+                ++it;
+                continue;
+            }
+            it->thread.join();
+            CloseChannel(it->channel);
+            it = connections.erase(it);
+        }
+        connections.emplace_back();
+        Connection& connection = connections.back();
+        connection.channel = channel;
+        connection.thread = std::thread([this, &connection] {
+            Converse(connection.channel);
+            connection.done = true;
+        });
+    }
+
+    void Announce(const std::string& endpoint) {
+        std::wcerr << L"Serving " << sections.size() << L" sections on " << endpoint.c_str()
+                   << L"; Ctrl+C to stop\n";
+        std::wcerr.flush();
+    }
+
+    // Ends the conversations still open and waits for their threads. A
+    // shut down socket stays shut; on a pipe each blocked read has to be
+    // cancelled, so that is repeated until the thread notices.
+    void HangUp() {
+        std::lock_guard<std::mutex> guard(connectionsLock);
+        for (auto& connection : connections) {
+#ifdef _WIN32
+            while (!connection.done) {
+                CancelIoEx(connection.channel, nullptr);
+                Sleep(10);
+            }
+#else
+            shutdown(connection.channel, SHUT_RDWR);
+#endif
+        }
+        for (auto& connection : connections) {
+            connection.thread.join();
+            CloseChannel(connection.channel);
+        }
+        connections.clear();
+    }
+
+    // Accepts connections until Ctrl+C; false if the endpoint cannot be
+    // set up.
+    bool Listen(const std::string& endpoint) {
+#ifdef _WIN32
+        std::wstring name = PipeName(endpoint);
+        // ConnectNamedPipe cannot be interrupted; a connection of our own
+        // wakes it once Ctrl+C is pressed.
+        std::thread waker([&name] {
+            while (!stopRequested) Sleep(100);
+            HANDLE pipe = CreateFileW(name.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, 0,
+                                      nullptr);
+            if (pipe != INVALID_HANDLE_VALUE) CloseHandle(pipe);
+        });
+        bool first = true;
+        while (!stopRequested) {
+            HANDLE pipe = CreateNamedPipeW(
+                name.c_str(), PIPE_ACCESS_DUPLEX | (first ? FILE_FLAG_FIRST_PIPE_INSTANCE : 0),
+                PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+                PIPE_UNLIMITED_INSTANCES, 64 * 1024, 64 * 1024, 0, nullptr);
+            if (pipe == INVALID_HANDLE_VALUE) {
+                if (first) {
+                    std::wcerr << L"Cannot create " << name << L" (error " << GetLastError()
+                               << L"); is another server using it?\n";
+                    stopRequested = true;
+                    waker.join();
+                    return false;
+                }
+                Sleep(100);
+                continue;
+            }
+            if (first) Announce(endpoint);
+            first = false;
+            if (!ConnectNamedPipe(pipe, nullptr) && GetLastError() != ERROR_PIPE_CONNECTED) {
+                CloseHandle(pipe);
+                continue;
+            }
+            if (stopRequested) {
+                CloseHandle(pipe);
+                break;
+            }
+            Accepted(pipe);
+        }
+        waker.join();
+        return true;
+#else
+        sockaddr_un address;
+        if (!SocketAddress(endpoint, address)) {
+            std::wcerr << L"Socket path too long: " << endpoint.c_str() << L"\n";
+            return false;
+        }
+        // A socket left by a server that died is removed; one still
+        // answering is not taken over, and nothing else is deleted.
+        struct stat info;
+        if (lstat(endpoint.c_str(), &info) == 0) {
+            if (!S_ISSOCK(info.st_mode)) {
+                std::wcerr << endpoint.c_str() << L" exists and is not a socket\n";
+                return false;
+            }
+            Channel live = ConnectTo(endpoint);
+            if (live != NO_CHANNEL) {
+                CloseChannel(live);
+                std::wcerr << endpoint.c_str() << L" is in use by another server\n";
+                return false;
+            }
+            unlink(endpoint.c_str());
+        }
+        int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listener < 0 || bind(listener, (sockaddr*)&address, sizeof(address)) != 0 ||
+            chmod(endpoint.c_str(), 0600) != 0 || listen(listener, SOMAXCONN) != 0) {
+            std::wcerr << L"Cannot listen on " << endpoint.c_str() << L": " << strerror(errno) << L"\n";
+            if (listener >= 0) close(listener);
+            return false;
+        }
+        Announce(endpoint);
+        while (!stopRequested) {
+            pollfd ready = {listener, POLLIN, 0};
+            if (poll(&ready, 1, 200) <= 0) continue;
+            int fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd >= 0) Accepted(fd);
+        }
+        close(listener);
+        unlink(endpoint.c_str());
+        return true;
+#endif
+    }
+
+public:
+    ReportService(std::vector<Section>& collected, const std::string& cacheFile, int queryTimeoutMs, int budgetMs,
+                  int intervalMs)
+        : sections(collected), cachePath(cacheFile), queryTimeout(queryTimeoutMs), budget(budgetMs),
+          interval(intervalMs), changedAt(collected.size(), 0) {
+        Deadline limit(std::chrono::steady_clock::time_point::max(),
+                       std::chrono::milliseconds(std::max(queryTimeout, 0)));
+        for (auto& section : sections) {
+            if (section.ttl > 0 && section.validation.empty() && section.key)
+                section.validation = section.key(limit);
+            published.push_back(std::make_shared<const std::string>(section.encoded));
+        }
+    }
+
+    // Serves until Ctrl+C; the exit status for main.
+    int Run(const std::string& endpoint) {
+#ifdef _WIN32
+        SetConsoleCtrlHandler(StopOnCtrlC, TRUE);
+#else
+        signal(SIGINT, StopOnSignal);
+        signal(SIGTERM, StopOnSignal);
+#endif
+        std::thread refresher([this] {
+#ifdef _WIN32
+            ComApartment apartment;
+#endif
+            auto next = std::chrono::steady_clock::now() + interval;
+            while (!stopRequested) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                if (std::chrono::steady_clock::now() < next) continue;
+                Refresh();
+                next = std::chrono::steady_clock::now() + interval;
+            }
+        });
+        bool listened = Listen(endpoint);
+        stopRequested = true;
+        refresher.join();
+        HangUp();
+        return listened ? 0 : 1;
+    }
+};
+
+// --query: writes the server's answer to one request to `outputPath`.
+int QueryService(const std::string& endpoint, const std::string& request, const std::string& outputPath) {
+    Channel channel = ConnectTo(endpoint);
+    if (channel == NO_CHANNEL) {
+        std::wcerr << L"Cannot connect to " << endpoint.c_str() << L"\n";
+        return 1;
+    }
+    std::string answer;
+    bool asked = Ask(channel, request, answer);
+    CloseChannel(channel);
+    if (!asked) {
+        std::wcerr << L"No answer from " << endpoint.c_str() << L"\n";
+        return 1;
+    }
+    if (answer[0] != 0) {
+        std::wcerr << answer.c_str() + 1 << L"\n";
+        return 1;
+    }
+    FILE* file = outputPath == "-" ? stdout : fopen(outputPath.c_str(), "wb");
+    if (!file) {
+        std::wcerr << L"Error creating " << outputPath.c_str() << L": " << strerror(errno) << L"\n";
+        return 1;
+    }
+    bool written = fwrite(answer.data() + 1, 1, answer.size() - 1, file) == answer.size() - 1;
+    written = (file == stdout ? fflush(file) : fclose(file)) == 0 && written;
+    if (!written) {
+        std::wcerr << L"Error writing " << outputPath.c_str() << L"\n";
+        return 1;
+    }
+    if (file != stdout) std::wcerr << L"File written to " << outputPath.c_str() << L"\n";
+    return 0;
+}
+
+// --load-test: `clients` callers at once, each sending `requests`
+// requests one after another over one connection (or a new connection
+// per request), then the throughput and the latency distribution.
+int LoadTest(const std::string& endpoint, const std::string& request, int clients, int requests, bool reconnect) {
+    struct Caller {
+        std::vector<double> latencies;  // microseconds
+        size_t bytes = 0;
+        int failed = 0;
+    };
+    std::vector<Caller> callers((size_t)clients);
+    auto started = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (auto& caller : callers) {
+        threads.emplace_back([&caller, &endpoint, &request, requests, reconnect] {
+            caller.latencies.reserve((size_t)requests);
+            Channel channel = NO_CHANNEL;
+            std::string answer;
+            for (int r = 0; r < requests; r++) {
+                auto sent = std::chrono::steady_clock::now();
+                if (channel == NO_CHANNEL) channel = ConnectTo(endpoint);
+                bool ok = channel != NO_CHANNEL && Ask(channel, request, answer) && answer[0] == 0;
+                if (!ok || reconnect) {
+                    if (channel != NO_CHANNEL) CloseChannel(channel);
+                    channel = NO_CHANNEL;
+                }
+                if (!ok) {
+                    caller.failed++;
+                    continue;
+                }
+                caller.latencies.push_back(SecondsSince(sent) * 1e6);
+                caller.bytes = answer.size() - 1;
+            }
+            if (channel != NO_CHANNEL) CloseChannel(channel);
+        });
+    }
+    for (auto& thread : threads) thread.join();
+    double wall = SecondsSince(started);
+
+    std::vector<double> latencies;
+    size_t bytes = 0;
+    int failed = 0;
+    for (const auto& caller : callers) {
+        latencies.insert(latencies.end(), caller.latencies.begin(), caller.latencies.end());
+        bytes = std::max(bytes, caller.bytes);
+        failed += caller.failed;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double p) {
+        return latencies.empty() ? 0.0 : latencies[std::min(latencies.size() - 1, (size_t)(p * latencies.size()))];
+    };
+    std::wcout << std::fixed << std::setprecision(1) << clients << L" clients x " << requests << L" requests"
+               << (reconnect ? L", one connection per request" : L"") << L": " << latencies.size()
+               << L" answered, " << failed << L" failed in " << wall * 1000 << L" ms, "
+               << (wall > 0 ? latencies.size() / wall : 0.0) << L" requests/s\n"
+               << L"Latency (us): p50 " << percentile(0.50) << L", p90 " << percentile(0.90) << L", p99 "
+               << percentile(0.99) << L", max " << (latencies.empty() ? 0.0 : latencies.back()) << L"; "
+               << bytes << L" bytes per answer\n";
+    return failed ? 1 : 0;
+}
+
+// Runs the report's queries against FakeWmiProvider under the old plan
+// and each improvement in turn, and prints the cost per row.
+void BenchmarkQueries(int rows, int roundTripUs) {
+    struct Variant {
+        const wchar_t* label;
+        QueryPlan plan;
+    } variants[4] = {
+        {L"SELECT *, 1 per Next, by name", {false, 1, false}},
+        {L"projected, 1 per Next, by name", {true, 1, false}},
+        {L"projected, 64 per Next, by name", {true, 64, false}},
+        {L"projected, 64 per Next, handles", {true, 64, true}},
+    };
+    std::wcout << L"Report queries, " << rows << L" objects per class, " << roundTripUs
+               << L" us per round trip, classes 60 properties wide\n";
+    for (const auto& variant : variants) {
+        FakeWmiProvider provider(variant.plan, rows, 60, roundTripUs);
+        std::string discarded;
+        BinarySink discard(discarded);
+        Deadline never;
+        auto started = std::chrono::steady_clock::now();
+        PrintSystemSummary(&provider, discard, never);
+        PrintHardwareResources(&provider, discard, never);
+        PrintComponents(&provider, discard, never);
+        PrintSoftwareEnvironment(&provider, discard, never);
+        double seconds = SecondsSince(started);
+        std::wcout << std::left << std::setw(34) << variant.label << std::right << std::fixed << std::setprecision(2)
+                   << std::setw(8) << seconds * 1e6 / provider.rowsReturned << L" us/row  " << std::setw(8)
+                   << provider.roundTrips << L" round trips  " << std::setw(9) << provider.propertiesCopied
+                   << L" properties copied\n";
+    }
+}
+
+// Per-row cost of turning a provider row into sink events: the former
+// per-call vector of properties with std::function formatters against the
+// constant tables with switch dispatch. Both extract the processor query
+// from the same in-memory row into the same recorder.
+struct DynamicProperty {
+    const wchar_t* name;
+    const char* displayName;
+    std::function<Value(const Value&)> formatter;
+};
+
+void BenchmarkExtraction(long long rows) {
+    std::array<Value, MAX_PROPERTIES> row;
+    row[0] = Value::FromString("Intel(R) Core(TM) i7-9700K CPU @ 3.60GHz");
+    row[1] = Value::FromInt(8);
+    row[2] = Value::FromInt(8);
+    row[3] = Value::FromInt(3600);
+    row[4] = Value::FromInt(2048);
+    row[5] = Value::FromInt(12288);
+    std::string recorded;
+    recorded.reserve(1 << 16);
+
+    auto before = std::chrono::steady_clock::now();
+    for (long long r = 0; r < rows; r++) {
+        std::vector<DynamicProperty> properties = {
+            {L"Name", "Processor", nullptr},
+            {L"NumberOfCores", "Cores", nullptr},
+            {L"NumberOfLogicalProcessors", "Logical Processors", nullptr},
+            {L"MaxClockSpeed", "Max Speed (MHz)", nullptr},
+            {L"L2CacheSize", "L2 Cache (MB)", [](const Value& v) { return Value::FromReal(v.AsDouble() / 1024.0, 1); }},
+            {L"L3CacheSize", "L3 Cache (MB)", [](const Value& v) { return Value::FromReal(v.AsDouble() / 1024.0, 1); }},
+        };
+        std::vector<Value> values(properties.size());
+        for (size_t i = 0; i < properties.size(); i++) values[i] = row[i];
+        recorded.clear();
+        BinarySink out(recorded);
+        out.BeginObject();
+        for (size_t i = 0; i < properties.size(); i++) {
+            if (values[i].kind == Value::Empty) continue;
+            if (properties[i].formatter)
+                out.Field(properties[i].displayName, properties[i].formatter(values[i]));
+            else
+                out.Field(properties[i].displayName, values[i]);
+        }
+        out.EndObject();
+    }
+    double dynamicSeconds = SecondsSince(before);
+    size_t dynamicBytes = recorded.size();
+
+    auto after = std::chrono::steady_clock::now();
+    PropertyList properties = PROCESSOR_FIELDS;
+    for (long long r = 0; r < rows; r++) {
+        std::array<Value, MAX_PROPERTIES> values;
+        for (size_t i = 0; i < properties.size(); i++) values[i] = row[i];
+        recorded.clear();
+        BinarySink out(recorded);
+        out.BeginObject();
+        for (size_t i = 0; i < properties.size(); i++) {
+            if (values[i].kind != Value::Empty) EmitField(out, properties[i], values[i]);
+        }
+        out.EndObject();
+    }
+    double staticSeconds = SecondsSince(after);
+
+    std::wcout << L"Extracting " << rows << L" rows of Win32_Processor (6 properties, 2 formatted)\n"
+               << std::fixed << std::setprecision(1)
+               << L"vector + std::function formatters: " << dynamicSeconds * 1e9 / rows << L" ns/row\n"
+               << L"constexpr table + switch:          " << staticSeconds * 1e9 / rows << L" ns/row\n";
+    if (recorded.size() != dynamicBytes) std::wcout << L"Outputs differ!\n";
+}
+
+int main(int argc, char* argv[]) {
+    unsigned jobs = 4;
+    int simulateLatency = -1;
+    bool timing = false;
+    int benchRows = 0, benchRoundTrip = 100;
+    bool benchExtraction = false;
+    bool probeVersions = false;
+    bool profile = false;
+    std::string profileDir;
+    unsigned probeJobs = 16;
+    int probeTimeout = 3000;
+    int queryTimeout = 30000, budget = 0;
+    std::string servePath, queryPath, loadTestPath, sectionList;
+    int refreshIntervalMs = 5000, clients = 16, requestsPerClient = 1000;
+    bool reconnect = false;
+    std::string cachePath = "system_info.cache";
+    bool refresh = false;
+    std::unordered_map<std::string, long long> ttls;
+    std::string samplePath;
+    std::string format = "text", outputPath;
+    int intervalMs = 1000, flushMs = 1000, durationS = 0;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--jobs" && i + 1 < argc) {
+            jobs = (unsigned)atoi(argv[++i]);
+        } else if (arg == "--sequential") {
+            jobs = 1;
+        } else if (arg == "--simulate-latency" && i + 1 < argc) {
+            simulateLatency = atoi(argv[++i]);
+        } else if (arg == "--timing") {
+            timing = true;
+        } else if (arg == "--query-timeout" && i + 1 < argc) {
+            queryTimeout = atoi(argv[++i]);
+        } else if (arg == "--budget" && i + 1 < argc) {
+            budget = atoi(argv[++i]);
+        } else if (arg == "--cache" && i + 1 < argc) {
+            cachePath = argv[++i];
+        } else if (arg == "--no-cache") {
+            cachePath.clear();
+        } else if (arg == "--format" && i + 1 < argc) {
+            format = argv[++i];
+            if (format != "text" && format != "json" && format != "binary") {
+                std::wcerr << L"--format expects text, json or binary\n";
+                return 1;
+            }
+        } else if (arg == "--output" && i + 1 < argc) {
+            outputPath = argv[++i];
+        } else if (arg == "--sample" && i + 1 < argc) {
+            samplePath = argv[++i];
+        } else if (arg == "--interval" && i + 1 < argc) {
+            intervalMs = atoi(argv[++i]);
+        } else if (arg == "--flush" && i + 1 < argc) {
+            flushMs = atoi(argv[++i]);
+        } else if (arg == "--duration" && i + 1 < argc) {
+            durationS = atoi(argv[++i]);
+        } else if (arg == "--profile") {
+            profile = true;
+        } else if (arg == "--profile-dir" && i + 1 < argc) {
+            profileDir = argv[++i];
+        } else if (arg == "--versions") {
+            probeVersions = true;
+        } else if (arg == "--probe-jobs" && i + 1 < argc) {
+            probeJobs = (unsigned)atoi(argv[++i]);
+        } else if (arg == "--probe-timeout" && i + 1 < argc) {
+            probeTimeout = atoi(argv[++i]);
+        } else if (arg == "--refresh") {
+            refresh = true;
+        } else if (arg == "--ttl" && i + 1 < argc) {
+            std::string spec = argv[++i];
+            size_t eq = spec.find('=');
+            if (eq == std::string::npos) {
+                std::wcerr << L"--ttl expects SECTION=SECONDS\n";
+                return 1;
+            }
+            ttls[spec.substr(0, eq)] = atoll(spec.c_str() + eq + 1);
+        } else if (arg == "--serve" && i + 1 < argc) {
+            servePath = argv[++i];
+        } else if (arg == "--refresh-interval" && i + 1 < argc) {
+            refreshIntervalMs = atoi(argv[++i]);
+        } else if (arg == "--query" && i + 1 < argc) {
+            queryPath = argv[++i];
+        } else if (arg == "--sections" && i + 1 < argc) {
+            sectionList = argv[++i];
+        } else if (arg == "--load-test" && i + 1 < argc) {
+            loadTestPath = argv[++i];
+        } else if (arg == "--clients" && i + 1 < argc) {
+            clients = atoi(argv[++i]);
+        } else if (arg == "--requests" && i + 1 < argc) {
+            requestsPerClient = atoi(argv[++i]);
+        } else if (arg == "--reconnect") {
+            reconnect = true;
+        } else if (arg == "--bench-extraction") {
+            benchExtraction = true;
+        } else if (arg == "--bench-queries") {
+            if (!benchRows) benchRows = 1000;
+        } else if (arg == "--bench-rows" && i + 1 < argc) {
+            benchRows = atoi(argv[++i]);
+        } else if (arg == "--bench-round-trip-us" && i + 1 < argc) {
+            benchRoundTrip = atoi(argv[++i]);
+        } else {
+            std::wcerr << L"Unknown option: " << argv[i] << L"\n"
+                       << L"Usage: SystemInfo [--jobs N | --sequential] [--simulate-latency MS] [--timing]\n"
+                       << L"                  [--query-timeout MS] [--budget MS]\n"
+                       << L"                  [--format text|json|binary] [--output FILE]\n"
+                       << L"                  [--cache FILE | --no-cache] [--refresh] [--ttl SECTION=SECONDS]\n"
+                       << L"                  [--versions [--probe-jobs N] [--probe-timeout MS]]\n"
+                       << L"                  [--profile [--profile-dir DIR]]\n"
+                       << L"                  [--serve ENDPOINT [--refresh-interval MS]]\n"
+                       << L"       SystemInfo --query ENDPOINT [--sections LIST] [--format F] [--output FILE]\n"
+                       << L"       SystemInfo --load-test ENDPOINT [--clients N] [--requests N] [--reconnect]\n"
+                       << L"                  [--sections LIST] [--format F]\n"
+                       << L"       SystemInfo --sample FILE [--interval MS] [--flush MS] [--duration S]\n"
+                       << L"       SystemInfo --bench-queries [--bench-rows N] [--bench-round-trip-us N]\n"
+                       << L"       SystemInfo --bench-extraction\n";
+            return 1;
+        }
+    }
+    if (jobs < 1) jobs = 1;
+    if (outputPath.empty())
+        outputPath = format == "json" ? "system_info.json" : format == "binary" ? "system_info.bin" : "system_info.txt";
+    if (benchRows > 0) {
+        BenchmarkQueries(benchRows, benchRoundTrip);
+        return 0;
+    }
+    if (benchExtraction) {
+        BenchmarkExtraction(2000000);
+        return 0;
+    }
+    if (!samplePath.empty()) {
+#ifndef _WIN32
+        setlocale(LC_ALL, "");
+#endif
+        return RunSampler(samplePath, std::max(intervalMs, 100), std::max(flushMs, 100), durationS);
+    }
+    if (!queryPath.empty() || !loadTestPath.empty()) {
+        std::string request = format.substr(0, 1) + sectionList;
+        if (!queryPath.empty()) return QueryService(queryPath, request, outputPath);
+        return LoadTest(loadTestPath, request, std::max(clients, 1), std::max(requestsPerClient, 1), reconnect);
+    }
+
+#ifdef _WIN32
+    ComInitializer comInit;
+    if (!comInit.IsOK()) {
+        std::wcerr << L"COM initialization failed!\n";
+        return 1;
+    }
+
+    WmiConnection wmi;
+    std::unique_ptr<Provider> provider;
+    if (simulateLatency >= 0) {
+        provider.reset(new SimulatedProvider(simulateLatency));
+    } else if (!wmi.IsConnected()) {
+        std::wcerr << L"WMI connection failed!\n";
+        return 1;
+    } else {
+        provider.reset(new WmiProvider(wmi.operator->()));
+    }
+#else
+    setlocale(LC_ALL, "");
+    std::unique_ptr<Provider> provider;
+    if (simulateLatency >= 0)
+        provider.reset(new SimulatedProvider(simulateLatency));
+    else
+        provider.reset(new LinuxProvider());
+#endif
+
+    // Sections are collected concurrently, each into its own buffer, and
+    // the report assembled in this order, so the run takes about as long
+    // as its slowest section rather than the sum of all of them. Hardware,
+    // firmware and drivers are reused from the cache until the next reboot
+    // or their TTL; network addresses and the locale are always collected.
+    Provider* source = provider.get();
+    // Keys carry the provider so simulated and real results never mix.
+    std::wstring origin = simulateLatency >= 0 ? L"simulated " : L"native ";
+    auto bootKey = [origin](const Deadline&) { return origin + BootKey(); };
+    // Tool versions are cached per executable beside the snapshot cache.
+    std::unique_ptr<VersionProber> prober;
+    if (probeVersions)
+        prober.reset(new VersionProber(probeJobs, std::max(probeTimeout, 1),
+                                       cachePath.empty() ? "" : cachePath + ".versions", !refresh));
+    VersionProber* versions = prober.get();
+    // Everything is collected by `report`: each query and blocking call gets
+    // at most --query-timeout, and nothing runs past the --budget.
+    auto started = std::chrono::steady_clock::now();
+    const Deadline report(budget > 0 ? started + std::chrono::milliseconds(budget)
+                                     : std::chrono::steady_clock::time_point::max(),
+                          std::chrono::milliseconds(std::max(queryTimeout, 0)));
+    auto pathKey = [origin, versions](const Deadline& deadline) {
+        return origin + PathKey(deadline) + (versions ? L" versions" : L"");
+    };
+    const long long DAY = 24 * 60 * 60;
+    std::vector<Section> sections = {
+        {"summary", "SYSTEM SUMMARY", 7 * DAY, bootKey,
+         [source](Sink& out, Deadline& deadline) { PrintSystemSummary(source, out, deadline); }},
+        {"hardware", "HARDWARE RESOURCES", 30 * DAY, bootKey,
+         [source](Sink& out, Deadline& deadline) { PrintHardwareResources(source, out, deadline); }},
+        {"components", "COMPONENTS", 7 * DAY, bootKey,
+         [source](Sink& out, Deadline& deadline) { PrintComponents(source, out, deadline); }},
+        {"software", "SOFTWARE ENVIRONMENT", 0, bootKey,
+         [source](Sink& out, Deadline& deadline) { PrintSoftwareEnvironment(source, out, deadline); }},
+        {"locale", "LOCALE AND ENCODING", 0, nullptr, PrintLocaleAndEncoding},
+        {"languages", "INSTALLED PROGRAMMING LANGUAGES", 30 * DAY, pathKey,
+         [versions](Sink& out, Deadline& deadline) { PrintInstalledLanguages(out, versions, deadline); }},
+    };
+    if (profile) {
+        sections.push_back({"performance", "PERFORMANCE PROFILE", 0, nullptr,
+                            [source, profileDir](Sink& out, Deadline& deadline) {
+                                PrintPerformanceProfile(source, out, profileDir, deadline);
+                            }});
+        sections.back().alone = true;
+    }
+    const size_t sectionCount = sections.size();
+    for (const auto& ttl : ttls) {
+        auto match = std::find_if(sections.begin(), sections.end(),
+                                  [&](const Section& section) { return ttl.first == section.name; });
+        if (match == sections.end()) {
+            std::wcerr << L"Unknown section for --ttl: " << ttl.first.c_str()
+                       << L" (summary, hardware, components, software, locale, languages, performance)\n";
+            return 1;
+        }
+        match->ttl = ttl.second;
+    }
+
+    long long now = (long long)time(nullptr);
+    std::unordered_map<std::string, CachedSection> cache;
+    if (!cachePath.empty() && !refresh) cache = LoadCache(cachePath);
+    size_t reused = 0;
+    for (auto& section : sections) {
+        if (cachePath.empty() || section.ttl <= 0) continue;
+        section.validation = section.key(report);
+        auto entry = cache.find(section.name);
+        if (entry == cache.end() || entry->second.key != section.validation ||
+            now - entry->second.collectedAt >= section.ttl || entry->second.collectedAt > now)
+            continue;
+        section.encoded = std::move(entry->second.data);
+        section.collectedAt = entry->second.collectedAt;
+        section.cached = true;
+        reused++;
+    }
+
+    // A section records into a buffer of its own and publishes it under
+    // `publish` when done, unless it was abandoned by then; what it still
+    // touches afterwards lives until the process ends (see abandonedWork).
+    std::mutex publish;
+    auto collect = [now, report, &publish](Section* target) {
+        auto sectionStarted = std::chrono::steady_clock::now();
+        std::string encoded;
+        BinarySink recorder(encoded);
+        Deadline deadline = report;
+        target->collect(recorder, deadline);
+        std::lock_guard<std::mutex> guard(publish);
+        if (target->abandoned) return;
+        target->encoded = std::move(encoded);
+        target->partial = deadline.Missed();
+        target->seconds = SecondsSince(sectionStarted);
+        target->collectedAt = now;
+        target->done = true;
+    };
+    auto collectAll = [&](bool alone, unsigned threads) {
+        auto pool = std::make_unique<TaskPool>(threads);
+        for (auto& section : sections) {
+            if (section.cached || section.alone != alone) continue;
+            Section* target = &section;
+            pool->Submit([target, &collect] { collect(target); });
+        }
+        if (pool->WaitUntil(report)) return;
+        (void)pool.release();  // its workers still run the abandoned sections
+        std::lock_guard<std::mutex> guard(publish);
+        for (auto& section : sections) {
+            if (section.cached || section.alone != alone || section.done) continue;
+            section.abandoned = section.partial = true;
+            abandonedWork++;
+            BinarySink placeholder(section.encoded);
+            placeholder.BeginSection(section.title);
+            placeholder.Error("Partial: not collected within the time budget");
+            placeholder.EndSection();
+        }
+    };
+    collectAll(false, std::min<unsigned>(jobs, (unsigned)(sectionCount - reused)));
+    collectAll(true, 1);
+    double elapsed = SecondsSince(started);
+    size_t partial = (size_t)std::count_if(sections.begin(), sections.end(),
+                                           [](const Section& section) { return section.partial; });
+    bool stale = std::any_of(sections.begin(), sections.end(), [](const Section& section) {
+        return section.ttl > 0 && !section.cached && !section.partial;
+    });
+    if (!cachePath.empty() && stale) SaveCache(cachePath, sections.data(), sectionCount);
+    if (prober) prober->Save();
+
+    if (timing) {
+        double total = 0;
+        for (const auto& section : sections) total += section.seconds;
+        std::wcerr << std::fixed << std::setprecision(1) << L"Collected " << sectionCount
+                   << L" sections in " << elapsed * 1000 << L" ms on " << jobs << L" threads (sections took "
+                   << total * 1000 << L" ms in all, " << reused << L" from cache, " << partial << L" partial)\n";
+        if (prober && prober->probed + prober->reused > 0)
+            std::wcerr << L"Probed " << prober->probed << L" executables for versions in " << prober->seconds * 1000
+                       << L" ms (slowest " << prober->slowest * 1000 << L" ms, " << prober->probeSeconds * 1000
+                       << L" ms in all, " << prober->reused << L" from cache, " << prober->timedOut << L" timed out)\n";
+    }
+
+    // Abandoned work may still use the provider, the sections and the
+    // prober; end without destroying them under it.
+    auto finish = [](int code) {
+        if (abandonedWork == 0) return code;
+        fflush(stdout);
+        std::_Exit(code);
+    };
+
+    // With --serve, what was just collected is kept and handed out on
+    // request rather than written once.
+    if (!servePath.empty()) {
+        ReportService service(sections, cachePath, queryTimeout, budget, std::max(refreshIntervalMs, 100));
+        int status = service.Run(servePath);
+        if (prober) prober->Save();
+        if (timing)
+            std::wcerr << L"Answered " << service.answered.load() << L" requests on " << service.accepted.load()
+                       << L" connections (" << service.reused.load() << L" from rendered answers); "
+                       << service.passes << L" refresh passes collected " << service.recollected
+                       << L" sections, " << service.changed << L" of them changed\n";
+        return finish(status);
+    }
+
+    // UTF-8 in every format; sections are replayed into the sink in order.
+    FILE* file = outputPath == "-" ? stdout : fopen(outputPath.c_str(), "wb");
+    if (!file) {
+        std::wcerr << L"Error creating " << outputPath.c_str() << L": " << strerror(errno) << L"\n";
+        return finish(1);
+    }
+    bool written;
+    {
+        Utf8Writer writer(file);
+        if (format == "binary") {
+            writer.Write(std::string_view(REPORT_MAGIC, sizeof(REPORT_MAGIC)));
+            for (const auto& section : sections) writer.Write(section.encoded);
+        } else {
+            TextSink text(writer);
+            JsonSink json(writer);
+            Sink& sink = format == "json" ? (Sink&)json : (Sink&)text;
+            sink.BeginReport();
+            for (const auto& section : sections) Replay(section.encoded, sink);
+            sink.EndReport();
+        }
+        written = writer.Flush();
+    }
+    if (file != stdout) written = fclose(file) == 0 && written;
+    if (!written) {
+        std::wcerr << L"Error writing " << outputPath.c_str() << L"\n";
+        return finish(1);
+    }
+    if (file != stdout) std::wcerr << L"File written to " << outputPath.c_str() << L"\n";
+
+    return finish(0);
+}